@@ -76,10 +76,23 @@ int main(int argc, char **argv) {
     gchar *kernver = NULL;
     gchar *kernpath = NULL;
     gchar *kmodpath = NULL;
+    gchar *transport = NULL;
+    gchar *rootcache = NULL;
+    gchar *rootcacheimage = NULL;
+    gint memory = 0;
+    gint vcpus = 0;
+    gchar *cpuset = NULL;
+    gchar *nodeset = NULL;
+    gboolean hugepages = FALSE;
+    gboolean memshared = FALSE;
+    gboolean memlocked = FALSE;
+    gboolean nosharepages = FALSE;
     gboolean verbose = FALSE;
     gboolean debug = FALSE;
     gboolean shell = FALSE;
     gboolean privileged = FALSE;
+    gboolean networkoptional = FALSE;
+    gint dhcptimeout = 0;
     GOptionContext *context;
     GOptionEntry options[] = {
         { "version", 'V', G_OPTION_FLAG_NO_ARG, G_OPTION_ARG_CALLBACK,
@@ -106,6 +119,10 @@ int main(int argc, char **argv) {
           N_("file contain list of files to include"), "FILE" },
         { "network", 'N', 0, G_OPTION_ARG_STRING_ARRAY, &networks,
           N_("setup network interface properties"), "PATH", },
+        { "network-optional", 0, 0, G_OPTION_ARG_NONE, &networkoptional,
+          N_("run the command without waiting for DHCP"), NULL, },
+        { "dhcp-timeout", 0, 0, G_OPTION_ARG_INT, &dhcptimeout,
+          N_("seconds to wait for DHCP leases"), "SECS", },
         { "security", 's', 0, G_OPTION_ARG_STRING, &security,
           N_("security properties"), "PATH", },
         { "privileged", 'p', 0, G_OPTION_ARG_NONE, &privileged,
@@ -118,6 +135,28 @@ int main(int argc, char **argv) {
           N_("kernel binary path"), NULL, },
         { "kmodpath", 0, 0, G_OPTION_ARG_STRING, &kmodpath,
           N_("kernel module directory"), NULL, },
+        { "transport", 0, 0, G_OPTION_ARG_STRING, &transport,
+          N_("host filesystem passthrough transport"), "9p|virtiofs", },
+        { "root-cache", 0, 0, G_OPTION_ARG_STRING, &rootcache,
+          N_("cache mode of the host root directory"), "MODE", },
+        { "root-cache-image", 0, 0, G_OPTION_ARG_STRING, &rootcacheimage,
+          N_("disk image for a persistent root fscache"), "PATH", },
+        { "memory", 0, 0, G_OPTION_ARG_INT, &memory,
+          N_("memory size in MiB"), "MIB", },
+        { "vcpus", 0, 0, G_OPTION_ARG_INT, &vcpus,
+          N_("number of virtual CPUs"), "COUNT", },
+        { "cpuset", 0, 0, G_OPTION_ARG_STRING, &cpuset,
+          N_("host CPUs to run on"), "CPU-LIST", },
+        { "nodeset", 0, 0, G_OPTION_ARG_STRING, &nodeset,
+          N_("host NUMA nodes to allocate memory from"), "NODE-LIST", },
+        { "hugepages", 0, 0, G_OPTION_ARG_NONE, &hugepages,
+          N_("back memory with huge pages"), NULL, },
+        { "memory-shared", 0, 0, G_OPTION_ARG_NONE, &memshared,
+          N_("back memory with a shared memfd"), NULL, },
+        { "memory-locked", 0, 0, G_OPTION_ARG_NONE, &memlocked,
+          N_("lock memory in host RAM"), NULL, },
+        { "nosharepages", 0, 0, G_OPTION_ARG_NONE, &nosharepages,
+          N_("exclude memory from page merging"), NULL, },
         { G_OPTION_REMAINING, '\0', 0, G_OPTION_ARG_STRING_ARRAY, &cmdargs,
           NULL, "COMMAND-PATH [ARGS...]" },
         { NULL, 0, 0, G_OPTION_ARG_NONE, NULL, NULL, NULL }
@@ -181,6 +220,49 @@ int main(int argc, char **argv) {
         gvir_sandbox_config_set_kernpath(cfg, kernpath);
     if (kmodpath)
         gvir_sandbox_config_set_kmodpath(cfg, kmodpath);
+    if (transport) {
+        GEnumClass *enum_class = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT);
+        GEnumValue *enum_value = g_enum_get_value_by_nick(enum_class, transport);
+        g_type_class_unref(enum_class);
+        if (!enum_value) {
+            g_printerr(_("Unknown transport %s\n"), transport);
+            goto cleanup;
+        }
+        gvir_sandbox_config_set_host_bind_transport(cfg, enum_value->value);
+    }
+    if (rootcache) {
+        GEnumClass *enum_class = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE);
+        GEnumValue *enum_value = g_enum_get_value_by_nick(enum_class, rootcache);
+        g_type_class_unref(enum_class);
+        if (!enum_value) {
+            g_printerr(_("Unknown root cache mode %s\n"), rootcache);
+            goto cleanup;
+        }
+        gvir_sandbox_config_set_root_cache(cfg, enum_value->value);
+    }
+    if (rootcacheimage)
+        gvir_sandbox_config_set_root_cache_image(cfg, rootcacheimage);
+
+    if (memory < 0 || vcpus < 0) {
+        g_printerr(_("Memory size and virtual CPU count must be positive\n"));
+        goto cleanup;
+    }
+    if (memory)
+        gvir_sandbox_config_set_memory(cfg, memory);
+    if (vcpus)
+        gvir_sandbox_config_set_vcpus(cfg, vcpus);
+    if (cpuset)
+        gvir_sandbox_config_set_cpuset(cfg, cpuset);
+    if (nodeset)
+        gvir_sandbox_config_set_nodeset(cfg, nodeset);
+    if (hugepages)
+        gvir_sandbox_config_set_hugepages(cfg, TRUE);
+    if (memshared)
+        gvir_sandbox_config_set_memory_shared(cfg, TRUE);
+    if (memlocked)
+        gvir_sandbox_config_set_memory_locked(cfg, TRUE);
+    if (nosharepages)
+        gvir_sandbox_config_set_memory_nosharepages(cfg, TRUE);
 
     if (privileged) {
         gvir_sandbox_config_set_userid(cfg, 0);
@@ -226,6 +308,14 @@ int main(int argc, char **argv) {
                    error && error->message ? error->message : _("Unknown failure"));
         goto cleanup;
     }
+    if (networkoptional)
+        gvir_sandbox_config_set_network_required(cfg, FALSE);
+    if (dhcptimeout < 0) {
+        g_printerr(_("DHCP timeout must be positive\n"));
+        goto cleanup;
+    }
+    if (dhcptimeout)
+        gvir_sandbox_config_set_dhcp_timeout(cfg, dhcptimeout);
     if (security &&
         !gvir_sandbox_config_set_security_opts(cfg, security, &error)) {
         g_printerr(_("Unable to parse security: %s\n"),
@@ -386,6 +476,18 @@ starting the sandbox and deleted afterwards. The C<--include> option
 is useful for populating these temporary directories with copies of host
 files.
 
+For machine based sandboxes, B<SRC> may be followed by comma separated
+options. B<transport=9p> or B<transport=virtiofs> overrides the
+transport set with C<--transport> for this mount, while B<dax> maps
+file contents of a virtiofs mount directly from the host page cache,
+where QEMU provides a DAX window for the device. B<msize=BYTES> sets
+the largest 9p request size, B<cache=none|loose|fscache|mmap> lets the
+guest cache the directory contents, and B<readahead=KIB> sets the
+guest readahead size. Caching is only safe for directories that are
+not changed on the host while the sandbox runs. For virtiofs mounts
+any cache mode other than B<none> lets virtiofsd cache as much as
+possible.
+
 =item B<host-image>
 
 If B<TYPE> is B<host-image>, then B<SRC> is interpreted as the path
@@ -411,6 +513,8 @@ coarser level.
 Some examples
 
  -m host-bind:/tmp=/var/lib/sandbox/demo/tmp
+ -m host-bind:/src=/home/demo/src,transport=virtiofs
+ -m host-bind:/usr=/usr,msize=262144,cache=loose
  -m host-image:/=/var/lib/sandbox/demo.img
  -m guest-bind:/home=/tmp/home
  -m ram:/tmp=500M
@@ -469,6 +573,21 @@ address of the gateway for the route. Some examples
 
 =back
 
+=item B<--network-optional>
+
+Start the command without waiting for the network interfaces
+configured with B<dhcp> to obtain their leases. The DHCP clients
+carry on in the background, so the command must cope with the
+network coming up after it starts. Static addresses and routes
+are always set up first.
+
+=item B<--dhcp-timeout=SECS>
+
+Give up starting the sandbox if the network interfaces configured
+with B<dhcp> do not all obtain a lease within B<SECS> seconds. The
+DHCP clients run in parallel, so this is the time taken by the
+slowest one. By default the DHCP client decides how long to try.
+
 =item B<-s SECURITY-OPTIONS>, B<--security=SECURITY-OPTIONS>
 
 Use alternative security options. SECURITY-OPTIONS is a set of key=val pairs,
@@ -515,6 +634,77 @@ Specify the path to the kernel module base directory. If omitted, defaults
 to C</lib/modules>. The suffix C<$KERNEL-VERSION/kernel> will be appended
 to this path to locate the modules.
 
+=item B<--transport=9p|virtiofs>
+
+Set how machine based sandboxes access B<host-bind> mounts which do
+not choose their own transport. Defaults to B<9p>. B<virtiofs> gives
+much better metadata and small file performance, but needs a host with
+virtiofsd. The sandbox memory is then automatically shared with
+virtiofsd. The host root directory and the sandbox configuration are
+always shared over 9p, as only 9p lets the host enforce that they
+stay read-only.
+
+=item B<--root-cache=MODE>
+
+Set how much of the host root directory machine based sandboxes may
+cache, using the same modes as the B<cache> option of B<host-bind>
+mounts. As the root is shared read-only, B<loose> or B<fscache> save
+re-reading host binaries over 9p on every exec, but the host software
+should not be updated while the sandbox runs.
+
+=item B<--root-cache-image=PATH>
+
+With C<--root-cache=fscache>, keep the fscache
+of the host root directory on the disk image C<PATH>, so that it
+stays warm from one sandbox to the next. The image must be a raw
+disk image formatted as ext4, for example
+
+ # truncate -s 2G /var/cache/sandbox-root.img
+ # mkfs.ext4 -F /var/cache/sandbox-root.img
+
+It is attached writable, so it is locked while the sandbox runs and
+a second sandbox started with the same image fails to start.
+
+=item B<--memory=MIB>
+
+Set the amount of memory given to the sandbox, in MiB. For machine
+based sandboxes this is the guest RAM size, while for container
+based sandboxes it is the memory limit. Defaults to 512 MiB.
+
+=item B<--vcpus=COUNT>
+
+Set the number of virtual CPUs for machine based sandboxes. Defaults
+to 1.
+
+=item B<--cpuset=CPU-LIST>
+
+Restrict the sandbox to run on the listed host CPUs, eg C<0-3,^2>.
+
+=item B<--nodeset=NODE-LIST>
+
+Allocate the sandbox memory only from the listed host NUMA nodes,
+eg C<0> or C<0-1>.
+
+=item B<--hugepages>
+
+Back the sandbox memory with huge pages. The host must have enough
+huge pages reserved to hold the whole memory size.
+
+=item B<--memory-shared>
+
+Allocate the memory of machine based sandboxes from a memfd mapped
+shared, as required by vhost-user devices such as virtiofs.
+
+=item B<--memory-locked>
+
+Lock the memory of machine based sandboxes in host RAM so that it
+is never swapped out.
+
+=item B<--nosharepages>
+
+Exclude the memory of machine based sandboxes from kernel samepage
+merging on the host.
+
 =item B<-p>, B<--privileged>
 
 Retain root privileges inside the sandbox, rather than dropping privileges
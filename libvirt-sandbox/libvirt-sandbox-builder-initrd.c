@@ -25,9 +25,21 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <sys/time.h>
 
 #include <glib/gi18n.h>
 
+#if WITH_ZLIB
+#include <zlib.h>
+#endif
+#if WITH_LZ4
+#include <lz4.h>
+#endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+
 #include "libvirt-sandbox/libvirt-sandbox.h"
 
 /**
@@ -46,9 +58,22 @@
 #define GVIR_SANDBOX_BUILDER_INITRD_GET_PRIVATE(obj)                    \
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), GVIR_SANDBOX_TYPE_BUILDER_INITRD, GVirSandboxBuilderInitrdPrivate))
 
+/* Bump whenever the initrd layout changes, to invalidate old cache entries */
+#define GVIR_SANDBOX_BUILDER_INITRD_CACHE_VERSION "3"
+
+#define GVIR_SANDBOX_BUILDER_INITRD_CACHE_SIZE 8
+
+#if WITH_ZLIB
+#define GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_DEFAULT GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_GZIP
+#else
+#define GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_DEFAULT GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_NONE
+#endif
+
 struct _GVirSandboxBuilderInitrdPrivate
 {
-    gboolean unused;
+    gchar *cachedir;
+    guint cachesize;
+    GVirSandboxBuilderInitrdCompression compression;
 };
 
 G_DEFINE_TYPE(GVirSandboxBuilderInitrd, gvir_sandbox_builder_initrd, G_TYPE_OBJECT);
@@ -56,6 +81,9 @@ G_DEFINE_TYPE(GVirSandboxBuilderInitrd, gvir_sandbox_builder_initrd, G_TYPE_OBJE
 
 enum {
     PROP_0,
+    PROP_CACHEDIR,
+    PROP_CACHESIZE,
+    PROP_COMPRESSION,
 };
 
 enum {
@@ -72,18 +100,34 @@ gvir_sandbox_builder_initrd_error_quark(void)
     return g_quark_from_static_string("gvir-sandbox-builder-initrd");
 }
 
+/*
+ * Checksums of init binaries, indexed by "path:dev:ino:size:mtime",
+ * so that cache lookups only need to stat the binary, not read it.
+ */
+G_LOCK_DEFINE_STATIC(initChecksums);
+static GHashTable *initChecksums;
+
 
 static void gvir_sandbox_builder_initrd_get_property(GObject *object,
                                                      guint prop_id,
-                                                     GValue *value G_GNUC_UNUSED,
+                                                     GValue *value,
                                                      GParamSpec *pspec)
 {
-#if 0
     GVirSandboxBuilderInitrd *builder = GVIR_SANDBOX_BUILDER_INITRD(object);
     GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
-#endif
 
     switch (prop_id) {
+    case PROP_CACHEDIR:
+        g_value_set_string(value, priv->cachedir);
+        break;
+
+    case PROP_CACHESIZE:
+        g_value_set_uint(value, priv->cachesize);
+        break;
+
+    case PROP_COMPRESSION:
+        g_value_set_enum(value, priv->compression);
+        break;
 
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
@@ -93,15 +137,25 @@ static void gvir_sandbox_builder_initrd_get_property(GObject *object,
 
 static void gvir_sandbox_builder_initrd_set_property(GObject *object,
                                                      guint prop_id,
-                                                     const GValue *value G_GNUC_UNUSED,
+                                                     const GValue *value,
                                                      GParamSpec *pspec)
 {
-#if 0
     GVirSandboxBuilderInitrd *builder = GVIR_SANDBOX_BUILDER_INITRD(object);
     GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
-#endif
 
     switch (prop_id) {
+    case PROP_CACHEDIR:
+        g_free(priv->cachedir);
+        priv->cachedir = g_value_dup_string(value);
+        break;
+
+    case PROP_CACHESIZE:
+        priv->cachesize = g_value_get_uint(value);
+        break;
+
+    case PROP_COMPRESSION:
+        priv->compression = g_value_get_enum(value);
+        break;
 
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
@@ -111,10 +165,10 @@ static void gvir_sandbox_builder_initrd_set_property(GObject *object,
 
 static void gvir_sandbox_builder_initrd_finalize(GObject *object)
 {
-#if 0
     GVirSandboxBuilderInitrd *builder = GVIR_SANDBOX_BUILDER_INITRD(object);
     GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
-#endif
+
+    g_free(priv->cachedir);
 
     G_OBJECT_CLASS(gvir_sandbox_builder_initrd_parent_class)->finalize(object);
 }
@@ -128,13 +182,53 @@ static void gvir_sandbox_builder_initrd_class_init(GVirSandboxBuilderInitrdClass
     object_class->get_property = gvir_sandbox_builder_initrd_get_property;
     object_class->set_property = gvir_sandbox_builder_initrd_set_property;
 
+    g_object_class_install_property(object_class,
+                                    PROP_CACHEDIR,
+                                    g_param_spec_string("cachedir",
+                                                        "Cachedir",
+                                                        "Directory for caching built ramdisks",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_CACHESIZE,
+                                    g_param_spec_uint("cachesize",
+                                                      "Cachesize",
+                                                      "Maximum number of cached ramdisks",
+                                                      0,
+                                                      G_MAXUINT,
+                                                      GVIR_SANDBOX_BUILDER_INITRD_CACHE_SIZE,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_COMPRESSION,
+                                    g_param_spec_enum("compression",
+                                                      "Compression",
+                                                      "The ramdisk compression format",
+                                                      GVIR_SANDBOX_TYPE_BUILDER_INITRD_COMPRESSION,
+                                                      GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_DEFAULT,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+
     g_type_class_add_private(klass, sizeof(GVirSandboxBuilderInitrdPrivate));
 }
 
 
 static void gvir_sandbox_builder_initrd_init(GVirSandboxBuilderInitrd *builder)
 {
-    builder->priv = GVIR_SANDBOX_BUILDER_INITRD_GET_PRIVATE(builder);
+    GVirSandboxBuilderInitrdPrivate *priv;
+    priv = builder->priv = GVIR_SANDBOX_BUILDER_INITRD_GET_PRIVATE(builder);
+    priv->cachesize = GVIR_SANDBOX_BUILDER_INITRD_CACHE_SIZE;
+    priv->compression = GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_DEFAULT;
 }
 
 
@@ -152,55 +246,807 @@ GVirSandboxBuilderInitrd *gvir_sandbox_builder_initrd_new(void)
 }
 
 
-static gchar *gvir_sandbox_builder_initrd_create_tempdir(GError **error)
+/**
+ * gvir_sandbox_builder_initrd_set_cachedir:
+ * @builder: (transfer none): the initrd builder
+ * @cachedir: (transfer none)(allow-none): the directory to cache ramdisks in
+ *
+ * Set the directory in which built ramdisks are kept for reuse
+ * by later sandboxes with the same kernel, module list and init
+ * binary. If NULL, a fresh ramdisk is built every time.
+ */
+void gvir_sandbox_builder_initrd_set_cachedir(GVirSandboxBuilderInitrd *builder,
+                                              const gchar *cachedir)
 {
-    gchar *tmpl = NULL;
-    gchar *dir = NULL;
-    const gchar *tmpdir = getenv("TEMPDIR");
+    GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
+    g_free(priv->cachedir);
+    priv->cachedir = g_strdup(cachedir);
+}
 
-    if (!tmpdir)
-        tmpdir = "/tmp";
 
-    if (!(tmpl = g_strdup_printf("%s/libvirt-sandbox-XXXXXX", tmpdir)))
-        goto cleanup;
+/**
+ * gvir_sandbox_builder_initrd_get_cachedir:
+ * @builder: (transfer none): the initrd builder
+ *
+ * Retrieves the directory in which built ramdisks are cached
+ *
+ * Returns: (transfer none): the cache directory, or NULL
+ */
+const gchar *gvir_sandbox_builder_initrd_get_cachedir(GVirSandboxBuilderInitrd *builder)
+{
+    GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
+    return priv->cachedir;
+}
 
-    dir = mkdtemp(tmpl);
 
-    if (!dir) {
-        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, errno,
-                    _("Unable to create temporary directory %s: %s"),
-                    tmpl, strerror(errno));
-        goto cleanup;
+/**
+ * gvir_sandbox_builder_initrd_set_cachesize:
+ * @builder: (transfer none): the initrd builder
+ * @cachesize: the maximum number of cached ramdisks
+ *
+ * Set the maximum number of ramdisks to keep in the cache
+ * directory. The least recently used ramdisks are removed
+ * once the limit is exceeded. A value of 0 means no limit.
+ */
+void gvir_sandbox_builder_initrd_set_cachesize(GVirSandboxBuilderInitrd *builder,
+                                               guint cachesize)
+{
+    GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
+    priv->cachesize = cachesize;
+}
+
+
+/**
+ * gvir_sandbox_builder_initrd_get_cachesize:
+ * @builder: (transfer none): the initrd builder
+ *
+ * Retrieves the maximum number of ramdisks to keep in the cache
+ *
+ * Returns: the maximum number of cached ramdisks
+ */
+guint gvir_sandbox_builder_initrd_get_cachesize(GVirSandboxBuilderInitrd *builder)
+{
+    GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
+    return priv->cachesize;
+}
+
+
+/**
+ * gvir_sandbox_builder_initrd_set_compression:
+ * @builder: (transfer none): the initrd builder
+ * @compression: the compression format
+ *
+ * Set the format used to compress the ramdisk. The host kernel
+ * must have been built with support for the chosen format.
+ */
+void gvir_sandbox_builder_initrd_set_compression(GVirSandboxBuilderInitrd *builder,
+                                                 GVirSandboxBuilderInitrdCompression compression)
+{
+    GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
+    priv->compression = compression;
+}
+
+
+/**
+ * gvir_sandbox_builder_initrd_get_compression:
+ * @builder: (transfer none): the initrd builder
+ *
+ * Retrieves the format used to compress the ramdisk
+ *
+ * Returns: the compression format
+ */
+GVirSandboxBuilderInitrdCompression gvir_sandbox_builder_initrd_get_compression(GVirSandboxBuilderInitrd *builder)
+{
+    GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
+    return priv->compression;
+}
+
+
+/*
+ * The ramdisk is written as a cpio "newc" archive, streamed
+ * straight through the compressor into the output file.
+ */
+#define GVIR_SANDBOX_BUILDER_INITRD_CHUNK (64 * 1024)
+
+#if WITH_LZ4
+/* The kernel only understands the legacy lz4 framing */
+#define GVIR_SANDBOX_BUILDER_INITRD_LZ4_MAGIC 0x184C2102
+#define GVIR_SANDBOX_BUILDER_INITRD_LZ4_BLOCK (8 * 1024 * 1024)
+#endif
+
+typedef struct _GVirSandboxBuilderInitrdArchive GVirSandboxBuilderInitrdArchive;
+struct _GVirSandboxBuilderInitrdArchive {
+    GVirSandboxBuilderInitrdCompression compression;
+    GOutputStream *os;
+    guint32 ino;
+    guint64 offset;
+#if WITH_ZLIB
+    z_stream zs;
+#endif
+#if WITH_LZ4
+    gchar *lz4in;
+    gsize lz4inLength;
+    gchar *lz4out;
+#endif
+#if WITH_ZSTD
+    ZSTD_CStream *zstd;
+#endif
+    guchar out[GVIR_SANDBOX_BUILDER_INITRD_CHUNK];
+};
+
+static void gvir_sandbox_builder_initrd_archive_free(GVirSandboxBuilderInitrdArchive *archive);
+
+static GVirSandboxBuilderInitrdArchive *
+gvir_sandbox_builder_initrd_archive_new(const gchar *outputfile,
+                                        GVirSandboxBuilderInitrdCompression compression,
+                                        GError **error)
+{
+    GVirSandboxBuilderInitrdArchive *archive = g_new0(GVirSandboxBuilderInitrdArchive, 1);
+    GFile *file = g_file_new_for_path(outputfile);
+#if WITH_LZ4
+    guint32 magic = GUINT32_TO_LE(GVIR_SANDBOX_BUILDER_INITRD_LZ4_MAGIC);
+#endif
+
+    archive->compression = compression;
+
+    switch (compression) {
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_NONE:
+        break;
+
+#if WITH_ZLIB
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_GZIP:
+        /* Window bits of 15 + 16 requests a gzip wrapper. Level 1 is
+         * plenty for an archive which is only unpacked once */
+        if (deflateInit2(&archive->zs, 1, Z_DEFLATED, 15 + 16, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, 0, "%s",
+                        _("Unable to initialize gzip compression"));
+            goto error;
+        }
+        break;
+#endif
+
+#if WITH_LZ4
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_LZ4:
+        archive->lz4in = g_new0(gchar, GVIR_SANDBOX_BUILDER_INITRD_LZ4_BLOCK);
+        archive->lz4out = g_new0(gchar, LZ4_compressBound(GVIR_SANDBOX_BUILDER_INITRD_LZ4_BLOCK));
+        break;
+#endif
+
+#if WITH_ZSTD
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_ZSTD:
+        if (!(archive->zstd = ZSTD_createCStream()) ||
+            ZSTD_isError(ZSTD_initCStream(archive->zstd, 3))) {
+            g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, 0, "%s",
+                        _("Unable to initialize zstd compression"));
+            goto error;
+        }
+        break;
+#endif
+
+    default:
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, 0,
+                    _("Ramdisk compression format %d is not supported"),
+                    compression);
+        goto error;
+    }
+
+    if (!(archive->os = G_OUTPUT_STREAM(g_file_replace(file, NULL, FALSE,
+                                                       G_FILE_CREATE_NONE,
+                                                       NULL, error))))
+        goto error;
+
+#if WITH_LZ4
+    if (compression == GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_LZ4 &&
+        !g_output_stream_write_all(archive->os, &magic, sizeof(magic),
+                                   NULL, NULL, error))
+        goto error;
+#endif
+
+    g_object_unref(file);
+    return archive;
+
+ error:
+    g_object_unref(file);
+    gvir_sandbox_builder_initrd_archive_free(archive);
+    return NULL;
+}
+
+
+static void gvir_sandbox_builder_initrd_archive_free(GVirSandboxBuilderInitrdArchive *archive)
+{
+    if (!archive)
+        return;
+
+    switch (archive->compression) {
+#if WITH_ZLIB
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_GZIP:
+        deflateEnd(&archive->zs);
+        break;
+#endif
+#if WITH_LZ4
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_LZ4:
+        g_free(archive->lz4in);
+        g_free(archive->lz4out);
+        break;
+#endif
+#if WITH_ZSTD
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_ZSTD:
+        if (archive->zstd)
+            ZSTD_freeCStream(archive->zstd);
+        break;
+#endif
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_NONE:
+    default:
+        break;
     }
 
+    if (archive->os)
+        g_object_unref(archive->os);
+    g_free(archive);
+}
+
+
+#if WITH_ZLIB
+static gboolean gvir_sandbox_builder_initrd_archive_gzip(GVirSandboxBuilderInitrdArchive *archive,
+                                                         const void *data,
+                                                         gsize len,
+                                                         gboolean finish,
+                                                         GError **error)
+{
+    int ret;
+
+    archive->zs.next_in = (Bytef *)data;
+    archive->zs.avail_in = len;
+
+    do {
+        archive->zs.next_out = archive->out;
+        archive->zs.avail_out = sizeof(archive->out);
+
+        ret = deflate(&archive->zs, finish ? Z_FINISH : Z_NO_FLUSH);
+        if (ret == Z_STREAM_ERROR) {
+            g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, 0, "%s",
+                        _("Unable to compress ramdisk with gzip"));
+            return FALSE;
+        }
+
+        if (!g_output_stream_write_all(archive->os, archive->out,
+                                       sizeof(archive->out) - archive->zs.avail_out,
+                                       NULL, NULL, error))
+            return FALSE;
+    } while (archive->zs.avail_out == 0 ||
+             (finish && ret != Z_STREAM_END));
+
+    return TRUE;
+}
+#endif
+
+
+#if WITH_LZ4
+static gboolean gvir_sandbox_builder_initrd_archive_lz4_block(GVirSandboxBuilderInitrdArchive *archive,
+                                                              GError **error)
+{
+    int ret;
+    guint32 size;
+
+    if (!archive->lz4inLength)
+        return TRUE;
+
+    ret = LZ4_compress_default(archive->lz4in, archive->lz4out,
+                               archive->lz4inLength,
+                               LZ4_compressBound(GVIR_SANDBOX_BUILDER_INITRD_LZ4_BLOCK));
+    if (ret <= 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, 0, "%s",
+                    _("Unable to compress ramdisk with lz4"));
+        return FALSE;
+    }
+
+    size = GUINT32_TO_LE(ret);
+    if (!g_output_stream_write_all(archive->os, &size, sizeof(size),
+                                   NULL, NULL, error) ||
+        !g_output_stream_write_all(archive->os, archive->lz4out, ret,
+                                   NULL, NULL, error))
+        return FALSE;
+
+    archive->lz4inLength = 0;
+    return TRUE;
+}
+
+
+static gboolean gvir_sandbox_builder_initrd_archive_lz4(GVirSandboxBuilderInitrdArchive *archive,
+                                                        const void *data,
+                                                        gsize len,
+                                                        gboolean finish,
+                                                        GError **error)
+{
+    const gchar *ptr = data;
+
+    while (len) {
+        gsize want = MIN(len, GVIR_SANDBOX_BUILDER_INITRD_LZ4_BLOCK - archive->lz4inLength);
+        memcpy(archive->lz4in + archive->lz4inLength, ptr, want);
+        archive->lz4inLength += want;
+        ptr += want;
+        len -= want;
+
+        if (archive->lz4inLength == GVIR_SANDBOX_BUILDER_INITRD_LZ4_BLOCK &&
+            !gvir_sandbox_builder_initrd_archive_lz4_block(archive, error))
+            return FALSE;
+    }
+
+    if (finish)
+        return gvir_sandbox_builder_initrd_archive_lz4_block(archive, error);
+
+    return TRUE;
+}
+#endif
+
+
+#if WITH_ZSTD
+static gboolean gvir_sandbox_builder_initrd_archive_zstd(GVirSandboxBuilderInitrdArchive *archive,
+                                                         const void *data,
+                                                         gsize len,
+                                                         gboolean finish,
+                                                         GError **error)
+{
+    ZSTD_inBuffer in = { data, len, 0 };
+    ZSTD_outBuffer out = { archive->out, sizeof(archive->out), 0 };
+    size_t ret = 0;
+
+    while (in.pos < in.size) {
+        out.pos = 0;
+        ret = ZSTD_compressStream(archive->zstd, &out, &in);
+        if (ZSTD_isError(ret))
+            goto error;
+        if (!g_output_stream_write_all(archive->os, archive->out, out.pos,
+                                       NULL, NULL, error))
+            return FALSE;
+    }
+
+    if (finish) {
+        do {
+            out.pos = 0;
+            ret = ZSTD_endStream(archive->zstd, &out);
+            if (ZSTD_isError(ret))
+                goto error;
+            if (!g_output_stream_write_all(archive->os, archive->out, out.pos,
+                                           NULL, NULL, error))
+                return FALSE;
+        } while (ret != 0);
+    }
+
+    return TRUE;
+
+ error:
+    g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, 0,
+                _("Unable to compress ramdisk with zstd: %s"),
+                ZSTD_getErrorName(ret));
+    return FALSE;
+}
+#endif
+
+
+static gboolean gvir_sandbox_builder_initrd_archive_write(GVirSandboxBuilderInitrdArchive *archive,
+                                                          const void *data,
+                                                          gsize len,
+                                                          gboolean finish,
+                                                          GError **error)
+{
+    archive->offset += len;
+
+    switch (archive->compression) {
+#if WITH_ZLIB
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_GZIP:
+        return gvir_sandbox_builder_initrd_archive_gzip(archive, data, len, finish, error);
+#endif
+#if WITH_LZ4
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_LZ4:
+        return gvir_sandbox_builder_initrd_archive_lz4(archive, data, len, finish, error);
+#endif
+#if WITH_ZSTD
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_ZSTD:
+        return gvir_sandbox_builder_initrd_archive_zstd(archive, data, len, finish, error);
+#endif
+    case GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_NONE:
+    default:
+        return g_output_stream_write_all(archive->os, data, len,
+                                         NULL, NULL, error);
+    }
+}
+
+
+static gboolean gvir_sandbox_builder_initrd_archive_pad(GVirSandboxBuilderInitrdArchive *archive,
+                                                        GError **error)
+{
+    static const gchar zeros[4];
+    gsize pad = (4 - (archive->offset % 4)) % 4;
+
+    if (!pad)
+        return TRUE;
+
+    return gvir_sandbox_builder_initrd_archive_write(archive, zeros, pad, FALSE, error);
+}
+
+
+static gboolean gvir_sandbox_builder_initrd_archive_header(GVirSandboxBuilderInitrdArchive *archive,
+                                                           const gchar *name,
+                                                           guint32 mode,
+                                                           guint32 size,
+                                                           GError **error)
+{
+    /* Timestamps are left at zero, so identical inputs
+     * always produce an identical ramdisk */
+    gchar *hdr = g_strdup_printf("070701"
+                                 "%08X%08X%08X%08X%08X%08X%08X"
+                                 "%08X%08X%08X%08X%08X%08X",
+                                 archive->ino++, /* ino */
+                                 mode,
+                                 0, 0,           /* uid, gid */
+                                 1,              /* nlink */
+                                 0,              /* mtime */
+                                 size,
+                                 0, 0, 0, 0,     /* dev & rdev major/minor */
+                                 (guint32)strlen(name) + 1,
+                                 0);             /* check */
+    gboolean ret = FALSE;
+
+    if (!gvir_sandbox_builder_initrd_archive_write(archive, hdr, strlen(hdr), FALSE, error))
+        goto cleanup;
+    if (!gvir_sandbox_builder_initrd_archive_write(archive, name, strlen(name) + 1, FALSE, error))
+        goto cleanup;
+    if (!gvir_sandbox_builder_initrd_archive_pad(archive, error))
+        goto cleanup;
+
+    ret = TRUE;
  cleanup:
-    return dir;
+    g_free(hdr);
+    return ret;
 }
 
 
-static gboolean gvir_sandbox_builder_initrd_copy_file(const gchar *srcpath,
-                                                      const gchar *tgtdir,
-                                                      const gchar *tgtname,
-                                                      GError **error)
+static gboolean gvir_sandbox_builder_initrd_archive_add_data(GVirSandboxBuilderInitrdArchive *archive,
+                                                             const gchar *name,
+                                                             guint32 mode,
+                                                             const gchar *data,
+                                                             gsize len,
+                                                             GError **error)
 {
-    gchar *tgtpath = g_strdup_printf("%s/%s", tgtdir, tgtname);
-    GFile *tgt = g_file_new_for_path(tgtpath);
-    GFile *src = g_file_new_for_path(srcpath);
+    if (!gvir_sandbox_builder_initrd_archive_header(archive, name, mode, len, error))
+        return FALSE;
+    if (!gvir_sandbox_builder_initrd_archive_write(archive, data, len, FALSE, error))
+        return FALSE;
+    return gvir_sandbox_builder_initrd_archive_pad(archive, error);
+}
+
+
+static gboolean gvir_sandbox_builder_initrd_archive_add_file(GVirSandboxBuilderInitrdArchive *archive,
+                                                             const gchar *name,
+                                                             guint32 mode,
+                                                             GFile *file,
+                                                             GError **error)
+{
+    GFileInputStream *is = NULL;
+    GFileInfo *info = NULL;
+    gchar *buf = NULL;
+    goffset size;
+    goffset done = 0;
     gboolean ret = FALSE;
 
-    g_free(tgtpath);
+    if (!(is = g_file_read(file, NULL, error)))
+        goto cleanup;
 
-    if (!g_file_copy(src, tgt, 0, NULL, NULL, NULL, error))
+    if (!(info = g_file_input_stream_query_info(is,
+                                                G_FILE_ATTRIBUTE_STANDARD_SIZE,
+                                                NULL, error)))
         goto cleanup;
 
-    ret = TRUE;
+    size = g_file_info_get_size(info);
+    if (!gvir_sandbox_builder_initrd_archive_header(archive, name, mode, size, error))
+        goto cleanup;
 
+    buf = g_new0(gchar, GVIR_SANDBOX_BUILDER_INITRD_CHUNK);
+    while (done < size) {
+        gssize got = g_input_stream_read(G_INPUT_STREAM(is), buf,
+                                         MIN(size - done, GVIR_SANDBOX_BUILDER_INITRD_CHUNK),
+                                         NULL, error);
+        if (got < 0)
+            goto cleanup;
+        if (got == 0) {
+            gchar *path = g_file_get_path(file);
+            g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, 0,
+                        _("File %s was truncated while reading"), path);
+            g_free(path);
+            goto cleanup;
+        }
+        if (!gvir_sandbox_builder_initrd_archive_write(archive, buf, got, FALSE, error))
+            goto cleanup;
+        done += got;
+    }
+
+    if (!gvir_sandbox_builder_initrd_archive_pad(archive, error))
+        goto cleanup;
+
+    ret = TRUE;
  cleanup:
-    g_object_unref(tgt);
-    g_object_unref(src);
+    g_free(buf);
+    if (info)
+        g_object_unref(info);
+    if (is)
+        g_object_unref(is);
     return ret;
 }
 
+
+static gboolean gvir_sandbox_builder_initrd_archive_finish(GVirSandboxBuilderInitrdArchive *archive,
+                                                           GError **error)
+{
+    if (!gvir_sandbox_builder_initrd_archive_header(archive, "TRAILER!!!", 0, 0, error))
+        return FALSE;
+    if (!gvir_sandbox_builder_initrd_archive_write(archive, NULL, 0, TRUE, error))
+        return FALSE;
+    return g_output_stream_close(archive->os, NULL, error);
+}
+
+
+/*
+ * Index of the kernel module metadata generated by depmod,
+ * so that modules can be resolved without walking the tree.
+ */
+typedef struct _GVirSandboxBuilderInitrdModIndex GVirSandboxBuilderInitrdModIndex;
+struct _GVirSandboxBuilderInitrdModIndex {
+    gchar *basedir;
+    gchar *stamp;
+    /* Module name -> strv of its path and the paths it depends on */
+    GHashTable *deps;
+    /* Module name -> alias target module name */
+    GHashTable *aliases;
+    /* Set of module names compiled into the kernel */
+    GHashTable *builtin;
+};
+
+/* Indexes of loaded module metadata, keyed on module base dir */
+G_LOCK_DEFINE_STATIC(modIndexes);
+static GHashTable *modIndexes;
+
+
+static void gvir_sandbox_builder_initrd_modindex_free(gpointer opaque)
+{
+    GVirSandboxBuilderInitrdModIndex *index = opaque;
+
+    g_free(index->basedir);
+    g_free(index->stamp);
+    g_hash_table_unref(index->deps);
+    g_hash_table_unref(index->aliases);
+    g_hash_table_unref(index->builtin);
+    g_free(index);
+}
+
+
+/*
+ * Turn "kernel/fs/9p/9p.ko.xz", "9p.ko" or "9p" into
+ * the canonical module name "9p", with '-' folded to '_'
+ */
+static gchar *gvir_sandbox_builder_initrd_modname(const gchar *path)
+{
+    gchar *name = g_path_get_basename(path);
+    gchar *ext = strstr(name, ".ko");
+    gchar *tmp;
+
+    if (ext && (ext[3] == '\0' || ext[3] == '.'))
+        *ext = '\0';
+
+    for (tmp = name; *tmp; tmp++)
+        if (*tmp == '-')
+            *tmp = '_';
+
+    return name;
+}
+
+
+static gchar **gvir_sandbox_builder_initrd_modindex_read(const gchar *basedir,
+                                                         const gchar *file,
+                                                         gboolean optional,
+                                                         GError **error)
+{
+    gchar *path = g_build_filename(basedir, file, NULL);
+    gchar *data = NULL;
+    gchar **lines = NULL;
+    GError *err = NULL;
+
+    if (!g_file_get_contents(path, &data, NULL, &err)) {
+        if (optional && g_error_matches(err, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_error_free(err);
+            lines = g_new0(gchar *, 1);
+        } else {
+            g_propagate_error(error, err);
+        }
+        goto cleanup;
+    }
+
+    lines = g_strsplit(data, "\n", 0);
+
+ cleanup:
+    g_free(data);
+    g_free(path);
+    return lines;
+}
+
+
+static GVirSandboxBuilderInitrdModIndex *
+gvir_sandbox_builder_initrd_modindex_load(const gchar *basedir,
+                                          const gchar *stamp,
+                                          GError **error)
+{
+    GVirSandboxBuilderInitrdModIndex *index = g_new0(GVirSandboxBuilderInitrdModIndex, 1);
+    gchar **lines = NULL;
+    gsize i;
+
+    index->basedir = g_strdup(basedir);
+    index->stamp = g_strdup(stamp);
+    index->deps = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                        g_free, (GDestroyNotify)g_strfreev);
+    index->aliases = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, g_free);
+    index->builtin = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                           g_free, NULL);
+
+    /* Lines look like "kernel/fs/9p/9p.ko: kernel/net/9p/9pnet.ko" */
+    if (!(lines = gvir_sandbox_builder_initrd_modindex_read(basedir, "modules.dep",
+                                                            FALSE, error)))
+        goto error;
+    for (i = 0; lines[i]; i++) {
+        gchar *deps = strchr(lines[i], ':');
+        gchar **paths;
+        gchar **extra;
+        gsize j, n;
+
+        if (!deps)
+            continue;
+        *deps = '\0';
+        deps++;
+
+        extra = g_strsplit_set(g_strstrip(deps), " \t", 0);
+        n = g_strv_length(extra);
+        paths = g_new0(gchar *, n + 2);
+        paths[0] = g_strdup(lines[i]);
+        for (j = 0, n = 1; extra[j]; j++)
+            if (extra[j][0])
+                paths[n++] = g_strdup(extra[j]);
+        g_strfreev(extra);
+
+        g_hash_table_insert(index->deps,
+                            gvir_sandbox_builder_initrd_modname(lines[i]),
+                            paths);
+    }
+    g_strfreev(lines);
+
+    /* Lines look like "alias fs-9p 9p" */
+    if (!(lines = gvir_sandbox_builder_initrd_modindex_read(basedir, "modules.alias",
+                                                            TRUE, error)))
+        goto error;
+    for (i = 0; lines[i]; i++) {
+        gchar **fields = g_strsplit(lines[i], " ", 3);
+        if (g_strv_length(fields) == 3 &&
+            g_str_equal(fields[0], "alias") &&
+            !strpbrk(fields[1], "*?["))
+            g_hash_table_insert(index->aliases,
+                                gvir_sandbox_builder_initrd_modname(fields[1]),
+                                gvir_sandbox_builder_initrd_modname(fields[2]));
+        g_strfreev(fields);
+    }
+    g_strfreev(lines);
+
+    /* Lines look like "kernel/fs/ext4/ext4.ko" */
+    if (!(lines = gvir_sandbox_builder_initrd_modindex_read(basedir, "modules.builtin",
+                                                            TRUE, error)))
+        goto error;
+    for (i = 0; lines[i]; i++) {
+        if (!lines[i][0])
+            continue;
+        g_hash_table_add(index->builtin,
+                         gvir_sandbox_builder_initrd_modname(lines[i]));
+    }
+    g_strfreev(lines);
+
+    return index;
+
+ error:
+    gvir_sandbox_builder_initrd_modindex_free(index);
+    return NULL;
+}
+
+
+/*
+ * Returns the module index for @basedir, loading it if it is not
+ * already cached. Returns NULL without setting @error if there is
+ * no modules.dep, so callers can fallback to walking the tree.
+ * The caller must hold the modIndexes lock while using the index.
+ */
+static GVirSandboxBuilderInitrdModIndex *
+gvir_sandbox_builder_initrd_modindex_get(const gchar *basedir,
+                                         GError **error)
+{
+    GVirSandboxBuilderInitrdModIndex *index = NULL;
+    gchar *deppath = g_build_filename(basedir, "modules.dep", NULL);
+    gchar *stamp = NULL;
+    struct stat sb;
+
+    if (stat(deppath, &sb) < 0) {
+        g_debug("No module index %s: %s", deppath, strerror(errno));
+        goto cleanup;
+    }
+
+    /* depmod rewrites the file, so the inode and mtime
+     * identify which version of the index we have */
+    stamp = g_strdup_printf("%llu:%llu:%llu",
+                            (unsigned long long)sb.st_ino,
+                            (unsigned long long)sb.st_size,
+                            (unsigned long long)sb.st_mtime);
+
+    if (!modIndexes)
+        modIndexes = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                                           gvir_sandbox_builder_initrd_modindex_free);
+
+    index = g_hash_table_lookup(modIndexes, basedir);
+    if (!index || !g_str_equal(index->stamp, stamp)) {
+        if ((index = gvir_sandbox_builder_initrd_modindex_load(basedir, stamp, error)))
+            g_hash_table_replace(modIndexes, index->basedir, index);
+    }
+
+ cleanup:
+    g_free(stamp);
+    g_free(deppath);
+    return index;
+}
+
+
+static void gvir_sandbox_builder_initrd_modindex_resolve(GVirSandboxBuilderInitrdModIndex *index,
+                                                         const gchar *modname,
+                                                         GHashTable *seen,
+                                                         GHashTable *moddeps,
+                                                         GList **modfiles)
+{
+    gchar *name = gvir_sandbox_builder_initrd_modname(modname);
+    gchar **paths;
+    gchar **deps;
+    gchar *path;
+    const gchar *target;
+    gsize i;
+
+    if (g_hash_table_contains(seen, name)) {
+        g_free(name);
+        return;
+    }
+    g_hash_table_add(seen, name);
+
+    if (g_hash_table_contains(index->builtin, name)) {
+        g_debug("Module %s is built into the kernel", name);
+        return;
+    }
+
+    if (!(paths = g_hash_table_lookup(index->deps, name))) {
+        if ((target = g_hash_table_lookup(index->aliases, name)))
+            gvir_sandbox_builder_initrd_modindex_resolve(index, target,
+                                                         seen, moddeps, modfiles);
+        else
+            g_debug("Module %s not found in %s", name, index->basedir);
+        return;
+    }
+
+    /* Dependencies must be listed, and thus loaded, first */
+    deps = g_new0(gchar *, g_strv_length(paths));
+    for (i = 1; paths[i]; i++) {
+        gvir_sandbox_builder_initrd_modindex_resolve(index, paths[i],
+                                                     seen, moddeps, modfiles);
+        deps[i - 1] = g_path_get_basename(paths[i]);
+    }
+    g_hash_table_insert(moddeps, g_path_get_basename(paths[0]), deps);
+
+    path = g_build_filename(index->basedir, paths[0], NULL);
+    *modfiles = g_list_prepend(*modfiles, g_file_new_for_path(path));
+    g_free(path);
+}
+
+
 #define FIND_USING_GIO
 
 #ifdef FIND_USING_GIO
@@ -337,90 +1183,128 @@ static GList *gvir_sandbox_builder_initrd_find_files(GList *modnames,
 #endif
 
 
+/*
+ * Returns the files for @modnames and all their dependencies,
+ * in the order in which they must be loaded. The dependencies
+ * of each file are added to @moddeps, keyed on file name, if
+ * they are known.
+ */
 static GList *gvir_sandbox_builder_initrd_find_modules(GList *modnames,
                                                        GVirSandboxConfigInitrd *config,
+                                                       GHashTable *moddeps,
                                                        GError **error)
 {
-    gchar *moddirpath = g_strdup_printf("%s",
-                                        gvir_sandbox_config_initrd_get_kmoddir(config));
-    GFile *moddir = g_file_new_for_path(moddirpath);
+    const gchar *moddirpath = gvir_sandbox_config_initrd_get_kmoddir(config);
+    gchar *basedir = g_path_get_dirname(moddirpath);
+    GVirSandboxBuilderInitrdModIndex *index;
+    GFile *moddir = NULL;
+    GList *found = NULL;
+    GList *modfiles = NULL;
+    GList *tmp;
 
-    GList *modfiles = gvir_sandbox_builder_initrd_find_files(modnames,
-                                                             moddir,
-                                                             error);
+    G_LOCK(modIndexes);
+    index = gvir_sandbox_builder_initrd_modindex_get(basedir, error);
+    if (index) {
+        GHashTable *seen = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                 g_free, NULL);
+        tmp = modnames;
+        while (tmp) {
+            gvir_sandbox_builder_initrd_modindex_resolve(index, tmp->data,
+                                                         seen, moddeps, &modfiles);
+            tmp = tmp->next;
+        }
+        g_hash_table_unref(seen);
+    }
+    G_UNLOCK(modIndexes);
+
+    if (index) {
+        modfiles = g_list_reverse(modfiles);
+        goto cleanup;
+    }
+    if (*error)
+        goto cleanup;
+
+    /* No depmod data, so search the tree for the named modules */
+    moddir = g_file_new_for_path(moddirpath);
+    found = gvir_sandbox_builder_initrd_find_files(modnames, moddir, error);
+    if (*error)
+        goto cleanup;
+
+    tmp = modnames;
+    while (tmp) {
+        GList *files = found;
+        while (files) {
+            gchar *basename = g_file_get_basename(files->data);
+            gboolean match = g_str_has_prefix(basename, tmp->data);
+            g_free(basename);
+            if (match) {
+                modfiles = g_list_prepend(modfiles, g_object_ref(files->data));
+                break;
+            }
+            files = files->next;
+        }
+        tmp = tmp->next;
+    }
+    modfiles = g_list_reverse(modfiles);
 
-    g_free(moddirpath);
-    g_object_unref(moddir);
+ cleanup:
+    g_list_foreach(found, (GFunc)g_object_unref, NULL);
+    g_list_free(found);
+    if (moddir)
+        g_object_unref(moddir);
+    g_free(basedir);
     return modfiles;
 }
 
 
-static gboolean gvir_sandbox_builder_initrd_populate_tmpdir(const gchar *tmpdir,
-                                                            GVirSandboxConfigInitrd *config,
-                                                            GError **error)
+static gboolean gvir_sandbox_builder_initrd_populate_archive(GVirSandboxBuilderInitrdArchive *archive,
+                                                             GVirSandboxConfigInitrd *config,
+                                                             GError **error)
 {
     gboolean ret = FALSE;
     GList *modnames = NULL;
     GList *modfiles = NULL;
     GList *tmp;
-    GFile *modlist = NULL;
-    gchar *modlistpath = NULL;
-    GOutputStream *modlistos = NULL;
+    GFile *init = g_file_new_for_path(gvir_sandbox_config_initrd_get_init(config));
+    GString *modlist = g_string_new("");
+    GHashTable *moddeps = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                g_free, (GDestroyNotify)g_strfreev);
 
-    if (!gvir_sandbox_builder_initrd_copy_file(
-                                               gvir_sandbox_config_initrd_get_init(config),
-                                               tmpdir, "init", error))
-        return FALSE;
+    if (!gvir_sandbox_builder_initrd_archive_add_file(archive, "init", 0100755,
+                                                      init, error))
+        goto cleanup;
 
     modnames = gvir_sandbox_config_initrd_get_modules(config);
-    modfiles = gvir_sandbox_builder_initrd_find_modules(modnames, config, error);
+    modfiles = gvir_sandbox_builder_initrd_find_modules(modnames, config, moddeps, error);
     if (*error)
         goto cleanup;
 
     tmp = modfiles;
     while (tmp) {
-        const gchar *basename = g_file_get_basename(tmp->data);
-        gchar *tgt = g_strdup_printf("%s/%s", tmpdir, basename);
-        GFile *file = g_file_new_for_path(tgt);
-        g_free(tgt);
-
-        if (!g_file_copy(tmp->data, file, 0, NULL, NULL, NULL, error)) {
-            g_object_unref(file);
-            goto cleanup;
+        gchar *basename = g_file_get_basename(tmp->data);
+        gboolean added = gvir_sandbox_builder_initrd_archive_add_file(archive, basename,
+                                                                      0100644,
+                                                                      tmp->data, error);
+        gchar **deps = g_hash_table_lookup(moddeps, basename);
+        g_string_append(modlist, basename);
+        /* Lines without a tab have unknown dependencies, so
+         * init loads them after all the modules before them */
+        if (deps) {
+            gchar *deplist = g_strjoinv(" ", deps);
+            g_string_append_printf(modlist, "\t%s", deplist);
+            g_free(deplist);
         }
-        g_object_unref(file);
-
-        tmp = tmp->next;
-    }
-
-
-    modlistpath = g_strdup_printf("%s/modules", tmpdir);
-    modlist = g_file_new_for_path(modlistpath);
-    if (!(modlistos = G_OUTPUT_STREAM(g_file_create(modlist, G_FILE_CREATE_NONE, NULL, error))))
-        goto cleanup;
+        g_string_append_c(modlist, '\n');
+        g_free(basename);
+        if (!added)
+            goto cleanup;
 
-    tmp = modnames;
-    while (tmp) {
-        GList *files = modfiles;
-        while (files) {
-            const gchar *basename = g_file_get_basename(files->data);
-            if (g_str_has_prefix(basename, tmp->data)) {
-                if (!g_output_stream_write_all(modlistos,
-                                               basename, strlen(basename),
-                                               NULL, NULL, error))
-                    goto cleanup;
-                if (!g_output_stream_write_all(modlistos,
-                                               "\n", 1,
-                                               NULL, NULL, error))
-                    goto cleanup;
-                break;
-            }
-            files = files->next;
-        }
         tmp = tmp->next;
     }
 
-    if (!g_output_stream_close(modlistos, NULL, error))
+    if (!gvir_sandbox_builder_initrd_archive_add_data(archive, "modules", 0100644,
+                                                      modlist->str, modlist->len,
+                                                      error))
         goto cleanup;
 
     ret = TRUE;
@@ -428,103 +1312,380 @@ static gboolean gvir_sandbox_builder_initrd_populate_tmpdir(const gchar *tmpdir,
     g_list_foreach(modfiles, (GFunc)g_object_unref, NULL);
     g_list_free(modfiles);
     g_list_free(modnames);
-    g_free(modlistpath);
-    if (modlist)
-        g_object_unref(modlist);
-    if (modlistos)
-        g_object_unref(modlistos);
+    g_string_free(modlist, TRUE);
+    g_hash_table_unref(moddeps);
+    g_object_unref(init);
     return ret;
 }
 
 
-static gboolean gvir_sandbox_builder_initrd_create_initrd(const gchar *tmpdir,
-                                                          const gchar *outputfile,
-                                                          GError **error)
+static gboolean gvir_sandbox_builder_initrd_build(GVirSandboxConfigInitrd *config,
+                                                  GVirSandboxBuilderInitrdCompression compression,
+                                                  const gchar *outputfile,
+                                                  GError **error)
 {
+    GVirSandboxBuilderInitrdArchive *archive = NULL;
     gboolean ret = FALSE;
-    gchar *src = g_shell_quote(tmpdir);
-    gchar *tgt = g_shell_quote(outputfile);
 
-    gchar *cmd = g_strdup_printf(
-                                 "/bin/sh -c \"(cd %s && ( find | cpio --quiet -o -H newc | gzip -9 ) ) > %s\"",
-                                 src, tgt);
+    if (!(archive = gvir_sandbox_builder_initrd_archive_new(outputfile,
+                                                            compression,
+                                                            error)))
+        goto cleanup;
+
+    if (!gvir_sandbox_builder_initrd_populate_archive(archive, config, error))
+        goto cleanup;
 
-    if (!g_spawn_command_line_sync(cmd, NULL, NULL, NULL, error))
+    if (!gvir_sandbox_builder_initrd_archive_finish(archive, error))
         goto cleanup;
 
     ret = TRUE;
  cleanup:
-    g_free(src);
-    g_free(tgt);
-    g_free(cmd);
+    gvir_sandbox_builder_initrd_archive_free(archive);
+    if (!ret)
+        unlink(outputfile);
     return ret;
 }
 
 
-static gboolean gvir_sandbox_builder_initrd_remove_tmpdir(const gchar *tmpdir,
-                                                          GError **error)
+static gchar *gvir_sandbox_builder_initrd_checksum_init(const gchar *path,
+                                                        GError **error)
 {
-    GFile *dir = g_file_new_for_path(tmpdir);
-    GFileEnumerator *children = g_file_enumerate_children(dir,
-                                                          "standard::name",
-                                                          G_FILE_QUERY_INFO_NONE,
-                                                          NULL,
-                                                          error);
-    GFileInfo *childinfo;
-    gboolean ret = FALSE;
-    if (!children)
-        goto cleanup;
+    struct stat sb;
+    gchar *key = NULL;
+    gchar *data = NULL;
+    gsize len;
+    gchar *sum = NULL;
 
-    while ((childinfo = g_file_enumerator_next_file(children, NULL, error)) != NULL) {
-        GFile *file = g_file_get_child(dir, g_file_info_get_name(childinfo));
-        g_file_delete(file, NULL, error && !*error ? error : NULL);
-        g_object_unref(childinfo);
+    if (stat(path, &sb) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, errno,
+                    _("Unable to access %s: %s"),
+                    path, strerror(errno));
+        return NULL;
     }
 
-    if (error && *error)
+    key = g_strdup_printf("%s:%llu:%llu:%llu:%llu", path,
+                          (unsigned long long)sb.st_dev,
+                          (unsigned long long)sb.st_ino,
+                          (unsigned long long)sb.st_size,
+                          (unsigned long long)sb.st_mtime);
+
+    G_LOCK(initChecksums);
+    if (!initChecksums)
+        initChecksums = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, g_free);
+    sum = g_strdup(g_hash_table_lookup(initChecksums, key));
+    G_UNLOCK(initChecksums);
+
+    if (sum)
         goto cleanup;
 
-    ret = TRUE;
+    if (!g_file_get_contents(path, &data, &len, error))
+        goto cleanup;
+
+    sum = g_compute_checksum_for_data(G_CHECKSUM_SHA256, (guchar *)data, len);
+
+    G_LOCK(initChecksums);
+    g_hash_table_replace(initChecksums, key, g_strdup(sum));
+    key = NULL;
+    G_UNLOCK(initChecksums);
+
  cleanup:
-    g_file_delete(dir, NULL, error && !*error ? error : NULL);
-    g_object_unref(dir);
+    g_free(key);
+    g_free(data);
+    return sum;
+}
 
-    g_object_unref(children);
+
+static gchar *gvir_sandbox_builder_initrd_cache_path(const gchar *cachedir,
+                                                     GVirSandboxConfigInitrd *config,
+                                                     GVirSandboxBuilderInitrdCompression compression,
+                                                     GError **error)
+{
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    GList *modnames = gvir_sandbox_config_initrd_get_modules(config);
+    GList *tmp;
+    gchar *initsum = NULL;
+    gchar *format = g_strdup_printf("%d", compression);
+    gchar *depfile = NULL;
+    gchar *depstamp = NULL;
+    gchar *name = NULL;
+    struct stat sb;
+    gchar *path = NULL;
+    const gchar *kver = gvir_sandbox_config_initrd_get_kver(config);
+    const gchar *kmoddir = gvir_sandbox_config_initrd_get_kmoddir(config);
+
+    if (!(initsum = gvir_sandbox_builder_initrd_checksum_init(
+              gvir_sandbox_config_initrd_get_init(config), error)))
+        goto cleanup;
+
+    /* Changes to the modules installed for a kernel
+     * version are detected via the depmod output */
+    depfile = g_build_filename(kmoddir ? kmoddir : "", "..", "modules.dep", NULL);
+    if (stat(depfile, &sb) == 0)
+        depstamp = g_strdup_printf("%llu:%llu",
+                                   (unsigned long long)sb.st_ino,
+                                   (unsigned long long)sb.st_mtime);
+
+#define CHECKSUM_FIELD(str)                                             \
+    do {                                                                \
+        const gchar *val = (str) ? (str) : "";                          \
+        g_checksum_update(sum, (const guchar *)val, strlen(val) + 1);   \
+    } while (0)
+
+    CHECKSUM_FIELD(GVIR_SANDBOX_BUILDER_INITRD_CACHE_VERSION);
+    CHECKSUM_FIELD(kver);
+    CHECKSUM_FIELD(kmoddir);
+    CHECKSUM_FIELD(initsum);
+    CHECKSUM_FIELD(format);
+    CHECKSUM_FIELD(depstamp);
+    tmp = modnames;
+    while (tmp) {
+        CHECKSUM_FIELD(tmp->data);
+        tmp = tmp->next;
+    }
+
+#undef CHECKSUM_FIELD
+
+    name = g_strdup_printf("initrd-%s.img", g_checksum_get_string(sum));
+    path = g_build_filename(cachedir, name, NULL);
+
+ cleanup:
+    g_checksum_free(sum);
+    g_list_free(modnames);
+    g_free(initsum);
+    g_free(format);
+    g_free(depfile);
+    g_free(depstamp);
+    g_free(name);
+    return path;
+}
+
+
+typedef struct _GVirSandboxBuilderInitrdCacheEntry GVirSandboxBuilderInitrdCacheEntry;
+struct _GVirSandboxBuilderInitrdCacheEntry {
+    gchar *path;
+    time_t mtime;
+};
+
+
+static gint gvir_sandbox_builder_initrd_cache_compare(gconstpointer a,
+                                                      gconstpointer b)
+{
+    const GVirSandboxBuilderInitrdCacheEntry *ea = a;
+    const GVirSandboxBuilderInitrdCacheEntry *eb = b;
+
+    /* Most recently used first */
+    if (ea->mtime > eb->mtime)
+        return -1;
+    if (ea->mtime < eb->mtime)
+        return 1;
+    return 0;
+}
+
+
+static void gvir_sandbox_builder_initrd_cache_evict(const gchar *cachedir,
+                                                    guint cachesize)
+{
+    GDir *dh;
+    const gchar *name;
+    GList *entries = NULL;
+    GList *tmp;
+    guint count = 0;
+
+    if (cachesize == 0)
+        return;
+
+    if (!(dh = g_dir_open(cachedir, 0, NULL)))
+        return;
+
+    while ((name = g_dir_read_name(dh)) != NULL) {
+        GVirSandboxBuilderInitrdCacheEntry *entry;
+        struct stat sb;
+        gchar *path;
+
+        if (!g_str_has_prefix(name, "initrd-") ||
+            !g_str_has_suffix(name, ".img"))
+            continue;
+
+        path = g_build_filename(cachedir, name, NULL);
+        if (stat(path, &sb) < 0) {
+            g_free(path);
+            continue;
+        }
+        entry = g_new0(GVirSandboxBuilderInitrdCacheEntry, 1);
+        entry->path = path;
+        entry->mtime = sb.st_mtime;
+        entries = g_list_prepend(entries, entry);
+    }
+    g_dir_close(dh);
+
+    entries = g_list_sort(entries, gvir_sandbox_builder_initrd_cache_compare);
+
+    tmp = entries;
+    while (tmp) {
+        GVirSandboxBuilderInitrdCacheEntry *entry = tmp->data;
+        /* Sandboxes already using an evicted ramdisk hold their
+         * own hard link to it, so deletion is always safe */
+        if (count++ >= cachesize) {
+            g_debug("Evicting cached initrd %s", entry->path);
+            if (unlink(entry->path) < 0)
+                g_debug("Unable to remove %s: %s",
+                        entry->path, strerror(errno));
+        }
+        g_free(entry->path);
+        g_free(entry);
+        tmp = tmp->next;
+    }
+
+    g_list_free(entries);
+}
+
+
+static gboolean gvir_sandbox_builder_initrd_link_output(const gchar *cachefile,
+                                                        const gchar *outputfile,
+                                                        GError **error)
+{
+    GFile *src;
+    GFile *tgt;
+    gboolean ret;
+
+    if (unlink(outputfile) < 0 &&
+        errno != ENOENT) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, errno,
+                    _("Unable to remove %s: %s"),
+                    outputfile, strerror(errno));
+        return FALSE;
+    }
+
+    if (link(cachefile, outputfile) == 0)
+        return TRUE;
+
+    if (errno != EXDEV && errno != EPERM && errno != EMLINK) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, errno,
+                    _("Unable to link %s to %s: %s"),
+                    cachefile, outputfile, strerror(errno));
+        return FALSE;
+    }
+
+    /* Cache is on a different filesystem, so fallback to a copy */
+    src = g_file_new_for_path(cachefile);
+    tgt = g_file_new_for_path(outputfile);
+    ret = g_file_copy(src, tgt, 0, NULL, NULL, NULL, error);
+    g_object_unref(src);
+    g_object_unref(tgt);
     return ret;
 }
 
-gboolean gvir_sandbox_builder_initrd_construct(GVirSandboxBuilderInitrd *builder G_GNUC_UNUSED,
+
+/**
+ * gvir_sandbox_builder_initrd_construct:
+ * @builder: (transfer none): the initrd builder
+ * @config: (transfer none): the initrd configuration
+ * @outputfile: the path to write the ramdisk to
+ * @error: (out): the error location
+ *
+ * Construct a ramdisk according to @config, writing it to
+ * @outputfile. If a cache directory is set, a previously built
+ * ramdisk with the same kernel version, module list and init
+ * binary will be linked to @outputfile instead of rebuilding it.
+ *
+ * Returns: TRUE on success, FALSE on error
+ */
+gboolean gvir_sandbox_builder_initrd_construct(GVirSandboxBuilderInitrd *builder,
                                                GVirSandboxConfigInitrd *config,
                                                gchar *outputfile,
                                                GError **error)
 {
-    gchar *tmpdir = NULL;
+    GVirSandboxBuilderInitrdPrivate *priv = builder->priv;
+    gchar *cachefile = NULL;
+    gchar *tmpfile = NULL;
+    GError *linkerr = NULL;
     gboolean ret = FALSE;
-    GFile *tgt = g_file_new_for_path(outputfile);
     mode_t mask;
+    int fd;
 
     mask = umask(0077);
 
-    if (!(tmpdir = gvir_sandbox_builder_initrd_create_tempdir(error)))
+    if (!priv->cachedir) {
+        ret = gvir_sandbox_builder_initrd_build(config, priv->compression,
+                                                outputfile, error);
         goto cleanup;
+    }
 
-    if (!gvir_sandbox_builder_initrd_populate_tmpdir(tmpdir, config, error))
+    if (!(cachefile = gvir_sandbox_builder_initrd_cache_path(priv->cachedir,
+                                                             config,
+                                                             priv->compression,
+                                                             error)))
         goto cleanup;
 
-    if (!gvir_sandbox_builder_initrd_create_initrd(tmpdir, outputfile, error))
+    if (access(cachefile, R_OK) == 0) {
+        g_debug("Using cached initrd %s", cachefile);
+        /* The modification time records last use for eviction */
+        if (utimes(cachefile, NULL) < 0)
+            g_debug("Unable to update timestamp on %s: %s",
+                    cachefile, strerror(errno));
+        if (gvir_sandbox_builder_initrd_link_output(cachefile,
+                                                    outputfile,
+                                                    &linkerr)) {
+            ret = TRUE;
+            goto cleanup;
+        }
+        /* Another process may have evicted it since, in which
+         * case it just needs building again */
+        if (!g_error_matches(linkerr, GVIR_SANDBOX_BUILDER_INITRD_ERROR, ENOENT) &&
+            !g_error_matches(linkerr, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) {
+            g_propagate_error(error, linkerr);
+            goto cleanup;
+        }
+        g_debug("Cached initrd %s has gone, rebuilding", cachefile);
+        g_clear_error(&linkerr);
+    }
+
+    if (g_mkdir_with_parents(priv->cachedir, 0700) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, errno,
+                    _("Unable to create cache directory %s: %s"),
+                    priv->cachedir, strerror(errno));
         goto cleanup;
+    }
 
-    ret = TRUE;
- cleanup:
-    if (tmpdir &&
-        !gvir_sandbox_builder_initrd_remove_tmpdir(tmpdir, ret ? error : NULL))
-        ret = FALSE;
+    /* Build under a temporary name, then rename so that concurrent
+     * lookups never see a partially written ramdisk */
+    tmpfile = g_strdup_printf("%s.XXXXXX", cachefile);
+    if ((fd = g_mkstemp(tmpfile)) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, errno,
+                    _("Unable to create temporary file %s: %s"),
+                    tmpfile, strerror(errno));
+        goto cleanup;
+    }
+    close(fd);
 
-    if (!ret && tgt)
-        g_file_delete(tgt, NULL, NULL);
+    if (!gvir_sandbox_builder_initrd_build(config, priv->compression,
+                                           tmpfile, error))
+        goto cleanup;
 
-    umask(mask);
+    if (rename(tmpfile, cachefile) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_INITRD_ERROR, errno,
+                    _("Unable to rename %s to %s: %s"),
+                    tmpfile, cachefile, strerror(errno));
+        goto cleanup;
+    }
+    g_free(tmpfile);
+    tmpfile = NULL;
 
+    gvir_sandbox_builder_initrd_cache_evict(priv->cachedir, priv->cachesize);
+
+    if (!gvir_sandbox_builder_initrd_link_output(cachefile, outputfile, error))
+        goto cleanup;
+
+    ret = TRUE;
+ cleanup:
+    umask(mask);
+    /* Don't leave a partially built ramdisk in the cache, where
+     * eviction would never find it */
+    if (tmpfile)
+        unlink(tmpfile);
+    g_free(cachefile);
+    g_free(tmpfile);
     return ret;
 }
 
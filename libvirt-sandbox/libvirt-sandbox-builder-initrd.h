@@ -36,6 +36,13 @@ G_BEGIN_DECLS
 #define GVIR_SANDBOX_IS_BUILDER_INITRD_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GVIR_SANDBOX_TYPE_BUILDER_INITRD))
 #define GVIR_SANDBOX_BUILDER_INITRD_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), GVIR_SANDBOX_TYPE_BUILDER_INITRD, GVirSandboxBuilderInitrdClass))
 
+typedef enum {
+    GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_NONE,
+    GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_GZIP,
+    GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_LZ4,
+    GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_ZSTD,
+} GVirSandboxBuilderInitrdCompression;
+
 typedef struct _GVirSandboxBuilderInitrd GVirSandboxBuilderInitrd;
 typedef struct _GVirSandboxBuilderInitrdPrivate GVirSandboxBuilderInitrdPrivate;
 typedef struct _GVirSandboxBuilderInitrdClass GVirSandboxBuilderInitrdClass;
@@ -60,6 +67,18 @@ GType gvir_sandbox_builder_initrd_get_type(void);
 
 GVirSandboxBuilderInitrd *gvir_sandbox_builder_initrd_new(void);
 
+void gvir_sandbox_builder_initrd_set_cachedir(GVirSandboxBuilderInitrd *builder,
+                                              const gchar *cachedir);
+const gchar *gvir_sandbox_builder_initrd_get_cachedir(GVirSandboxBuilderInitrd *builder);
+
+void gvir_sandbox_builder_initrd_set_cachesize(GVirSandboxBuilderInitrd *builder,
+                                               guint cachesize);
+guint gvir_sandbox_builder_initrd_get_cachesize(GVirSandboxBuilderInitrd *builder);
+
+void gvir_sandbox_builder_initrd_set_compression(GVirSandboxBuilderInitrd *builder,
+                                                 GVirSandboxBuilderInitrdCompression compression);
+GVirSandboxBuilderInitrdCompression gvir_sandbox_builder_initrd_get_compression(GVirSandboxBuilderInitrd *builder);
+
 gboolean gvir_sandbox_builder_initrd_construct(GVirSandboxBuilderInitrd *builder,
                                                GVirSandboxConfigInitrd *config,
                                                gchar *outputfile,
@@ -23,12 +23,19 @@
 #include <config.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <sys/utsname.h>
+#include <linux/fs.h>
 
 #include <glib/gi18n.h>
 
 #include "libvirt-sandbox/libvirt-sandbox.h"
 #include "libvirt-sandbox/libvirt-sandbox-builder-private.h"
+#include "libvirt-sandbox/libvirt-sandbox-manifest.h"
 
 /**
  * SECTION: libvirt-sandbox-builder-machine
@@ -47,7 +54,7 @@
 
 struct _GVirSandboxBuilderMachinePrivate
 {
-    gboolean unused;
+    int rootCacheLock;
 };
 
 G_DEFINE_TYPE(GVirSandboxBuilderMachine, gvir_sandbox_builder_machine, GVIR_SANDBOX_TYPE_BUILDER);
@@ -109,10 +116,11 @@ static void gvir_sandbox_builder_machine_set_property(GObject *object,
 
 static void gvir_sandbox_builder_machine_finalize(GObject *object)
 {
-#if 0
     GVirSandboxBuilderMachine *builder = GVIR_SANDBOX_BUILDER_MACHINE(object);
     GVirSandboxBuilderMachinePrivate *priv = builder->priv;
-#endif
+
+    if (priv->rootCacheLock != -1)
+        close(priv->rootCacheLock);
 
     G_OBJECT_CLASS(gvir_sandbox_builder_machine_parent_class)->finalize(object);
 }
@@ -145,6 +153,142 @@ static gchar *gvir_sandbox_builder_machine_get_kernpath(GVirSandboxConfig *confi
 }
 
 
+/*
+ * The transport a host-bind mount is passed through with, or
+ * the one used for the root and config shares if @mconfig is
+ * NULL. Those two are always 9p: they must be read only, and
+ * virtiofs can only be made read only by the guest, which would
+ * leave the host root writable by anything running as root in
+ * the sandbox.
+ */
+static GVirSandboxConfigMountHostBindTransport
+gvir_sandbox_builder_machine_get_transport(GVirSandboxConfig *config,
+                                           GVirSandboxConfigMount *mconfig)
+{
+    GVirSandboxConfigMountHostBindTransport transport =
+        GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT;
+
+    if (!mconfig)
+        return GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P;
+
+    if (GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_BIND(mconfig))
+        transport = gvir_sandbox_config_mount_host_bind_get_transport(
+            GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND(mconfig));
+    if (transport == GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT)
+        transport = gvir_sandbox_config_get_host_bind_transport(config);
+    if (transport == GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT)
+        transport = GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P;
+    return transport;
+}
+
+
+static gboolean gvir_sandbox_builder_machine_has_transport(GVirSandboxConfig *config,
+                                                           GVirSandboxConfigMountHostBindTransport transport)
+{
+    GList *tmp = NULL, *mounts = NULL;
+    gboolean ret = FALSE;
+
+    /* The config share is always present */
+    if (gvir_sandbox_builder_machine_get_transport(config, NULL) == transport)
+        return TRUE;
+
+    tmp = mounts = gvir_sandbox_config_get_mounts(config);
+    while (tmp && !ret) {
+        GVirSandboxConfigMount *mconfig = GVIR_SANDBOX_CONFIG_MOUNT(tmp->data);
+        if (GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_BIND(mconfig) &&
+            gvir_sandbox_builder_machine_get_transport(config, mconfig) == transport)
+            ret = TRUE;
+        tmp = tmp->next;
+    }
+    g_list_foreach(mounts, (GFunc)g_object_unref, NULL);
+    g_list_free(mounts);
+    return ret;
+}
+
+
+/*
+ * The persistent fscache image for the root share, if one is
+ * to be attached.
+ */
+static const gchar *gvir_sandbox_builder_machine_get_root_cache_image(GVirSandboxConfig *config)
+{
+    if (gvir_sandbox_config_has_root_mount(config) ||
+        gvir_sandbox_config_get_root_cache(config) !=
+        GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_FSCACHE)
+        return NULL;
+
+    return gvir_sandbox_config_get_root_cache_image(config);
+}
+
+
+/*
+ * The root cache image is attached read-write, and two guests
+ * mounting the same ext4 image would corrupt it, so it is locked
+ * until the sandbox is cleaned up after it stops. The builder
+ * must be kept by the caller for as long as the sandbox runs.
+ */
+static gboolean gvir_sandbox_builder_machine_lock_root_cache(GVirSandboxBuilderMachine *builder,
+                                                             const gchar *image,
+                                                             GError **error)
+{
+    GVirSandboxBuilderMachinePrivate *priv = builder->priv;
+    int fd;
+
+    if (priv->rootCacheLock != -1)
+        return TRUE;
+
+    if ((fd = open(image, O_RDWR | O_CLOEXEC)) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                    _("Unable to open root cache image %s: %s"),
+                    image, strerror(errno));
+        return FALSE;
+    }
+
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+        if (errno == EWOULDBLOCK)
+            g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                        _("Root cache image %s is in use by another sandbox"),
+                        image);
+        else
+            g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                        _("Unable to lock root cache image %s: %s"),
+                        image, strerror(errno));
+        close(fd);
+        return FALSE;
+    }
+
+    priv->rootCacheLock = fd;
+    return TRUE;
+}
+
+
+/*
+ * The root cache image is attached after the disks and
+ * host-image mounts, so it takes the next virtio disk name
+ */
+static gchar gvir_sandbox_builder_machine_get_root_cache_dev(GVirSandboxConfig *config)
+{
+    GList *tmp = NULL, *mounts = NULL, *disks = NULL;
+    guint nVirtioDev;
+
+    disks = gvir_sandbox_config_get_disks(config);
+    nVirtioDev = g_list_length(disks);
+    g_list_foreach(disks, (GFunc)g_object_unref, NULL);
+    g_list_free(disks);
+
+    tmp = mounts = gvir_sandbox_config_get_mounts(config);
+    while (tmp) {
+        if (GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_IMAGE(tmp->data))
+            nVirtioDev++;
+        tmp = tmp->next;
+    }
+    g_list_foreach(mounts, (GFunc)g_object_unref, NULL);
+    g_list_free(mounts);
+
+    return (char)('a' + nVirtioDev);
+}
+
+
 static gchar *gvir_sandbox_builder_machine_mkinitrd(GVirSandboxConfig *config,
                                                     const char *statedir,
                                                     GError **error)
@@ -154,9 +298,13 @@ static gchar *gvir_sandbox_builder_machine_mkinitrd(GVirSandboxConfig *config,
     gchar *targetfile = g_strdup_printf("%s/initrd.img", statedir);
     gchar *kver = gvir_sandbox_builder_machine_get_kernrelease(config);
     const gchar *kmodpath = gvir_sandbox_config_get_kmodpath(config);
+    const gchar *cachedir = (getuid() ? g_get_user_cache_dir() : RUNDIR);
+    gchar *initrdcache = g_build_filename(cachedir, "libvirt-sandbox-initrd", NULL);
     if (!kmodpath)
         kmodpath = "/lib/modules";
 
+    gvir_sandbox_builder_initrd_set_cachedir(builder, initrdcache);
+
     gvir_sandbox_config_initrd_set_kver(initrd, kver);
     gchar *kmoddir = g_strdup_printf("%s/%s/kernel",
                                      kmodpath, kver);
@@ -168,15 +316,26 @@ static gchar *gvir_sandbox_builder_machine_mkinitrd(GVirSandboxConfig *config,
     gvir_sandbox_config_initrd_add_module(initrd, "virtio.ko");
     gvir_sandbox_config_initrd_add_module(initrd, "virtio_ring.ko");
     gvir_sandbox_config_initrd_add_module(initrd, "virtio_pci.ko");
-    gvir_sandbox_config_initrd_add_module(initrd, "9pnet.ko");
-    gvir_sandbox_config_initrd_add_module(initrd, "9p.ko");
-    gvir_sandbox_config_initrd_add_module(initrd, "9pnet_virtio.ko");
+    if (gvir_sandbox_builder_machine_has_transport(config,
+                                                   GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P)) {
+        gvir_sandbox_config_initrd_add_module(initrd, "9pnet.ko");
+        gvir_sandbox_config_initrd_add_module(initrd, "9p.ko");
+        gvir_sandbox_config_initrd_add_module(initrd, "9pnet_virtio.ko");
+    }
+    if (gvir_sandbox_builder_machine_has_transport(config,
+                                                   GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS)) {
+        gvir_sandbox_config_initrd_add_module(initrd, "fuse.ko");
+        gvir_sandbox_config_initrd_add_module(initrd, "virtiofs.ko");
+    }
     if (gvir_sandbox_config_has_networks(config))
         gvir_sandbox_config_initrd_add_module(initrd, "virtio_net.ko");
     if (gvir_sandbox_config_has_mounts_with_type(config,
                                                  GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_IMAGE) ||
-        gvir_sandbox_config_has_disks(config))
+        gvir_sandbox_config_has_disks(config) ||
+        gvir_sandbox_builder_machine_get_root_cache_image(config))
         gvir_sandbox_config_initrd_add_module(initrd, "virtio_blk.ko");
+    if (gvir_sandbox_builder_machine_get_root_cache_image(config))
+        gvir_sandbox_config_initrd_add_module(initrd, "cachefiles.ko");
     gvir_sandbox_config_initrd_add_module(initrd, "virtio_console.ko");
 #if 0
     gvir_sandbox_config_initrd_add_module(initrd, "virtio_balloon.ko");
@@ -192,40 +351,284 @@ static gchar *gvir_sandbox_builder_machine_mkinitrd(GVirSandboxConfig *config,
     }
     g_free(kmoddir);
     g_free(kver);
+    g_free(initrdcache);
     g_object_unref(initrd);
     g_object_unref(builder);
     return targetfile;
 }
 
 
+/*
+ * Place @source at @target, sharing storage where the filesystem
+ * allows it: a hard link, then a copy-on-write clone, and only
+ * then a full copy.
+ */
+static gboolean gvir_sandbox_builder_machine_stage_file(const gchar *source,
+                                                        const gchar *target,
+                                                        GError **error)
+{
+    GFile *sfile;
+    GFile *tfile;
+    gboolean ret;
+
+    if (unlink(target) < 0 &&
+        errno != ENOENT) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                    _("Unable to remove %s: %s"),
+                    target, strerror(errno));
+        return FALSE;
+    }
+
+    if (link(source, target) == 0)
+        return TRUE;
+
+#ifdef FICLONE
+    {
+        int sfd = -1, tfd = -1;
+        gboolean cloned = FALSE;
+        if ((sfd = open(source, O_RDONLY)) >= 0 &&
+            (tfd = open(target, O_WRONLY|O_CREAT|O_EXCL, 0644)) >= 0 &&
+            ioctl(tfd, FICLONE, sfd) == 0)
+            cloned = TRUE;
+        if (sfd != -1)
+            close(sfd);
+        if (tfd != -1 && close(tfd) < 0)
+            cloned = FALSE;
+        if (cloned)
+            return TRUE;
+        if (tfd != -1)
+            unlink(target);
+    }
+#endif
+
+    sfile = g_file_new_for_path(source);
+    tfile = g_file_new_for_path(target);
+    ret = g_file_copy(sfile, tfile, G_FILE_COPY_NONE,
+                      NULL, NULL, NULL, error);
+    g_object_unref(sfile);
+    g_object_unref(tfile);
+    return ret;
+}
+
+
+static gchar *gvir_sandbox_builder_machine_checksum_file(GFile *file,
+                                                         GOutputStream *copy,
+                                                         GError **error)
+{
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    GFileInputStream *is = NULL;
+    gchar *buf = g_new0(gchar, 64 * 1024);
+    gchar *ret = NULL;
+    gssize got;
+
+    if (!(is = g_file_read(file, NULL, error)))
+        goto cleanup;
+
+    while ((got = g_input_stream_read(G_INPUT_STREAM(is), buf, 64 * 1024,
+                                      NULL, error)) > 0) {
+        g_checksum_update(sum, (guchar *)buf, got);
+        if (copy &&
+            !g_output_stream_write_all(copy, buf, got, NULL, NULL, error))
+            goto cleanup;
+    }
+    if (got < 0)
+        goto cleanup;
+
+    ret = g_strdup(g_checksum_get_string(sum));
+ cleanup:
+    if (is)
+        g_object_unref(is);
+    g_checksum_free(sum);
+    g_free(buf);
+    return ret;
+}
+
+
+/*
+ * Returns the path of a read-only copy of @source, shared
+ * between all sandboxes, creating it if required. Entries
+ * are named after the source path and the identity of the
+ * source file, so a replaced kernel image gets a new entry
+ * while different kernels with the same basename don't
+ * replace each other.
+ */
+static gchar *gvir_sandbox_builder_machine_cache_kernel(const gchar *source,
+                                                        GError **error)
+{
+    const gchar *cachedir = (getuid() ? g_get_user_cache_dir() : RUNDIR);
+    gchar *kerncache = g_build_filename(cachedir, "libvirt-sandbox-kernel", NULL);
+    gchar *basename = g_path_get_basename(source);
+    gchar *identity = NULL;
+    gchar *srckey = NULL;
+    gchar *name = NULL;
+    gchar *cachefile = NULL;
+    gchar *tmpfile = NULL;
+    gchar *srcsum = NULL;
+    gchar *tmpsum = NULL;
+    GFile *sfile = g_file_new_for_path(source);
+    GFile *tfile = NULL;
+    GOutputStream *os = NULL;
+    GDir *dh = NULL;
+    const gchar *entry;
+    gboolean ret = FALSE;
+    struct stat sb;
+    int fd;
+
+    if (stat(source, &sb) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                    _("Kernel image %s does not exist"),
+                    source);
+        goto cleanup;
+    }
+
+    identity = g_strdup_printf("%s:%llu:%llu:%llu:%llu", source,
+                               (unsigned long long)sb.st_dev,
+                               (unsigned long long)sb.st_ino,
+                               (unsigned long long)sb.st_size,
+                               (unsigned long long)sb.st_mtime);
+    srckey = g_compute_checksum_for_string(G_CHECKSUM_SHA256, source, -1);
+    name = g_compute_checksum_for_string(G_CHECKSUM_SHA256, identity, -1);
+    cachefile = g_strdup_printf("%s/%s-%.16s-%s", kerncache, basename, srckey, name);
+
+    if (access(cachefile, R_OK) == 0) {
+        ret = TRUE;
+        goto cleanup;
+    }
+
+    if (g_mkdir_with_parents(kerncache, 0755) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                    _("Unable to create cache directory %s: %s"),
+                    kerncache, strerror(errno));
+        goto cleanup;
+    }
+
+    tmpfile = g_strdup_printf("%s.XXXXXX", cachefile);
+    if ((fd = g_mkstemp_full(tmpfile, O_RDWR, 0644)) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                    _("Unable to create temporary file %s: %s"),
+                    tmpfile, strerror(errno));
+        goto cleanup;
+    }
+    close(fd);
+
+    tfile = g_file_new_for_path(tmpfile);
+    if (!(os = G_OUTPUT_STREAM(g_file_replace(tfile, NULL, FALSE,
+                                              G_FILE_CREATE_NONE,
+                                              NULL, error))))
+        goto cleanup;
+
+    if (!(srcsum = gvir_sandbox_builder_machine_checksum_file(sfile, os, error)))
+        goto cleanup;
+    if (!g_output_stream_close(os, NULL, error))
+        goto cleanup;
+
+    /* Since every sandbox will boot from this copy, make
+     * sure it really matches what was read from the source */
+    if (!(tmpsum = gvir_sandbox_builder_machine_checksum_file(tfile, NULL, error)))
+        goto cleanup;
+    if (!g_str_equal(srcsum, tmpsum)) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                    _("Checksum mismatch copying kernel %s to %s"),
+                    source, tmpfile);
+        goto cleanup;
+    }
+
+    if (chmod(tmpfile, 0444) < 0 ||
+        rename(tmpfile, cachefile) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                    _("Unable to publish kernel %s: %s"),
+                    cachefile, strerror(errno));
+        goto cleanup;
+    }
+
+    /* Drop copies of older versions of the same kernel image */
+    if ((dh = g_dir_open(kerncache, 0, NULL))) {
+        gchar *prefix = g_strdup_printf("%s-%.16s-", basename, srckey);
+        gchar *current = g_path_get_basename(cachefile);
+        while ((entry = g_dir_read_name(dh)) != NULL) {
+            if (g_str_has_prefix(entry, prefix) &&
+                strlen(entry) == strlen(current) &&
+                !g_str_equal(entry, current)) {
+                gchar *path = g_build_filename(kerncache, entry, NULL);
+                g_debug("Removing stale kernel %s", path);
+                unlink(path);
+                g_free(path);
+            }
+        }
+        g_free(current);
+        g_free(prefix);
+        g_dir_close(dh);
+    }
+
+    ret = TRUE;
+ cleanup:
+    if (tmpfile && !ret)
+        unlink(tmpfile);
+    if (!ret) {
+        g_free(cachefile);
+        cachefile = NULL;
+    }
+    if (os)
+        g_object_unref(os);
+    if (tfile)
+        g_object_unref(tfile);
+    g_object_unref(sfile);
+    g_free(kerncache);
+    g_free(basename);
+    g_free(identity);
+    g_free(srckey);
+    g_free(name);
+    g_free(tmpfile);
+    g_free(srcsum);
+    g_free(tmpsum);
+    return cachefile;
+}
+
+
 static gchar *gvir_sandbox_builder_machine_copykern(GVirSandboxConfig *config,
                                                     const char *statedir,
                                                     GError **error)
 {
     gchar *target = g_strdup_printf("%s/vmlinuz", statedir);
     gchar *source = gvir_sandbox_builder_machine_get_kernpath(config);
+    gchar *cached = NULL;
+    GError *stageerr = NULL;
     gboolean ret = FALSE;
-    GFile *tfile = g_file_new_for_path(target);
-    GFile *sfile = g_file_new_for_path(source);
+    int attempt;
 
-    if (!g_file_copy(sfile, tfile, G_FILE_COPY_NONE,
-                     NULL, NULL, NULL, error))
-        goto cleanup;
+    for (attempt = 0 ; ; attempt++) {
+        if (!(cached = gvir_sandbox_builder_machine_cache_kernel(source, error)))
+            goto cleanup;
+
+        if (gvir_sandbox_builder_machine_stage_file(cached, target, &stageerr))
+            break;
+
+        /* A concurrent start replacing the kernel may have just
+         * removed our copy, in which case it is a cache miss */
+        if (attempt > 0 ||
+            access(cached, F_OK) == 0 || errno != ENOENT) {
+            g_propagate_error(error, stageerr);
+            goto cleanup;
+        }
+        g_debug("Cached kernel %s has gone, copying again", cached);
+        g_clear_error(&stageerr);
+        g_free(cached);
+        cached = NULL;
+    }
 
     ret = TRUE;
  cleanup:
     g_free(source);
+    g_free(cached);
     if (!ret) {
         g_free(target);
         target = NULL;
     }
-    g_object_unref(sfile);
-    g_object_unref(tfile);
     return target;
 }
 
 
-static gchar *gvir_sandbox_builder_machine_cmdline(GVirSandboxConfig *config G_GNUC_UNUSED)
+static gchar *gvir_sandbox_builder_machine_cmdline(GVirSandboxConfig *config)
 {
     GString *str = g_string_new("");
     gchar *ret;
@@ -246,6 +649,20 @@ static gchar *gvir_sandbox_builder_machine_cmdline(GVirSandboxConfig *config G_G
         }
     }
 
+    /* The root share is mounted before the boot manifest can be read */
+    if (!gvir_sandbox_config_has_root_mount(config) &&
+        gvir_sandbox_config_get_root_cache(config) !=
+        GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT) {
+        GEnumClass *klass = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE);
+        GEnumValue *value = g_enum_get_value(klass,
+                                             gvir_sandbox_config_get_root_cache(config));
+        g_string_append_printf(str, " sandbox_rootcache=%s", value->value_nick);
+        g_type_class_unref(klass);
+    }
+    if (gvir_sandbox_builder_machine_get_root_cache_image(config))
+        g_string_append_printf(str, " sandbox_cachedev=vd%c",
+                               gvir_sandbox_builder_machine_get_root_cache_dev(config));
+
     /* These make boot a little bit faster */
     g_string_append(str, " edd=off");
     g_string_append(str, " printk.time=1");
@@ -268,26 +685,55 @@ static gchar *gvir_sandbox_builder_machine_cmdline(GVirSandboxConfig *config G_G
 }
 
 
-static gboolean gvir_sandbox_builder_machine_write_mount_cfg(GVirSandboxConfig *config,
-                                                             const gchar *statedir,
-                                                             GError **error)
+/*
+ * The options for mounting @mbind in the guest. readahead is
+ * not a real mount option, init-qemu strips it and applies it
+ * to the mount's backing device info.
+ */
+static gchar *gvir_sandbox_builder_machine_host_bind_opts(GVirSandboxConfigMountHostBind *mbind,
+                                                         const gchar *fstype)
+{
+    GVirSandboxConfigMountHostBindCache cache = gvir_sandbox_config_mount_host_bind_get_cache(mbind);
+    guint msize = gvir_sandbox_config_mount_host_bind_get_msize(mbind);
+    guint readahead = gvir_sandbox_config_mount_host_bind_get_readahead(mbind);
+    GString *str = g_string_new("");
+
+    if (g_str_equal(fstype, "9p")) {
+        g_string_append(str, "trans=virtio,version=9p2000.u");
+        if (msize)
+            g_string_append_printf(str, ",msize=%u", msize);
+        if (cache != GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT) {
+            GEnumClass *klass = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE);
+            GEnumValue *value = g_enum_get_value(klass, cache);
+            g_string_append_printf(str, ",cache=%s", value->value_nick);
+            g_type_class_unref(klass);
+        }
+    } else if (gvir_sandbox_config_mount_host_bind_get_dax(mbind)) {
+        g_string_append(str, "dax");
+    }
+
+    if (readahead)
+        g_string_append_printf(str, "%sreadahead=%u",
+                               str->len ? "," : "", readahead);
+
+    return g_string_free(str, FALSE);
+}
+
+
+static gboolean gvir_sandbox_builder_machine_construct_manifest(GVirSandboxBuilder *builder,
+                                                                GVirSandboxConfig *config,
+                                                                GByteArray *manifest,
+                                                                GError **error)
 {
-    gchar *mntfile = g_strdup_printf("%s/config/mounts.cfg", statedir);
-    GFile *file = g_file_new_for_path(mntfile);
-    GFileOutputStream *fos = g_file_replace(file,
-                                            NULL,
-                                            FALSE,
-                                            G_FILE_CREATE_REPLACE_DESTINATION,
-                                            NULL,
-                                            error);
-    gboolean ret = FALSE;
     GList *mounts = gvir_sandbox_config_get_mounts(config);
     GList *disks = gvir_sandbox_config_get_disks(config);
     GList *tmp = NULL;
+    gboolean ret = FALSE;
     size_t nHostBind = 0;
     guint nVirtioDev = g_list_length(disks);
 
-    if (!fos)
+    if (!GVIR_SANDBOX_BUILDER_CLASS(gvir_sandbox_builder_machine_parent_class)->
+        construct_manifest(builder, config, manifest, error))
         goto cleanup;
 
     tmp = mounts;
@@ -297,12 +743,17 @@ static gboolean gvir_sandbox_builder_machine_write_mount_cfg(GVirSandboxConfig *
         gchar *source;
         gchar *options;
         const gchar *target;
-        gchar *line;
 
         if (GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_BIND(mconfig)) {
+            GVirSandboxConfigMountHostBind *mbind = GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND(mconfig);
             source = g_strdup_printf("sandbox:mount%zu", nHostBind++);
-            fstype = "9p";
-            options = g_strdup("trans=virtio,version=9p2000.u");
+            if (gvir_sandbox_builder_machine_get_transport(config, mconfig) ==
+                GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS) {
+                fstype = "virtiofs";
+            } else {
+                fstype = "9p";
+            }
+            options = gvir_sandbox_builder_machine_host_bind_opts(mbind, fstype);
         } else if (GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_IMAGE(mconfig)) {
             source = g_strdup_printf("/dev/vd%c", (char)('a' + nVirtioDev++));
             fstype = "ext4";
@@ -323,63 +774,24 @@ static gboolean gvir_sandbox_builder_machine_write_mount_cfg(GVirSandboxConfig *
         }
         target = gvir_sandbox_config_mount_get_target(mconfig);
 
-        line = g_strdup_printf("%s\t%s\t%s\t%s\n",
-                               source, target, fstype, options);
+        gvir_sandbox_builder_manifest_add(manifest, GVIR_SANDBOX_MANIFEST_MOUNT, 4,
+                                          source, target, fstype, options);
         g_free(source);
         g_free(options);
 
-        if (!g_output_stream_write_all(G_OUTPUT_STREAM(fos),
-                                       line, strlen(line),
-                                       NULL, NULL, error)) {
-            g_free(line);
-            goto cleanup;
-        }
-        g_free(line);
-
         tmp = tmp->next;
     }
 
-    if (!g_output_stream_close(G_OUTPUT_STREAM(fos), NULL, error))
-        goto cleanup;
-
-#if 0
-    gvir_sandbox_cleaner_add_rmfile_post_stop(cleaner,
-                                              mntfile);
-#endif
-
     ret = TRUE;
  cleanup:
     g_list_foreach(mounts, (GFunc)g_object_unref, NULL);
     g_list_free(mounts);
+    g_list_foreach(disks, (GFunc)g_object_unref, NULL);
     g_list_free(disks);
-    if (fos)
-        g_object_unref(fos);
-    if (!ret)
-        g_file_delete(file, NULL, NULL);
-    g_object_unref(file);
-    g_free(mntfile);
     return ret;
 }
 
 
-static gboolean gvir_sandbox_builder_machine_construct_domain(GVirSandboxBuilder *builder,
-                                                              GVirSandboxConfig *config,
-                                                              const gchar *statedir,
-                                                              GVirConfigDomain *domain,
-                                                              GError **error)
-{
-    if (!gvir_sandbox_builder_machine_write_mount_cfg(config,
-                                                      statedir,
-                                                      error))
-        return FALSE;
-
-    if (!GVIR_SANDBOX_BUILDER_CLASS(gvir_sandbox_builder_machine_parent_class)->
-        construct_domain(builder, config, statedir, domain, error))
-        return FALSE;
-
-    return TRUE;
-}
-
 static gboolean gvir_sandbox_builder_machine_construct_basic(GVirSandboxBuilder *builder,
                                                              GVirSandboxConfig *config,
                                                              const gchar *statedir,
@@ -411,6 +823,31 @@ static gboolean gvir_sandbox_builder_machine_construct_basic(GVirSandboxBuilder
 }
 
 
+static gboolean gvir_sandbox_builder_machine_construct_memory_backing(GVirSandboxBuilder *builder,
+                                                                      GVirSandboxConfig *config,
+                                                                      GString *backing,
+                                                                      GError **error)
+{
+    if (!GVIR_SANDBOX_BUILDER_CLASS(gvir_sandbox_builder_machine_parent_class)->
+        construct_memory_backing(builder, config, backing, error))
+        return FALSE;
+
+    if (gvir_sandbox_config_get_memory_nosharepages(config))
+        g_string_append(backing, "    <nosharepages/>\n");
+    if (gvir_sandbox_config_get_memory_locked(config))
+        g_string_append(backing, "    <locked/>\n");
+    /* virtiofsd needs to map guest memory */
+    if (gvir_sandbox_config_get_memory_shared(config) ||
+        gvir_sandbox_builder_machine_has_transport(config,
+                                                   GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS))
+        g_string_append(backing,
+                        "    <source type=\"memfd\"/>\n"
+                        "    <access mode=\"shared\"/>\n");
+
+    return TRUE;
+}
+
+
 static gboolean gvir_sandbox_builder_machine_construct_os(GVirSandboxBuilder *builder,
                                                           GVirSandboxConfig *config,
                                                           const gchar *statedir,
@@ -491,13 +928,76 @@ static gboolean gvir_sandbox_builder_machine_construct_features(GVirSandboxBuild
     return TRUE;
 }
 
+/*
+ * Adds a device passing the host directory @source through to
+ * the guest under the tag @target. libvirt-gconfig has no API
+ * for the virtiofs driver, so those devices are parsed from XML.
+ * virtiofs requires passthrough access and cannot be made read
+ * only by the host, so @readonly shares must use 9p. Its caching
+ * is chosen by virtiofsd rather than the guest.
+ */
+static gboolean gvir_sandbox_builder_machine_add_filesys(GVirConfigDomain *domain,
+                                                         GVirSandboxConfigMountHostBindTransport transport,
+                                                         const gchar *source,
+                                                         const gchar *target,
+                                                         GVirConfigDomainFilesysAccessType access,
+                                                         GVirSandboxConfigMountHostBindCache cache,
+                                                         gboolean readonly,
+                                                         GError **error)
+{
+    GVirConfigDomainFilesys *fs;
+
+    if (transport == GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS) {
+        const gchar *binary = "";
+        gchar *xml;
+
+        if (readonly) {
+            g_set_error(error, GVIR_SANDBOX_BUILDER_MACHINE_ERROR, 0,
+                        _("Share %s cannot be passed through read only with virtiofs"),
+                        target);
+            return FALSE;
+        }
+
+        if (cache == GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_NONE)
+            binary = "<binary><cache mode='none'/></binary>";
+        else if (cache != GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT)
+            binary = "<binary><cache mode='always'/></binary>";
+
+        xml = g_markup_printf_escaped("<filesystem type='mount' accessmode='passthrough'>"
+                                      "<driver type='virtiofs'/>"
+                                      "%s"
+                                      "<source dir='%s'/>"
+                                      "<target dir='%s'/>"
+                                      "</filesystem>",
+                                      binary, source, target);
+        fs = gvir_config_domain_filesys_new_from_xml(xml, error);
+        g_free(xml);
+        if (!fs)
+            return FALSE;
+    } else {
+        fs = gvir_config_domain_filesys_new();
+        gvir_config_domain_filesys_set_type(fs, GVIR_CONFIG_DOMAIN_FILESYS_MOUNT);
+        gvir_config_domain_filesys_set_access_type(fs, access);
+        gvir_config_domain_filesys_set_source(fs, source);
+        gvir_config_domain_filesys_set_target(fs, target);
+        if (readonly)
+            gvir_config_domain_filesys_set_readonly(fs, TRUE);
+    }
+
+    gvir_config_domain_add_device(domain,
+                                  GVIR_CONFIG_DOMAIN_DEVICE(fs));
+    g_object_unref(fs);
+    return TRUE;
+}
+
+
 static gboolean gvir_sandbox_builder_machine_construct_devices(GVirSandboxBuilder *builder,
                                                                GVirSandboxConfig *config,
                                                                const gchar *statedir,
                                                                GVirConfigDomain *domain,
                                                                GError **error)
 {
-    GVirConfigDomainFilesys *fs;
+    GVirSandboxConfigMountHostBindTransport transport;
     GVirConfigDomainDisk *disk;
     GVirConfigDomainDiskDriver *diskDriver;
     GVirConfigDomainInterface *iface;
@@ -515,31 +1015,24 @@ static gboolean gvir_sandbox_builder_machine_construct_devices(GVirSandboxBuilde
         construct_devices(builder, config, statedir, domain, error))
         goto cleanup;
 
-    if (!gvir_sandbox_config_has_root_mount(config)) {
-        fs = gvir_config_domain_filesys_new();
-        gvir_config_domain_filesys_set_type(fs, GVIR_CONFIG_DOMAIN_FILESYS_MOUNT);
-        gvir_config_domain_filesys_set_access_type(fs, GVIR_CONFIG_DOMAIN_FILESYS_ACCESS_SQUASH);
-        gvir_config_domain_filesys_set_source(fs,
-                                              gvir_sandbox_config_get_root(config));
-        gvir_config_domain_filesys_set_target(fs, "sandbox:root");
-        gvir_config_domain_filesys_set_readonly(fs, TRUE);
-
-        gvir_config_domain_add_device(domain,
-                                      GVIR_CONFIG_DOMAIN_DEVICE(fs));
-        g_object_unref(fs);
-    }
-
+    transport = gvir_sandbox_builder_machine_get_transport(config, NULL);
 
-    fs = gvir_config_domain_filesys_new();
-    gvir_config_domain_filesys_set_type(fs, GVIR_CONFIG_DOMAIN_FILESYS_MOUNT);
-    gvir_config_domain_filesys_set_access_type(fs, GVIR_CONFIG_DOMAIN_FILESYS_ACCESS_SQUASH);
-    gvir_config_domain_filesys_set_source(fs, configdir);
-    gvir_config_domain_filesys_set_target(fs, "sandbox:config");
-    gvir_config_domain_filesys_set_readonly(fs, TRUE);
+    if (!gvir_sandbox_config_has_root_mount(config) &&
+        !gvir_sandbox_builder_machine_add_filesys(domain, transport,
+                                                  gvir_sandbox_config_get_root(config),
+                                                  "sandbox:root",
+                                                  GVIR_CONFIG_DOMAIN_FILESYS_ACCESS_SQUASH,
+                                                  gvir_sandbox_config_get_root_cache(config),
+                                                  TRUE, error))
+        goto cleanup;
 
-    gvir_config_domain_add_device(domain,
-                                  GVIR_CONFIG_DOMAIN_DEVICE(fs));
-    g_object_unref(fs);
+    if (!gvir_sandbox_builder_machine_add_filesys(domain, transport,
+                                                  configdir,
+                                                  "sandbox:config",
+                                                  GVIR_CONFIG_DOMAIN_FILESYS_ACCESS_SQUASH,
+                                                  GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT,
+                                                  TRUE, error))
+        goto cleanup;
 
 
     tmp = disks = gvir_sandbox_config_get_disks(config);
@@ -580,16 +1073,19 @@ static gboolean gvir_sandbox_builder_machine_construct_devices(GVirSandboxBuilde
 
             gchar *target = g_strdup_printf("sandbox:mount%zu", nHostBind++);
 
-            fs = gvir_config_domain_filesys_new();
-            gvir_config_domain_filesys_set_type(fs, GVIR_CONFIG_DOMAIN_FILESYS_MOUNT);
-            gvir_config_domain_filesys_set_access_type(fs, GVIR_CONFIG_DOMAIN_FILESYS_ACCESS_PASSTHROUGH);
-            gvir_config_domain_filesys_set_source(fs,
-                                                  gvir_sandbox_config_mount_file_get_source(mfile));
-            gvir_config_domain_filesys_set_target(fs, target);
-
-            gvir_config_domain_add_device(domain,
-                                          GVIR_CONFIG_DOMAIN_DEVICE(fs));
-            g_object_unref(fs);
+            if (!gvir_sandbox_builder_machine_add_filesys(domain,
+                                                          gvir_sandbox_builder_machine_get_transport(config, mconfig),
+                                                          gvir_sandbox_config_mount_file_get_source(mfile),
+                                                          target,
+                                                          GVIR_CONFIG_DOMAIN_FILESYS_ACCESS_PASSTHROUGH,
+                                                          gvir_sandbox_config_mount_host_bind_get_cache(
+                                                              GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND(mconfig)),
+                                                          FALSE, error)) {
+                g_free(target);
+                g_list_foreach(mounts, (GFunc)g_object_unref, NULL);
+                g_list_free(mounts);
+                goto cleanup;
+            }
             g_free(target);
 
         } else if (GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_IMAGE(mconfig)) {
@@ -620,6 +1116,36 @@ static gboolean gvir_sandbox_builder_machine_construct_devices(GVirSandboxBuilde
     g_list_foreach(mounts, (GFunc)g_object_unref, NULL);
     g_list_free(mounts);
 
+    if (gvir_sandbox_builder_machine_get_root_cache_image(config)) {
+        gchar *target;
+
+        if (!gvir_sandbox_builder_machine_lock_root_cache(GVIR_SANDBOX_BUILDER_MACHINE(builder),
+                                                          gvir_sandbox_builder_machine_get_root_cache_image(config),
+                                                          error))
+            goto cleanup;
+
+        target = g_strdup_printf("vd%c", (char)('a' + nVirtioDev++));
+
+        disk = gvir_config_domain_disk_new();
+        gvir_config_domain_disk_set_type(disk, GVIR_CONFIG_DOMAIN_DISK_FILE);
+        gvir_config_domain_disk_set_source(disk,
+                                           gvir_sandbox_builder_machine_get_root_cache_image(config));
+        gvir_config_domain_disk_set_target_bus(disk,
+                                               GVIR_CONFIG_DOMAIN_DISK_BUS_VIRTIO);
+        gvir_config_domain_disk_set_target_dev(disk, target);
+
+        diskDriver = gvir_config_domain_disk_driver_new();
+        gvir_config_domain_disk_driver_set_format(diskDriver,
+                                                  GVIR_CONFIG_DOMAIN_DISK_FORMAT_RAW);
+        gvir_config_domain_disk_set_driver(disk, diskDriver);
+
+        gvir_config_domain_add_device(domain,
+                                      GVIR_CONFIG_DOMAIN_DEVICE(disk));
+        g_object_unref(diskDriver);
+        g_object_unref(disk);
+        g_free(target);
+    }
+
     tmp = networks = gvir_sandbox_config_get_networks(config);
     while (tmp) {
         const gchar *source, *mac;
@@ -745,15 +1271,15 @@ static gboolean gvir_sandbox_builder_machine_clean_post_stop(GVirSandboxBuilder
                                                              const gchar *statedir,
                                                              GError **error)
 {
-    gchar *mntfile = g_strdup_printf("%s/config/mounts.cfg", statedir);
-    gboolean ret = TRUE;
+    GVirSandboxBuilderMachinePrivate *priv = GVIR_SANDBOX_BUILDER_MACHINE(builder)->priv;
 
-    if (unlink(mntfile) < 0 &&
-        errno != ENOENT)
-        ret = FALSE;
+    if (priv->rootCacheLock != -1) {
+        close(priv->rootCacheLock);
+        priv->rootCacheLock = -1;
+    }
 
-    g_free(mntfile);
-    return ret;
+    return GVIR_SANDBOX_BUILDER_CLASS(gvir_sandbox_builder_machine_parent_class)->
+        clean_post_stop(builder, config, statedir, error);
 }
 
 
@@ -774,7 +1300,6 @@ static void gvir_sandbox_builder_machine_class_init(GVirSandboxBuilderMachineCla
     object_class->get_property = gvir_sandbox_builder_machine_get_property;
     object_class->set_property = gvir_sandbox_builder_machine_set_property;
 
-    builder_class->construct_domain = gvir_sandbox_builder_machine_construct_domain;
     builder_class->construct_basic = gvir_sandbox_builder_machine_construct_basic;
     builder_class->construct_os = gvir_sandbox_builder_machine_construct_os;
     builder_class->construct_features = gvir_sandbox_builder_machine_construct_features;
@@ -782,6 +1307,8 @@ static void gvir_sandbox_builder_machine_class_init(GVirSandboxBuilderMachineCla
     builder_class->clean_post_start = gvir_sandbox_builder_machine_clean_post_start;
     builder_class->clean_post_stop = gvir_sandbox_builder_machine_clean_post_stop;
     builder_class->get_disk_prefix = gvir_sandbox_builder_machine_get_disk_prefix;
+    builder_class->construct_memory_backing = gvir_sandbox_builder_machine_construct_memory_backing;
+    builder_class->construct_manifest = gvir_sandbox_builder_machine_construct_manifest;
 
     g_type_class_add_private(klass, sizeof(GVirSandboxBuilderMachinePrivate));
 }
@@ -790,6 +1317,7 @@ static void gvir_sandbox_builder_machine_class_init(GVirSandboxBuilderMachineCla
 static void gvir_sandbox_builder_machine_init(GVirSandboxBuilderMachine *builder)
 {
     builder->priv = GVIR_SANDBOX_BUILDER_MACHINE_GET_PRIVATE(builder);
+    builder->priv->rootCacheLock = -1;
 }
 
 
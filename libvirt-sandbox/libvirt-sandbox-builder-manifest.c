@@ -0,0 +1,103 @@
+/*
+ * libvirt-sandbox-builder-manifest.c: boot manifest writer
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <config.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "libvirt-sandbox/libvirt-sandbox.h"
+#include "libvirt-sandbox/libvirt-sandbox-builder-private.h"
+#include "libvirt-sandbox/libvirt-sandbox-manifest.h"
+
+/*
+ * The writer is kept apart from the rest of the builder so
+ * that the tests can build it in without the library.
+ */
+
+static void gvir_sandbox_builder_manifest_append_u32(GByteArray *manifest,
+                                                    guint32 val)
+{
+    guint32 le = GUINT32_TO_LE(val);
+    g_byte_array_append(manifest, (const guint8 *)&le, sizeof(le));
+}
+
+
+/*
+ * Returns a manifest with a header and no records
+ */
+GByteArray *gvir_sandbox_builder_manifest_new(void)
+{
+    GByteArray *manifest = g_byte_array_new();
+
+    g_byte_array_append(manifest, (const guint8 *)GVIR_SANDBOX_MANIFEST_MAGIC, 4);
+    gvir_sandbox_builder_manifest_append_u32(manifest, GVIR_SANDBOX_MANIFEST_VERSION);
+    gvir_sandbox_builder_manifest_append_u32(manifest, 0);
+    return manifest;
+}
+
+
+/*
+ * Appends a record of @type with @nfields string fields to
+ * @manifest, which must have been created by
+ * gvir_sandbox_builder_manifest_new()
+ */
+void gvir_sandbox_builder_manifest_add(GByteArray *manifest,
+                                       guint32 type,
+                                       guint nfields,
+                                       ...)
+{
+    guint32 nrecords, reclen;
+    gsize start;
+    va_list args;
+    guint i;
+
+    g_return_if_fail(nfields <= GVIR_SANDBOX_MANIFEST_MAX_FIELDS);
+
+    gvir_sandbox_builder_manifest_append_u32(manifest, type);
+    /* The record length is filled in once the fields are known */
+    gvir_sandbox_builder_manifest_append_u32(manifest, 0);
+    start = manifest->len;
+    gvir_sandbox_builder_manifest_append_u32(manifest, nfields);
+    va_start(args, nfields);
+    for (i = 0; i < nfields; i++) {
+        const gchar *field = va_arg(args, const gchar *);
+        gsize len = strlen(field);
+        gvir_sandbox_builder_manifest_append_u32(manifest, len);
+        g_byte_array_append(manifest, (const guint8 *)field, len + 1);
+    }
+    va_end(args);
+
+    reclen = GUINT32_TO_LE(manifest->len - start);
+    memcpy(manifest->data + start - sizeof(reclen), &reclen, sizeof(reclen));
+
+    /* The record count is the last field of the header */
+    memcpy(&nrecords, manifest->data + 8, sizeof(nrecords));
+    nrecords = GUINT32_TO_LE(GUINT32_FROM_LE(nrecords) + 1);
+    memcpy(manifest->data + 8, &nrecords, sizeof(nrecords));
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ *  tab-width: 8
+ * End:
+ */
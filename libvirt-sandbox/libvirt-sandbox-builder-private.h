@@ -33,6 +33,12 @@ void gvir_sandbox_builder_set_filterref(GVirSandboxBuilder *builder,
                                         GVirConfigDomainInterface *iface,
                                         GVirSandboxConfigNetworkFilterref *filterref);
 
+GByteArray *gvir_sandbox_builder_manifest_new(void);
+void gvir_sandbox_builder_manifest_add(GByteArray *manifest,
+                                       guint32 type,
+                                       guint nfields,
+                                       ...);
+
 G_END_DECLS
 
 #endif /* __LIBVIRT_SANDBOX_BUILDER_PRIVATE_H__ */
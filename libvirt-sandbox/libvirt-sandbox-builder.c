@@ -22,10 +22,18 @@
 
 #include <config.h>
 #include <string.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <glib/gi18n.h>
 
 #include "libvirt-sandbox/libvirt-sandbox.h"
 #include "libvirt-sandbox/libvirt-sandbox-builder-private.h"
+#include "libvirt-sandbox/libvirt-sandbox-manifest.h"
 
 /**
  * SECTION: libvirt-sandbox-builder
@@ -75,6 +83,10 @@ static gboolean gvir_sandbox_builder_construct_domain(GVirSandboxBuilder *builde
                                                       const gchar *statedir,
                                                       GVirConfigDomain *domain,
                                                       GError **error);
+static gboolean gvir_sandbox_builder_construct_memory_backing(GVirSandboxBuilder *builder,
+                                                              GVirSandboxConfig *config,
+                                                              GString *backing,
+                                                              GError **error);
 static gboolean gvir_sandbox_builder_construct_basic(GVirSandboxBuilder *builder,
                                                      GVirSandboxConfig *config,
                                                      const gchar *statedir,
@@ -100,6 +112,10 @@ static gboolean gvir_sandbox_builder_construct_security(GVirSandboxBuilder *buil
                                                         const gchar *statedir,
                                                         GVirConfigDomain *domain,
                                                         GError **error);
+static gboolean gvir_sandbox_builder_construct_manifest(GVirSandboxBuilder *builder,
+                                                        GVirSandboxConfig *config,
+                                                        GByteArray *manifest,
+                                                        GError **error);
 static gboolean gvir_sandbox_builder_clean_post_start_default(GVirSandboxBuilder *builder,
                                                               GVirSandboxConfig *config,
                                                               const gchar *statedir,
@@ -173,10 +189,12 @@ static void gvir_sandbox_builder_class_init(GVirSandboxBuilderClass *klass)
 
     klass->construct_domain = gvir_sandbox_builder_construct_domain;
     klass->construct_basic = gvir_sandbox_builder_construct_basic;
+    klass->construct_memory_backing = gvir_sandbox_builder_construct_memory_backing;
     klass->construct_os = gvir_sandbox_builder_construct_os;
     klass->construct_features = gvir_sandbox_builder_construct_features;
     klass->construct_devices = gvir_sandbox_builder_construct_devices;
     klass->construct_security = gvir_sandbox_builder_construct_security;
+    klass->construct_manifest = gvir_sandbox_builder_construct_manifest;
     klass->clean_post_start = gvir_sandbox_builder_clean_post_start_default;
     klass->clean_post_stop = gvir_sandbox_builder_clean_post_stop_default;
     klass->get_files_to_copy = gvir_sandbox_builder_get_files_to_copy;
@@ -251,9 +269,47 @@ GVirConnection *gvir_sandbox_builder_get_connection(GVirSandboxBuilder *builder)
 }
 
 
+/*
+ * The programs and libraries copied into the sandbox are kept in a
+ * shared bundle, so that sandbox startup only has to check that the
+ * host files are unchanged and hard link them, instead of running
+ * ldd and copying everything again.
+ *
+ *  <cachedir>/libvirt-sandbox-libs/<programs digest>/
+ *       current -> bundle-<manifest digest>
+ *       bundle-<manifest digest>/MANIFEST
+ *       bundle-<manifest digest>/<files...>
+ *
+ * Each MANIFEST line is "source<TAB>name<TAB>identity", where the
+ * identity is the device, inode, size and mtime of the host file.
+ *
+ * The mtime of a bundle directory records when it was last used.
+ * Bundles other than the current one are only removed once they
+ * have been unused for a while, since a concurrent start may have
+ * just picked one before 'current' was switched away from it.
+ */
+#define GVIR_SANDBOX_BUILDER_BUNDLE_VERSION "1"
+#define GVIR_SANDBOX_BUILDER_BUNDLE_MAX_AGE (60 * 60)
+
+static gchar *gvir_sandbox_builder_file_identity(const gchar *path)
+{
+    struct stat sb;
+
+    if (stat(path, &sb) < 0)
+        return NULL;
+
+    return g_strdup_printf("%llu:%llu:%llu:%llu",
+                           (unsigned long long)sb.st_dev,
+                           (unsigned long long)sb.st_ino,
+                           (unsigned long long)sb.st_size,
+                           (unsigned long long)sb.st_mtime);
+}
+
+
 static gboolean gvir_sandbox_builder_copy_file(const char *path,
                                                const char *libsdir,
                                                const char *newname,
+                                               GString *manifest,
                                                GError **error)
 {
     gchar *name = g_path_get_basename(path);
@@ -263,10 +319,27 @@ static gboolean gvir_sandbox_builder_copy_file(const char *path,
     gboolean result = FALSE;
 
 
-    if (!g_file_query_exists(tgtFile, NULL) &&
-        !g_file_copy(srcFile, tgtFile, 0, NULL, NULL, NULL, error))
+    if (g_file_query_exists(tgtFile, NULL)) {
+        result = TRUE;
+        goto cleanup;
+    }
+
+    if (!g_file_copy(srcFile, tgtFile, 0, NULL, NULL, NULL, error))
         goto cleanup;
 
+    if (manifest) {
+        gchar *identity = gvir_sandbox_builder_file_identity(path);
+        if (!identity) {
+            g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0,
+                        _("Unable to access %s: %s"),
+                        path, strerror(errno));
+            goto cleanup;
+        }
+        g_string_append_printf(manifest, "%s\t%s\t%s\n",
+                               path, newname ? newname : name, identity);
+        g_free(identity);
+    }
+
     result = TRUE;
 
  cleanup:
@@ -278,19 +351,17 @@ static gboolean gvir_sandbox_builder_copy_file(const char *path,
     return result;
 }
 
-static gboolean gvir_sandbox_builder_copy_program(const char *program,
-                                                  const char *dest,
-                                                  GError **error)
+#if !WITH_STATIC_INIT_COMMON
+static gboolean gvir_sandbox_builder_copy_libraries(const char *program,
+                                                    const char *dest,
+                                                    GString *manifest,
+                                                    GError **error)
 {
     gchar *out = NULL;
     gchar *line, *tmp;
     const gchar *argv[] = {LDD_PATH, program, NULL};
     gboolean result = FALSE;
 
-    if (!gvir_sandbox_builder_copy_file(program, dest, NULL, error))
-        goto cleanup;
-
-
     /* Get all the dependencies to be hard linked */
     if (!g_spawn_sync(NULL, (gchar **)argv, NULL, 0,
                       NULL, NULL, &out, NULL, NULL, error))
@@ -327,7 +398,7 @@ static gboolean gvir_sandbox_builder_copy_program(const char *program,
                 newname = "ld.so";
             }
 
-            if (!gvir_sandbox_builder_copy_file(start, dest, newname, error))
+            if (!gvir_sandbox_builder_copy_file(start, dest, newname, manifest, error))
                 goto cleanup;
         }
 
@@ -340,6 +411,265 @@ static gboolean gvir_sandbox_builder_copy_program(const char *program,
 
     return result;
 }
+#endif
+
+static gboolean gvir_sandbox_builder_copy_program(const char *program,
+                                                  const char *dest,
+                                                  GString *manifest,
+                                                  GError **error)
+{
+    if (!gvir_sandbox_builder_copy_file(program, dest, NULL, manifest, error))
+        return FALSE;
+
+#if !WITH_STATIC_INIT_COMMON
+    if (!gvir_sandbox_builder_copy_libraries(program, dest, manifest, error))
+        return FALSE;
+#endif
+
+    return TRUE;
+}
+
+static void gvir_sandbox_builder_bundle_remove(const gchar *dir)
+{
+    GDir *dh;
+    const gchar *entry;
+
+    if ((dh = g_dir_open(dir, 0, NULL))) {
+        while ((entry = g_dir_read_name(dh)) != NULL) {
+            gchar *path = g_build_filename(dir, entry, NULL);
+            unlink(path);
+            g_free(path);
+        }
+        g_dir_close(dh);
+    }
+    rmdir(dir);
+}
+
+
+static gchar *gvir_sandbox_builder_bundle_topdir(GList *tocopy)
+{
+    const gchar *cachedir = (getuid() ? g_get_user_cache_dir() : RUNDIR);
+    GChecksum *sum = g_checksum_new(G_CHECKSUM_SHA256);
+    GList *tmp = tocopy;
+    gchar *ret;
+
+    g_checksum_update(sum, (const guchar *)GVIR_SANDBOX_BUILDER_BUNDLE_VERSION, -1);
+    while (tmp) {
+        g_checksum_update(sum, (const guchar *)tmp->data, strlen(tmp->data) + 1);
+        tmp = tmp->next;
+    }
+
+    ret = g_build_filename(cachedir, "libvirt-sandbox-libs",
+                           g_checksum_get_string(sum), NULL);
+    g_checksum_free(sum);
+    return ret;
+}
+
+
+/*
+ * Returns the lines of the bundle manifest, or NULL
+ * if any host file has changed since it was created
+ */
+static gchar **gvir_sandbox_builder_bundle_check(const gchar *bundledir)
+{
+    gchar *path = g_build_filename(bundledir, "MANIFEST", NULL);
+    gchar *data = NULL;
+    gchar **lines = NULL;
+    gsize i;
+
+    if (!g_file_get_contents(path, &data, NULL, NULL))
+        goto cleanup;
+
+    lines = g_strsplit(data, "\n", 0);
+    for (i = 0; lines[i]; i++) {
+        gchar **fields;
+        gchar *identity = NULL;
+        gboolean valid = FALSE;
+
+        if (!lines[i][0])
+            continue;
+
+        fields = g_strsplit(lines[i], "\t", 3);
+        if (g_strv_length(fields) == 3) {
+            identity = gvir_sandbox_builder_file_identity(fields[0]);
+            valid = identity && g_str_equal(identity, fields[2]);
+            if (!valid)
+                g_debug("Bundle file %s has changed", fields[0]);
+        }
+        g_free(identity);
+        g_strfreev(fields);
+
+        if (!valid) {
+            g_strfreev(lines);
+            lines = NULL;
+            goto cleanup;
+        }
+    }
+
+ cleanup:
+    g_free(data);
+    g_free(path);
+    return lines;
+}
+
+
+static gboolean gvir_sandbox_builder_bundle_link(const gchar *bundledir,
+                                                 gchar **lines,
+                                                 const gchar *libsdir,
+                                                 GError **error)
+{
+    gsize i;
+
+    for (i = 0; lines[i]; i++) {
+        gchar **fields;
+        gchar *src;
+        gchar *dst;
+        gboolean ok = TRUE;
+
+        if (!lines[i][0])
+            continue;
+
+        fields = g_strsplit(lines[i], "\t", 3);
+        src = g_build_filename(bundledir, fields[1], NULL);
+        dst = g_build_filename(libsdir, fields[1], NULL);
+
+        if (link(src, dst) == 0 || errno == EEXIST) {
+            /* Linked, or already in place */
+        } else if (errno == ENOENT) {
+            g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, ENOENT,
+                        _("Bundle file %s has been removed"), src);
+            ok = FALSE;
+        } else {
+            /* Cache is on a different filesystem */
+            GFile *srcFile = g_file_new_for_path(src);
+            GFile *dstFile = g_file_new_for_path(dst);
+            ok = g_file_copy(srcFile, dstFile, 0, NULL, NULL, NULL, error);
+            g_object_unref(srcFile);
+            g_object_unref(dstFile);
+        }
+
+        g_free(src);
+        g_free(dst);
+        g_strfreev(fields);
+        if (!ok)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+static gchar *gvir_sandbox_builder_bundle_create(const gchar *topdir,
+                                                 GList *tocopy,
+                                                 GError **error)
+{
+    GString *manifest = g_string_new("");
+    gchar *tmpdir = g_build_filename(topdir, "tmp-XXXXXX", NULL);
+    gchar *digest = NULL;
+    gchar *bundlename = NULL;
+    gchar *bundledir = NULL;
+    gchar *manifestpath = NULL;
+    gchar *link = NULL;
+    gchar *current = NULL;
+    GList *tmp;
+    GDir *dh;
+    const gchar *entry;
+    gboolean ret = FALSE;
+
+    if (g_mkdir_with_parents(topdir, 0755) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0,
+                    _("Unable to create cache directory %s: %s"),
+                    topdir, strerror(errno));
+        goto cleanup;
+    }
+
+    if (!mkdtemp(tmpdir)) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0,
+                    _("Unable to create temporary directory %s: %s"),
+                    tmpdir, strerror(errno));
+        goto cleanup;
+    }
+    chmod(tmpdir, 0755);
+
+    tmp = tocopy;
+    while (tmp) {
+        if (!gvir_sandbox_builder_copy_program(tmp->data, tmpdir, manifest, error))
+            goto cleanup;
+        tmp = tmp->next;
+    }
+
+    manifestpath = g_build_filename(tmpdir, "MANIFEST", NULL);
+    if (!g_file_set_contents(manifestpath, manifest->str, manifest->len, error))
+        goto cleanup;
+
+    digest = g_compute_checksum_for_string(G_CHECKSUM_SHA256,
+                                           manifest->str, -1);
+    bundlename = g_strdup_printf("bundle-%s", digest);
+    bundledir = g_build_filename(topdir, bundlename, NULL);
+
+    /* A concurrent start may have already published the same bundle */
+    if (rename(tmpdir, bundledir) < 0 &&
+        errno != EEXIST && errno != ENOTEMPTY) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0,
+                    _("Unable to rename %s to %s: %s"),
+                    tmpdir, bundledir, strerror(errno));
+        goto cleanup;
+    }
+
+    /* Switch the 'current' symlink atomically */
+    link = g_build_filename(topdir, "current.tmp", NULL);
+    current = g_build_filename(topdir, "current", NULL);
+    unlink(link);
+    if (symlink(bundlename, link) < 0 ||
+        rename(link, current) < 0) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0,
+                    _("Unable to update %s: %s"),
+                    current, strerror(errno));
+        goto cleanup;
+    }
+
+    /* Bundles for older library versions are no longer needed once
+     * nothing has used them for a while. Any running sandbox holds
+     * its own links to the files it uses. */
+    if ((dh = g_dir_open(topdir, 0, NULL))) {
+        time_t now = time(NULL);
+        while ((entry = g_dir_read_name(dh)) != NULL) {
+            gchar *old;
+            struct stat sb;
+
+            if (!g_str_has_prefix(entry, "bundle-") ||
+                g_str_equal(entry, bundlename))
+                continue;
+
+            old = g_build_filename(topdir, entry, NULL);
+            if (stat(old, &sb) == 0 &&
+                now - sb.st_mtime > GVIR_SANDBOX_BUILDER_BUNDLE_MAX_AGE) {
+                g_debug("Removing stale bundle %s", old);
+                gvir_sandbox_builder_bundle_remove(old);
+            }
+            g_free(old);
+        }
+        g_dir_close(dh);
+    }
+
+    ret = TRUE;
+ cleanup:
+    if (g_file_test(tmpdir, G_FILE_TEST_IS_DIR))
+        gvir_sandbox_builder_bundle_remove(tmpdir);
+    if (!ret) {
+        g_free(bundledir);
+        bundledir = NULL;
+    }
+    g_string_free(manifest, TRUE);
+    g_free(tmpdir);
+    g_free(digest);
+    g_free(bundlename);
+    g_free(manifestpath);
+    g_free(link);
+    g_free(current);
+    return bundledir;
+}
+
 
 static gboolean gvir_sandbox_builder_copy_init(GVirSandboxBuilder *builder,
                                                GVirSandboxConfig *config,
@@ -349,22 +679,79 @@ static gboolean gvir_sandbox_builder_copy_init(GVirSandboxBuilder *builder,
     gchar *libsdir;
     GVirSandboxBuilderClass *klass = GVIR_SANDBOX_BUILDER_GET_CLASS(builder);
     GList *tocopy = NULL, *tmp = NULL;
+    gchar *topdir = NULL;
+    gchar *current = NULL;
+    gchar *target = NULL;
+    gchar *bundledir = NULL;
+    gchar **lines = NULL;
+    GError *err = NULL;
     gboolean result = FALSE;
 
     libsdir = g_build_filename(statedir, "config", ".libs", NULL);
     g_mkdir_with_parents(libsdir, 0755);
 
-    tmp = tocopy = klass->get_files_to_copy(builder, config);
-    while (tmp) {
-        if (!gvir_sandbox_builder_copy_program(tmp->data, libsdir, error))
+    tocopy = klass->get_files_to_copy(builder, config);
+
+    topdir = gvir_sandbox_builder_bundle_topdir(tocopy);
+    current = g_build_filename(topdir, "current", NULL);
+    /* Resolve the link once, in case another start replaces it */
+    if ((target = g_file_read_link(current, NULL))) {
+        bundledir = g_build_filename(topdir, target, NULL);
+        if ((lines = gvir_sandbox_builder_bundle_check(bundledir))) {
+            g_debug("Using library bundle %s", bundledir);
+            /* Record the use, so the bundle is not seen as stale */
+            if (utimes(bundledir, NULL) < 0)
+                g_debug("Unable to update timestamp on %s: %s",
+                        bundledir, strerror(errno));
+        } else {
+            g_free(bundledir);
+            bundledir = NULL;
+        }
+    }
+
+    if (!lines) {
+        if ((bundledir = gvir_sandbox_builder_bundle_create(topdir, tocopy, &err))) {
+            g_debug("Created library bundle %s", bundledir);
+            lines = gvir_sandbox_builder_bundle_check(bundledir);
+        } else {
+            g_debug("Unable to create library bundle: %s", err->message);
+            g_clear_error(&err);
+        }
+    }
+
+    if (lines &&
+        !gvir_sandbox_builder_bundle_link(bundledir, lines, libsdir, &err)) {
+        /* The bundle may have been removed while we were using it,
+         * in which case fall back to the original files */
+        if (!g_error_matches(err, GVIR_SANDBOX_BUILDER_ERROR, ENOENT)) {
+            g_propagate_error(error, err);
             goto cleanup;
+        }
+        g_debug("%s, copying files directly", err->message);
+        g_clear_error(&err);
+        g_strfreev(lines);
+        lines = NULL;
+    }
 
-        tmp = tmp->next;
+    if (!lines) {
+        /* No usable cache, so copy directly into the sandbox */
+        tmp = tocopy;
+        while (tmp) {
+            if (!gvir_sandbox_builder_copy_program(tmp->data, libsdir, NULL, error))
+                goto cleanup;
+
+            tmp = tmp->next;
+        }
     }
     result = TRUE;
 
  cleanup:
     g_free(libsdir);
+    g_free(topdir);
+    g_free(current);
+    g_free(target);
+    g_free(bundledir);
+    g_strfreev(lines);
     g_list_free_full(tocopy, g_free);
 
     return result;
@@ -414,8 +801,21 @@ static gboolean gvir_sandbox_builder_construct_basic(GVirSandboxBuilder *builder
     gvir_config_domain_set_uuid(domain,
                                 gvir_sandbox_config_get_uuid(config));
 #endif
-    /* XXX configurable */
-    gvir_config_domain_set_memory(domain, 1024*512);
+    gvir_config_domain_set_memory(domain,
+                                  gvir_sandbox_config_get_memory(config) * 1024);
+    gvir_config_domain_set_vcpus(domain,
+                                 gvir_sandbox_config_get_vcpus(config));
+    return TRUE;
+}
+
+
+static gboolean gvir_sandbox_builder_construct_memory_backing(GVirSandboxBuilder *builder G_GNUC_UNUSED,
+                                                              GVirSandboxConfig *config,
+                                                              GString *backing,
+                                                              GError **error G_GNUC_UNUSED)
+{
+    if (gvir_sandbox_config_get_hugepages(config))
+        g_string_append(backing, "    <hugepages/>\n");
     return TRUE;
 }
 
@@ -439,28 +839,23 @@ static gboolean gvir_sandbox_builder_construct_features(GVirSandboxBuilder *buil
     return TRUE;
 }
 
-static gboolean gvir_sandbox_builder_construct_disk_cfg(GVirSandboxBuilder *builder,
-                                                        GVirSandboxConfig *config,
-                                                        const gchar *statedir,
-                                                        GError **error)
+/*
+ * Writes the boot manifest read by the guest init programs,
+ * with the disks, plus whatever the subclass adds
+ */
+static gboolean gvir_sandbox_builder_construct_manifest_file(GVirSandboxBuilder *builder,
+                                                             GVirSandboxConfig *config,
+                                                             const gchar *statedir,
+                                                             GError **error)
 {
     GVirSandboxBuilderClass *klass = GVIR_SANDBOX_BUILDER_GET_CLASS(builder);
     guint nVirtioDev = 0;
-    gchar *dskfile = g_strdup_printf("%s/config/disks.cfg", statedir);
-    GFile *file = g_file_new_for_path(dskfile);
-    GFileOutputStream *fos = g_file_replace(file,
-                                            NULL,
-                                            FALSE,
-                                            G_FILE_CREATE_REPLACE_DESTINATION,
-                                            NULL,
-                                            error);
+    gchar *manifestfile = g_build_filename(statedir, "config",
+                                           GVIR_SANDBOX_MANIFEST_FILE, NULL);
+    GByteArray *manifest = gvir_sandbox_builder_manifest_new();
     gboolean ret = FALSE;
     GList *disks = gvir_sandbox_config_get_disks(config);
     GList *tmp = NULL;
-    const gchar *tag;
-
-    if (!fos)
-        goto cleanup;
 
     tmp = disks;
     while (tmp) {
@@ -468,40 +863,38 @@ static gboolean gvir_sandbox_builder_construct_disk_cfg(GVirSandboxBuilder *buil
         const gchar *prefix = klass->get_disk_prefix(builder, config, mconfig);
         gchar *device = g_strdup_printf("/dev/%s%c", prefix,
                                         (char)('a' + (nVirtioDev)++));
-        gchar *line;
-
-        tag = gvir_sandbox_config_disk_get_tag(mconfig);
 
-        line = g_strdup_printf("%s\t%s\n",
-                               tag, device);
+        gvir_sandbox_builder_manifest_add(manifest, GVIR_SANDBOX_MANIFEST_DISK, 2,
+                                          gvir_sandbox_config_disk_get_tag(mconfig),
+                                          device);
         g_free(device);
 
-        if (!g_output_stream_write_all(G_OUTPUT_STREAM(fos),
-                                       line, strlen(line),
-                                       NULL, NULL, error)) {
-            g_free(line);
-            goto cleanup;
-        }
-        g_free(line);
-
         tmp = tmp->next;
     }
 
-    if (!g_output_stream_close(G_OUTPUT_STREAM(fos), NULL, error))
+    if (!klass->construct_manifest(builder, config, manifest, error))
+        goto cleanup;
+
+    if (!g_file_set_contents(manifestfile, (const gchar *)manifest->data,
+                             manifest->len, error))
         goto cleanup;
 
     ret = TRUE;
  cleanup:
     g_list_foreach(disks, (GFunc)g_object_unref, NULL);
     g_list_free(disks);
-    if (fos)
-        g_object_unref(fos);
-    if (!ret)
-        g_file_delete(file, NULL, NULL);
-    g_object_unref(file);
-    g_free(dskfile);
+    g_byte_array_unref(manifest);
+    g_free(manifestfile);
     return ret;
+}
+
 
+static gboolean gvir_sandbox_builder_construct_manifest(GVirSandboxBuilder *builder G_GNUC_UNUSED,
+                                                        GVirSandboxConfig *config G_GNUC_UNUSED,
+                                                        GByteArray *manifest G_GNUC_UNUSED,
+                                                        GError **error G_GNUC_UNUSED)
+{
+    return TRUE;
 }
 
 static gboolean gvir_sandbox_builder_construct_devices(GVirSandboxBuilder *builder,
@@ -510,7 +903,7 @@ static gboolean gvir_sandbox_builder_construct_devices(GVirSandboxBuilder *build
                                                        GVirConfigDomain *domain,
                                                        GError **error)
 {
-    return gvir_sandbox_builder_construct_disk_cfg(builder, config, statedir,error);
+    return gvir_sandbox_builder_construct_manifest_file(builder, config, statedir, error);
 }
 
 static gboolean gvir_sandbox_builder_construct_security_selinux (GVirSandboxBuilder *builder,
@@ -647,6 +1040,113 @@ static GList *gvir_sandbox_builder_get_files_to_copy(GVirSandboxBuilder *builder
 }
 
 
+static gboolean gvir_sandbox_builder_check_cpulist(const gchar *list,
+                                                   const gchar *what,
+                                                   GError **error)
+{
+    if (list[0] == '\0' ||
+        strspn(list, "0123456789,-^") != strlen(list)) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0,
+                    _("Invalid %s '%s'"), what, list);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/*
+ * libvirt-gconfig has no API for CPU placement, NUMA or
+ * memory backing, so when any are requested the elements
+ * are added to the generated XML and the domain re-parsed
+ */
+static gboolean gvir_sandbox_builder_construct_tuning(GVirSandboxBuilder *builder,
+                                                      GVirSandboxConfig *config,
+                                                      GVirConfigDomain **domain,
+                                                      GError **error)
+{
+    GVirSandboxBuilderClass *klass = GVIR_SANDBOX_BUILDER_GET_CLASS(builder);
+    const gchar *cpuset = gvir_sandbox_config_get_cpuset(config);
+    const gchar *nodeset = gvir_sandbox_config_get_nodeset(config);
+    GVirConfigDomain *newdomain = NULL;
+    GString *backing = g_string_new("");
+    GString *tuning = NULL;
+    GString *str = NULL;
+    gchar *xml = NULL;
+    const gchar *rest;
+    const gchar *tmp;
+    gboolean ret = FALSE;
+
+    if (!klass->construct_memory_backing(builder, config, backing, error))
+        goto cleanup;
+
+    if (!cpuset && !nodeset && !backing->len) {
+        ret = TRUE;
+        goto cleanup;
+    }
+
+    if (cpuset &&
+        !gvir_sandbox_builder_check_cpulist(cpuset, "cpuset", error))
+        goto cleanup;
+    if (nodeset &&
+        !gvir_sandbox_builder_check_cpulist(nodeset, "nodeset", error))
+        goto cleanup;
+
+    tuning = g_string_new("");
+    if (nodeset)
+        g_string_append_printf(tuning,
+                               "  <numatune>\n"
+                               "    <memory mode=\"strict\" nodeset=\"%s\"/>\n"
+                               "  </numatune>\n",
+                               nodeset);
+    if (backing->len)
+        g_string_append_printf(tuning,
+                               "  <memoryBacking>\n"
+                               "%s"
+                               "  </memoryBacking>\n",
+                               backing->str);
+
+    xml = gvir_config_object_to_xml(GVIR_CONFIG_OBJECT(*domain));
+    str = g_string_new("");
+    rest = xml;
+
+    if (cpuset) {
+        if (!(tmp = strstr(rest, "<vcpu>"))) {
+            g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0, "%s",
+                        _("Missing vcpu element in domain XML"));
+            goto cleanup;
+        }
+        g_string_append_len(str, rest, tmp - rest);
+        g_string_append_printf(str, "<vcpu cpuset=\"%s\">", cpuset);
+        rest = tmp + strlen("<vcpu>");
+    }
+
+    if (!(tmp = g_strrstr(rest, "</domain>"))) {
+        g_set_error(error, GVIR_SANDBOX_BUILDER_ERROR, 0, "%s",
+                    _("Missing end of domain XML"));
+        goto cleanup;
+    }
+    g_string_append_len(str, rest, tmp - rest);
+    g_string_append(str, tuning->str);
+    g_string_append(str, tmp);
+
+    if (!(newdomain = gvir_config_domain_new_from_xml(str->str, error)))
+        goto cleanup;
+
+    g_object_unref(*domain);
+    *domain = newdomain;
+
+    ret = TRUE;
+ cleanup:
+    g_free(xml);
+    if (str)
+        g_string_free(str, TRUE);
+    if (tuning)
+        g_string_free(tuning, TRUE);
+    g_string_free(backing, TRUE);
+    return ret;
+}
+
+
 /**
  * gvir_sandbox_builder_construct:
  * @builder: (transfer none): the sandbox builder
@@ -665,7 +1165,8 @@ GVirConfigDomain *gvir_sandbox_builder_construct(GVirSandboxBuilder *builder,
     GVirConfigDomain *domain = gvir_config_domain_new();
     GVirSandboxBuilderClass *klass = GVIR_SANDBOX_BUILDER_GET_CLASS(builder);
 
-    if (!(klass->construct_domain(builder, config, statedir, domain, error))) {
+    if (!(klass->construct_domain(builder, config, statedir, domain, error)) ||
+        !gvir_sandbox_builder_construct_tuning(builder, config, &domain, error)) {
         g_object_unref(domain);
         return NULL;
     }
@@ -718,14 +1219,16 @@ gboolean gvir_sandbox_builder_clean_post_stop(GVirSandboxBuilder *builder,
     GFileEnumerator *enumerator = NULL;
     GFileInfo *info = NULL;
     GFile *child = NULL;
-    gchar *dskfile = g_build_filename(statedir, "config", "disks.cfg", NULL);
+    gchar *manifestfile = g_build_filename(statedir, "config",
+                                           GVIR_SANDBOX_MANIFEST_FILE, NULL);
     gboolean ret = TRUE;
 
     ret = klass->clean_post_stop(builder, config, statedir, error);
 
-    if (unlink(dskfile) < 0 &&
+    if (unlink(manifestfile) < 0 &&
         errno != ENOENT)
         ret = FALSE;
+    g_free(manifestfile);
 
     if (!(enumerator = g_file_enumerate_children(libsFile, "*", G_FILE_QUERY_INFO_NONE,
                                                  NULL, error)) &&
@@ -99,6 +99,14 @@ struct _GVirSandboxBuilderClass
                                     GVirSandboxConfigDisk *disk);
     GList *(*get_files_to_copy)(GVirSandboxBuilder *builder,
                                 GVirSandboxConfig *config);
+    gboolean (*construct_memory_backing)(GVirSandboxBuilder *builder,
+                                         GVirSandboxConfig *config,
+                                         GString *backing,
+                                         GError **error);
+    gboolean (*construct_manifest)(GVirSandboxBuilder *builder,
+                                   GVirSandboxConfig *config,
+                                   GByteArray *manifest,
+                                   GError **error);
 
     gpointer padding[LIBVIRT_SANDBOX_CLASS_PADDING];
 };
@@ -45,14 +45,210 @@
 
 struct _GVirSandboxConfigMountHostBindPrivate
 {
-    gboolean unused;
+    GVirSandboxConfigMountHostBindTransport transport;
+    gboolean dax;
+    guint msize;
+    GVirSandboxConfigMountHostBindCache cache;
+    guint readahead;
 };
 
 G_DEFINE_TYPE(GVirSandboxConfigMountHostBind, gvir_sandbox_config_mount_host_bind, GVIR_SANDBOX_TYPE_CONFIG_MOUNT_FILE);
 
+GType gvir_sandbox_config_mount_host_bind_transport_get_type(void)
+{
+    static volatile gsize type = 0;
+
+    if (g_once_init_enter(&type)) {
+        static const GEnumValue values[] = {
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT", "default" },
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P", "9p" },
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS", "virtiofs" },
+            { 0, NULL, NULL }
+        };
+        GType id = g_enum_register_static(g_intern_static_string("GVirSandboxConfigMountHostBindTransport"),
+                                          values);
+        g_once_init_leave(&type, id);
+    }
+
+    return type;
+}
+
+
+GType gvir_sandbox_config_mount_host_bind_cache_get_type(void)
+{
+    static volatile gsize type = 0;
+
+    if (g_once_init_enter(&type)) {
+        static const GEnumValue values[] = {
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT", "default" },
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_NONE,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_NONE", "none" },
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_LOOSE,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_LOOSE", "loose" },
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_FSCACHE,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_FSCACHE", "fscache" },
+            { GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_MMAP,
+              "GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_MMAP", "mmap" },
+            { 0, NULL, NULL }
+        };
+        GType id = g_enum_register_static(g_intern_static_string("GVirSandboxConfigMountHostBindCache"),
+                                          values);
+        g_once_init_leave(&type, id);
+    }
+
+    return type;
+}
+
+
+enum {
+    PROP_0,
+    PROP_TRANSPORT,
+    PROP_DAX,
+    PROP_MSIZE,
+    PROP_CACHE,
+    PROP_READAHEAD,
+};
+
+enum {
+    LAST_SIGNAL
+};
+
+//static gint signals[LAST_SIGNAL];
+
+
+static void gvir_sandbox_config_mount_host_bind_get_property(GObject *object,
+                                                             guint prop_id,
+                                                             GValue *value,
+                                                             GParamSpec *pspec)
+{
+    GVirSandboxConfigMountHostBind *config = GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND(object);
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+
+    switch (prop_id) {
+    case PROP_TRANSPORT:
+        g_value_set_enum(value, priv->transport);
+        break;
+    case PROP_DAX:
+        g_value_set_boolean(value, priv->dax);
+        break;
+    case PROP_MSIZE:
+        g_value_set_uint(value, priv->msize);
+        break;
+    case PROP_CACHE:
+        g_value_set_enum(value, priv->cache);
+        break;
+    case PROP_READAHEAD:
+        g_value_set_uint(value, priv->readahead);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    }
+}
+
+
+static void gvir_sandbox_config_mount_host_bind_set_property(GObject *object,
+                                                             guint prop_id,
+                                                             const GValue *value,
+                                                             GParamSpec *pspec)
+{
+    GVirSandboxConfigMountHostBind *config = GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND(object);
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+
+    switch (prop_id) {
+    case PROP_TRANSPORT:
+        priv->transport = g_value_get_enum(value);
+        break;
+    case PROP_DAX:
+        priv->dax = g_value_get_boolean(value);
+        break;
+    case PROP_MSIZE:
+        priv->msize = g_value_get_uint(value);
+        break;
+    case PROP_CACHE:
+        priv->cache = g_value_get_enum(value);
+        break;
+    case PROP_READAHEAD:
+        priv->readahead = g_value_get_uint(value);
+        break;
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    }
+}
+
 
 static void gvir_sandbox_config_mount_host_bind_class_init(GVirSandboxConfigMountHostBindClass *klass)
 {
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->get_property = gvir_sandbox_config_mount_host_bind_get_property;
+    object_class->set_property = gvir_sandbox_config_mount_host_bind_set_property;
+
+    g_object_class_install_property(object_class,
+                                    PROP_TRANSPORT,
+                                    g_param_spec_enum("transport",
+                                                      "Transport",
+                                                      "The filesystem passthrough transport",
+                                                      GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT,
+                                                      GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_DAX,
+                                    g_param_spec_boolean("dax",
+                                                         "DAX",
+                                                         "Whether to map file contents directly into the guest",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_STATIC_NAME |
+                                                         G_PARAM_STATIC_NICK |
+                                                         G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_MSIZE,
+                                    g_param_spec_uint("msize",
+                                                      "Msize",
+                                                      "The maximum 9p message size in bytes",
+                                                      0,
+                                                      G_MAXUINT,
+                                                      0,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_CACHE,
+                                    g_param_spec_enum("cache",
+                                                      "Cache",
+                                                      "The guest cache mode",
+                                                      GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE,
+                                                      GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_READAHEAD,
+                                    g_param_spec_uint("readahead",
+                                                      "Readahead",
+                                                      "The guest readahead size in KiB",
+                                                      0,
+                                                      G_MAXUINT,
+                                                      0,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+
     g_type_class_add_private(klass, sizeof(GVirSandboxConfigMountHostBindPrivate));
 }
 
@@ -80,6 +276,166 @@ GVirSandboxConfigMountHostBind *gvir_sandbox_config_mount_host_bind_new(const gc
                                                             NULL));
 }
 
+/**
+ * gvir_sandbox_config_mount_host_bind_set_transport:
+ * @config: (transfer none): the sandbox mount config
+ * @transport: the filesystem passthrough transport
+ *
+ * Set the transport used to pass the host directory through to
+ * machine based sandboxes. The default is to use the transport
+ * configured for the whole sandbox.
+ */
+void gvir_sandbox_config_mount_host_bind_set_transport(GVirSandboxConfigMountHostBind *config,
+                                                       GVirSandboxConfigMountHostBindTransport transport)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    priv->transport = transport;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_get_transport:
+ * @config: (transfer none): the sandbox mount config
+ *
+ * Retrieves the filesystem passthrough transport of the mount
+ *
+ * Returns: the transport
+ */
+GVirSandboxConfigMountHostBindTransport gvir_sandbox_config_mount_host_bind_get_transport(GVirSandboxConfigMountHostBind *config)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    return priv->transport;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_set_dax:
+ * @config: (transfer none): the sandbox mount config
+ * @dax: true to map file contents directly into the guest
+ *
+ * Set whether a virtiofs mount uses DAX, so file contents are
+ * mapped from the host page cache rather than copied into the
+ * guest. This needs a QEMU which provides a DAX window for the
+ * device and is ignored for 9p mounts.
+ */
+void gvir_sandbox_config_mount_host_bind_set_dax(GVirSandboxConfigMountHostBind *config,
+                                                 gboolean dax)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    priv->dax = dax;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_get_dax:
+ * @config: (transfer none): the sandbox mount config
+ *
+ * Retrieves whether the mount uses DAX
+ *
+ * Returns: the DAX flag
+ */
+gboolean gvir_sandbox_config_mount_host_bind_get_dax(GVirSandboxConfigMountHostBind *config)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    return priv->dax;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_set_msize:
+ * @config: (transfer none): the sandbox mount config
+ * @msize: the maximum message size in bytes
+ *
+ * Set the maximum size of the messages a 9p mount exchanges with
+ * the host, which bounds the size of each read and write request.
+ * Zero leaves the choice to the guest kernel.
+ */
+void gvir_sandbox_config_mount_host_bind_set_msize(GVirSandboxConfigMountHostBind *config,
+                                                   guint msize)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    priv->msize = msize;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_get_msize:
+ * @config: (transfer none): the sandbox mount config
+ *
+ * Retrieves the maximum 9p message size
+ *
+ * Returns: the message size in bytes, or 0 for the default
+ */
+guint gvir_sandbox_config_mount_host_bind_get_msize(GVirSandboxConfigMountHostBind *config)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    return priv->msize;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_set_cache:
+ * @config: (transfer none): the sandbox mount config
+ * @cache: the cache mode
+ *
+ * Set how much of the host directory the guest may cache. The
+ * loose, fscache and mmap modes are only safe if the directory
+ * is not changed on the host while the sandbox runs. virtiofs
+ * mounts only distinguish none from the caching modes.
+ */
+void gvir_sandbox_config_mount_host_bind_set_cache(GVirSandboxConfigMountHostBind *config,
+                                                   GVirSandboxConfigMountHostBindCache cache)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    priv->cache = cache;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_get_cache:
+ * @config: (transfer none): the sandbox mount config
+ *
+ * Retrieves the cache mode of the mount
+ *
+ * Returns: the cache mode
+ */
+GVirSandboxConfigMountHostBindCache gvir_sandbox_config_mount_host_bind_get_cache(GVirSandboxConfigMountHostBind *config)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    return priv->cache;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_set_readahead:
+ * @config: (transfer none): the sandbox mount config
+ * @readahead: the readahead size in KiB
+ *
+ * Set the readahead size the guest uses for the mount. Zero
+ * leaves the choice to the guest kernel.
+ */
+void gvir_sandbox_config_mount_host_bind_set_readahead(GVirSandboxConfigMountHostBind *config,
+                                                       guint readahead)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    priv->readahead = readahead;
+}
+
+
+/**
+ * gvir_sandbox_config_mount_host_bind_get_readahead:
+ * @config: (transfer none): the sandbox mount config
+ *
+ * Retrieves the readahead size of the mount
+ *
+ * Returns: the readahead size in KiB, or 0 for the default
+ */
+guint gvir_sandbox_config_mount_host_bind_get_readahead(GVirSandboxConfigMountHostBind *config)
+{
+    GVirSandboxConfigMountHostBindPrivate *priv = config->priv;
+    return priv->readahead;
+}
+
 /*
  * Local variables:
  *  c-indent-level: 4
@@ -36,6 +36,26 @@ G_BEGIN_DECLS
 #define GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_BIND_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND))
 #define GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND, GVirSandboxConfigMountHostBindClass))
 
+/* Registered by hand rather than in libvirt-sandbox-enum-types,
+ * since init-common links the config objects without it */
+typedef enum /*< skip >*/ {
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT,
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P,
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS,
+} GVirSandboxConfigMountHostBindTransport;
+
+#define GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT (gvir_sandbox_config_mount_host_bind_transport_get_type ())
+
+typedef enum /*< skip >*/ {
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT,
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_NONE,
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_LOOSE,
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_FSCACHE,
+    GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_MMAP,
+} GVirSandboxConfigMountHostBindCache;
+
+#define GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE (gvir_sandbox_config_mount_host_bind_cache_get_type ())
+
 typedef struct _GVirSandboxConfigMountHostBind GVirSandboxConfigMountHostBind;
 typedef struct _GVirSandboxConfigMountHostBindPrivate GVirSandboxConfigMountHostBindPrivate;
 typedef struct _GVirSandboxConfigMountHostBindClass GVirSandboxConfigMountHostBindClass;
@@ -57,10 +77,32 @@ struct _GVirSandboxConfigMountHostBindClass
 };
 
 GType gvir_sandbox_config_mount_host_bind_get_type(void);
+GType gvir_sandbox_config_mount_host_bind_transport_get_type(void) G_GNUC_CONST;
+GType gvir_sandbox_config_mount_host_bind_cache_get_type(void) G_GNUC_CONST;
 
 GVirSandboxConfigMountHostBind *gvir_sandbox_config_mount_host_bind_new(const gchar *source,
                                                                         const gchar *targetdir);
 
+void gvir_sandbox_config_mount_host_bind_set_transport(GVirSandboxConfigMountHostBind *config,
+                                                       GVirSandboxConfigMountHostBindTransport transport);
+GVirSandboxConfigMountHostBindTransport gvir_sandbox_config_mount_host_bind_get_transport(GVirSandboxConfigMountHostBind *config);
+
+void gvir_sandbox_config_mount_host_bind_set_dax(GVirSandboxConfigMountHostBind *config,
+                                                 gboolean dax);
+gboolean gvir_sandbox_config_mount_host_bind_get_dax(GVirSandboxConfigMountHostBind *config);
+
+void gvir_sandbox_config_mount_host_bind_set_msize(GVirSandboxConfigMountHostBind *config,
+                                                   guint msize);
+guint gvir_sandbox_config_mount_host_bind_get_msize(GVirSandboxConfigMountHostBind *config);
+
+void gvir_sandbox_config_mount_host_bind_set_cache(GVirSandboxConfigMountHostBind *config,
+                                                   GVirSandboxConfigMountHostBindCache cache);
+GVirSandboxConfigMountHostBindCache gvir_sandbox_config_mount_host_bind_get_cache(GVirSandboxConfigMountHostBind *config);
+
+void gvir_sandbox_config_mount_host_bind_set_readahead(GVirSandboxConfigMountHostBind *config,
+                                                       guint readahead);
+guint gvir_sandbox_config_mount_host_bind_get_readahead(GVirSandboxConfigMountHostBind *config);
+
 G_END_DECLS
 
 #endif /* __LIBVIRT_SANDBOX_CONFIG_MOUNT_HOST_BIND_H__ */
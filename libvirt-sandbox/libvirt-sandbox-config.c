@@ -42,6 +42,8 @@
  * create application sandboxes with a simple text based console.
  */
 
+#define GVIR_SANDBOX_CONFIG_DEFAULT_MEMORY 512
+
 #define GVIR_SANDBOX_CONFIG_GET_PRIVATE(obj)                            \
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), GVIR_SANDBOX_TYPE_CONFIG, GVirSandboxConfigPrivate))
 
@@ -55,6 +57,18 @@ struct _GVirSandboxConfigPrivate
     gchar *kernpath;
     gchar *kmodpath;
     gboolean shell;
+    GVirSandboxConfigMountHostBindTransport hostBindTransport;
+    GVirSandboxConfigMountHostBindCache rootCache;
+    gchar *rootCacheImage;
+
+    guint memory;
+    guint vcpus;
+    gchar *cpuset;
+    gchar *nodeset;
+    gboolean hugepages;
+    gboolean memShared;
+    gboolean memLocked;
+    gboolean memNoSharePages;
 
     guint uid;
     guint gid;
@@ -62,6 +76,8 @@ struct _GVirSandboxConfigPrivate
     gchar *homedir;
 
     GList *networks;
+    guint dhcpTimeout;
+    gboolean networkRequired;
     GList *mounts;
     GList *disks;
     GList *envs;
@@ -84,6 +100,18 @@ enum {
     PROP_KERNRELEASE,
     PROP_KERNPATH,
     PROP_KMODPATH,
+    PROP_HOST_BIND_TRANSPORT,
+    PROP_ROOT_CACHE,
+    PROP_ROOT_CACHE_IMAGE,
+
+    PROP_MEMORY,
+    PROP_VCPUS,
+    PROP_CPUSET,
+    PROP_NODESET,
+    PROP_HUGEPAGES,
+    PROP_MEMORY_SHARED,
+    PROP_MEMORY_LOCKED,
+    PROP_MEMORY_NOSHAREPAGES,
 
     PROP_UID,
     PROP_GID,
@@ -92,6 +120,9 @@ enum {
 
     PROP_SECURITY_LABEL,
     PROP_SECURITY_DYNAMIC,
+
+    PROP_DHCP_TIMEOUT,
+    PROP_NETWORK_REQUIRED,
 };
 
 enum {
@@ -151,10 +182,54 @@ static void gvir_sandbox_config_get_property(GObject *object,
         g_value_set_string(value, priv->kmodpath);
         break;
 
+    case PROP_HOST_BIND_TRANSPORT:
+        g_value_set_enum(value, priv->hostBindTransport);
+        break;
+
+    case PROP_ROOT_CACHE:
+        g_value_set_enum(value, priv->rootCache);
+        break;
+
+    case PROP_ROOT_CACHE_IMAGE:
+        g_value_set_string(value, priv->rootCacheImage);
+        break;
+
     case PROP_SHELL:
         g_value_set_boolean(value, priv->shell);
         break;
 
+    case PROP_MEMORY:
+        g_value_set_uint(value, priv->memory);
+        break;
+
+    case PROP_VCPUS:
+        g_value_set_uint(value, priv->vcpus);
+        break;
+
+    case PROP_CPUSET:
+        g_value_set_string(value, priv->cpuset);
+        break;
+
+    case PROP_NODESET:
+        g_value_set_string(value, priv->nodeset);
+        break;
+
+    case PROP_HUGEPAGES:
+        g_value_set_boolean(value, priv->hugepages);
+        break;
+
+    case PROP_MEMORY_SHARED:
+        g_value_set_boolean(value, priv->memShared);
+        break;
+
+    case PROP_MEMORY_LOCKED:
+        g_value_set_boolean(value, priv->memLocked);
+        break;
+
+    case PROP_MEMORY_NOSHAREPAGES:
+        g_value_set_boolean(value, priv->memNoSharePages);
+        break;
+
     case PROP_UID:
         g_value_set_uint(value, priv->uid);
         break;
@@ -179,6 +254,14 @@ static void gvir_sandbox_config_get_property(GObject *object,
         g_value_set_boolean(value, priv->secDynamic);
         break;
 
+    case PROP_DHCP_TIMEOUT:
+        g_value_set_uint(value, priv->dhcpTimeout);
+        break;
+
+    case PROP_NETWORK_REQUIRED:
+        g_value_set_boolean(value, priv->networkRequired);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -229,10 +312,57 @@ static void gvir_sandbox_config_set_property(GObject *object,
         priv->kmodpath = g_value_dup_string(value);
         break;
 
+    case PROP_HOST_BIND_TRANSPORT:
+        priv->hostBindTransport = g_value_get_enum(value);
+        break;
+
+    case PROP_ROOT_CACHE:
+        priv->rootCache = g_value_get_enum(value);
+        break;
+
+    case PROP_ROOT_CACHE_IMAGE:
+        g_free(priv->rootCacheImage);
+        priv->rootCacheImage = g_value_dup_string(value);
+        break;
+
     case PROP_SHELL:
         priv->shell = g_value_get_boolean(value);
         break;
 
+    case PROP_MEMORY:
+        priv->memory = g_value_get_uint(value);
+        break;
+
+    case PROP_VCPUS:
+        priv->vcpus = g_value_get_uint(value);
+        break;
+
+    case PROP_CPUSET:
+        g_free(priv->cpuset);
+        priv->cpuset = g_value_dup_string(value);
+        break;
+
+    case PROP_NODESET:
+        g_free(priv->nodeset);
+        priv->nodeset = g_value_dup_string(value);
+        break;
+
+    case PROP_HUGEPAGES:
+        priv->hugepages = g_value_get_boolean(value);
+        break;
+
+    case PROP_MEMORY_SHARED:
+        priv->memShared = g_value_get_boolean(value);
+        break;
+
+    case PROP_MEMORY_LOCKED:
+        priv->memLocked = g_value_get_boolean(value);
+        break;
+
+    case PROP_MEMORY_NOSHAREPAGES:
+        priv->memNoSharePages = g_value_get_boolean(value);
+        break;
+
     case PROP_UID:
         priv->uid = g_value_get_uint(value);
         break;
@@ -260,6 +390,14 @@ static void gvir_sandbox_config_set_property(GObject *object,
         priv->secDynamic = g_value_get_boolean(value);
         break;
 
+    case PROP_DHCP_TIMEOUT:
+        priv->dhcpTimeout = g_value_get_uint(value);
+        break;
+
+    case PROP_NETWORK_REQUIRED:
+        priv->networkRequired = g_value_get_boolean(value);
+        break;
+
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
     }
@@ -291,6 +429,9 @@ static void gvir_sandbox_config_finalize(GObject *object)
     g_free(priv->kernrelease);
     g_free(priv->kernpath);
     g_free(priv->kmodpath);
+    g_free(priv->rootCacheImage);
+    g_free(priv->cpuset);
+    g_free(priv->nodeset);
     g_free(priv->secLabel);
 
     G_OBJECT_CLASS(gvir_sandbox_config_parent_class)->finalize(object);
@@ -387,6 +528,41 @@ static void gvir_sandbox_config_class_init(GVirSandboxConfigClass *klass)
                                                         G_PARAM_STATIC_NAME |
                                                         G_PARAM_STATIC_NICK |
                                                         G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_HOST_BIND_TRANSPORT,
+                                    g_param_spec_enum("host-bind-transport",
+                                                      "Host bind transport",
+                                                      "The default filesystem passthrough transport",
+                                                      GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT,
+                                                      GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_ROOT_CACHE,
+                                    g_param_spec_enum("root-cache",
+                                                      "Root cache",
+                                                      "The guest cache mode of the root share",
+                                                      GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE,
+                                                      GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_DEFAULT,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_ROOT_CACHE_IMAGE,
+                                    g_param_spec_string("root-cache-image",
+                                                        "Root cache image",
+                                                        "The disk image holding the root share fscache",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
     g_object_class_install_property(object_class,
                                     PROP_SHELL,
                                     g_param_spec_string("shell",
@@ -398,6 +574,98 @@ static void gvir_sandbox_config_class_init(GVirSandboxConfigClass *klass)
                                                         G_PARAM_STATIC_NAME |
                                                         G_PARAM_STATIC_NICK |
                                                         G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_MEMORY,
+                                    g_param_spec_uint("memory",
+                                                      "Memory",
+                                                      "The memory size in MiB",
+                                                      1,
+                                                      G_MAXUINT / 1024,
+                                                      GVIR_SANDBOX_CONFIG_DEFAULT_MEMORY,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_VCPUS,
+                                    g_param_spec_uint("vcpus",
+                                                      "VCPUs",
+                                                      "The number of virtual CPUs",
+                                                      1,
+                                                      G_MAXUINT,
+                                                      1,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_CPUSET,
+                                    g_param_spec_string("cpuset",
+                                                        "Cpuset",
+                                                        "The host CPUs to run on",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_NODESET,
+                                    g_param_spec_string("nodeset",
+                                                        "Nodeset",
+                                                        "The host NUMA nodes to allocate memory from",
+                                                        NULL,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_HUGEPAGES,
+                                    g_param_spec_boolean("hugepages",
+                                                         "Hugepages",
+                                                         "Whether memory is backed by huge pages",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_STATIC_NAME |
+                                                         G_PARAM_STATIC_NICK |
+                                                         G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_MEMORY_SHARED,
+                                    g_param_spec_boolean("memory-shared",
+                                                         "Memory shared",
+                                                         "Whether memory is shared memfd backed",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_STATIC_NAME |
+                                                         G_PARAM_STATIC_NICK |
+                                                         G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_MEMORY_LOCKED,
+                                    g_param_spec_boolean("memory-locked",
+                                                         "Memory locked",
+                                                         "Whether memory is locked in host RAM",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_STATIC_NAME |
+                                                         G_PARAM_STATIC_NICK |
+                                                         G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_MEMORY_NOSHAREPAGES,
+                                    g_param_spec_boolean("memory-nosharepages",
+                                                         "Memory nosharepages",
+                                                         "Whether memory is excluded from page merging",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_STATIC_NAME |
+                                                         G_PARAM_STATIC_NICK |
+                                                         G_PARAM_STATIC_BLURB));
     g_object_class_install_property(object_class,
                                     PROP_UID,
                                     g_param_spec_uint("uid",
@@ -468,6 +736,30 @@ static void gvir_sandbox_config_class_init(GVirSandboxConfigClass *klass)
                                                          G_PARAM_STATIC_NAME |
                                                          G_PARAM_STATIC_NICK |
                                                          G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_DHCP_TIMEOUT,
+                                    g_param_spec_uint("dhcp-timeout",
+                                                      "DHCP timeout",
+                                                      "Seconds to wait for DHCP leases",
+                                                      0,
+                                                      G_MAXUINT,
+                                                      0,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_NETWORK_REQUIRED,
+                                    g_param_spec_boolean("network-required",
+                                                         "Network required",
+                                                         "Whether the command waits for the network",
+                                                         TRUE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_STATIC_NAME |
+                                                         G_PARAM_STATIC_NICK |
+                                                         G_PARAM_STATIC_BLURB));
 
     g_type_class_add_private(klass, sizeof(GVirSandboxConfigPrivate));
 }
@@ -486,6 +778,11 @@ static void gvir_sandbox_config_init(GVirSandboxConfig *config)
     priv->root = g_strdup("/");
     priv->arch = g_strdup(uts.machine);
     priv->secDynamic = TRUE;
+    priv->networkRequired = TRUE;
+    priv->hostBindTransport = GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P;
+
+    priv->memory = GVIR_SANDBOX_CONFIG_DEFAULT_MEMORY;
+    priv->vcpus = 1;
 
     priv->uid = geteuid();
     priv->gid = getegid();
@@ -696,6 +993,109 @@ const gchar *gvir_sandbox_config_get_kmodpath(GVirSandboxConfig *config)
 }
 
 
+/**
+ * gvir_sandbox_config_set_host_bind_transport:
+ * @config: (transfer none): the sandbox config
+ * @transport: the filesystem passthrough transport
+ *
+ * Set the transport used by machine based sandboxes for any
+ * host-bind mounts which do not choose their own transport. The
+ * default is 9p. The root and config directories are always
+ * passed through with 9p, so the host can keep them read only.
+ */
+void gvir_sandbox_config_set_host_bind_transport(GVirSandboxConfig *config,
+                                                 GVirSandboxConfigMountHostBindTransport transport)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    if (transport == GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_DEFAULT)
+        transport = GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_9P;
+    priv->hostBindTransport = transport;
+}
+
+
+/**
+ * gvir_sandbox_config_get_host_bind_transport:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the default filesystem passthrough transport
+ *
+ * Returns: the transport
+ */
+GVirSandboxConfigMountHostBindTransport gvir_sandbox_config_get_host_bind_transport(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->hostBindTransport;
+}
+
+
+/**
+ * gvir_sandbox_config_set_root_cache:
+ * @config: (transfer none): the sandbox config
+ * @cache: the cache mode
+ *
+ * Set how much of the host root directory machine based sandboxes
+ * may cache. The host root is shared read-only, so caching is safe
+ * as long as the host software is not updated while the sandbox
+ * runs. It has no effect if the sandbox has its own root mount.
+ */
+void gvir_sandbox_config_set_root_cache(GVirSandboxConfig *config,
+                                        GVirSandboxConfigMountHostBindCache cache)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->rootCache = cache;
+}
+
+
+/**
+ * gvir_sandbox_config_get_root_cache:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the cache mode of the root share
+ *
+ * Returns: the cache mode
+ */
+GVirSandboxConfigMountHostBindCache gvir_sandbox_config_get_root_cache(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->rootCache;
+}
+
+
+/**
+ * gvir_sandbox_config_set_root_cache_image:
+ * @config: (transfer none): the sandbox config
+ * @image: (transfer none): path to an ext4 formatted disk image
+ *
+ * Set a disk image to keep the fscache of a 9p root share in, so
+ * that the cache stays warm from one sandbox to the next. The
+ * image is attached writable, so it is locked while an interactive
+ * sandbox runs, and service sandboxes and pools cannot use it. It
+ * is only used when the root cache mode is fscache.
+ */
+void gvir_sandbox_config_set_root_cache_image(GVirSandboxConfig *config,
+                                              const gchar *image)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    g_free(priv->rootCacheImage);
+    priv->rootCacheImage = g_strdup(image);
+}
+
+
+/**
+ * gvir_sandbox_config_get_root_cache_image:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the disk image holding the root share fscache
+ *
+ * Returns: (transfer none): the image path, or NULL
+ */
+const gchar *gvir_sandbox_config_get_root_cache_image(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->rootCacheImage;
+}
+
+
 /**
  * gvir_sandbox_config_set_shell:
  * @config: (transfer none): the sandbox config
@@ -725,6 +1125,252 @@ gboolean gvir_sandbox_config_get_shell(GVirSandboxConfig *config)
 }
 
 
+/**
+ * gvir_sandbox_config_set_memory:
+ * @config: (transfer none): the sandbox config
+ * @memory: the memory size in MiB
+ *
+ * Set the amount of memory given to the sandbox. For machine
+ * sandboxes this is the guest RAM size, for containers it is
+ * the cgroup memory limit. Defaults to 512 MiB.
+ */
+void gvir_sandbox_config_set_memory(GVirSandboxConfig *config, guint memory)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->memory = memory;
+}
+
+
+/**
+ * gvir_sandbox_config_get_memory:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the sandbox memory size
+ *
+ * Returns: the memory size in MiB
+ */
+guint gvir_sandbox_config_get_memory(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->memory;
+}
+
+
+/**
+ * gvir_sandbox_config_set_vcpus:
+ * @config: (transfer none): the sandbox config
+ * @vcpus: the number of virtual CPUs
+ *
+ * Set the number of virtual CPUs given to the sandbox.
+ * Defaults to 1.
+ */
+void gvir_sandbox_config_set_vcpus(GVirSandboxConfig *config, guint vcpus)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->vcpus = vcpus;
+}
+
+
+/**
+ * gvir_sandbox_config_get_vcpus:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the number of virtual CPUs
+ *
+ * Returns: the number of virtual CPUs
+ */
+guint gvir_sandbox_config_get_vcpus(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->vcpus;
+}
+
+
+/**
+ * gvir_sandbox_config_set_cpuset:
+ * @config: (transfer none): the sandbox config
+ * @cpuset: (transfer none)(allow-none): the host CPU list
+ *
+ * Restrict the sandbox to run on the host CPUs listed in
+ * @cpuset, using the libvirt syntax, eg "0-3,^2". If NULL
+ * the sandbox may run on any host CPU.
+ */
+void gvir_sandbox_config_set_cpuset(GVirSandboxConfig *config, const gchar *cpuset)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    g_free(priv->cpuset);
+    priv->cpuset = g_strdup(cpuset);
+}
+
+
+/**
+ * gvir_sandbox_config_get_cpuset:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the host CPUs the sandbox may run on
+ *
+ * Returns: (transfer none): the host CPU list, or NULL
+ */
+const gchar *gvir_sandbox_config_get_cpuset(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->cpuset;
+}
+
+
+/**
+ * gvir_sandbox_config_set_nodeset:
+ * @config: (transfer none): the sandbox config
+ * @nodeset: (transfer none)(allow-none): the host NUMA node list
+ *
+ * Require the sandbox memory to be allocated from the host
+ * NUMA nodes listed in @nodeset, using the libvirt syntax,
+ * eg "0-1". If NULL memory may come from any node.
+ */
+void gvir_sandbox_config_set_nodeset(GVirSandboxConfig *config, const gchar *nodeset)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    g_free(priv->nodeset);
+    priv->nodeset = g_strdup(nodeset);
+}
+
+
+/**
+ * gvir_sandbox_config_get_nodeset:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the host NUMA nodes the sandbox memory comes from
+ *
+ * Returns: (transfer none): the host NUMA node list, or NULL
+ */
+const gchar *gvir_sandbox_config_get_nodeset(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->nodeset;
+}
+
+
+/**
+ * gvir_sandbox_config_set_hugepages:
+ * @config: (transfer none): the sandbox config
+ * @hugepages: true if memory should be backed by huge pages
+ *
+ * Set whether the sandbox memory is backed by the host's
+ * huge pages, which must have been reserved in advance.
+ */
+void gvir_sandbox_config_set_hugepages(GVirSandboxConfig *config, gboolean hugepages)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->hugepages = hugepages;
+}
+
+
+/**
+ * gvir_sandbox_config_get_hugepages:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves whether memory is backed by huge pages
+ *
+ * Returns: the huge pages flag
+ */
+gboolean gvir_sandbox_config_get_hugepages(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->hugepages;
+}
+
+
+/**
+ * gvir_sandbox_config_set_memory_shared:
+ * @config: (transfer none): the sandbox config
+ * @shared: true if memory should be shared memfd backed
+ *
+ * Set whether machine sandbox memory is allocated from a memfd
+ * and mapped shared, which vhost-user based devices such as
+ * virtiofs need to access guest memory.
+ */
+void gvir_sandbox_config_set_memory_shared(GVirSandboxConfig *config, gboolean shared)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->memShared = shared;
+}
+
+
+/**
+ * gvir_sandbox_config_get_memory_shared:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves whether memory is shared memfd backed
+ *
+ * Returns: the shared memory flag
+ */
+gboolean gvir_sandbox_config_get_memory_shared(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->memShared;
+}
+
+
+/**
+ * gvir_sandbox_config_set_memory_locked:
+ * @config: (transfer none): the sandbox config
+ * @locked: true if memory should be locked in host RAM
+ *
+ * Set whether machine sandbox memory is locked in host RAM,
+ * so that it is never swapped out.
+ */
+void gvir_sandbox_config_set_memory_locked(GVirSandboxConfig *config, gboolean locked)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->memLocked = locked;
+}
+
+
+/**
+ * gvir_sandbox_config_get_memory_locked:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves whether memory is locked in host RAM
+ *
+ * Returns: the locked memory flag
+ */
+gboolean gvir_sandbox_config_get_memory_locked(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->memLocked;
+}
+
+
+/**
+ * gvir_sandbox_config_set_memory_nosharepages:
+ * @config: (transfer none): the sandbox config
+ * @nosharepages: true if memory should not be merged with other guests
+ *
+ * Set whether machine sandbox memory is excluded from kernel
+ * samepage merging on the host.
+ */
+void gvir_sandbox_config_set_memory_nosharepages(GVirSandboxConfig *config, gboolean nosharepages)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->memNoSharePages = nosharepages;
+}
+
+
+/**
+ * gvir_sandbox_config_get_memory_nosharepages:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves whether memory is excluded from page merging
+ *
+ * Returns: the nosharepages flag
+ */
+gboolean gvir_sandbox_config_get_memory_nosharepages(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->memNoSharePages;
+}
+
+
 /**
  * gvir_sandbox_config_set_userid:
  * @config: (transfer none): the sandbox config
@@ -1148,6 +1794,71 @@ gboolean gvir_sandbox_config_has_networks(GVirSandboxConfig *config)
     return priv->networks ? TRUE : FALSE;
 }
 
+
+/**
+ * gvir_sandbox_config_set_dhcp_timeout:
+ * @config: (transfer none): the sandbox config
+ * @timeout: the timeout in seconds
+ *
+ * Set how long to wait for the DHCP leases of all the network
+ * interfaces before giving up on starting the sandbox. A
+ * timeout of 0 leaves it up to the DHCP client.
+ */
+void gvir_sandbox_config_set_dhcp_timeout(GVirSandboxConfig *config,
+                                          guint timeout)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->dhcpTimeout = timeout;
+}
+
+
+/**
+ * gvir_sandbox_config_get_dhcp_timeout:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves the DHCP lease timeout
+ *
+ * Returns: the timeout in seconds, or 0
+ */
+guint gvir_sandbox_config_get_dhcp_timeout(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->dhcpTimeout;
+}
+
+
+/**
+ * gvir_sandbox_config_set_network_required:
+ * @config: (transfer none): the sandbox config
+ * @required: TRUE to wait for the network
+ *
+ * Set whether the sandboxed command must wait for the DHCP
+ * leases to be obtained. If not, it is started straight away
+ * while the DHCP clients carry on in the background. Static
+ * addresses are always configured before the command starts.
+ */
+void gvir_sandbox_config_set_network_required(GVirSandboxConfig *config,
+                                              gboolean required)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    priv->networkRequired = required;
+}
+
+
+/**
+ * gvir_sandbox_config_get_network_required:
+ * @config: (transfer none): the sandbox config
+ *
+ * Retrieves whether the command waits for the network
+ *
+ * Returns: TRUE if the command waits for DHCP leases
+ */
+gboolean gvir_sandbox_config_get_network_required(GVirSandboxConfig *config)
+{
+    GVirSandboxConfigPrivate *priv = config->priv;
+    return priv->networkRequired;
+}
+
 /**
  * gvir_sandbox_config_add_env:
  * @config: (transfer none): the sandbox config
@@ -1538,6 +2249,66 @@ gboolean gvir_sandbox_config_add_mount_strv(GVirSandboxConfig *config,
 }
 
 
+static gboolean gvir_sandbox_config_parse_host_bind_opts(GVirSandboxConfigMountHostBind *mbind,
+                                                         const gchar *optstr,
+                                                         GError **error)
+{
+    gchar **opts = g_strsplit(optstr, ",", 0);
+    gboolean ret = FALSE;
+    gsize i;
+
+    for (i = 0 ; opts[i] ; i++) {
+        gchar *value = strchr(opts[i], '=');
+        gchar *end;
+
+        if (value)
+            *value++ = '\0';
+
+        if (g_str_equal(opts[i], "dax") && !value) {
+            gvir_sandbox_config_mount_host_bind_set_dax(mbind, TRUE);
+        } else if ((g_str_equal(opts[i], "transport") ||
+                    g_str_equal(opts[i], "cache")) && value) {
+            gboolean isCache = g_str_equal(opts[i], "cache");
+            GEnumClass *enum_class = g_type_class_ref(isCache ?
+                                                      GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE :
+                                                      GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT);
+            GEnumValue *enum_value = g_enum_get_value_by_nick(enum_class, value);
+            g_type_class_unref(enum_class);
+            if (!enum_value) {
+                g_set_error(error, GVIR_SANDBOX_CONFIG_ERROR, 0,
+                            _("Unknown mount %s: '%s'"), opts[i], value);
+                goto cleanup;
+            }
+            if (isCache)
+                gvir_sandbox_config_mount_host_bind_set_cache(mbind, enum_value->value);
+            else
+                gvir_sandbox_config_mount_host_bind_set_transport(mbind, enum_value->value);
+        } else if ((g_str_equal(opts[i], "msize") ||
+                    g_str_equal(opts[i], "readahead")) && value) {
+            guint64 size = g_ascii_strtoull(value, &end, 10);
+            if (end == value || *end != '\0' || size > G_MAXUINT) {
+                g_set_error(error, GVIR_SANDBOX_CONFIG_ERROR, 0,
+                            _("Invalid mount %s: '%s'"), opts[i], value);
+                goto cleanup;
+            }
+            if (g_str_equal(opts[i], "msize"))
+                gvir_sandbox_config_mount_host_bind_set_msize(mbind, size);
+            else
+                gvir_sandbox_config_mount_host_bind_set_readahead(mbind, size);
+        } else {
+            g_set_error(error, GVIR_SANDBOX_CONFIG_ERROR, 0,
+                        _("Unknown mount option: '%s'"), opts[i]);
+            goto cleanup;
+        }
+    }
+
+    ret = TRUE;
+ cleanup:
+    g_strfreev(opts);
+    return ret;
+}
+
+
 /**
  * gvir_sandbox_config_add_mount_opts:
  * @config: (transfer none): the sandbox config
@@ -1548,6 +2319,8 @@ gboolean gvir_sandbox_config_add_mount_strv(GVirSandboxConfig *config,
  * example
  *
  * - host-bind:/tmp=/var/lib/sandbox/demo/tmp
+ * - host-bind:/src=/home/demo/src,transport=virtiofs,dax
+ * - host-bind:/=/var/lib/sandbox/demo/root,msize=262144,cache=loose
  * - host-image:/=/var/lib/sandbox/demo.img
  * - host-image:/=/var/lib/sandbox/demo.qcow2,format=qcow2
  * - guest-bind:/home=/tmp/home
@@ -1638,6 +2411,23 @@ gboolean gvir_sandbox_config_add_mount_opts(GVirSandboxConfig *config,
                                                      "source", source,
                                                      "format", format,
                                                      NULL));
+    } else if (type == GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND) {
+        const gchar *opts = NULL;
+
+        if ((tmp = strchr(source, ',')) != NULL) {
+            *tmp = '\0';
+            opts = tmp + 1;
+        }
+
+        mnt = GVIR_SANDBOX_CONFIG_MOUNT(gvir_sandbox_config_mount_host_bind_new(source,
+                                                                                target));
+        if (opts &&
+            !gvir_sandbox_config_parse_host_bind_opts(GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND(mnt),
+                                                      opts, error)) {
+            g_object_unref(mnt);
+            g_free(target);
+            return FALSE;
+        }
     } else {
         mnt = GVIR_SANDBOX_CONFIG_MOUNT(g_object_new(type,
                                                      "target", target,
@@ -2018,6 +2808,42 @@ static GVirSandboxConfigMount *gvir_sandbox_config_load_config_mount(GKeyFile *f
             config = GVIR_SANDBOX_CONFIG_MOUNT(gvir_sandbox_config_mount_host_image_new(source,
                                                                                         target,
                                                                                         enum_value->value));
+        } else if (mountType == GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND) {
+            GVirSandboxConfigMountHostBind *mbind = gvir_sandbox_config_mount_host_bind_new(source,
+                                                                                           target);
+
+            config = GVIR_SANDBOX_CONFIG_MOUNT(mbind);
+
+            if ((formatStr = g_key_file_get_string(file, key, "transport", NULL)) != NULL) {
+                GEnumClass *enum_class = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT);
+                GEnumValue *enum_value = g_enum_get_value_by_nick(enum_class, formatStr);
+                g_type_class_unref(enum_class);
+                if (!enum_value) {
+                    g_set_error(error, GVIR_SANDBOX_CONFIG_ERROR, 0,
+                                _("Unknown mount transport %s in config file"), formatStr);
+                    goto error;
+                }
+                gvir_sandbox_config_mount_host_bind_set_transport(mbind, enum_value->value);
+            }
+            gvir_sandbox_config_mount_host_bind_set_dax(mbind,
+                                                        g_key_file_get_boolean(file, key, "dax", NULL));
+
+            g_free(formatStr);
+            if ((formatStr = g_key_file_get_string(file, key, "cache", NULL)) != NULL) {
+                GEnumClass *enum_class = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE);
+                GEnumValue *enum_value = g_enum_get_value_by_nick(enum_class, formatStr);
+                g_type_class_unref(enum_class);
+                if (!enum_value) {
+                    g_set_error(error, GVIR_SANDBOX_CONFIG_ERROR, 0,
+                                _("Unknown mount cache %s in config file"), formatStr);
+                    goto error;
+                }
+                gvir_sandbox_config_mount_host_bind_set_cache(mbind, enum_value->value);
+            }
+            gvir_sandbox_config_mount_host_bind_set_msize(mbind,
+                                                          g_key_file_get_uint64(file, key, "msize", NULL));
+            gvir_sandbox_config_mount_host_bind_set_readahead(mbind,
+                                                              g_key_file_get_uint64(file, key, "readahead", NULL));
         } else {
             config = GVIR_SANDBOX_CONFIG_MOUNT(g_object_new(mountType,
                                                             "target", target,
@@ -2051,6 +2877,7 @@ static GVirSandboxConfigMount *gvir_sandbox_config_load_config_mount(GKeyFile *f
     g_free(target);
     g_free(source);
     g_free(type);
+    g_free(formatStr);
     g_free(key);
     return config;
 
@@ -2342,6 +3169,36 @@ static gboolean gvir_sandbox_config_load_config(GVirSandboxConfig *config,
         g_free(priv->kmodpath);
         priv->kmodpath = str;
     }
+    if ((str = g_key_file_get_string(file, "core", "transport", NULL)) != NULL) {
+        GEnumClass *enum_class = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT);
+        GEnumValue *enum_value = g_enum_get_value_by_nick(enum_class, str);
+        g_type_class_unref(enum_class);
+        if (!enum_value) {
+            g_set_error(error, GVIR_SANDBOX_CONFIG_ERROR, 0,
+                        _("Unknown transport %s in config file"), str);
+            g_free(str);
+            goto cleanup;
+        }
+        gvir_sandbox_config_set_host_bind_transport(config, enum_value->value);
+        g_free(str);
+    }
+    if ((str = g_key_file_get_string(file, "core", "rootcache", NULL)) != NULL) {
+        GEnumClass *enum_class = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE);
+        GEnumValue *enum_value = g_enum_get_value_by_nick(enum_class, str);
+        g_type_class_unref(enum_class);
+        if (!enum_value) {
+            g_set_error(error, GVIR_SANDBOX_CONFIG_ERROR, 0,
+                        _("Unknown root cache %s in config file"), str);
+            g_free(str);
+            goto cleanup;
+        }
+        priv->rootCache = enum_value->value;
+        g_free(str);
+    }
+    if ((str = g_key_file_get_string(file, "core", "rootcacheimage", NULL)) != NULL) {
+        g_free(priv->rootCacheImage);
+        priv->rootCacheImage = str;
+    }
     b = g_key_file_get_boolean(file, "core", "shell", &e);
     if (e) {
         g_error_free(e);
@@ -2349,6 +3206,71 @@ static gboolean gvir_sandbox_config_load_config(GVirSandboxConfig *config,
     } else {
         priv->shell = b;
     }
+    u = g_key_file_get_uint64(file, "core", "dhcptimeout", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->dhcpTimeout = u;
+    }
+    b = g_key_file_get_boolean(file, "core", "networkrequired", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->networkRequired = b;
+    }
+
+    u = g_key_file_get_uint64(file, "resources", "memory", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->memory = u;
+    }
+    u = g_key_file_get_uint64(file, "resources", "vcpus", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->vcpus = u;
+    }
+    if ((str = g_key_file_get_string(file, "resources", "cpuset", NULL)) != NULL) {
+        g_free(priv->cpuset);
+        priv->cpuset = str;
+    }
+    if ((str = g_key_file_get_string(file, "resources", "nodeset", NULL)) != NULL) {
+        g_free(priv->nodeset);
+        priv->nodeset = str;
+    }
+    b = g_key_file_get_boolean(file, "resources", "hugepages", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->hugepages = b;
+    }
+    b = g_key_file_get_boolean(file, "resources", "memshared", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->memShared = b;
+    }
+    b = g_key_file_get_boolean(file, "resources", "memlocked", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->memLocked = b;
+    }
+    b = g_key_file_get_boolean(file, "resources", "nosharepages", &e);
+    if (e) {
+        g_error_free(e);
+        e = NULL;
+    } else {
+        priv->memNoSharePages = b;
+    }
 
     u = g_key_file_get_uint64(file, "identity", "uid", &e);
     if (e) {
@@ -2509,6 +3431,23 @@ static void gvir_sandbox_config_save_config_mount(GVirSandboxConfigMount *config
             GEnumValue *value = g_enum_get_value(klass, format);
             g_type_class_unref(klass);
             g_key_file_set_string(file, key, "format", value->value_nick);
+        } else if (GVIR_SANDBOX_IS_CONFIG_MOUNT_HOST_BIND(config)) {
+            GVirSandboxConfigMountHostBind *mbind = GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND(config);
+            GVirSandboxConfigMountHostBindTransport transport = gvir_sandbox_config_mount_host_bind_get_transport(mbind);
+            GEnumClass *klass = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT);
+            GEnumValue *value = g_enum_get_value(klass, transport);
+            g_type_class_unref(klass);
+            g_key_file_set_string(file, key, "transport", value->value_nick);
+            g_key_file_set_boolean(file, key, "dax",
+                                   gvir_sandbox_config_mount_host_bind_get_dax(mbind));
+            klass = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE);
+            value = g_enum_get_value(klass, gvir_sandbox_config_mount_host_bind_get_cache(mbind));
+            g_type_class_unref(klass);
+            g_key_file_set_string(file, key, "cache", value->value_nick);
+            g_key_file_set_uint64(file, key, "msize",
+                                  gvir_sandbox_config_mount_host_bind_get_msize(mbind));
+            g_key_file_set_uint64(file, key, "readahead",
+                                  gvir_sandbox_config_mount_host_bind_get_readahead(mbind));
         }
         g_key_file_set_string(file, key, "source",
                               gvir_sandbox_config_mount_file_get_source(
@@ -2641,7 +3580,33 @@ static void gvir_sandbox_config_save_config(GVirSandboxConfig *config,
         g_key_file_set_string(file, "core", "kernpath", priv->kernpath);
     if (priv->kmodpath)
         g_key_file_set_string(file, "core", "kmodpath", priv->kmodpath);
+    {
+        GEnumClass *klass = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_TRANSPORT);
+        GEnumValue *value = g_enum_get_value(klass, priv->hostBindTransport);
+        g_type_class_unref(klass);
+        g_key_file_set_string(file, "core", "transport", value->value_nick);
+
+        klass = g_type_class_ref(GVIR_SANDBOX_TYPE_CONFIG_MOUNT_HOST_BIND_CACHE);
+        value = g_enum_get_value(klass, priv->rootCache);
+        g_type_class_unref(klass);
+        g_key_file_set_string(file, "core", "rootcache", value->value_nick);
+    }
+    if (priv->rootCacheImage)
+        g_key_file_set_string(file, "core", "rootcacheimage", priv->rootCacheImage);
     g_key_file_set_boolean(file, "core", "shell", priv->shell);
+    g_key_file_set_uint64(file, "core", "dhcptimeout", priv->dhcpTimeout);
+    g_key_file_set_boolean(file, "core", "networkrequired", priv->networkRequired);
+
+    g_key_file_set_uint64(file, "resources", "memory", priv->memory);
+    g_key_file_set_uint64(file, "resources", "vcpus", priv->vcpus);
+    if (priv->cpuset)
+        g_key_file_set_string(file, "resources", "cpuset", priv->cpuset);
+    if (priv->nodeset)
+        g_key_file_set_string(file, "resources", "nodeset", priv->nodeset);
+    g_key_file_set_boolean(file, "resources", "hugepages", priv->hugepages);
+    g_key_file_set_boolean(file, "resources", "memshared", priv->memShared);
+    g_key_file_set_boolean(file, "resources", "memlocked", priv->memLocked);
+    g_key_file_set_boolean(file, "resources", "nosharepages", priv->memNoSharePages);
 
     g_key_file_set_uint64(file, "identity", "uid", priv->uid);
     g_key_file_set_uint64(file, "identity", "gid", priv->gid);
@@ -96,9 +96,45 @@ const gchar *gvir_sandbox_config_get_kernpath(GVirSandboxConfig *config);
 void gvir_sandbox_config_set_kmodpath(GVirSandboxConfig *config, const gchar *kmodpath);
 const gchar *gvir_sandbox_config_get_kmodpath(GVirSandboxConfig *config);
 
+void gvir_sandbox_config_set_host_bind_transport(GVirSandboxConfig *config,
+                                                 GVirSandboxConfigMountHostBindTransport transport);
+GVirSandboxConfigMountHostBindTransport gvir_sandbox_config_get_host_bind_transport(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_root_cache(GVirSandboxConfig *config,
+                                        GVirSandboxConfigMountHostBindCache cache);
+GVirSandboxConfigMountHostBindCache gvir_sandbox_config_get_root_cache(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_root_cache_image(GVirSandboxConfig *config,
+                                              const gchar *image);
+const gchar *gvir_sandbox_config_get_root_cache_image(GVirSandboxConfig *config);
+
 void gvir_sandbox_config_set_shell(GVirSandboxConfig *config, gboolean shell);
 gboolean gvir_sandbox_config_get_shell(GVirSandboxConfig *config);
 
+void gvir_sandbox_config_set_memory(GVirSandboxConfig *config, guint memory);
+guint gvir_sandbox_config_get_memory(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_vcpus(GVirSandboxConfig *config, guint vcpus);
+guint gvir_sandbox_config_get_vcpus(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_cpuset(GVirSandboxConfig *config, const gchar *cpuset);
+const gchar *gvir_sandbox_config_get_cpuset(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_nodeset(GVirSandboxConfig *config, const gchar *nodeset);
+const gchar *gvir_sandbox_config_get_nodeset(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_hugepages(GVirSandboxConfig *config, gboolean hugepages);
+gboolean gvir_sandbox_config_get_hugepages(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_memory_shared(GVirSandboxConfig *config, gboolean shared);
+gboolean gvir_sandbox_config_get_memory_shared(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_memory_locked(GVirSandboxConfig *config, gboolean locked);
+gboolean gvir_sandbox_config_get_memory_locked(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_memory_nosharepages(GVirSandboxConfig *config, gboolean nosharepages);
+gboolean gvir_sandbox_config_get_memory_nosharepages(GVirSandboxConfig *config);
+
 void gvir_sandbox_config_set_userid(GVirSandboxConfig *config, guint uid);
 guint gvir_sandbox_config_get_userid(GVirSandboxConfig *config);
 
@@ -122,6 +158,14 @@ gboolean gvir_sandbox_config_add_network_strv(GVirSandboxConfig *config,
                                               GError **error);
 gboolean gvir_sandbox_config_has_networks(GVirSandboxConfig *config);
 
+void gvir_sandbox_config_set_dhcp_timeout(GVirSandboxConfig *config,
+                                          guint timeout);
+guint gvir_sandbox_config_get_dhcp_timeout(GVirSandboxConfig *config);
+
+void gvir_sandbox_config_set_network_required(GVirSandboxConfig *config,
+                                              gboolean required);
+gboolean gvir_sandbox_config_get_network_required(GVirSandboxConfig *config);
+
 void gvir_sandbox_config_add_env(GVirSandboxConfig *config,
                                   GVirSandboxConfigEnv *env);
 GList *gvir_sandbox_config_get_envs(GVirSandboxConfig *config);
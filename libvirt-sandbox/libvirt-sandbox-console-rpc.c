@@ -67,17 +67,17 @@ typedef enum {
     /*
      * Remote stream connected, need tx/rx.
      *
-     *  - Sending GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT bytes every 50ms
+     *  - Sending GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT_V2 bytes every 50ms
      *
-     * If receive GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT byte, switch
-     * to next state
+     * If receive GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC{,_V2} byte, record
+     * the protocol version the guest chose & switch to next state
      */
     GVIR_SANDBOX_CONSOLE_RPC_STATE_WAITING = 1,
 
     /*
      * Remote stream connected, need tx
      *
-     *  - Send single GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC byte
+     *  - Send single GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC{,_V2} byte
      *
      * When byte is sent, switch to next state
      */
@@ -110,7 +110,19 @@ typedef enum {
 } GVirSandboxConsoleRpcState;
 
 
-#define GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA 1024
+/* With protocol v1, stop reading packets from the guest once
+ * this much output is queued for either of stdout / stderr */
+#define GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA (4 * GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX)
+
+/* With protocol v2, written output is credited back to the
+ * guest in batches of this size, rather than per packet */
+#define GVIR_SANDBOX_CONSOLE_CREDIT_BATCH (GVIR_SANDBOX_PROTOCOL_WINDOW_INITIAL / 4)
+
+/* Seconds between keepalives, sent while a v2 stream has no other tx */
+#define GVIR_SANDBOX_CONSOLE_KEEPALIVE_INTERVAL 5
+
+/* Initial size of stdin reads, grown while reads fill it */
+#define GVIR_SANDBOX_CONSOLE_MIN_IO 4096
 
 struct _GVirSandboxConsoleRpcPrivate
 {
@@ -124,18 +136,34 @@ struct _GVirSandboxConsoleRpcPrivate
     struct termios termiosProps;
 
     /* Encoded RPC messages, being sent/received */
+    GVirSandboxRPCPacketPool *pool;
     GVirSandboxRPCPacket *rx;
     GVirSandboxRPCPacket *tx;
+    GQueue txQueue; /* Waiting to be sent after tx */
+
+    /* Protocol version chosen by the guest during handshake */
+    guint version;
+
+    /* Flow control, only used with protocol v2. The amount of
+     * stdin the guest will accept, and the amount of output
+     * written locally, but not yet credited back to the guest */
+    gsize stdinCredit;
+    gsize stdoutGranted;
+    gsize stderrGranted;
+    guint keepaliveTimer;
 
-    /* Decoded RPC message forwarded to stdout */
-    gchar *localToStdout;
-    gsize localToStdoutLength; /* No more than GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA*/
-    gsize localToStdoutOffset;
+    /* Decoded RPC packets, whose payload is forwarded to stdout.
+     * The bufferOffset of each packet marks how much is written */
+    GQueue localToStdout;
+    gsize localToStdoutLength; /* Bytes queued, no more than GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA */
 
-    /* Decoded RPC message forwarded to stdout */
-    gchar *localToStderr;
-    gsize localToStderrLength; /* No more than GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA*/
-    gsize localToStderrOffset;
+    /* Decoded RPC packets, whose payload is forwarded to stderr */
+    GQueue localToStderr;
+    gsize localToStderrLength; /* Bytes queued, no more than GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA */
+
+    /* Buffer for stdin reads, sized to recent reads */
+    gchar *localFromStdin;
+    gsize localFromStdinSize;
 
     GVirSandboxConsoleRpcState state;
 
@@ -146,6 +174,7 @@ struct _GVirSandboxConsoleRpcPrivate
     GSource *localStdoutSource;
     GSource *localStderrSource;
     gint consoleWatch;
+    GVirStreamIOCondition consoleWatchCond;
 
     /* True if on a TTY & escape sequence is allowed */
     gboolean allowEscape;
@@ -171,12 +200,13 @@ gvir_sandbox_console_rpc_error_quark(void)
 }
 
 static GVirSandboxRPCPacket *
-gvir_sandbox_console_rpc_build_handshake_wait(void)
+gvir_sandbox_console_rpc_build_handshake_wait(GVirSandboxConsoleRpc *console)
 {
-    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_new(FALSE);
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(priv->pool, FALSE, 0);
 
     g_debug("Build wait");
-    pkt->buffer[0] = GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT;
+    pkt->buffer[0] = GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT_V2;
     pkt->bufferLength = 1;
     pkt->bufferOffset = 0;
 
@@ -185,12 +215,15 @@ gvir_sandbox_console_rpc_build_handshake_wait(void)
 
 
 static GVirSandboxRPCPacket *
-gvir_sandbox_console_rpc_build_handshake_sync(void)
+gvir_sandbox_console_rpc_build_handshake_sync(GVirSandboxConsoleRpc *console)
 {
-    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_new(FALSE);
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(priv->pool, FALSE, 0);
 
-    g_debug("Build sync");
-    pkt->buffer[0] = GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC;
+    g_debug("Build sync v%u", priv->version);
+    pkt->buffer[0] = priv->version >= 2 ?
+        GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC_V2 :
+        GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC;
     pkt->bufferLength = 1;
     pkt->bufferOffset = 0;
 
@@ -203,7 +236,7 @@ gvir_sandbox_console_rpc_build_quit(GVirSandboxConsoleRpc *console,
                                     GError **error)
 {
     GVirSandboxConsoleRpcPrivate *priv = console->priv;
-    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_new(FALSE);
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(priv->pool, FALSE, 0);
 
     g_debug("Build quit");
     pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_QUIT;
@@ -225,6 +258,102 @@ gvir_sandbox_console_rpc_build_quit(GVirSandboxConsoleRpc *console,
 
 
 
+static GVirSandboxRPCPacket *
+gvir_sandbox_console_rpc_build_nop(GVirSandboxConsoleRpc *console,
+                                   GError **error)
+{
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(priv->pool, FALSE, 0);
+
+    g_debug("Build nop");
+    pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_NOP;
+    pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
+    pkt->header.type = GVIR_SANDBOX_PROTOCOL_TYPE_MESSAGE;
+    pkt->header.serial = priv->serial++;
+
+    if (!gvir_sandbox_rpcpacket_encode_header(pkt, error))
+        goto error;
+    if (!gvir_sandbox_rpcpacket_encode_payload_empty(pkt, error))
+        goto error;
+
+    return pkt;
+
+ error:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return NULL;
+}
+
+
+static GVirSandboxRPCPacket *
+gvir_sandbox_console_rpc_build_features(GVirSandboxConsoleRpc *console,
+                                        guint compress,
+                                        GError **error)
+{
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(priv->pool, FALSE, 0);
+    GVirSandboxProtocolMessageFeatures msg;
+
+    g_debug("Build features compress=%u", compress);
+    memset(&msg, 0, sizeof(msg));
+    msg.compress = compress;
+
+    pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_FEATURES;
+    pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
+    pkt->header.type = GVIR_SANDBOX_PROTOCOL_TYPE_MESSAGE;
+    pkt->header.serial = priv->serial++;
+
+    if (!gvir_sandbox_rpcpacket_encode_header(pkt, error))
+        goto error;
+    if (!gvir_sandbox_rpcpacket_encode_payload_msg(pkt,
+                                                   (xdrproc_t)xdr_GVirSandboxProtocolMessageFeatures,
+                                                   (void*)&msg,
+                                                   error))
+        goto error;
+
+    return pkt;
+
+ error:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return NULL;
+}
+
+
+static GVirSandboxRPCPacket *
+gvir_sandbox_console_rpc_build_credit(GVirSandboxConsoleRpc *console,
+                                      GVirSandboxProtocolStream stream,
+                                      gsize bytes,
+                                      GError **error)
+{
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(priv->pool, FALSE, 0);
+    GVirSandboxProtocolMessageCredit msg;
+
+    g_debug("Build credit %d %zu", stream, bytes);
+    memset(&msg, 0, sizeof(msg));
+    msg.stream = stream;
+    msg.bytes = bytes;
+
+    pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_CREDIT;
+    pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
+    pkt->header.type = GVIR_SANDBOX_PROTOCOL_TYPE_MESSAGE;
+    pkt->header.serial = priv->serial++;
+
+    if (!gvir_sandbox_rpcpacket_encode_header(pkt, error))
+        goto error;
+    if (!gvir_sandbox_rpcpacket_encode_payload_msg(pkt,
+                                                   (xdrproc_t)xdr_GVirSandboxProtocolMessageCredit,
+                                                   (void*)&msg,
+                                                   error))
+        goto error;
+
+    return pkt;
+
+ error:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return NULL;
+}
+
+
 static GVirSandboxRPCPacket *
 gvir_sandbox_console_rpc_build_stdin(GVirSandboxConsoleRpc *console,
                                      gchar *data,
@@ -232,7 +361,8 @@ gvir_sandbox_console_rpc_build_stdin(GVirSandboxConsoleRpc *console,
                                      GError **error)
 {
     GVirSandboxConsoleRpcPrivate *priv = console->priv;
-    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_new(FALSE);
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get
+        (priv->pool, FALSE, GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX + len);
 
     g_debug("Build stdin %p %zu", data, len);
     pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_STDIN;
@@ -265,9 +395,15 @@ static void gvir_sandbox_console_rpc_finalize(GObject *object)
 
     gvir_sandbox_rpcpacket_free(priv->tx);
     gvir_sandbox_rpcpacket_free(priv->rx);
+    g_queue_foreach(&priv->txQueue, (GFunc)gvir_sandbox_rpcpacket_free, NULL);
+    g_queue_clear(&priv->txQueue);
+    gvir_sandbox_rpcpacket_pool_unref(priv->pool);
 
-    g_free(priv->localToStdout);
-    g_free(priv->localToStderr);
+    g_queue_foreach(&priv->localToStdout, (GFunc)gvir_sandbox_rpcpacket_free, NULL);
+    g_queue_clear(&priv->localToStdout);
+    g_queue_foreach(&priv->localToStderr, (GFunc)gvir_sandbox_rpcpacket_free, NULL);
+    g_queue_clear(&priv->localToStderr);
+    g_free(priv->localFromStdin);
 
     G_OBJECT_CLASS(gvir_sandbox_console_rpc_parent_class)->finalize(object);
 }
@@ -299,6 +435,7 @@ static void gvir_sandbox_console_rpc_class_init(GVirSandboxConsoleRpcClass *klas
 static void gvir_sandbox_console_rpc_init(GVirSandboxConsoleRpc *console)
 {
     console->priv = GVIR_SANDBOX_CONSOLE_RPC_GET_PRIVATE(console);
+    console->priv->pool = gvir_sandbox_rpcpacket_pool_new();
 }
 
 
@@ -412,6 +549,57 @@ static gboolean do_console_rpc_stdout_write(GObject *stream,
                                             gpointer opaque);
 static gboolean do_console_rpc_stderr_write(GObject *stream,
                                             gpointer opaque);
+static void do_console_rpc_update_events(GVirSandboxConsoleRpc *console);
+static void do_console_rpc_close(GVirSandboxConsoleRpc *console,
+                                 GError *err);
+
+/*
+ * Send @pkt once any packets ahead of it are sent
+ */
+static void do_console_rpc_queue_tx(GVirSandboxConsoleRpc *console,
+                                    GVirSandboxRPCPacket *pkt)
+{
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+
+    if (!priv->tx)
+        priv->tx = pkt;
+    else
+        g_queue_push_tail(&priv->txQueue, pkt);
+}
+
+
+static void do_console_rpc_clear_tx_queue(GVirSandboxConsoleRpc *console)
+{
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+
+    g_queue_foreach(&priv->txQueue, (GFunc)gvir_sandbox_rpcpacket_free, NULL);
+    g_queue_clear(&priv->txQueue);
+}
+
+
+static gboolean do_console_rpc_keepalive(gpointer opaque)
+{
+    GVirSandboxConsoleRpc *console = GVIR_SANDBOX_CONSOLE_RPC(opaque);
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
+    GError *err = NULL;
+
+    /* Only needed if nothing else is being sent */
+    if (priv->state != GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING ||
+        priv->tx)
+        return TRUE;
+
+    if (!(priv->tx = gvir_sandbox_console_rpc_build_nop(console, &err))) {
+        g_debug("Failed to build nop packet");
+        priv->keepaliveTimer = 0;
+        do_console_rpc_close(console, err);
+        g_error_free(err);
+        return FALSE;
+    }
+
+    do_console_rpc_update_events(console);
+    return TRUE;
+}
+
 
 static gboolean do_console_rpc_set_state(GVirSandboxConsoleRpc *console,
                                          GVirSandboxConsoleRpcState state,
@@ -428,31 +616,53 @@ static gboolean do_console_rpc_set_state(GVirSandboxConsoleRpc *console,
 
     switch (priv->state) {
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_WAITING:
-        priv->tx = gvir_sandbox_console_rpc_build_handshake_wait();
-        priv->rx = gvir_sandbox_rpcpacket_new(FALSE);
+        priv->tx = gvir_sandbox_console_rpc_build_handshake_wait(console);
+        priv->rx = gvir_sandbox_rpcpacket_pool_get(priv->pool, FALSE, 0);
         priv->rx->bufferLength = 1; /* We need to recv a hanshake byte */
         break;
 
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_SYNCING:
         if (priv->tx)
             gvir_sandbox_rpcpacket_free(priv->tx);
-        priv->tx = gvir_sandbox_console_rpc_build_handshake_sync();
+        priv->tx = gvir_sandbox_console_rpc_build_handshake_sync(console);
         break;
 
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING:
-        priv->rx = gvir_sandbox_rpcpacket_new(TRUE);
+        priv->rx = gvir_sandbox_rpcpacket_pool_get(priv->pool, TRUE, 0);
+        if (priv->version >= 2) {
+            guint compress = gvir_sandbox_rpcpacket_compress_formats();
+            /* Let the guest know what output it may compress */
+            if (compress) {
+                GVirSandboxRPCPacket *pkt;
+                if (!(pkt = gvir_sandbox_console_rpc_build_features(console, compress, err)))
+                    return FALSE;
+                do_console_rpc_queue_tx(console, pkt);
+            }
+            priv->stdinCredit = GVIR_SANDBOX_PROTOCOL_WINDOW_INITIAL;
+            priv->keepaliveTimer = g_timeout_add_seconds(GVIR_SANDBOX_CONSOLE_KEEPALIVE_INTERVAL,
+                                                         do_console_rpc_keepalive,
+                                                         console);
+        } else {
+            priv->stdinCredit = G_MAXSIZE;
+        }
         break;
 
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_STOPPING:
         /* Container has exited, so no point trying to send any
-         * stdin data that might be queued */
+         * stdin data or credit that might be queued */
         if (priv->tx) {
             gvir_sandbox_rpcpacket_free(priv->tx);
             priv->tx = NULL;
         }
+        do_console_rpc_clear_tx_queue(console);
         break;
 
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_FINISHED:
+        if (priv->tx) {
+            gvir_sandbox_rpcpacket_free(priv->tx);
+            priv->tx = NULL;
+        }
+        do_console_rpc_clear_tx_queue(console);
         if (!(priv->tx = gvir_sandbox_console_rpc_build_quit(console, err)))
             return FALSE;
         break;
@@ -486,7 +696,7 @@ static void do_console_rpc_update_events(GVirSandboxConsoleRpc *console)
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING:
         /* If nothing is waiting to be sent to guest, we can read
          * some more of stdin */
-        if (!priv->tx && !priv->localEOF)
+        if (!priv->tx && !priv->localEOF && priv->stdinCredit)
             needLocalStdin = TRUE;
 
         /* Fall through */
@@ -591,16 +801,23 @@ static void do_console_rpc_update_events(GVirSandboxConsoleRpc *console)
         }
     }
 
+    /* Leave the stream watch armed if it is already
+     * waiting for the right conditions */
+    if (priv->consoleWatch && priv->consoleWatchCond == cond)
+        return;
+
     if (priv->consoleWatch) {
         g_source_remove(priv->consoleWatch);
         priv->consoleWatch = 0;
     }
 
-    if (cond)
+    if (cond) {
         priv->consoleWatch = gvir_stream_add_watch(priv->console,
                                                    cond,
                                                    do_console_rpc_stream_readwrite,
                                                    console);
+        priv->consoleWatchCond = cond;
+    }
 }
 
 
@@ -612,58 +829,111 @@ static void do_console_rpc_close(GVirSandboxConsoleRpc *console,
     g_signal_emit_by_name(console, "closed", err != NULL);
 }
 
+/*
+ * Queue the payload of @pkt for writing to a local stream. The
+ * packet itself is kept on the queue, so the payload is never
+ * copied. Takes ownership of @pkt.
+ */
+static void do_console_rpc_queue_output(GQueue *queue,
+                                        gsize *queueLength,
+                                        GVirSandboxRPCPacket *pkt)
+{
+    gsize want = pkt->bufferLength - pkt->bufferOffset;
+
+    if (!want) {
+        gvir_sandbox_rpcpacket_free(pkt);
+        return;
+    }
+
+    g_queue_push_tail(queue, pkt);
+    *queueLength += want;
+}
+
+
+/*
+ * Write as much queued output to @stream as it will take
+ * without blocking, releasing packets once fully written.
+ */
+static gboolean do_console_rpc_drain_output(GOutputStream *stream,
+                                            GQueue *queue,
+                                            gsize *queueLength,
+                                            GError **error)
+{
+    GVirSandboxRPCPacket *pkt;
+
+    while ((pkt = g_queue_peek_head(queue))) {
+        GError *err = NULL;
+        gssize ret = g_pollable_output_stream_write_nonblocking
+            (G_POLLABLE_OUTPUT_STREAM(stream),
+             pkt->buffer + pkt->bufferOffset,
+             pkt->bufferLength - pkt->bufferOffset,
+             NULL, &err);
+        if (ret < 0) {
+            if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_error_free(err);
+                break;
+            }
+            g_propagate_error(error, err);
+            return FALSE;
+        }
+
+        pkt->bufferOffset += ret;
+        *queueLength -= ret;
+        if (pkt->bufferOffset == pkt->bufferLength) {
+            g_queue_pop_head(queue);
+            gvir_sandbox_rpcpacket_free(pkt);
+        }
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Takes ownership of @pkt
+ */
 static gboolean do_console_rpc_dispatch_proc(GVirSandboxConsoleRpc *console,
                                              GVirSandboxRPCPacket *pkt,
                                              GError **error)
 {
     GVirSandboxConsoleRpcPrivate *priv = console->priv;
     struct GVirSandboxProtocolMessageExit msgexit;
-    gsize want;
+    struct GVirSandboxProtocolMessageCredit msgcredit;
+    gboolean ret = FALSE;
 
     if (!gvir_sandbox_rpcpacket_decode_header(pkt, error))
-        return FALSE;
+        goto cleanup;
 
     if (pkt->header.status != GVIR_SANDBOX_PROTOCOL_STATUS_OK) {
         g_set_error(error, GVIR_SANDBOX_CONSOLE_RPC_ERROR, 0,
                     _("Unexpected rpc status %u"),
                     pkt->header.status);
-        return FALSE;
+        goto cleanup;
     }
     //g_debug("Procedure %d", pkt->header.proc);
+    if ((pkt->header.proc == GVIR_SANDBOX_PROTOCOL_PROC_STDOUT ||
+         pkt->header.proc == GVIR_SANDBOX_PROTOCOL_PROC_STDERR) &&
+        pkt->header.type != GVIR_SANDBOX_PROTOCOL_TYPE_DATA) {
+        GVirSandboxRPCPacket *raw;
+        if (!(raw = gvir_sandbox_rpcpacket_decompress_payload(priv->pool, pkt, error)))
+            goto cleanup;
+        gvir_sandbox_rpcpacket_free(pkt);
+        pkt = raw;
+    }
+
     switch (pkt->header.proc) {
     case GVIR_SANDBOX_PROTOCOL_PROC_STDOUT:
-        want = pkt->bufferLength - pkt->bufferOffset;
-        if (!priv->localToStdout) {
-            priv->localToStdoutOffset = 0;
-            priv->localToStdoutLength = 0;
-            priv->localToStdout = g_new0(gchar, want);
-        } else {
-            priv->localToStdout = g_renew(gchar,
-                                          priv->localToStdout,
-                                          priv->localToStdoutLength + want);
-        }
-        memcpy(priv->localToStdout + priv->localToStdoutLength,
-               pkt->buffer + pkt->bufferOffset,
-               want);
-        priv->localToStdoutLength += want;
+        do_console_rpc_queue_output(&priv->localToStdout,
+                                    &priv->localToStdoutLength,
+                                    pkt);
+        pkt = NULL;
         break;
 
     case GVIR_SANDBOX_PROTOCOL_PROC_STDERR:
-        want = pkt->bufferLength - pkt->bufferOffset;
-        if (!priv->localToStderr) {
-            priv->localToStderrOffset = 0;
-            priv->localToStderrLength = 0;
-            priv->localToStderr = g_new0(gchar, want);
-        } else {
-            priv->localToStderr = g_renew(gchar,
-                                          priv->localToStderr,
-                                          priv->localToStderrLength + want);
-        }
-
-        memcpy(priv->localToStderr + priv->localToStderrLength,
-               pkt->buffer + pkt->bufferOffset,
-               want);
-        priv->localToStderrLength += want;
+        do_console_rpc_queue_output(&priv->localToStderr,
+                                    &priv->localToStderrLength,
+                                    pkt);
+        pkt = NULL;
         break;
 
     case GVIR_SANDBOX_PROTOCOL_PROC_EXIT:
@@ -672,7 +942,7 @@ static gboolean do_console_rpc_dispatch_proc(GVirSandboxConsoleRpc *console,
                                                         (xdrproc_t)xdr_GVirSandboxProtocolMessageExit,
                                                         (void*)&msgexit,
                                                         error)))
-            return FALSE;
+            goto cleanup;
 
         g_signal_emit_by_name(console, "exited", msgexit.status);
 
@@ -681,27 +951,60 @@ static gboolean do_console_rpc_dispatch_proc(GVirSandboxConsoleRpc *console,
             if (!do_console_rpc_set_state(console,
                                           GVIR_SANDBOX_CONSOLE_RPC_STATE_FINISHED,
                                           error))
-                return FALSE;
+                goto cleanup;
         } else {
             if (!do_console_rpc_set_state(console,
                                           GVIR_SANDBOX_CONSOLE_RPC_STATE_STOPPING,
                                           error))
-                return FALSE;
+                goto cleanup;
         }
         break;
 
+    case GVIR_SANDBOX_PROTOCOL_PROC_CREDIT:
+        if (priv->version < 2)
+            goto unexpected;
+        memset(&msgcredit, 0, sizeof(msgcredit));
+        if (!(gvir_sandbox_rpcpacket_decode_payload_msg(pkt,
+                                                        (xdrproc_t)xdr_GVirSandboxProtocolMessageCredit,
+                                                        (void*)&msgcredit,
+                                                        error)))
+            goto cleanup;
+
+        if (msgcredit.stream != GVIR_SANDBOX_PROTOCOL_STREAM_STDIN) {
+            g_set_error(error, GVIR_SANDBOX_CONSOLE_RPC_ERROR, 0,
+                        _("Unexpected credit for stream %d"),
+                        msgcredit.stream);
+            goto cleanup;
+        }
+        priv->stdinCredit += msgcredit.bytes;
+        break;
+
+    case GVIR_SANDBOX_PROTOCOL_PROC_NOP:
+        if (priv->version < 2)
+            goto unexpected;
+        break;
+
     case GVIR_SANDBOX_PROTOCOL_PROC_QUIT:
     case GVIR_SANDBOX_PROTOCOL_PROC_STDIN:
     default:
+    unexpected:
         g_set_error(error, GVIR_SANDBOX_CONSOLE_RPC_ERROR, 0,
                     _("Unexpected rpc proc %u"),
                     pkt->header.proc);
-        return FALSE;
+        goto cleanup;
     }
-    return TRUE;
+
+    ret = TRUE;
+
+ cleanup:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return ret;
 }
 
 
+/*
+ * Takes ownership of @pkt
+ */
 static gboolean
 do_console_rpc_process_packet_rx(GVirSandboxConsoleRpc *console,
                                  GVirSandboxRPCPacket *pkt,
@@ -714,33 +1017,41 @@ do_console_rpc_process_packet_rx(GVirSandboxConsoleRpc *console,
 
     switch (priv->state) {
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_WAITING:
-        if (pkt->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC) {
+        if (pkt->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC ||
+            pkt->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC_V2) {
+            priv->version = pkt->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC_V2 ? 2 : 1;
+            gvir_sandbox_rpcpacket_free(pkt);
             if (!do_console_rpc_set_state(console,
                                           GVIR_SANDBOX_CONSOLE_RPC_STATE_SYNCING,
                                           err))
                 return FALSE;
         } else {
             /* Try recv another byte */
-            priv->rx = gvir_sandbox_rpcpacket_new(FALSE);
+            priv->rx = pkt;
             priv->rx->bufferLength = 1; /* We need to recv a hanshake byte */
+            priv->rx->bufferOffset = 0;
         }
         break;
 
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING:
         if (pkt->bufferLength == GVIR_SANDBOX_PROTOCOL_LEN_MAX) {
-            if (!gvir_sandbox_rpcpacket_decode_length(pkt, err))
+            if (!gvir_sandbox_rpcpacket_decode_length(pkt, err)) {
+                gvir_sandbox_rpcpacket_free(pkt);
                 return FALSE;
-            /* Setup new packet to receive the payload */
-            priv->rx = gvir_sandbox_rpcpacket_new(TRUE);
-            memcpy(priv->rx, pkt, sizeof(*pkt));
+            }
+            /* Carry on receiving the payload into the same packet */
+            priv->rx = pkt;
         } else {
             if (!do_console_rpc_dispatch_proc(console, pkt, err))
                 return FALSE;
 
+            /* A v2 guest keeps within the credit we grant, so there
+             * is no need to stop reading while output is queued */
             if (priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING &&
-                priv->localToStdoutLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA &&
-                priv->localToStderrLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA)
-                priv->rx = gvir_sandbox_rpcpacket_new(TRUE);
+                (priv->version >= 2 ||
+                 (priv->localToStdoutLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA &&
+                  priv->localToStderrLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA)))
+                priv->rx = gvir_sandbox_rpcpacket_pool_get(priv->pool, TRUE, 0);
         }
         break;
 
@@ -749,6 +1060,7 @@ do_console_rpc_process_packet_rx(GVirSandboxConsoleRpc *console,
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_INACTIVE:
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_SYNCING:
     default:
+        gvir_sandbox_rpcpacket_free(pkt);
         g_set_error(err, GVIR_SANDBOX_CONSOLE_RPC_ERROR, 0,
                     _("Got rx in unexpected state %d"), priv->state);
         return FALSE;
@@ -769,7 +1081,7 @@ static gboolean do_console_handshake_wait_tx_queue(gpointer opaque)
     if (priv->tx != NULL)
         return FALSE;
 
-    priv->tx = gvir_sandbox_console_rpc_build_handshake_wait();
+    priv->tx = gvir_sandbox_console_rpc_build_handshake_wait(console);
     do_console_rpc_update_events(console);
 
     return FALSE;
@@ -791,9 +1103,9 @@ do_console_rpc_process_packet_tx(GVirSandboxConsoleRpc *console,
                       console);
         break;
     case GVIR_SANDBOX_CONSOLE_RPC_STATE_SYNCING:
-        if (pkt->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT) {
+        if (pkt->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT_V2) {
             g_debug("Schedule tx of sync packet");
-            priv->tx = gvir_sandbox_console_rpc_build_handshake_sync();
+            priv->tx = gvir_sandbox_console_rpc_build_handshake_sync(console);
         } else {
             if (!do_console_rpc_set_state(console,
                                           GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING,
@@ -828,6 +1140,7 @@ static gboolean do_console_rpc_stream_readwrite(GVirStream *stream,
 {
     GVirSandboxConsoleRpc *console = GVIR_SANDBOX_CONSOLE_RPC(opaque);
     GVirSandboxConsoleRpcPrivate *priv = console->priv;
+    gint watch = priv->consoleWatch;
     g_debug("Stream read write cond=%d state=%d rx=%p tx=%p",
             cond, priv->state, priv->rx, priv->tx);
     if (cond & GVIR_STREAM_IO_CONDITION_READABLE) {
@@ -865,53 +1178,61 @@ static gboolean do_console_rpc_stream_readwrite(GVirStream *stream,
                 if (!do_console_rpc_process_packet_rx(console,
                                                       pkt,
                                                       &err)) {
-                    gvir_sandbox_rpcpacket_free(pkt);
                     g_debug("Error process rx packet");
                     do_console_rpc_close(console, err);
                     g_error_free(err);
                     goto cleanup;
                 }
-                gvir_sandbox_rpcpacket_free(pkt);
             }
         }
     }
 
-    if ((cond & GVIR_STREAM_IO_CONDITION_WRITABLE) &&
-        priv->tx) {
-        GError *err = NULL;
-        gssize ret = gvir_stream_send(stream,
-                                      priv->tx->buffer + priv->tx->bufferOffset,
-                                      priv->tx->bufferLength - priv->tx->bufferOffset,
-                                      NULL,
-                                      &err);
-        if (ret < 0) {
-            g_debug("Error writing to stream");
-            do_console_rpc_close(console, err);
-            g_error_free(err);
-            goto cleanup;
-        }
-
-        priv->tx->bufferOffset += ret;
-        if (priv->tx->bufferOffset == priv->tx->bufferLength) {
-            GVirSandboxRPCPacket *pkt = priv->tx;
-            priv->tx = NULL;
-            if (!do_console_rpc_process_packet_tx(console,
-                                                  pkt,
-                                                  &err)) {
-                gvir_sandbox_rpcpacket_free(pkt);
-                g_debug("Error process tx packet");
+    if (cond & GVIR_STREAM_IO_CONDITION_WRITABLE) {
+        while (priv->tx) {
+            GError *err = NULL;
+            gssize ret = gvir_stream_send(stream,
+                                          priv->tx->buffer + priv->tx->bufferOffset,
+                                          priv->tx->bufferLength - priv->tx->bufferOffset,
+                                          NULL,
+                                          &err);
+            if (ret < 0) {
+                if (err && err->code == G_IO_ERROR_WOULD_BLOCK) {
+                    g_debug("Would block");
+                    g_error_free(err);
+                    break;
+                }
+                g_debug("Error writing to stream");
                 do_console_rpc_close(console, err);
                 g_error_free(err);
                 goto cleanup;
             }
-            gvir_sandbox_rpcpacket_free(pkt);
+
+            priv->tx->bufferOffset += ret;
+            if (priv->tx->bufferOffset == priv->tx->bufferLength) {
+                GVirSandboxRPCPacket *pkt = priv->tx;
+                priv->tx = NULL;
+                if (!do_console_rpc_process_packet_tx(console,
+                                                      pkt,
+                                                      &err)) {
+                    gvir_sandbox_rpcpacket_free(pkt);
+                    g_debug("Error process tx packet");
+                    do_console_rpc_close(console, err);
+                    g_error_free(err);
+                    goto cleanup;
+                }
+                gvir_sandbox_rpcpacket_free(pkt);
+                if (!priv->tx)
+                    priv->tx = g_queue_pop_head(&priv->txQueue);
+            }
         }
     }
 
  done:
-    priv->consoleWatch = 0;
     do_console_rpc_update_events(console);
 
+    /* Stay registered unless the wanted conditions changed */
+    return priv->consoleWatch == watch;
+
  cleanup:
     return FALSE;
 }
@@ -922,8 +1243,6 @@ static gboolean do_console_rpc_stream_readwrite(GVirStream *stream,
  */
 #define CONTROL(c) ((c) ^ 0x40)
 
-#define MAX_IO 4096
-
 static gboolean do_console_rpc_stdin_read(GObject *stream,
                                           gpointer opaque)
 {
@@ -931,11 +1250,18 @@ static gboolean do_console_rpc_stdin_read(GObject *stream,
     GVirSandboxConsoleRpc *console = GVIR_SANDBOX_CONSOLE_RPC(opaque);
     GVirSandboxConsoleRpcPrivate *priv = console->priv;
     GError *err = NULL;
-    gchar *buf = g_new0(gchar, MAX_IO);
+    gchar *buf;
+    gssize ret;
 
-    gssize ret = g_input_stream_read
+    if (!priv->localFromStdin) {
+        priv->localFromStdinSize = GVIR_SANDBOX_CONSOLE_MIN_IO;
+        priv->localFromStdin = g_new(gchar, priv->localFromStdinSize);
+    }
+    buf = priv->localFromStdin;
+
+    ret = g_input_stream_read
         (G_INPUT_STREAM(localStdin),
-         buf, MAX_IO,
+         buf, MIN(priv->localFromStdinSize, priv->stdinCredit),
          NULL, &err);
     if (ret < 0) {
         g_debug("Error reading from stdin");
@@ -960,136 +1286,134 @@ static gboolean do_console_rpc_stdin_read(GObject *stream,
         g_error_free(err);
         goto cleanup;
     }
+    priv->stdinCredit -= ret;
+
+    /* Piped input filled the buffer, so read more at once next time */
+    if (ret == priv->localFromStdinSize &&
+        priv->localFromStdinSize < GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX) {
+        priv->localFromStdinSize = MIN(priv->localFromStdinSize * 2,
+                                       GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX);
+        priv->localFromStdin = g_renew(gchar, priv->localFromStdin,
+                                       priv->localFromStdinSize);
+    }
     priv->localStdinSource = NULL;
  cleanup:
     do_console_rpc_update_events(console);
-    g_free(buf);
     return FALSE;
 }
 
 
-static gboolean do_console_rpc_stdout_write(GObject *stream,
-                                            gpointer opaque)
+/*
+ * Write out as much of the queued output for one local stream
+ * as possible in a single wakeup. Returns TRUE if the source
+ * should remain attached, because more output is queued.
+ */
+static gboolean do_console_rpc_local_write(GVirSandboxConsoleRpc *console,
+                                           GObject *stream,
+                                           GVirSandboxProtocolStream id,
+                                           GQueue *queue,
+                                           gsize *queueLength,
+                                           gsize *granted,
+                                           GSource **source,
+                                           gsize otherLength)
 {
-    GUnixOutputStream *localStdout = G_UNIX_OUTPUT_STREAM(stream);
-    GVirSandboxConsoleRpc *console = GVIR_SANDBOX_CONSOLE_RPC(opaque);
     GVirSandboxConsoleRpcPrivate *priv = console->priv;
     GError *err = NULL;
-    g_debug("Stdout write %p %p",
-            priv->localStdoutSource,
-            priv->localToStdout);
-    gssize ret = g_output_stream_write
-        (G_OUTPUT_STREAM(localStdout),
-         priv->localToStdout + priv->localToStdoutOffset,
-         priv->localToStdoutLength - priv->localToStdoutOffset,
-         NULL, &err);
-    if (ret < 0) {
-        g_debug("Failed write stdout");
+    gsize queued = *queueLength;
+
+    if (!do_console_rpc_drain_output(G_OUTPUT_STREAM(stream),
+                                     queue, queueLength, &err)) {
+        g_debug("Failed to write output");
         do_console_rpc_close(console, err);
         g_error_free(err);
-        goto cleanup;
+        return FALSE;
     }
 
-    priv->localToStdoutOffset += ret;
-
-    if (priv->localToStdoutOffset == priv->localToStdoutLength) {
-        g_free(priv->localToStdout);
-        priv->localToStdout = NULL;
-        priv->localToStdoutOffset = priv->localToStdoutLength = 0;
-
-        if (priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING &&
-            !priv->rx &&
-            priv->localToStderrLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA)
-            priv->rx = gvir_sandbox_rpcpacket_new(TRUE);
-
-        if (priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_STOPPING &&
-            priv->localToStderrLength == 0 &&
-            !do_console_rpc_set_state(console,
-                                      GVIR_SANDBOX_CONSOLE_RPC_STATE_FINISHED,
-                                      &err)) {
-            g_debug("Failed set finished state");
+    /* Let a v2 guest send more on this stream */
+    *granted += queued - *queueLength;
+    if (priv->version >= 2 &&
+        priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING &&
+        *granted >= GVIR_SANDBOX_CONSOLE_CREDIT_BATCH) {
+        GVirSandboxRPCPacket *pkt;
+        if (!(pkt = gvir_sandbox_console_rpc_build_credit(console, id,
+                                                          *granted, &err))) {
+            g_debug("Failed to build credit packet");
             do_console_rpc_close(console, err);
             g_error_free(err);
-            goto cleanup;
+            return FALSE;
         }
-    } else if (0) {
-        memmove(priv->localToStdout,
-                priv->localToStdout + priv->localToStdoutOffset,
-                priv->localToStdoutLength - priv->localToStdoutOffset);
-        priv->localToStdoutLength -= priv->localToStdoutOffset;
-        priv->localToStdoutOffset = 0;
-        priv->localToStdout = g_renew(gchar,
-                                      priv->localToStdout,
-                                      priv->localToStdoutLength);
+        do_console_rpc_queue_tx(console, pkt);
+        *granted = 0;
     }
-    priv->localStdoutSource = NULL;
-    do_console_rpc_update_events(console);
 
- cleanup:
+    /* Resume receiving from the guest once the queues have room */
+    if (priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING &&
+        !priv->rx &&
+        *queueLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA &&
+        otherLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA)
+        priv->rx = gvir_sandbox_rpcpacket_pool_get(priv->pool, TRUE, 0);
+
+    if (*queueLength) {
+        do_console_rpc_update_events(console);
+        return TRUE;
+    }
+
+    g_source_unref(*source);
+    *source = NULL;
+
+    if (priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_STOPPING &&
+        otherLength == 0 &&
+        !do_console_rpc_set_state(console,
+                                  GVIR_SANDBOX_CONSOLE_RPC_STATE_FINISHED,
+                                  &err)) {
+        g_debug("Failed set finished state");
+        do_console_rpc_close(console, err);
+        g_error_free(err);
+        return FALSE;
+    }
+
+    do_console_rpc_update_events(console);
     return FALSE;
 }
 
 
-static gboolean do_console_rpc_stderr_write(GObject *stream,
+static gboolean do_console_rpc_stdout_write(GObject *stream,
                                             gpointer opaque)
 {
-    GUnixOutputStream *localStderr = G_UNIX_OUTPUT_STREAM(stream);
     GVirSandboxConsoleRpc *console = GVIR_SANDBOX_CONSOLE_RPC(opaque);
     GVirSandboxConsoleRpcPrivate *priv = console->priv;
-    GError *err = NULL;
-    g_debug("Stderr write %p %p",
-            priv->localStderrSource,
-            priv->localToStderr);
-    gssize ret = g_output_stream_write
-        (G_OUTPUT_STREAM(localStderr),
-         priv->localToStderr,
-         priv->localToStderrOffset,
-         NULL, &err);
-    if (ret < 0) {
-        g_debug("Failed to write stderr");
-        do_console_rpc_close(console, err);
-        g_error_free(err);
-        goto cleanup;
-    }
-
-    priv->localToStderrOffset += ret;
 
-    if (priv->localToStderrOffset == priv->localToStderrLength) {
-        g_free(priv->localToStderr);
-        priv->localToStderr = NULL;
-        priv->localToStderrOffset = priv->localToStderrLength = 0;
+    g_debug("Stdout write %p %zu",
+            priv->localStdoutSource,
+            priv->localToStdoutLength);
+
+    return do_console_rpc_local_write(console, stream,
+                                      GVIR_SANDBOX_PROTOCOL_STREAM_STDOUT,
+                                      &priv->localToStdout,
+                                      &priv->localToStdoutLength,
+                                      &priv->stdoutGranted,
+                                      &priv->localStdoutSource,
+                                      priv->localToStderrLength);
+}
 
-        if (priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_RUNNING &&
-            !priv->rx &&
-            priv->localToStdoutLength < GVIR_SANDBOX_CONSOLE_MAX_QUEUED_DATA)
-            priv->rx = gvir_sandbox_rpcpacket_new(TRUE);
 
-        if (priv->state == GVIR_SANDBOX_CONSOLE_RPC_STATE_STOPPING &&
-            priv->localToStdoutLength == 0 &&
-            !do_console_rpc_set_state(console,
-                                      GVIR_SANDBOX_CONSOLE_RPC_STATE_FINISHED,
-                                      &err)) {
-            g_debug("Failed set finished state");
-            do_console_rpc_close(console, err);
-            g_error_free(err);
-            goto cleanup;
-        }
-    } else if (0) {
-        memmove(priv->localToStderr,
-                priv->localToStderr + priv->localToStderrOffset,
-                priv->localToStderrLength - priv->localToStderrOffset);
-        priv->localToStderrLength -= priv->localToStderrOffset;
-        priv->localToStderrOffset = 0;
-        priv->localToStderr = g_renew(gchar,
-                                      priv->localToStderr,
-                                      priv->localToStderrLength);
-    }
+static gboolean do_console_rpc_stderr_write(GObject *stream,
+                                            gpointer opaque)
+{
+    GVirSandboxConsoleRpc *console = GVIR_SANDBOX_CONSOLE_RPC(opaque);
+    GVirSandboxConsoleRpcPrivate *priv = console->priv;
 
-    priv->localStderrSource = NULL;
-    do_console_rpc_update_events(console);
+    g_debug("Stderr write %p %zu",
+            priv->localStderrSource,
+            priv->localToStderrLength);
 
- cleanup:
-    return FALSE;
+    return do_console_rpc_local_write(console, stream,
+                                      GVIR_SANDBOX_PROTOCOL_STREAM_STDERR,
+                                      &priv->localToStderr,
+                                      &priv->localToStderrLength,
+                                      &priv->stderrGranted,
+                                      &priv->localStderrSource,
+                                      priv->localToStdoutLength);
 }
 
 
@@ -1181,8 +1505,11 @@ static gboolean gvir_sandbox_console_rpc_detach(GVirSandboxConsole *console,
         g_source_unref(priv->localStderrSource);
     if (priv->consoleWatch)
         g_source_remove(priv->consoleWatch);
+    if (priv->keepaliveTimer)
+        g_source_remove(priv->keepaliveTimer);
     priv->localStdinSource = priv->localStdoutSource = priv->localStderrSource = NULL;
     priv->consoleWatch = 0;
+    priv->keepaliveTimer = 0;
 
     if (priv->localStdin)
         g_object_unref(priv->localStdin);
@@ -1192,15 +1519,21 @@ static gboolean gvir_sandbox_console_rpc_detach(GVirSandboxConsole *console,
     priv->localStdout = NULL;
     priv->localStderr = NULL;
 
-    g_free(priv->localToStdout);
-    g_free(priv->localToStderr);
-    priv->localToStdout = priv->localToStderr = NULL;
-    priv->localToStdoutLength = priv->localToStdoutOffset = 0;
-    priv->localToStderrLength = priv->localToStderrOffset = 0;
+    g_queue_foreach(&priv->localToStdout, (GFunc)gvir_sandbox_rpcpacket_free, NULL);
+    g_queue_clear(&priv->localToStdout);
+    g_queue_foreach(&priv->localToStderr, (GFunc)gvir_sandbox_rpcpacket_free, NULL);
+    g_queue_clear(&priv->localToStderr);
+    priv->localToStdoutLength = 0;
+    priv->localToStderrLength = 0;
 
     gvir_sandbox_rpcpacket_free(priv->tx);
     gvir_sandbox_rpcpacket_free(priv->rx);
     priv->tx = priv->rx = NULL;
+    do_console_rpc_clear_tx_queue(GVIR_SANDBOX_CONSOLE_RPC(console));
+
+    priv->version = 0;
+    priv->stdinCredit = 0;
+    priv->stdoutGranted = priv->stderrGranted = 0;
 
     priv->state = GVIR_SANDBOX_CONSOLE_RPC_STATE_INACTIVE;
 
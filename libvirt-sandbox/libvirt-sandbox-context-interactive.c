@@ -21,8 +21,10 @@
  */
 
 #include <config.h>
+#include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <unistd.h>
 
 #include <glib/gi18n.h>
 
@@ -46,7 +48,9 @@
 
 struct _GVirSandboxContextInteractivePrivate
 {
-    gboolean unused;
+    /* Kept while the sandbox runs, as it may hold locks on
+     * resources the sandbox is using */
+    GVirSandboxBuilder *builder;
 };
 
 G_DEFINE_TYPE(GVirSandboxContextInteractive, gvir_sandbox_context_interactive, GVIR_SANDBOX_TYPE_CONTEXT);
@@ -108,10 +112,11 @@ static void gvir_sandbox_context_interactive_set_property(GObject *object,
 
 static void gvir_sandbox_context_interactive_finalize(GObject *object)
 {
-#if 0
     GVirSandboxContextInteractive *context = GVIR_SANDBOX_CONTEXT_INTERACTIVE(object);
     GVirSandboxContextInteractivePrivate *priv = context->priv;
-#endif
+
+    if (priv->builder)
+        g_object_unref(priv->builder);
 
     G_OBJECT_CLASS(gvir_sandbox_context_interactive_parent_class)->finalize(object);
 }
@@ -196,6 +201,7 @@ static gboolean gvir_sandbox_context_clean_post_stop(GVirSandboxContext *ctxt,
 
 static gboolean gvir_sandbox_context_interactive_start(GVirSandboxContext *ctxt, GError **error)
 {
+    GVirSandboxContextInteractivePrivate *priv = GVIR_SANDBOX_CONTEXT_INTERACTIVE(ctxt)->priv;
     GVirConfigDomain *configdom = NULL;
     GVirSandboxBuilder *builder = NULL;
     GVirConnection *connection = NULL;
@@ -271,6 +277,9 @@ static gboolean gvir_sandbox_context_interactive_start(GVirSandboxContext *ctxt,
 
     g_object_set(ctxt, "domain", domain, NULL);
 
+    priv->builder = builder;
+    builder = NULL;
+
     ret = TRUE;
  cleanup:
     if (!ret && domain)
@@ -297,6 +306,7 @@ static gboolean gvir_sandbox_context_interactive_start(GVirSandboxContext *ctxt,
 
 static gboolean gvir_sandbox_context_interactive_stop(GVirSandboxContext *ctxt, GError **error)
 {
+    GVirSandboxContextInteractivePrivate *priv = GVIR_SANDBOX_CONTEXT_INTERACTIVE(ctxt)->priv;
     GVirDomain *domain;
     GVirConnection *connection;
     GVirSandboxBuilder *builder;
@@ -317,8 +327,10 @@ static gboolean gvir_sandbox_context_interactive_stop(GVirSandboxContext *ctxt,
 
     connection = gvir_sandbox_context_get_connection(ctxt);
 
-    if (!(builder = gvir_sandbox_builder_for_connection(connection,
-                                                        error)))
+    if ((builder = priv->builder))
+        priv->builder = NULL;
+    else if (!(builder = gvir_sandbox_builder_for_connection(connection,
+                                                             error)))
         ret = FALSE;
 
     if (builder &&
@@ -374,6 +386,69 @@ GVirSandboxContextInteractive *gvir_sandbox_context_interactive_new(GVirConnecti
 }
 
 
+/**
+ * gvir_sandbox_context_interactive_set_command:
+ * @ctxt: (transfer none): the sandbox context
+ * @argv: (transfer none)(array zero-terminated=1): the new command path and arguments
+ * @error: (out): the error
+ *
+ * Change the command run by a started sandbox. The sandbox does
+ * not launch its command until the application console is
+ * attached, so this may be called any time before then, allowing
+ * sandboxes to be started before it is known what they will run.
+ *
+ * Returns: TRUE on success, FALSE on error
+ */
+gboolean gvir_sandbox_context_interactive_set_command(GVirSandboxContextInteractive *ctxt,
+                                                      gchar **argv,
+                                                      GError **error)
+{
+    GVirSandboxConfig *config = gvir_sandbox_context_get_config(GVIR_SANDBOX_CONTEXT(ctxt));
+    const gchar *cachedir;
+    gchar *configfile;
+    gchar *tmpfile = NULL;
+    gboolean ret = FALSE;
+
+    gvir_sandbox_config_interactive_set_command(GVIR_SANDBOX_CONFIG_INTERACTIVE(config),
+                                                argv);
+
+    cachedir = (getuid() ? g_get_user_cache_dir() : RUNDIR);
+    configfile = g_build_filename(cachedir, "libvirt-sandbox",
+                                  gvir_sandbox_config_get_name(config),
+                                  "config", "sandbox.cfg",
+                                  NULL);
+
+    /* The guest may read the config at any moment, so it must
+     * only ever see the old or the new version in full */
+    tmpfile = g_strdup_printf("%s.new", configfile);
+    if (unlink(tmpfile) < 0 &&
+        errno != ENOENT) {
+        g_set_error(error, GVIR_SANDBOX_CONTEXT_INTERACTIVE_ERROR, 0,
+                    _("Unable to remove %s: %s"),
+                    tmpfile, strerror(errno));
+        goto cleanup;
+    }
+
+    if (!gvir_sandbox_config_save_to_path(config, tmpfile, error))
+        goto cleanup;
+
+    if (rename(tmpfile, configfile) < 0) {
+        g_set_error(error, GVIR_SANDBOX_CONTEXT_INTERACTIVE_ERROR, 0,
+                    _("Unable to replace config %s: %s"),
+                    configfile, strerror(errno));
+        unlink(tmpfile);
+        goto cleanup;
+    }
+
+    ret = TRUE;
+ cleanup:
+    g_free(tmpfile);
+    g_free(configfile);
+    g_object_unref(config);
+    return ret;
+}
+
+
 /**
  * gvir_sandbox_context_interactive_get_app_console:
  * @ctxt: (transfer none): the sandbox context
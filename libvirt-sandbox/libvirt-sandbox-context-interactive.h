@@ -61,6 +61,10 @@ GType gvir_sandbox_context_interactive_get_type(void);
 GVirSandboxContextInteractive *gvir_sandbox_context_interactive_new(GVirConnection *connection,
                                                                     GVirSandboxConfigInteractive *config);
 
+gboolean gvir_sandbox_context_interactive_set_command(GVirSandboxContextInteractive *ctxt,
+                                                      gchar **argv,
+                                                      GError **error);
+
 GVirSandboxConsole *gvir_sandbox_context_interactive_get_app_console(GVirSandboxContextInteractive *ctxt,
                                                                      GError **error);
 
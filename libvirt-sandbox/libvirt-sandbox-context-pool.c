@@ -0,0 +1,600 @@
+/*
+ * libvirt-sandbox-context-pool.c: libvirt sandbox context pool
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Author: Daniel P. Berrange <berrange@redhat.com>
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include <glib/gi18n.h>
+
+#include "libvirt-sandbox/libvirt-sandbox.h"
+
+/**
+ * SECTION: libvirt-sandbox-context-pool
+ * @short_description: Pool of pre-started interactive sandboxes
+ * @include: libvirt-sandbox/libvirt-sandbox.h
+ * @see_also: #GVirSandboxContextInteractive
+ *
+ * Provides a pool of interactive sandboxes which are booted ahead of time
+ *
+ * The GVirSandboxContextPool object starts a number of
+ * #GVirSandboxContextInteractive instances from a template
+ * configuration. Each one boots as far as waiting for the host
+ * to attach to its application console. When an application
+ * is to be run, a parked sandbox is handed out with its command
+ * replaced, so the caller only pays for the console handshake
+ * rather than a full boot.
+ *
+ * Everything other than the command is fixed by the template
+ * when the sandbox boots.
+ *
+ * Pre-starting sandboxes is used instead of saving a booted
+ * template and restoring it for each launch, since QEMU refuses
+ * to save a guest while its virtio-9p exports are mounted and
+ * every machine sandbox runs from 9p mounts.
+ */
+
+#define GVIR_SANDBOX_CONTEXT_POOL_GET_PRIVATE(obj)                      \
+    (G_TYPE_INSTANCE_GET_PRIVATE((obj), GVIR_SANDBOX_TYPE_CONTEXT_POOL, GVirSandboxContextPoolPrivate))
+
+struct _GVirSandboxContextPoolPrivate
+{
+    GVirConnection *connection;
+    GVirSandboxConfigInteractive *config;
+    guint size;
+    gboolean autofill;
+
+    /* Started contexts waiting to be acquired */
+    GQueue parked;
+    guint serial;
+    guint refillId;
+};
+
+G_DEFINE_TYPE(GVirSandboxContextPool, gvir_sandbox_context_pool, G_TYPE_OBJECT);
+
+
+enum {
+    PROP_0,
+
+    PROP_CONNECTION,
+    PROP_CONFIG,
+    PROP_SIZE,
+    PROP_AUTOFILL,
+};
+
+enum {
+    LAST_SIGNAL
+};
+
+//static gint signals[LAST_SIGNAL];
+
+#define GVIR_SANDBOX_CONTEXT_POOL_ERROR gvir_sandbox_context_pool_error_quark()
+
+static GQuark
+gvir_sandbox_context_pool_error_quark(void)
+{
+    return g_quark_from_static_string("gvir-sandbox-context-pool");
+}
+
+static void gvir_sandbox_context_pool_get_property(GObject *object,
+                                                   guint prop_id,
+                                                   GValue *value,
+                                                   GParamSpec *pspec)
+{
+    GVirSandboxContextPool *pool = GVIR_SANDBOX_CONTEXT_POOL(object);
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+
+    switch (prop_id) {
+    case PROP_CONNECTION:
+        g_value_set_object(value, priv->connection);
+        break;
+
+    case PROP_CONFIG:
+        g_value_set_object(value, priv->config);
+        break;
+
+    case PROP_SIZE:
+        g_value_set_uint(value, priv->size);
+        break;
+
+    case PROP_AUTOFILL:
+        g_value_set_boolean(value, priv->autofill);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    }
+}
+
+
+static void gvir_sandbox_context_pool_set_property(GObject *object,
+                                                   guint prop_id,
+                                                   const GValue *value,
+                                                   GParamSpec *pspec)
+{
+    GVirSandboxContextPool *pool = GVIR_SANDBOX_CONTEXT_POOL(object);
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+
+    switch (prop_id) {
+    case PROP_CONNECTION:
+        if (priv->connection)
+            g_object_unref(priv->connection);
+        priv->connection = g_value_dup_object(value);
+        break;
+
+    case PROP_CONFIG:
+        if (priv->config)
+            g_object_unref(priv->config);
+        priv->config = g_value_dup_object(value);
+        break;
+
+    case PROP_SIZE:
+        priv->size = g_value_get_uint(value);
+        break;
+
+    case PROP_AUTOFILL:
+        priv->autofill = g_value_get_boolean(value);
+        break;
+
+    default:
+        G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
+    }
+}
+
+
+static void gvir_sandbox_context_pool_finalize(GObject *object)
+{
+    GVirSandboxContextPool *pool = GVIR_SANDBOX_CONTEXT_POOL(object);
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+
+    if (priv->refillId)
+        g_source_remove(priv->refillId);
+
+    gvir_sandbox_context_pool_drain(pool, NULL);
+
+    if (priv->connection)
+        g_object_unref(priv->connection);
+    if (priv->config)
+        g_object_unref(priv->config);
+
+    G_OBJECT_CLASS(gvir_sandbox_context_pool_parent_class)->finalize(object);
+}
+
+
+static void gvir_sandbox_context_pool_class_init(GVirSandboxContextPoolClass *klass)
+{
+    GObjectClass *object_class = G_OBJECT_CLASS(klass);
+
+    object_class->finalize = gvir_sandbox_context_pool_finalize;
+    object_class->get_property = gvir_sandbox_context_pool_get_property;
+    object_class->set_property = gvir_sandbox_context_pool_set_property;
+
+    g_object_class_install_property(object_class,
+                                    PROP_CONNECTION,
+                                    g_param_spec_object("connection",
+                                                        "Connection",
+                                                        "The sandbox connection",
+                                                        GVIR_TYPE_CONNECTION,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_CONFIG,
+                                    g_param_spec_object("config",
+                                                        "Config",
+                                                        "The template sandbox configuration",
+                                                        GVIR_SANDBOX_TYPE_CONFIG_INTERACTIVE,
+                                                        G_PARAM_READABLE |
+                                                        G_PARAM_WRITABLE |
+                                                        G_PARAM_CONSTRUCT_ONLY |
+                                                        G_PARAM_STATIC_NAME |
+                                                        G_PARAM_STATIC_NICK |
+                                                        G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_SIZE,
+                                    g_param_spec_uint("size",
+                                                      "Size",
+                                                      "Number of sandboxes to keep started",
+                                                      0,
+                                                      G_MAXUINT,
+                                                      1,
+                                                      G_PARAM_READABLE |
+                                                      G_PARAM_WRITABLE |
+                                                      G_PARAM_STATIC_NAME |
+                                                      G_PARAM_STATIC_NICK |
+                                                      G_PARAM_STATIC_BLURB));
+    g_object_class_install_property(object_class,
+                                    PROP_AUTOFILL,
+                                    g_param_spec_boolean("autofill",
+                                                         "Autofill",
+                                                         "Restart sandboxes as they are acquired",
+                                                         FALSE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_STATIC_NAME |
+                                                         G_PARAM_STATIC_NICK |
+                                                         G_PARAM_STATIC_BLURB));
+
+    g_type_class_add_private(klass, sizeof(GVirSandboxContextPoolPrivate));
+}
+
+
+static void gvir_sandbox_context_pool_init(GVirSandboxContextPool *pool)
+{
+    pool->priv = GVIR_SANDBOX_CONTEXT_POOL_GET_PRIVATE(pool);
+
+    pool->priv->size = 1;
+    g_queue_init(&pool->priv->parked);
+}
+
+
+/**
+ * gvir_sandbox_context_pool_new:
+ * @connection: (transfer none): the libvirt connection
+ * @config: (transfer none): the template configuration
+ * @size: the number of sandboxes to keep started
+ *
+ * Create a new pool of interactive sandboxes. No sandboxes are
+ * started until gvir_sandbox_context_pool_fill() is called.
+ *
+ * Returns: (transfer full): a new sandbox pool object
+ */
+GVirSandboxContextPool *gvir_sandbox_context_pool_new(GVirConnection *connection,
+                                                      GVirSandboxConfigInteractive *config,
+                                                      guint size)
+{
+    return GVIR_SANDBOX_CONTEXT_POOL(g_object_new(GVIR_SANDBOX_TYPE_CONTEXT_POOL,
+                                                  "connection", connection,
+                                                  "config", config,
+                                                  "size", size,
+                                                  NULL));
+}
+
+
+/**
+ * gvir_sandbox_context_pool_get_connection:
+ * @pool: (transfer none): the sandbox pool
+ *
+ * Retrieves the libvirt connection the sandboxes are started on
+ *
+ * Returns: (transfer full): the libvirt connection
+ */
+GVirConnection *gvir_sandbox_context_pool_get_connection(GVirSandboxContextPool *pool)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    g_object_ref(priv->connection);
+    return priv->connection;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_get_config:
+ * @pool: (transfer none): the sandbox pool
+ *
+ * Retrieves the template configuration the sandboxes are started from
+ *
+ * Returns: (transfer full): the template configuration
+ */
+GVirSandboxConfigInteractive *gvir_sandbox_context_pool_get_config(GVirSandboxContextPool *pool)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    g_object_ref(priv->config);
+    return priv->config;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_set_size:
+ * @pool: (transfer none): the sandbox pool
+ * @size: the number of sandboxes to keep started
+ *
+ * Set the number of sandboxes that gvir_sandbox_context_pool_fill()
+ * will keep started. Reducing the size does not stop sandboxes
+ * which are already started.
+ */
+void gvir_sandbox_context_pool_set_size(GVirSandboxContextPool *pool, guint size)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    priv->size = size;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_get_size:
+ * @pool: (transfer none): the sandbox pool
+ *
+ * Retrieves the number of sandboxes to keep started
+ *
+ * Returns: the pool size
+ */
+guint gvir_sandbox_context_pool_get_size(GVirSandboxContextPool *pool)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    return priv->size;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_set_autofill:
+ * @pool: (transfer none): the sandbox pool
+ * @autofill: TRUE to restart sandboxes as they are acquired
+ *
+ * When enabled, each gvir_sandbox_context_pool_acquire() schedules
+ * a refill of the pool from the default main context, so that a
+ * long running service always has sandboxes ready.
+ */
+void gvir_sandbox_context_pool_set_autofill(GVirSandboxContextPool *pool, gboolean autofill)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    priv->autofill = autofill;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_get_autofill:
+ * @pool: (transfer none): the sandbox pool
+ *
+ * Retrieves whether the pool is refilled automatically
+ *
+ * Returns: TRUE if autofill is enabled
+ */
+gboolean gvir_sandbox_context_pool_get_autofill(GVirSandboxContextPool *pool)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    return priv->autofill;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_get_available:
+ * @pool: (transfer none): the sandbox pool
+ *
+ * Retrieves the number of started sandboxes waiting to be acquired
+ *
+ * Returns: the number of available sandboxes
+ */
+guint gvir_sandbox_context_pool_get_available(GVirSandboxContextPool *pool)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    return g_queue_get_length(&priv->parked);
+}
+
+
+/*
+ * The name is a construct only property, so the template is
+ * cloned via its keyfile form to give each sandbox its own
+ * name, and hence its own domain and state directory.
+ */
+static GVirSandboxConfigInteractive *
+gvir_sandbox_context_pool_clone_config(GVirSandboxContextPool *pool,
+                                       GError **error)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    GVirSandboxConfig *tmpl = GVIR_SANDBOX_CONFIG(priv->config);
+    GVirSandboxConfig *config = NULL;
+    GKeyFile *file = g_key_file_new();
+    gchar *data = NULL;
+    gchar *name = NULL;
+    gsize len;
+
+    /* Only one sandbox at a time may use a root cache image */
+    if (gvir_sandbox_config_get_root_cache_image(tmpl)) {
+        g_set_error(error, GVIR_SANDBOX_CONTEXT_POOL_ERROR, 0,
+                    _("Pool template %s cannot use a root cache image"),
+                    gvir_sandbox_config_get_name(tmpl));
+        goto cleanup;
+    }
+
+    if (!(data = gvir_sandbox_config_save_to_data(tmpl, error)))
+        goto cleanup;
+
+    if (!g_key_file_load_from_data(file, data, -1, G_KEY_FILE_NONE, error))
+        goto cleanup;
+
+    name = g_strdup_printf("%s-pool-%u",
+                           gvir_sandbox_config_get_name(tmpl),
+                           ++priv->serial);
+    g_key_file_set_string(file, "core", "name", name);
+    g_key_file_remove_key(file, "core", "uuid", NULL);
+
+    g_free(data);
+    if (!(data = g_key_file_to_data(file, &len, error)))
+        goto cleanup;
+
+    if (!(config = gvir_sandbox_config_load_from_data(data, error)))
+        goto cleanup;
+
+    if (!GVIR_SANDBOX_IS_CONFIG_INTERACTIVE(config)) {
+        g_set_error(error, GVIR_SANDBOX_CONTEXT_POOL_ERROR, 0,
+                    _("Pool template %s is not an interactive configuration"),
+                    gvir_sandbox_config_get_name(tmpl));
+        g_object_unref(config);
+        config = NULL;
+        goto cleanup;
+    }
+
+ cleanup:
+    g_free(name);
+    g_free(data);
+    g_key_file_free(file);
+    return config ? GVIR_SANDBOX_CONFIG_INTERACTIVE(config) : NULL;
+}
+
+
+static GVirSandboxContextInteractive *
+gvir_sandbox_context_pool_start_one(GVirSandboxContextPool *pool,
+                                    GError **error)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    GVirSandboxConfigInteractive *config;
+    GVirSandboxContextInteractive *ctxt;
+
+    if (!(config = gvir_sandbox_context_pool_clone_config(pool, error)))
+        return NULL;
+
+    ctxt = gvir_sandbox_context_interactive_new(priv->connection, config);
+    g_object_unref(config);
+
+    if (!gvir_sandbox_context_start(GVIR_SANDBOX_CONTEXT(ctxt), error)) {
+        g_object_unref(ctxt);
+        return NULL;
+    }
+
+    return ctxt;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_fill:
+ * @pool: (transfer none): the sandbox pool
+ * @error: (out): the error
+ *
+ * Start sandboxes until the number available matches the pool
+ * size. Each sandbox is left waiting for its application console
+ * to be attached.
+ *
+ * Returns: TRUE if the pool is full, FALSE on error
+ */
+gboolean gvir_sandbox_context_pool_fill(GVirSandboxContextPool *pool,
+                                        GError **error)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+
+    while (g_queue_get_length(&priv->parked) < priv->size) {
+        GVirSandboxContextInteractive *ctxt;
+
+        if (!(ctxt = gvir_sandbox_context_pool_start_one(pool, error)))
+            return FALSE;
+
+        g_queue_push_tail(&priv->parked, ctxt);
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Start one sandbox per main loop iteration so that an
+ * application servicing consoles is never stalled for
+ * more than a single boot.
+ */
+static gboolean gvir_sandbox_context_pool_refill(gpointer opaque)
+{
+    GVirSandboxContextPool *pool = opaque;
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    GVirSandboxContextInteractive *ctxt;
+    GError *error = NULL;
+
+    if (g_queue_get_length(&priv->parked) >= priv->size)
+        goto done;
+
+    if (!(ctxt = gvir_sandbox_context_pool_start_one(pool, &error))) {
+        g_warning("Unable to refill sandbox pool: %s", error->message);
+        g_error_free(error);
+        goto done;
+    }
+
+    g_queue_push_tail(&priv->parked, ctxt);
+    if (g_queue_get_length(&priv->parked) < priv->size)
+        return TRUE;
+
+ done:
+    priv->refillId = 0;
+    return FALSE;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_acquire:
+ * @pool: (transfer none): the sandbox pool
+ * @command: (transfer none)(array zero-terminated=1): the command path and arguments
+ * @error: (out): the error
+ *
+ * Take a started sandbox out of the pool and set it to run
+ * @command. If the pool is empty a sandbox is started on
+ * demand. The application runs once the caller attaches to
+ * the console from gvir_sandbox_context_interactive_get_app_console()
+ * and the caller is responsible for stopping the sandbox.
+ *
+ * Returns: (transfer full): the started sandbox context, or NULL on error
+ */
+GVirSandboxContextInteractive *gvir_sandbox_context_pool_acquire(GVirSandboxContextPool *pool,
+                                                                 gchar **command,
+                                                                 GError **error)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    GVirSandboxContextInteractive *ctxt;
+
+    if (!(ctxt = g_queue_pop_head(&priv->parked)) &&
+        !(ctxt = gvir_sandbox_context_pool_start_one(pool, error)))
+        return NULL;
+
+    if (!gvir_sandbox_context_interactive_set_command(ctxt, command, error)) {
+        gvir_sandbox_context_stop(GVIR_SANDBOX_CONTEXT(ctxt), NULL);
+        g_object_unref(ctxt);
+        return NULL;
+    }
+
+    if (priv->autofill && !priv->refillId)
+        priv->refillId = g_idle_add(gvir_sandbox_context_pool_refill, pool);
+
+    return ctxt;
+}
+
+
+/**
+ * gvir_sandbox_context_pool_drain:
+ * @pool: (transfer none): the sandbox pool
+ * @error: (out): the error
+ *
+ * Stop all sandboxes waiting in the pool. Sandboxes which have
+ * already been acquired are not affected.
+ *
+ * Returns: TRUE if all sandboxes were stopped, FALSE on error
+ */
+gboolean gvir_sandbox_context_pool_drain(GVirSandboxContextPool *pool,
+                                         GError **error)
+{
+    GVirSandboxContextPoolPrivate *priv = pool->priv;
+    GVirSandboxContextInteractive *ctxt;
+    gboolean ret = TRUE;
+
+    while ((ctxt = g_queue_pop_head(&priv->parked))) {
+        if (!gvir_sandbox_context_stop(GVIR_SANDBOX_CONTEXT(ctxt),
+                                       ret ? error : NULL))
+            ret = FALSE;
+        g_object_unref(ctxt);
+    }
+
+    return ret;
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ *  tab-width: 8
+ * End:
+ */
@@ -0,0 +1,97 @@
+/*
+ * libvirt-sandbox-context-pool.h: libvirt sandbox context pool
+ *
+ * Copyright (C) 2011 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ * Author: Daniel P. Berrange <berrange@redhat.com>
+ */
+
+#if !defined(__LIBVIRT_SANDBOX_H__) && !defined(LIBVIRT_SANDBOX_BUILD)
+#error "Only <libvirt-sandbox/libvirt-sandbox.h> can be included directly."
+#endif
+
+#ifndef __LIBVIRT_SANDBOX_CONTEXT_POOL_H__
+#define __LIBVIRT_SANDBOX_CONTEXT_POOL_H__
+
+G_BEGIN_DECLS
+
+#define GVIR_SANDBOX_TYPE_CONTEXT_POOL            (gvir_sandbox_context_pool_get_type ())
+#define GVIR_SANDBOX_CONTEXT_POOL(obj)            (G_TYPE_CHECK_INSTANCE_CAST ((obj), GVIR_SANDBOX_TYPE_CONTEXT_POOL, GVirSandboxContextPool))
+#define GVIR_SANDBOX_CONTEXT_POOL_CLASS(klass)    (G_TYPE_CHECK_CLASS_CAST ((klass), GVIR_SANDBOX_TYPE_CONTEXT_POOL, GVirSandboxContextPoolClass))
+#define GVIR_SANDBOX_IS_CONTEXT_POOL(obj)         (G_TYPE_CHECK_INSTANCE_TYPE ((obj), GVIR_SANDBOX_TYPE_CONTEXT_POOL))
+#define GVIR_SANDBOX_IS_CONTEXT_POOL_CLASS(klass) (G_TYPE_CHECK_CLASS_TYPE ((klass), GVIR_SANDBOX_TYPE_CONTEXT_POOL))
+#define GVIR_SANDBOX_CONTEXT_POOL_GET_CLASS(obj)  (G_TYPE_INSTANCE_GET_CLASS ((obj), GVIR_SANDBOX_TYPE_CONTEXT_POOL, GVirSandboxContextPoolClass))
+
+typedef struct _GVirSandboxContextPool GVirSandboxContextPool;
+typedef struct _GVirSandboxContextPoolPrivate GVirSandboxContextPoolPrivate;
+typedef struct _GVirSandboxContextPoolClass GVirSandboxContextPoolClass;
+
+struct _GVirSandboxContextPool
+{
+    GObject parent;
+
+    GVirSandboxContextPoolPrivate *priv;
+
+    /* Do not add fields to this struct */
+};
+
+struct _GVirSandboxContextPoolClass
+{
+    GObjectClass parent_class;
+
+    gpointer padding[LIBVIRT_SANDBOX_CLASS_PADDING];
+};
+
+GType gvir_sandbox_context_pool_get_type(void);
+
+GVirSandboxContextPool *gvir_sandbox_context_pool_new(GVirConnection *connection,
+                                                      GVirSandboxConfigInteractive *config,
+                                                      guint size);
+
+GVirConnection *gvir_sandbox_context_pool_get_connection(GVirSandboxContextPool *pool);
+GVirSandboxConfigInteractive *gvir_sandbox_context_pool_get_config(GVirSandboxContextPool *pool);
+
+void gvir_sandbox_context_pool_set_size(GVirSandboxContextPool *pool, guint size);
+guint gvir_sandbox_context_pool_get_size(GVirSandboxContextPool *pool);
+
+void gvir_sandbox_context_pool_set_autofill(GVirSandboxContextPool *pool, gboolean autofill);
+gboolean gvir_sandbox_context_pool_get_autofill(GVirSandboxContextPool *pool);
+
+guint gvir_sandbox_context_pool_get_available(GVirSandboxContextPool *pool);
+
+gboolean gvir_sandbox_context_pool_fill(GVirSandboxContextPool *pool,
+                                        GError **error);
+
+GVirSandboxContextInteractive *gvir_sandbox_context_pool_acquire(GVirSandboxContextPool *pool,
+                                                                 gchar **command,
+                                                                 GError **error);
+
+gboolean gvir_sandbox_context_pool_drain(GVirSandboxContextPool *pool,
+                                         GError **error);
+
+G_END_DECLS
+
+#endif /* __LIBVIRT_SANDBOX_CONTEXT_POOL_H__ */
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ *  tab-width: 8
+ * End:
+ */
@@ -24,6 +24,8 @@
 #include <string.h>
 #include <errno.h>
 
+#include <glib/gi18n.h>
+
 #include "libvirt-sandbox/libvirt-sandbox.h"
 
 /**
@@ -132,6 +134,15 @@ static gboolean gvir_sandbox_context_service_define_default(GVirSandboxContextSe
     configfile = g_build_filename(configdir, "sandbox.cfg", NULL);
     emptydir = g_build_filename(configdir, "empty", NULL);
 
+    /* Services are started by libvirt, so there is nothing to
+     * hold the root cache image lock while they run */
+    if (gvir_sandbox_config_get_root_cache_image(config)) {
+        g_set_error(error, GVIR_SANDBOX_CONTEXT_SERVICE_ERROR, 0,
+                    _("Service sandbox %s cannot use a root cache image"),
+                    gvir_sandbox_config_get_name(config));
+        goto cleanup;
+    }
+
     if (!(builder = gvir_sandbox_builder_for_connection(connection,
                                                         error)))
         goto cleanup;
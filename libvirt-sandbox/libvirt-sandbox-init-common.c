@@ -22,6 +22,7 @@
 
 #include <config.h>
 
+#define _GNU_SOURCE
 #include <libvirt-sandbox/libvirt-sandbox-config-all.h>
 #include <glib/gi18n.h>
 
@@ -40,38 +41,47 @@
 #include <sys/resource.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
 #include <termios.h>
 #include <unistd.h>
 #include <limits.h>
 #include <grp.h>
 
 #include "libvirt-sandbox-rpcpacket.h"
+#include "libvirt-sandbox-manifest.h"
 
 static gboolean debug = FALSE;
 static gboolean verbose = FALSE;
-static int sigwrite;
-
-#define ATTR_UNUSED __attribute__((__unused__))
-
-static void sig_child(int sig ATTR_UNUSED)
-{
-    char ignore = '1';
-    if (write(sigwrite, &ignore, 1) != 1)
-        abort();
-}
 
 static gboolean setup_disk_tags(void) {
-    FILE *fp;
+    gchar *data = NULL;
+    gsize len;
+    size_t offset;
+    long nrecords;
+    GError *err = NULL;
     gboolean ret = FALSE;
-    static char line[1024];
     if (debug)
         fprintf(stderr, "libvirt-sandbox-init-common: %s: populate /dev/disk/by-tag/\n",
                 __func__);
-    fp = fopen(SANDBOXCONFIGDIR "/disks.cfg", "r");
-    if (fp == NULL) {
-        fprintf(stderr, "libvirt-sandbox-init-common: %s: cannot open " SANDBOXCONFIGDIR "/disks.cfg: %s\n",
-                __func__, strerror(errno));
-
+    if (!g_file_get_contents(SANDBOXCONFIGDIR "/" GVIR_SANDBOX_MANIFEST_FILE,
+                             &data, &len, &err)) {
+        fprintf(stderr, "libvirt-sandbox-init-common: %s: cannot read manifest: %s\n",
+                __func__, err->message);
+        g_error_free(err);
+        goto cleanup;
+    }
+    if ((nrecords = gvir_sandbox_manifest_open(data, len, &offset)) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-common: %s: malformed manifest "
+                SANDBOXCONFIGDIR "/" GVIR_SANDBOX_MANIFEST_FILE "\n",
+                __func__);
         goto cleanup;
     }
     if (g_mkdir_with_parents("/dev/disk/by-tag",0755) < 0) {
@@ -80,14 +90,21 @@ static gboolean setup_disk_tags(void) {
 
        goto cleanup;
     }
-    while (fgets(line, sizeof line, fp)) {
-        char *tag = line;
-        char *device = strchr(tag, '\t');
+    while (nrecords-- > 0) {
+        GVirSandboxManifestRecord rec;
+        const char *tag, *device;
         gchar *path = NULL;
-        *device = '\0';
-        device++;
-        char *tmp = strchr(device, '\n');
-        *tmp = '\0';
+
+        if (gvir_sandbox_manifest_next(data, len, &offset, &rec) < 0) {
+            fprintf(stderr, "libvirt-sandbox-init-common: %s: malformed record at "
+                    "offset %zu in manifest\n", __func__, offset);
+            goto cleanup;
+        }
+        if (rec.type != GVIR_SANDBOX_MANIFEST_DISK || rec.nfields < 2)
+            continue;
+
+        tag = rec.fields[0];
+        device = rec.fields[1];
         path = g_strdup_printf("/dev/disk/by-tag/%s", tag);
 
         if (debug)
@@ -105,7 +122,7 @@ static gboolean setup_disk_tags(void) {
     }
     ret = TRUE;
  cleanup:
-    fclose(fp);
+    g_free(data);
     return ret;
 }
 
@@ -157,7 +174,12 @@ start_shell(void)
 }
 
 
-static gboolean start_dhcp(const gchar *devname, GError **error)
+/*
+ * Starts a DHCP client on @devname without waiting for it.
+ * dhclient exits once it has a lease, leaving a daemon to
+ * renew it.
+ */
+static gboolean start_dhcp(const gchar *devname, GPid *pid, GError **error)
 {
     const gchar *argv[] = { "/sbin/dhclient", "-v", "--no-pid", devname, NULL };
     gboolean ret;
@@ -168,167 +190,483 @@ static gboolean start_dhcp(const gchar *devname, GError **error)
     sigaddset(&newset, SIGHUP);
 
     sigprocmask(SIG_BLOCK, &newset, &oldset);
-    ret = g_spawn_sync(NULL, (gchar**)argv, NULL, 0,
-                       NULL, NULL, NULL, NULL, NULL, error);
+    ret = g_spawn_async(NULL, (gchar**)argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                        NULL, NULL, pid, error);
     sigprocmask(SIG_SETMASK, &oldset, NULL);
 
     return ret;
 }
 
 
-static gboolean add_address(const gchar *devname,
-                            GVirSandboxConfigNetworkAddress *config,
-                            GError **error)
+/*
+ * Waits for the DHCP clients in @pids to get their leases,
+ * for up to @timeout seconds if it is not 0. It fails as soon
+ * as any client fails or the time runs out, killing the
+ * clients which are still running. SIGCHLD is blocked while
+ * waiting, so that it is left pending until the clients are
+ * reaped, whichever order they exit in.
+ */
+static gboolean wait_dhcp(GArray *pids, GPtrArray *devnames,
+                          guint timeout, GError **error)
 {
-    GInetAddress *addr = gvir_sandbox_config_network_address_get_primary(config);
-    guint prefix = gvir_sandbox_config_network_address_get_prefix(config);
-    GInetAddress *bcast = gvir_sandbox_config_network_address_get_broadcast(config);
-    gchar *addrstr = g_inet_address_to_string(addr);
-    gchar *fulladdrstr = g_strdup_printf("%s/%u", addrstr, prefix);
-    gchar *bcaststr = bcast ? g_inet_address_to_string(bcast) : NULL;
+    gint64 deadline = g_get_monotonic_time() + (gint64)timeout * G_USEC_PER_SEC;
+    guint pending = pids->len;
+    gboolean ret = TRUE;
+    sigset_t mask;
+    sigset_t oldmask;
+    guint i;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    while (pending) {
+        gint64 remaining;
+        struct timespec ts;
+
+        for (i = 0; i < pids->len; i++) {
+            GPid pid = g_array_index(pids, GPid, i);
+            int status;
+            pid_t rv;
+
+            if (pid <= 0)
+                continue;
+            if ((rv = waitpid(pid, &status, WNOHANG)) == 0)
+                continue;
+
+            if (rv < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                            "DHCP client for %s failed",
+                            (gchar *)g_ptr_array_index(devnames, i));
+                ret = FALSE;
+            } else if (debug) {
+                fprintf(stderr, "libvirt-sandbox-init-common: %s: "
+                        "DHCP client for %s is configured\n",
+                        __func__, (gchar *)g_ptr_array_index(devnames, i));
+            }
+            g_array_index(pids, GPid, i) = 0;
+            pending--;
+            if (!ret)
+                break;
+        }
+
+        if (!pending)
+            break;
+
+        remaining = deadline - g_get_monotonic_time();
+        if (!ret || (timeout && remaining <= 0)) {
+            for (i = 0; i < pids->len; i++) {
+                GPid pid = g_array_index(pids, GPid, i);
+                if (pid <= 0)
+                    continue;
+                if (ret)
+                    g_set_error(error, G_IO_ERROR, G_IO_ERROR_TIMED_OUT,
+                                "Timed out waiting for a DHCP lease for %s",
+                                (gchar *)g_ptr_array_index(devnames, i));
+                kill(pid, SIGTERM);
+                waitpid(pid, NULL, 0);
+                ret = FALSE;
+            }
+            break;
+        }
+
+        /* Any client exiting, or the deadline passing, wakes
+         * us up to reap them again */
+        if (timeout) {
+            ts.tv_sec = remaining / G_USEC_PER_SEC;
+            ts.tv_nsec = (remaining % G_USEC_PER_SEC) * 1000;
+            sigtimedwait(&mask, NULL, &ts);
+        } else {
+            sigwaitinfo(&mask, NULL);
+        }
+    }
+
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return ret;
+}
+
+
+/*
+ * A set of rtnetlink requests which are sent to the kernel
+ * in a single write, instead of running /sbin/ip for each
+ * of them. The kernel handles them in order, replying with
+ * an ack or an error for each.
+ */
+typedef struct _GVirSandboxNetlinkBatch GVirSandboxNetlinkBatch;
+struct _GVirSandboxNetlinkBatch {
+    GByteArray *buf;
+    /* Offset of the request being built */
+    guint last;
+    /* What each request does, indexed by sequence number */
+    GPtrArray *descs;
+};
+
+
+static void netlink_batch_init(GVirSandboxNetlinkBatch *batch)
+{
+    batch->buf = g_byte_array_new();
+    batch->last = 0;
+    batch->descs = g_ptr_array_new_with_free_func(g_free);
+}
+
+
+static void netlink_batch_clear(GVirSandboxNetlinkBatch *batch)
+{
+    g_byte_array_unref(batch->buf);
+    g_ptr_array_unref(batch->descs);
+}
+
+
+/* Grows the buffer by @len zeroed bytes, returning their offset */
+static guint netlink_batch_reserve(GVirSandboxNetlinkBatch *batch,
+                                   size_t len)
+{
+    guint offset = batch->buf->len;
+
+    g_byte_array_set_size(batch->buf, offset + len);
+    memset(batch->buf->data + offset, 0, len);
+    return offset;
+}
+
+
+/*
+ * Starts a new request, returning its zeroed family header of
+ * @hdrlen bytes. Takes ownership of @desc, which is used in
+ * error messages.
+ */
+static void *netlink_batch_add(GVirSandboxNetlinkBatch *batch,
+                               guint16 type, guint16 flags,
+                               size_t hdrlen, gchar *desc)
+{
+    struct nlmsghdr *nlh;
+
+    batch->last = netlink_batch_reserve(batch, NLMSG_SPACE(hdrlen));
+    nlh = (struct nlmsghdr *)(batch->buf->data + batch->last);
+    nlh->nlmsg_len = NLMSG_SPACE(hdrlen);
+    nlh->nlmsg_type = type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+    nlh->nlmsg_seq = batch->descs->len;
+    g_ptr_array_add(batch->descs, desc);
+
+    return NLMSG_DATA(nlh);
+}
+
+
+/* Appends an attribute to the request being built */
+static void netlink_batch_add_attr(GVirSandboxNetlinkBatch *batch,
+                                   guint16 type, const void *data,
+                                   size_t len)
+{
+    guint offset = netlink_batch_reserve(batch, RTA_SPACE(len));
+    struct rtattr *rta = (struct rtattr *)(batch->buf->data + offset);
+    struct nlmsghdr *nlh;
+
+    rta->rta_len = RTA_LENGTH(len);
+    rta->rta_type = type;
+    memcpy(RTA_DATA(rta), data, len);
+
+    nlh = (struct nlmsghdr *)(batch->buf->data + batch->last);
+    nlh->nlmsg_len = batch->buf->len - batch->last;
+}
+
+
+/*
+ * Sends all the requests in @batch and waits for the kernel
+ * to answer each one, reporting the first that failed
+ */
+static gboolean netlink_batch_commit(GVirSandboxNetlinkBatch *batch,
+                                     GError **error)
+{
+    struct sockaddr_nl sa;
+    guint8 reply[8192];
+    guint pending = batch->descs->len;
     gboolean ret = FALSE;
+    int fd;
 
-    const gchar *argv1a[] = {
-        "/sbin/ip", "addr",
-        "add", fulladdrstr,
-        "broadcast", bcaststr,
-        "dev", devname,
-        NULL
-    };
-    const gchar *argv1b[] = {
-        "/sbin/ip", "addr",
-        "add", fulladdrstr,
-        "dev", devname,
-        NULL
-    };
-    const gchar *argv2[] = {
-        "/sbin/ip", "link",
-        "set", devname, "up",
-        NULL
-    };
+    if (!pending)
+        return TRUE;
 
-    if (bcaststr) {
-        if (!g_spawn_sync(NULL, (gchar**)argv1a, NULL, 0,
-                          NULL, NULL, NULL, NULL, NULL, error))
-            goto cleanup;
-    } else {
-        if (!g_spawn_sync(NULL, (gchar**)argv1b, NULL, 0,
-                          NULL, NULL, NULL, NULL, NULL, error))
-            goto cleanup;
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Cannot open netlink socket: %s", strerror(errno));
+        return FALSE;
     }
-    if (!g_spawn_sync(NULL, (gchar**)argv2, NULL, 0,
-                      NULL, NULL, NULL, NULL, NULL, error))
+
+    memset(&sa, 0, sizeof(sa));
+    sa.nl_family = AF_NETLINK;
+    if (sendto(fd, batch->buf->data, batch->buf->len, 0,
+               (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Cannot send netlink requests: %s", strerror(errno));
         goto cleanup;
+    }
+
+    while (pending) {
+        struct nlmsghdr *nlh;
+        ssize_t got;
+
+        if ((got = recv(fd, reply, sizeof(reply), 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "Cannot read netlink reply: %s", strerror(errno));
+            goto cleanup;
+        }
+
+        for (nlh = (struct nlmsghdr *)reply; NLMSG_OK(nlh, got);
+             nlh = NLMSG_NEXT(nlh, got)) {
+            struct nlmsgerr *err = NLMSG_DATA(nlh);
+
+            if (nlh->nlmsg_type != NLMSG_ERROR)
+                continue;
+            if (err->error != 0) {
+                const gchar *desc = nlh->nlmsg_seq < batch->descs->len ?
+                    g_ptr_array_index(batch->descs, nlh->nlmsg_seq) :
+                    "netlink request";
+                g_set_error(error, G_IO_ERROR, g_io_error_from_errno(-err->error),
+                            "Cannot %s: %s", desc, strerror(-err->error));
+                goto cleanup;
+            }
+            pending--;
+        }
+    }
 
     ret = TRUE;
  cleanup:
-    g_free(addrstr);
-    g_free(bcaststr);
-    g_free(fulladdrstr);
+    close(fd);
     return ret;
 }
 
 
-static gboolean add_route(const gchar *devname,
-                          GVirSandboxConfigNetworkRoute *config,
-                          GError **error)
+static int inet_address_family(GInetAddress *addr)
+{
+    return g_inet_address_get_family(addr) == G_SOCKET_FAMILY_IPV6 ?
+        AF_INET6 : AF_INET;
+}
+
+
+static void add_link_up(GVirSandboxNetlinkBatch *batch,
+                        const gchar *devname,
+                        int ifindex)
+{
+    struct ifinfomsg *ifi;
+
+    ifi = netlink_batch_add(batch, RTM_NEWLINK, 0, sizeof(*ifi),
+                            g_strdup_printf("set %s up", devname));
+    ifi->ifi_family = AF_UNSPEC;
+    ifi->ifi_index = ifindex;
+    ifi->ifi_flags = IFF_UP;
+    ifi->ifi_change = IFF_UP;
+}
+
+
+static void add_address(GVirSandboxNetlinkBatch *batch,
+                        const gchar *devname,
+                        int ifindex,
+                        GVirSandboxConfigNetworkAddress *config)
+{
+    GInetAddress *addr = gvir_sandbox_config_network_address_get_primary(config);
+    guint prefix = gvir_sandbox_config_network_address_get_prefix(config);
+    GInetAddress *bcast = gvir_sandbox_config_network_address_get_broadcast(config);
+    gchar *addrstr = g_inet_address_to_string(addr);
+    gsize len = g_inet_address_get_native_size(addr);
+    struct ifaddrmsg *ifa;
+
+    ifa = netlink_batch_add(batch, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL,
+                            sizeof(*ifa),
+                            g_strdup_printf("add address %s/%u to %s",
+                                            addrstr, prefix, devname));
+    ifa->ifa_family = inet_address_family(addr);
+    ifa->ifa_prefixlen = prefix;
+    ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+    ifa->ifa_index = ifindex;
+
+    netlink_batch_add_attr(batch, IFA_LOCAL,
+                           g_inet_address_to_bytes(addr), len);
+    netlink_batch_add_attr(batch, IFA_ADDRESS,
+                           g_inet_address_to_bytes(addr), len);
+    if (bcast)
+        netlink_batch_add_attr(batch, IFA_BROADCAST,
+                               g_inet_address_to_bytes(bcast),
+                               g_inet_address_get_native_size(bcast));
+
+    g_free(addrstr);
+}
+
+
+static void add_route(GVirSandboxNetlinkBatch *batch,
+                      const gchar *devname,
+                      int ifindex,
+                      GVirSandboxConfigNetworkRoute *config)
 {
     guint prefix = gvir_sandbox_config_network_route_get_prefix(config);
     GInetAddress *gateway = gvir_sandbox_config_network_route_get_gateway(config);
     GInetAddress *target = gvir_sandbox_config_network_route_get_target(config);
     gchar *targetstr = g_inet_address_to_string(target);
-    gchar *fulltargetstr = g_strdup_printf("%s/%u", targetstr, prefix);
     gchar *gatewaystr = g_inet_address_to_string(gateway);
-    gboolean ret = FALSE;
-
-    const gchar *argv[] = {
-        "/sbin/ip", "route",
-        "add", fulltargetstr,
-        "via", gatewaystr,
-        "dev", devname,
-        NULL
-    };
-
-    if (!g_spawn_sync(NULL, (gchar**)argv, NULL, 0,
-                      NULL, NULL, NULL, NULL, NULL, error))
-        goto cleanup;
+    guint32 oif = ifindex;
+    struct rtmsg *rtm;
+
+    rtm = netlink_batch_add(batch, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL,
+                            sizeof(*rtm),
+                            g_strdup_printf("add route %s/%u via %s dev %s",
+                                            targetstr, prefix, gatewaystr,
+                                            devname));
+    rtm->rtm_family = inet_address_family(target);
+    rtm->rtm_dst_len = prefix;
+    rtm->rtm_table = RT_TABLE_MAIN;
+    rtm->rtm_protocol = RTPROT_BOOT;
+    rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+    rtm->rtm_type = RTN_UNICAST;
+
+    if (prefix)
+        netlink_batch_add_attr(batch, RTA_DST,
+                               g_inet_address_to_bytes(target),
+                               g_inet_address_get_native_size(target));
+    netlink_batch_add_attr(batch, RTA_GATEWAY,
+                           g_inet_address_to_bytes(gateway),
+                           g_inet_address_get_native_size(gateway));
+    netlink_batch_add_attr(batch, RTA_OIF, &oif, sizeof(oif));
 
-    ret = TRUE;
- cleanup:
-    g_free(fulltargetstr);
     g_free(gatewaystr);
     g_free(targetstr);
-    return ret;
+}
+
+
+static int get_ifindex(const gchar *devname, GError **error)
+{
+    int ifindex;
+
+    if (!(ifindex = if_nametoindex(devname)))
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Cannot find network device %s: %s",
+                    devname, strerror(errno));
+    return ifindex;
 }
 
 
 static gboolean setup_network_device(GVirSandboxConfigNetwork *config,
                                      const gchar *devname,
+                                     GVirSandboxNetlinkBatch *batch,
                                      GError **error)
 {
     GList *addrs = NULL;
-    GList *routes = NULL;
     GList *tmp;
-    gboolean ret = FALSE;
+    int ifindex;
 
-    if (gvir_sandbox_config_network_get_dhcp(config)) {
-        if (!start_dhcp(devname, error))
-            goto cleanup;
-    } else {
-        tmp = addrs = gvir_sandbox_config_network_get_addresses(config);
-        while (tmp) {
-            GVirSandboxConfigNetworkAddress *addr = tmp->data;
+    if (!(ifindex = get_ifindex(devname, error)))
+        return FALSE;
 
-            if (!add_address(devname, addr, error))
-                goto cleanup;
+    add_link_up(batch, devname, ifindex);
 
-            tmp = tmp->next;
-        }
+    tmp = addrs = gvir_sandbox_config_network_get_addresses(config);
+    while (tmp) {
+        add_address(batch, devname, ifindex, tmp->data);
+        tmp = tmp->next;
+    }
 
-        tmp = routes = gvir_sandbox_config_network_get_routes(config);
-        while (tmp) {
-            GVirSandboxConfigNetworkRoute *route = tmp->data;
+    g_list_foreach(addrs, (GFunc)g_object_unref, NULL);
+    g_list_free(addrs);
+    return TRUE;
+}
 
-            if (!add_route(devname, route, error))
-                goto cleanup;
+static gboolean setup_network_routes(GVirSandboxConfigNetwork *config,
+                                     const gchar *devname,
+                                     GVirSandboxNetlinkBatch *batch,
+                                     GError **error)
+{
+    GList *routes = NULL;
+    GList *tmp;
+    int ifindex;
 
-            tmp = tmp->next;
-        }
-    }
+    if (!(ifindex = get_ifindex(devname, error)))
+        return FALSE;
 
-    ret = TRUE;
+    tmp = routes = gvir_sandbox_config_network_get_routes(config);
+    while (tmp) {
+        add_route(batch, devname, ifindex, tmp->data);
+        tmp = tmp->next;
+    }
 
- cleanup:
-    g_list_foreach(addrs, (GFunc)g_object_unref, NULL);
-    g_list_free(addrs);
     g_list_foreach(routes, (GFunc)g_object_unref, NULL);
     g_list_free(routes);
-    return ret;
+    return TRUE;
 }
 
+/*
+ * All the static interfaces are configured with one batch of
+ * netlink requests. Routes go after every link is up and has
+ * its addresses, so that their gateways are reachable.
+ */
 static gboolean setup_network(GVirSandboxConfig *config, GError **error)
 {
-    int i = 0;
+    int i;
     GList *nets, *tmp;
+    GVirSandboxNetlinkBatch batch;
+    GArray *dhcpPids = g_array_new(FALSE, FALSE, sizeof(GPid));
+    GPtrArray *dhcpDevnames = g_ptr_array_new_with_free_func(g_free);
     gchar *devname = NULL;
     gboolean ret = FALSE;
 
-    nets = tmp = gvir_sandbox_config_get_networks(config);
+    netlink_batch_init(&batch);
+    nets = gvir_sandbox_config_get_networks(config);
 
-    while (tmp) {
+    for (tmp = nets, i = 0; tmp; tmp = tmp->next, i++) {
         GVirSandboxConfigNetwork *netconfig = tmp->data;
 
+        if (gvir_sandbox_config_network_get_dhcp(netconfig))
+            continue;
+
         g_free(devname);
-        devname = g_strdup_printf("eth%d", i++);
-        if (!setup_network_device(netconfig, devname, error))
+        devname = g_strdup_printf("eth%d", i);
+        if (!setup_network_device(netconfig, devname, &batch, error))
             goto cleanup;
+    }
 
-        tmp = tmp->next;
+    for (tmp = nets, i = 0; tmp; tmp = tmp->next, i++) {
+        GVirSandboxConfigNetwork *netconfig = tmp->data;
+
+        if (gvir_sandbox_config_network_get_dhcp(netconfig))
+            continue;
+
+        g_free(devname);
+        devname = g_strdup_printf("eth%d", i);
+        if (!setup_network_routes(netconfig, devname, &batch, error))
+            goto cleanup;
+    }
+
+    if (!netlink_batch_commit(&batch, error))
+        goto cleanup;
+
+    /* All the DHCP clients run in parallel */
+    for (tmp = nets, i = 0; tmp; tmp = tmp->next, i++) {
+        GVirSandboxConfigNetwork *netconfig = tmp->data;
+        GPid pid;
+
+        if (!gvir_sandbox_config_network_get_dhcp(netconfig))
+            continue;
+
+        g_free(devname);
+        devname = g_strdup_printf("eth%d", i);
+        if (!start_dhcp(devname, &pid, error))
+            goto cleanup;
+        g_array_append_val(dhcpPids, pid);
+        g_ptr_array_add(dhcpDevnames, devname);
+        devname = NULL;
     }
 
+    /* Otherwise the clients are reaped by the event loop */
+    if (gvir_sandbox_config_get_network_required(config) &&
+        !wait_dhcp(dhcpPids, dhcpDevnames,
+                   gvir_sandbox_config_get_dhcp_timeout(config), error))
+        goto cleanup;
+
     ret = TRUE;
 
  cleanup:
+    netlink_batch_clear(&batch);
+    g_array_unref(dhcpPids);
+    g_ptr_array_unref(dhcpDevnames);
     g_free(devname);
     g_list_foreach(nets, (GFunc)g_object_unref, NULL);
     g_list_free(nets);
@@ -496,6 +834,14 @@ static gboolean run_command(gboolean interactive, gchar **argv,
                 abort();
         }
 
+        /* SIGCHLD is blocked in the parent for the signalfd */
+        {
+            sigset_t mask;
+            sigemptyset(&mask);
+            sigaddset(&mask, SIGCHLD);
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        }
+
         execv(argv[0], argv);
         fprintf(stderr, "Cannot execute '%s': %s\n", argv[0], strerror(errno));
         exit(EXIT_FAILURE);
@@ -536,12 +882,14 @@ static gboolean run_command(gboolean interactive, gchar **argv,
     return FALSE;
 }
 
-static GVirSandboxRPCPacket *gvir_sandbox_encode_stdout(const gchar *data,
+static GVirSandboxRPCPacket *gvir_sandbox_encode_stdout(GVirSandboxRPCPacketPool *pool,
+                                                        const gchar *data,
                                                         gsize len,
                                                         unsigned int serial,
                                                         GError **error)
 {
-    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_new(FALSE);
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get
+        (pool, FALSE, GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX + len);
 
     pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_STDOUT;
     pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
@@ -564,12 +912,14 @@ static GVirSandboxRPCPacket *gvir_sandbox_encode_stdout(const gchar *data,
 }
 
 
-static GVirSandboxRPCPacket *gvir_sandbox_encode_stderr(const gchar *data,
+static GVirSandboxRPCPacket *gvir_sandbox_encode_stderr(GVirSandboxRPCPacketPool *pool,
+                                                        const gchar *data,
                                                         gsize len,
                                                         unsigned int serial,
                                                         GError **error)
 {
-    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_new(FALSE);
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get
+        (pool, FALSE, GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX + len);
 
     pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_STDERR;
     pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
@@ -589,11 +939,12 @@ static GVirSandboxRPCPacket *gvir_sandbox_encode_stderr(const gchar *data,
 }
 
 
-static GVirSandboxRPCPacket *gvir_sandbox_encode_exit(int status,
+static GVirSandboxRPCPacket *gvir_sandbox_encode_exit(GVirSandboxRPCPacketPool *pool,
+                                                      int status,
                                                       unsigned int serial,
                                                       GError **error)
 {
-    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_new(FALSE);
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(pool, FALSE, 0);
     GVirSandboxProtocolMessageExit msg;
 
     memset(&msg, 0, sizeof(msg));
@@ -620,6 +971,40 @@ static GVirSandboxRPCPacket *gvir_sandbox_encode_exit(int status,
 }
 
 
+static GVirSandboxRPCPacket *gvir_sandbox_encode_credit(GVirSandboxRPCPacketPool *pool,
+                                                        int stream,
+                                                        gsize bytes,
+                                                        unsigned int serial,
+                                                        GError **error)
+{
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(pool, FALSE, 0);
+    GVirSandboxProtocolMessageCredit msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.stream = stream;
+    msg.bytes = bytes;
+
+    pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_CREDIT;
+    pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
+    pkt->header.type = GVIR_SANDBOX_PROTOCOL_TYPE_MESSAGE;
+    pkt->header.serial = serial;
+
+    if (!gvir_sandbox_rpcpacket_encode_header(pkt, error))
+        goto error;
+    if (!gvir_sandbox_rpcpacket_encode_payload_msg(pkt,
+                                                   (xdrproc_t)xdr_GVirSandboxProtocolMessageCredit,
+                                                   (void*)&msg,
+                                                   error))
+        goto error;
+
+    return pkt;
+
+ error:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return NULL;
+}
+
+
 
 
 static gssize read_data(int fd, char *buf, size_t len)
@@ -660,486 +1045,1255 @@ static gssize write_data(int fd, const char *buf, size_t len)
     return got;
 }
 
-typedef enum {
-    GVIR_SANDBOX_CONSOLE_STATE_WAITING,
-    GVIR_SANDBOX_CONSOLE_STATE_SYNCING,
-    GVIR_SANDBOX_CONSOLE_STATE_RUNNING,
-} GVirSandboxConsoleState;
-
-static gboolean eventloop(gboolean interactive,
-                          gchar **appargv,
-                          int sigread,
-                          int host)
+static gssize writev_data(int fd, const struct iovec *iov, int iovcnt)
 {
-    GVirSandboxRPCPacket *rx = NULL;
-    GVirSandboxRPCPacket *tx = NULL;
-    gboolean quit = FALSE;
-    gboolean appOutEOF = FALSE;
-    gboolean appErrEOF = FALSE;
-    gboolean appQuit = FALSE;
-    int exitstatus = 0;
-    gchar *hostToStdin = NULL;
-    gsize hostToStdinLength = 0;
-    gsize hostToStdinOffset = 0;
-    unsigned int serial = 0;
-    pid_t child = 0;
-    int appin = -1;
-    int appout = -1;
-    int apperr = -1;
-    gboolean ret = FALSE;
-    GVirSandboxConsoleState state = GVIR_SANDBOX_CONSOLE_STATE_WAITING;
+    gssize got;
 
-    if (debug)
-        fprintf(stderr, "libvirt-sandbox-init-common: running I/O loop %d %d", appin, appout);
+ rewrite:
+    got = writev(fd, iov, iovcnt);
+    if (got < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        if (errno == EINTR)
+            goto rewrite;
+        if (debug)
+            fprintf(stderr, "Unable to write data: %s\n", strerror(errno));
+        return -1;
+    }
 
+    return got;
+}
 
-    rx = gvir_sandbox_rpcpacket_new(FALSE);
-    rx->bufferLength = 1; /* Ready to get a sync packet */
 
-    while (!quit) {
-        int i;
-        struct pollfd fds[6];
-        size_t nfds = 0;
-        int appinEv = 0;
-        int appoutEv = 0;
-        int apperrEv = 0;
-        int hostEv = 0;
-
-        fds[nfds].fd = sigread;
-        fds[nfds].events = POLLIN;
-        nfds++;
-
-        switch (state) {
-        case GVIR_SANDBOX_CONSOLE_STATE_WAITING:
-            hostEv = POLLIN;
-            break;
-        case GVIR_SANDBOX_CONSOLE_STATE_SYNCING:
-            hostEv = POLLIN;
-            if (tx)
-                hostEv |= POLLOUT;
-            break;
-        case GVIR_SANDBOX_CONSOLE_STATE_RUNNING:
-            if (hostToStdin && appin != -1)
-                appinEv |= POLLOUT;
-            else if (rx != NULL)
-                hostEv |= POLLIN;
-
-            if (tx != NULL)
-                hostEv |= POLLOUT;
-            else {
-                if (!appOutEOF && appout != -1)
-                    appoutEv |= POLLIN;
-                if ((appout != apperr) && !appErrEOF && apperr != -1)
-                    apperrEv |= POLLIN;
-            }
-            break;
-        default:
-            break;
-        }
+/*
+ * Packets queued for sending to the host. Application output
+ * is only read while fewer than GVIR_SANDBOX_TX_RING_DATA packets
+ * are queued, so there is always a free slot left for the exit
+ * status / handshake packets.
+ */
+#define GVIR_SANDBOX_TX_RING_SIZE 16
+#define GVIR_SANDBOX_TX_RING_DATA (GVIR_SANDBOX_TX_RING_SIZE - 1)
 
-        if (appinEv) {
-            fds[nfds].fd = appin;
-            fds[nfds].events = appinEv;
-            nfds++;
-        }
-        if (appoutEv) {
-            fds[nfds].fd = appout;
-            fds[nfds].events = appoutEv;
-            nfds++;
-        }
-        if (apperrEv) {
-            fds[nfds].fd = apperr;
-            fds[nfds].events = apperrEv;
-            nfds++;
-        }
-        if (hostEv) {
-            fds[nfds].fd = host;
-            fds[nfds].events = hostEv;
-            nfds++;
-        }
+/*
+ * With protocol v2, consumed stdin is credited back to the
+ * host in batches of this size, rather than per packet.
+ */
+#define GVIR_SANDBOX_CREDIT_BATCH (GVIR_SANDBOX_PROTOCOL_WINDOW_INITIAL / 4)
 
-    repoll:
-        if (poll(fds, nfds, -1) < 0) {
-            if (errno == EINTR)
-                goto repoll;
-            if (debug)
-                fprintf(stderr, "Poll error:%s\n",
-                        strerror(errno));
-            return -1;
-        }
+/* Smaller data packets are not worth compressing */
+#define GVIR_SANDBOX_COMPRESS_MIN 256
 
-        for (i = 0 ; i < nfds ; i++) {
-            gssize got;
-
-            if (fds[i].fd == sigread) {
-                /* The self-pipe signal handler */
-                if (fds[i].revents) {
-                    char ignore;
-                    pid_t rv;
-                    if (read(sigread, &ignore, 1) != 1)
-                        goto cleanup;
-                    while (1) {
-                        rv = waitpid(-1, &exitstatus, WNOHANG);
-                        if (rv == -1 || rv == 0)
-                            break;
-                        if (rv == child) {
-                            appQuit = TRUE;
-                            if (appErrEOF && appOutEOF) {
-                                if (debug)
-                                    fprintf(stderr, "Encoding exit status sigchild %d\n", exitstatus);
-                                if (!(tx = gvir_sandbox_encode_exit(exitstatus, serial++, NULL)))
-                                    goto cleanup;
-                            }
-                        }
-                    }
-                }
-            } else if (fds[i].fd == host) {
-                /* The channel to the virt-sandbox library client in host */
-                if (fds[i].revents & POLLIN) {
-                    if (debug)
-                        fprintf(stderr, "host readable\n");
-                    if (rx) {
-                    readmore:
-                        got = read_data(host,
-                                        rx->buffer + rx->bufferOffset,
-                                        rx->bufferLength - rx->bufferOffset);
-                        if (debug)
-                            fprintf(stderr, "read %zd %zu %zu\n", got, rx->bufferLength, rx->bufferOffset);
-                        if (got <= 0) {
-                            gvir_sandbox_rpcpacket_free(rx);
-                            rx = NULL;
-                            quit = TRUE;
-                        } else {
-                            rx->bufferOffset += got;
-                            if (rx->bufferLength == rx->bufferOffset) {
-                                switch (state) {
-                                case GVIR_SANDBOX_CONSOLE_STATE_WAITING:
-                                    /* We now expect a 'wait' byte. Anything else is bad */
-                                    if (rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT) {
-                                        if (debug)
-                                            fprintf(stderr, "Unexpected syntax byte %d",
-                                                    rx->buffer[0]);
-                                        goto cleanup;
-                                    }
-                                    state = GVIR_SANDBOX_CONSOLE_STATE_SYNCING;
-                                    if (debug)
-                                        fprintf(stderr, "Sending sync confirm\n");
-
-                                    /* Great, we can sync with the host now */
-                                    tx = gvir_sandbox_rpcpacket_new(FALSE);
-                                    tx->buffer[0] = GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC;
-                                    tx->bufferLength = 1;
-                                    tx->bufferOffset = 0;
-
-                                    rx->bufferLength = 1;
-                                    rx->bufferOffset = 0;
-                                    break;
-
-                                case GVIR_SANDBOX_CONSOLE_STATE_SYNCING:
-                                    /* We now expect a 'sync' byte. We might still get a few
-                                     * 'wait' bytes which we need to ignore. Anything else is bad
-                                     */
-                                    if (rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT &&
-                                        rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC) {
-                                        if (debug)
-                                            fprintf(stderr, "Unexpected syntax byte %d",
-                                                    rx->buffer[0]);
-                                        goto cleanup;
-                                    }
-                                    /* We've got a 'sync' from the host. Now we can launch
-                                     * the command we know neither side will loose any I/O
-                                     */
-                                    if (rx->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC) {
-                                        if (debug)
-                                            fprintf(stderr, "Running command\n");
-                                        if (!run_command(interactive,
-                                                         appargv,
-                                                         &child,
-                                                         &appin,
-                                                         &appout,
-                                                         &apperr)) {
-                                            if (debug)
-                                                fprintf(stderr, "Failed to run command\n");
-                                            goto cleanup;
-                                        }
-                                        state = GVIR_SANDBOX_CONSOLE_STATE_RUNNING;
-                                        rx->bufferLength = 4;
-                                        rx->bufferOffset = 0;
-                                    } else {
-                                        if (debug)
-                                            fprintf(stderr, "Ignoring delayed wait\n");
-                                        rx->bufferLength = 1;
-                                        rx->bufferOffset = 0;
-                                    }
-                                    break;
-
-                                case GVIR_SANDBOX_CONSOLE_STATE_RUNNING:
-                                    if (debug)
-                                        fprintf(stderr, "Read packet %zu\n", rx->bufferLength);
-                                    if (rx->bufferLength == GVIR_SANDBOX_PROTOCOL_LEN_MAX) {
-                                        GError *error = NULL;
-                                        if (!gvir_sandbox_rpcpacket_decode_length(rx, &error)) {
-                                            if (debug)
-                                                fprintf(stderr, "Cannot decode length %zu: %s\n",
-                                                        rx->bufferLength, error->message);
-                                            goto cleanup;
-                                        }
-                                        goto readmore;
-                                    } else {
-                                        if (!gvir_sandbox_rpcpacket_decode_header(rx, NULL)) {
-                                            if (debug)
-                                                fprintf(stderr, "Cannot decode header %zu\n", rx->bufferLength);
-                                            goto cleanup;
-                                        }
-
-                                        switch (rx->header.proc) {
-                                        case GVIR_SANDBOX_PROTOCOL_PROC_STDIN:
-                                            if (rx->bufferLength - rx->bufferOffset) {
-                                                hostToStdinOffset = 0;
-                                                hostToStdinLength = rx->bufferLength - rx->bufferOffset;
-                                                hostToStdin = g_new0(gchar, hostToStdinLength);
-                                                memcpy(hostToStdin,
-                                                       rx->buffer + rx->bufferOffset,
-                                                       hostToStdinLength);
-                                                if (debug)
-                                                    fprintf(stderr, "Processed stdin %zu\n", hostToStdinLength);
-                                            } else {
-                                                close(appin);
-                                                appin = -1;
-                                            }
-                                            break;
-
-                                        case GVIR_SANDBOX_PROTOCOL_PROC_QUIT:
-                                            quit = TRUE;
-                                            break;
-
-                                        case GVIR_SANDBOX_PROTOCOL_PROC_STDOUT:
-                                        case GVIR_SANDBOX_PROTOCOL_PROC_STDERR:
-                                        case GVIR_SANDBOX_PROTOCOL_PROC_EXIT:
-                                        default:
-                                            if (debug)
-                                                fprintf(stderr, "Unexpected proc %u\n", rx->header.proc);
-                                            goto cleanup;
-                                        }
-                                    }
-                                    gvir_sandbox_rpcpacket_free(rx);
-                                    rx = NULL;
-                                    break;
-                                default:
-                                    if (debug)
-                                        fprintf(stderr, "Unexpected state %d\n", state);
-                                    break;
-                                }
-                            }
-                        }
-                    }
-                    fds[i].revents &= ~(POLLIN);
-                }
-                if (fds[i].revents & POLLOUT) {
-                    if (debug)
-                        fprintf(stderr, "Host writable\n");
-                    if (tx) {
-                        got = write_data(host,
-                                         tx->buffer + tx->bufferOffset,
-                                         tx->bufferLength - tx->bufferOffset);
-                        if (got < 0) {
-                            if (debug)
-                                fprintf(stderr, "Cannot write packet to host %s\n",
-                                        strerror(errno));
-                            gvir_sandbox_rpcpacket_free(tx);
-                            tx = NULL;
-                            quit = TRUE;
-                        } else {
-                            tx->bufferOffset += got;
-                            if (tx->bufferOffset == tx->bufferLength) {
-                                if (debug)
-                                    fprintf(stderr, "Wrote packet %zu to host\n",
-                                            tx->bufferOffset);
-                                gvir_sandbox_rpcpacket_free(tx);
-                                tx = NULL;
-                            }
-                        }
-                    }
-                    fds[i].revents &= ~(POLLOUT);
-                }
-                if (fds[i].revents) {
-                    quit = TRUE;
-                }
-            } else if (fds[i].fd == appin &&
-                       fds[i].fd == appout) {
-                /* The child application, when using a psuedo-tty */
-                if (fds[i].revents & POLLIN) {
-                    if (!tx) {
-                        gsize len = 4096;
-                        gchar *buf = g_new0(gchar, len);
-                        got = read_data(appout, buf, len);
-                        if (got <= 0) {
-                            if (got < 0 && debug)
-                                fprintf(stderr, "Failed to read from app %s\n",
-                                        strerror(errno));
-                            appOutEOF = TRUE;
-                            appErrEOF = TRUE;
-                            if (appQuit) {
-                                if (debug)
-                                    fprintf(stderr, "Encoding exit status appout tty %d\n", exitstatus);
-                                if (!(tx = gvir_sandbox_encode_exit(exitstatus, serial++, NULL)))
-                                    goto cleanup;
-                            }
-                        } else {
-                            if (!(tx = gvir_sandbox_encode_stdout(buf, got, serial++, NULL))) {
-                                g_free(buf);
-                                if (debug)
-                                    fprintf(stderr, "Failed to encode stdout\n");
-                                goto cleanup;
-                            }
-                        }
-                        g_free(buf);
-                    }
-                    fds[i].revents &= ~(POLLIN | POLLHUP);
-                }
-                if (fds[i].revents & POLLOUT) {
-                    if (hostToStdin) {
-                        got = write_data(appin,
-                                         hostToStdin + hostToStdinOffset,
-                                         hostToStdinLength - hostToStdinOffset);
-                        if (got < 0) {
-                            if (debug)
-                                fprintf(stderr, "Failed to write to app %s\n",
-                                        strerror(errno));
-                            g_free(hostToStdin);
-                            hostToStdin = NULL;
-                            hostToStdinLength = hostToStdinOffset = 0;
-                        } else {
-                            hostToStdinOffset += got;
-                            if (hostToStdinOffset == hostToStdinLength) {
-                                g_free(hostToStdin);
-                                hostToStdin = NULL;
-                                hostToStdinLength = hostToStdinOffset = 0;
-                                rx = gvir_sandbox_rpcpacket_new(TRUE);
-                            }
-                        }
-                    }
-                    fds[i].revents &= ~(POLLOUT | POLLHUP);
-                }
-                if (fds[i].revents & POLLHUP) {
-                    appOutEOF = TRUE;
-                    appErrEOF = TRUE;
-                    if (appQuit) {
-                        if (debug)
-                            fprintf(stderr, "Encoding exit status due to HUP %d\n", exitstatus);
-                        if (!(tx = gvir_sandbox_encode_exit(exitstatus, serial++, NULL)))
-                            goto cleanup;
-                    }
-                }
-            } else if (fds[i].fd == appin) {
-                /* The child stdin when using a plain pipe */
-                if (fds[i].revents && hostToStdin) {
-                    got = write_data(appin,
-                                     hostToStdin + hostToStdinOffset,
-                                     hostToStdinLength - hostToStdinOffset);
-                    if (got < 0) {
-                        g_free(hostToStdin);
-                        hostToStdin = NULL;
-                        hostToStdinLength = hostToStdinOffset = 0;
-                    } else {
-                        hostToStdinOffset += got;
-                        if (hostToStdinOffset == hostToStdinLength) {
-                            g_free(hostToStdin);
-                            hostToStdin = NULL;
-                            hostToStdinLength = hostToStdinOffset = 0;
-                            rx = gvir_sandbox_rpcpacket_new(TRUE);
-                        }
-                    }
+typedef struct {
+    GVirSandboxRPCPacket *pkts[GVIR_SANDBOX_TX_RING_SIZE];
+    gsize head;
+    gsize count;
+    gsize compressed; /* Leading packets already considered for compression */
+} GVirSandboxTxRing;
+
+static void tx_ring_push(GVirSandboxTxRing *ring,
+                         GVirSandboxRPCPacket *pkt)
+{
+    g_assert(ring->count < GVIR_SANDBOX_TX_RING_SIZE);
+    ring->pkts[(ring->head + ring->count) % GVIR_SANDBOX_TX_RING_SIZE] = pkt;
+    ring->count++;
+}
+
+static void tx_ring_pop(GVirSandboxTxRing *ring)
+{
+    gvir_sandbox_rpcpacket_free(ring->pkts[ring->head]);
+    ring->pkts[ring->head] = NULL;
+    ring->head = (ring->head + 1) % GVIR_SANDBOX_TX_RING_SIZE;
+    ring->count--;
+    if (ring->compressed)
+        ring->compressed--;
+}
+
+static void tx_ring_clear(GVirSandboxTxRing *ring)
+{
+    while (ring->count)
+        tx_ring_pop(ring);
+}
+
+static gboolean tx_ring_can_read(GVirSandboxTxRing *ring)
+{
+    return ring->count < GVIR_SANDBOX_TX_RING_DATA;
+}
+
+/*
+ * Queue output from the application, appending to the last
+ * queued packet if it is for the same stream and has not
+ * started to be sent yet, so that many small reads are sent
+ * as a few large packets.
+ */
+static gboolean tx_ring_queue_data(GVirSandboxTxRing *ring,
+                                   GVirSandboxRPCPacketPool *pool,
+                                   int proc,
+                                   const gchar *data,
+                                   gsize len,
+                                   unsigned int *serial)
+{
+    GVirSandboxRPCPacket *pkt = NULL;
+
+    if (ring->count)
+        pkt = ring->pkts[(ring->head + ring->count - 1) % GVIR_SANDBOX_TX_RING_SIZE];
+
+    if (pkt &&
+        pkt->bufferOffset == 0 &&
+        pkt->header.type == GVIR_SANDBOX_PROTOCOL_TYPE_DATA &&
+        pkt->header.proc == proc) {
+        gsize avail = GVIR_SANDBOX_PROTOCOL_LEN_MAX +
+            GVIR_SANDBOX_PROTOCOL_PACKET_MAX - pkt->bufferLength;
+        gsize want = MIN(avail, len);
+
+        if (want &&
+            !gvir_sandbox_rpcpacket_append_payload_raw(pkt, data, want, NULL))
+            return FALSE;
+        data += want;
+        len -= want;
+    }
+
+    if (!len)
+        return TRUE;
+
+    if (proc == GVIR_SANDBOX_PROTOCOL_PROC_STDOUT)
+        pkt = gvir_sandbox_encode_stdout(pool, data, len, (*serial)++, NULL);
+    else
+        pkt = gvir_sandbox_encode_stderr(pool, data, len, (*serial)++, NULL);
+    if (!pkt)
+        return FALSE;
+
+    tx_ring_push(ring, pkt);
+    return TRUE;
+}
+
+static gboolean tx_ring_queue_exit(GVirSandboxTxRing *ring,
+                                   GVirSandboxRPCPacketPool *pool,
+                                   int status,
+                                   unsigned int *serial)
+{
+    GVirSandboxRPCPacket *pkt;
+
+    if (!(pkt = gvir_sandbox_encode_exit(pool, status, (*serial)++, NULL)))
+        return FALSE;
+
+    tx_ring_push(ring, pkt);
+    return TRUE;
+}
+
+static gboolean tx_ring_queue_credit(GVirSandboxTxRing *ring,
+                                     GVirSandboxRPCPacketPool *pool,
+                                     int stream,
+                                     gsize bytes,
+                                     unsigned int *serial)
+{
+    GVirSandboxRPCPacket *pkt;
+
+    if (!(pkt = gvir_sandbox_encode_credit(pool, stream, bytes, (*serial)++, NULL)))
+        return FALSE;
+
+    tx_ring_push(ring, pkt);
+    return TRUE;
+}
+
+/*
+ * Compress the payload of data packets queued since the
+ * last call, once they're about to be sent and so can't
+ * have any more output appended. Packets which don't
+ * compress well are left to be sent as is.
+ */
+static void tx_ring_compress(GVirSandboxTxRing *ring,
+                             GVirSandboxRPCPacketPool *pool,
+                             guint format)
+{
+    for (; ring->compressed < ring->count ; ring->compressed++) {
+        gsize idx = (ring->head + ring->compressed) % GVIR_SANDBOX_TX_RING_SIZE;
+        GVirSandboxRPCPacket *pkt = ring->pkts[idx];
+        GVirSandboxRPCPacket *zpkt;
+
+        if (pkt->bufferOffset != 0 ||
+            pkt->header.type != GVIR_SANDBOX_PROTOCOL_TYPE_DATA ||
+            pkt->bufferLength < (GVIR_SANDBOX_PROTOCOL_LEN_MAX +
+                                 GVIR_SANDBOX_PROTOCOL_HEADER_MAX +
+                                 GVIR_SANDBOX_COMPRESS_MIN))
+            continue;
+
+        if (!(zpkt = gvir_sandbox_rpcpacket_compress_payload(pool, pkt, format)))
+            continue;
+
+        if (debug)
+            fprintf(stderr, "Compressed packet %zu to %zu\n",
+                    pkt->bufferLength, zpkt->bufferLength);
+        gvir_sandbox_rpcpacket_free(pkt);
+        ring->pkts[idx] = zpkt;
+    }
+}
+
+/*
+ * Send as much of the queued packets as the host will
+ * take in one go, releasing those fully written.
+ */
+static gssize tx_ring_write(GVirSandboxTxRing *ring, int fd)
+{
+    struct iovec iov[GVIR_SANDBOX_TX_RING_SIZE];
+    gsize i;
+    gssize got, done;
+
+    for (i = 0 ; i < ring->count ; i++) {
+        GVirSandboxRPCPacket *pkt = ring->pkts[(ring->head + i) % GVIR_SANDBOX_TX_RING_SIZE];
+        iov[i].iov_base = pkt->buffer + pkt->bufferOffset;
+        iov[i].iov_len = pkt->bufferLength - pkt->bufferOffset;
+    }
+
+    if ((got = writev_data(fd, iov, ring->count)) <= 0)
+        return got;
+
+    done = got;
+    while (done > 0) {
+        GVirSandboxRPCPacket *pkt = ring->pkts[ring->head];
+        gsize want = pkt->bufferLength - pkt->bufferOffset;
+
+        if (done < want) {
+            pkt->bufferOffset += done;
+            break;
+        }
+        if (debug)
+            fprintf(stderr, "Wrote packet %zu to host\n", pkt->bufferLength);
+        done -= want;
+        tx_ring_pop(ring);
+    }
+
+    return got;
+}
+
+
+/*
+ * Write as much of the queued stdin packets to the application
+ * as it will take, releasing those fully written.
+ *
+ * Returns the payload size written, -1 upon error
+ */
+static gssize stdin_queue_write(GQueue *queue, int fd)
+{
+    GVirSandboxRPCPacket *pkt;
+    gssize done = 0;
+
+    while ((pkt = g_queue_peek_head(queue))) {
+        gssize got = write_data(fd,
+                                pkt->buffer + pkt->bufferOffset,
+                                pkt->bufferLength - pkt->bufferOffset);
+        if (got < 0)
+            return -1;
+        if (got == 0)
+            break;
+
+        done += got;
+        pkt->bufferOffset += got;
+        if (pkt->bufferOffset == pkt->bufferLength) {
+            g_queue_pop_head(queue);
+            gvir_sandbox_rpcpacket_free(pkt);
+        }
+    }
+
+    return done;
+}
+
+static gsize stdin_queue_clear(GQueue *queue)
+{
+    GVirSandboxRPCPacket *pkt;
+    gsize dropped = 0;
+
+    while ((pkt = g_queue_pop_head(queue))) {
+        dropped += pkt->bufferLength - pkt->bufferOffset;
+        gvir_sandbox_rpcpacket_free(pkt);
+    }
+
+    return dropped;
+}
+
+/*
+ * Forward queued stdin to the application, closing its
+ * stdin once everything is written if the host has sent
+ * EOF. Data which can't be written is discarded.
+ *
+ * Returns the payload size consumed from the queue
+ */
+static gsize stdin_queue_forward(GQueue *queue, int *appin, gboolean eof)
+{
+    gssize got = stdin_queue_write(queue, *appin);
+
+    if (got < 0)
+        got = stdin_queue_clear(queue);
+
+    if (eof && g_queue_is_empty(queue)) {
+        close(*appin);
+        *appin = -1;
+    }
+
+    return got;
+}
+
+
+/*
+ * Whether @fd can be written to right now, without waiting
+ */
+static gboolean fd_writable(int fd)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLOUT);
+}
+
+
+static gboolean write_all(int fd, const char *buf, size_t len)
+{
+    while (len) {
+        gssize got = write_data(fd, buf, len);
+        if (got < 0)
+            return FALSE;
+        buf += got;
+        len -= got;
+    }
+    return TRUE;
+}
+
+
+/*
+ * Send whatever output the application has waiting in its
+ * pipe, up to @max bytes, to the host as a single packet. Only the length word
+ * and header are encoded here, the payload is moved from the
+ * pipe to the host with splice(), avoiding copying it through
+ * userspace twice. If the host device can't splice, the rest
+ * is copied via @buf, and @canSplice is cleared so later
+ * output goes via the normal queue.
+ *
+ * Must only be called when no other packets are queued, so
+ * that ordering is preserved, and only when the host is
+ * writable, since the host fd is blocking and the loop would
+ * otherwise stall, stdin included, while the host isn't reading.
+ *
+ * Returns the payload size sent, 0 upon EOF, -1 upon error.
+ * After an error the host may have been sent a header without
+ * all of its payload, so the session can't continue.
+ */
+static gssize splice_output(GVirSandboxRPCPacketPool *pool,
+                            int fd,
+                            int host,
+                            int proc,
+                            gsize max,
+                            unsigned int *serial,
+                            gchar *buf,
+                            gboolean *canSplice)
+{
+    GVirSandboxRPCPacket *pkt = NULL;
+    int avail = 0;
+    gsize len, done = 0;
+    gssize ret = -1;
+
+    if (ioctl(fd, FIONREAD, &avail) < 0) {
+        if (debug)
+            fprintf(stderr, "Unable to query pipe size: %s\n", strerror(errno));
+        return -1;
+    }
+    /* Readable with nothing to read means the writer went away */
+    if (avail <= 0)
+        return 0;
+
+    len = MIN(avail, max);
+
+    pkt = gvir_sandbox_rpcpacket_pool_get(pool, FALSE, 0);
+    pkt->header.proc = proc;
+    pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
+    pkt->header.type = GVIR_SANDBOX_PROTOCOL_TYPE_DATA;
+    pkt->header.serial = (*serial)++;
+
+    if (!gvir_sandbox_rpcpacket_encode_header(pkt, NULL) ||
+        !gvir_sandbox_rpcpacket_encode_payload_external(pkt, len, NULL))
+        goto cleanup;
+
+    if (!write_all(host, pkt->buffer, pkt->bufferLength))
+        goto cleanup;
+
+    /* The header is out, so exactly @len bytes must follow */
+    while (done < len) {
+        gssize got;
+
+        if (*canSplice) {
+            got = splice(fd, NULL, host, NULL, len - done,
+                         SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (got < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                if (debug)
+                    fprintf(stderr, "Host does not support splice, copying\n");
+                *canSplice = FALSE;
+                continue;
+            }
+            if (got < 0 && errno == EINTR)
+                continue;
+        } else {
+            got = read_data(fd, buf, MIN(len - done, GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX));
+            if (got > 0 && !write_all(host, buf, got))
+                got = -1;
+        }
+        if (got <= 0) {
+            if (debug)
+                fprintf(stderr, "Unable to forward output: %s\n", strerror(errno));
+            goto cleanup;
+        }
+        done += got;
+    }
+
+    ret = len;
+
+ cleanup:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return ret;
+}
+
+
+/*
+ * The set of file descriptors currently registered with
+ * epoll, along with their event masks and the roles they
+ * play in the loop. The registrations persist across
+ * iterations of the event loop, and are only touched when
+ * the wanted events for a descriptor change. The roles are
+ * stored in the epoll data, to pick the handler for an event.
+ */
+#define GVIR_SANDBOX_WATCH_MAX 4
+
+typedef enum {
+    GVIR_SANDBOX_WATCH_SIGNAL = (1 << 0),
+    GVIR_SANDBOX_WATCH_HOST = (1 << 1),
+    GVIR_SANDBOX_WATCH_APPIN = (1 << 2),
+    GVIR_SANDBOX_WATCH_APPOUT = (1 << 3),
+    GVIR_SANDBOX_WATCH_APPERR = (1 << 4),
+} GVirSandboxWatchRole;
+
+typedef struct {
+    int fd[GVIR_SANDBOX_WATCH_MAX];
+    guint32 events[GVIR_SANDBOX_WATCH_MAX];
+    guint32 roles[GVIR_SANDBOX_WATCH_MAX];
+    gsize nfds;
+} GVirSandboxWatchSet;
+
+static void watch_set_add(GVirSandboxWatchSet *set,
+                          int fd,
+                          guint32 events,
+                          GVirSandboxWatchRole role)
+{
+    gsize i;
+
+    if (fd == -1 || !events)
+        return;
+
+    /* The pty master is used for both stdin & stdout */
+    for (i = 0 ; i < set->nfds ; i++) {
+        if (set->fd[i] == fd) {
+            set->events[i] |= events;
+            set->roles[i] |= role;
+            return;
+        }
+    }
+
+    g_assert(set->nfds < GVIR_SANDBOX_WATCH_MAX);
+    set->fd[set->nfds] = fd;
+    set->events[set->nfds] = events;
+    set->roles[set->nfds] = role;
+    set->nfds++;
+}
+
+static gboolean watch_set_apply(int epfd,
+                                GVirSandboxWatchSet *cur,
+                                const GVirSandboxWatchSet *want)
+{
+    struct epoll_event ev;
+    gsize i, j;
+
+    for (i = 0 ; i < cur->nfds ; i++) {
+        for (j = 0 ; j < want->nfds ; j++) {
+            if (want->fd[j] == cur->fd[i])
+                break;
+        }
+        /* The descriptor may already have been closed, in
+         * which case the kernel dropped it from the set */
+        if (j == want->nfds)
+            epoll_ctl(epfd, EPOLL_CTL_DEL, cur->fd[i], NULL);
+    }
+
+    for (j = 0 ; j < want->nfds ; j++) {
+        int op = EPOLL_CTL_ADD;
+        for (i = 0 ; i < cur->nfds ; i++) {
+            if (cur->fd[i] == want->fd[j]) {
+                op = EPOLL_CTL_MOD;
+                break;
+            }
+        }
+        if (op == EPOLL_CTL_MOD &&
+            cur->events[i] == want->events[j] &&
+            cur->roles[i] == want->roles[j])
+            continue;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = want->events[j];
+        ev.data.u32 = want->roles[j];
+        if (epoll_ctl(epfd, op, want->fd[j], &ev) < 0) {
+            /* Already closed, eg the pty master after stdin EOF */
+            if (errno == EBADF)
+                continue;
+            if (debug)
+                fprintf(stderr, "Unable to watch fd %d: %s\n",
+                        want->fd[j], strerror(errno));
+            return FALSE;
+        }
+    }
+
+    *cur = *want;
+    return TRUE;
+}
+
+
+typedef enum {
+    GVIR_SANDBOX_CONSOLE_STATE_WAITING,
+    GVIR_SANDBOX_CONSOLE_STATE_SYNCING,
+    GVIR_SANDBOX_CONSOLE_STATE_RUNNING,
+} GVirSandboxConsoleState;
+
+/* The wait status reported when there is no command to run */
+#define GVIR_SANDBOX_RELOAD_FAILED_STATUS (255 << 8)
+
+/*
+ * A sandbox started ahead of time by a pool does not know
+ * what it will run until the host attaches, at which point
+ * the host has rewritten the command in the config. Running
+ * anything else would be wrong, so returns NULL if the config
+ * can't be read.
+ */
+static gchar **reload_command(const gchar *configfile)
+{
+    GVirSandboxConfig *config;
+    GError *error = NULL;
+    gchar **command;
+
+    if (!(config = gvir_sandbox_config_load_from_path(configfile, &error))) {
+        g_printerr(_("libvirt-sandbox-init-common: unable to reload config %s: %s\n"),
+                   configfile, error->message);
+        g_error_free(error);
+        return NULL;
+    }
+
+    command = gvir_sandbox_config_get_command(config);
+    g_object_unref(config);
+
+    if (!command || !command[0]) {
+        g_printerr(_("libvirt-sandbox-init-common: no command in config %s\n"),
+                   configfile);
+        g_strfreev(command);
+        return NULL;
+    }
+
+    return command;
+}
+
+/*
+ * The state shared by the event loop handlers
+ */
+typedef struct {
+    gboolean interactive;
+    const gchar *configfile;
+    int host;
+    GVirSandboxRPCPacketPool *pool;
+    GVirSandboxRPCPacket *rx;
+    GVirSandboxTxRing tx;
+    /* Packets from the host, whose payload is written to the app */
+    GQueue stdinQueue;
+    gboolean stdinEOF;
+    gchar *appbuf;
+    /* Batch (non-tty) output bypasses the queue when it can */
+    gboolean canSplice;
+    gboolean quit;
+    gboolean appOutEOF;
+    gboolean appErrEOF;
+    gboolean appQuit;
+    int exitstatus;
+    unsigned int serial;
+    /* The protocol version agreed with the host. Version 1 has
+     * no flow control, so its windows are never exhausted */
+    int version;
+    gsize stdoutCredit;
+    gsize stderrCredit;
+    gsize stdinConsumed;
+    /* Compression format for output, if the host offered one */
+    guint compress;
+    pid_t child;
+    int appin;
+    int appout;
+    int apperr;
+    GVirSandboxConsoleState state;
+} GVirSandboxEventLoop;
+
+
+/*
+ * Once the application has exited and all its output has
+ * been read, tell the host its exit status
+ */
+static gboolean eventloop_queue_exit(GVirSandboxEventLoop *loop,
+                                     const char *why)
+{
+    if (!(loop->appQuit && loop->appOutEOF && loop->appErrEOF))
+        return TRUE;
+
+    if (debug)
+        fprintf(stderr, "Encoding exit status %s %d\n", why, loop->exitstatus);
+    return tx_ring_queue_exit(&loop->tx, loop->pool,
+                              loop->exitstatus, &loop->serial);
+}
+
+
+static gboolean eventloop_signal(GVirSandboxEventLoop *loop,
+                                 int sigfd)
+{
+    /* SIGCHLD delivered through the signalfd */
+    struct signalfd_siginfo info;
+    int status;
+    pid_t rv;
+
+    if (read(sigfd, &info, sizeof(info)) != sizeof(info))
+        return FALSE;
+
+    /* Other children, such as DHCP clients, are reaped too,
+     * but only the application's status is reported */
+    while (1) {
+        rv = waitpid(-1, &status, WNOHANG);
+        if (rv == -1 || rv == 0)
+            break;
+        if (rv == loop->child) {
+            loop->exitstatus = status;
+            loop->appQuit = TRUE;
+            if (!eventloop_queue_exit(loop, "sigchild"))
+                return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * Act on a complete packet in loop->rx, setting up
+ * loop->rx for the next one to be read
+ */
+static gboolean eventloop_host_packet(GVirSandboxEventLoop *loop)
+{
+    GVirSandboxRPCPacket *rx = loop->rx;
+    GVirSandboxRPCPacket *pkt;
+
+    switch (loop->state) {
+    case GVIR_SANDBOX_CONSOLE_STATE_WAITING:
+        /* We now expect a 'wait' byte, whose value says which
+         * protocol version the host offers. Anything else is bad */
+        if (rx->buffer[0] == GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT_V2) {
+            loop->version = 2;
+        } else if (rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT) {
+            if (debug)
+                fprintf(stderr, "Unexpected syntax byte %d",
+                        rx->buffer[0]);
+            return FALSE;
+        }
+        loop->state = GVIR_SANDBOX_CONSOLE_STATE_SYNCING;
+        if (debug)
+            fprintf(stderr, "Sending sync confirm v%d\n", loop->version);
+
+        /* Great, we can sync with the host now */
+        pkt = gvir_sandbox_rpcpacket_pool_get(loop->pool, FALSE, 0);
+        pkt->buffer[0] = loop->version >= 2 ?
+            GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC_V2 :
+            GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC;
+        pkt->bufferLength = 1;
+        pkt->bufferOffset = 0;
+        tx_ring_push(&loop->tx, pkt);
+
+        rx->bufferLength = 1;
+        rx->bufferOffset = 0;
+        break;
+
+    case GVIR_SANDBOX_CONSOLE_STATE_SYNCING:
+        /* We now expect a 'sync' byte. We might still get a few
+         * 'wait' bytes which we need to ignore. Anything else is bad
+         */
+        if (rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT &&
+            rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT_V2 &&
+            rx->buffer[0] != (loop->version >= 2 ?
+                              GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC_V2 :
+                              GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC)) {
+            if (debug)
+                fprintf(stderr, "Unexpected syntax byte %d",
+                        rx->buffer[0]);
+            return FALSE;
+        }
+        /* We've got a 'sync' from the host. Now we can launch
+         * the command we know neither side will loose any I/O
+         */
+        if (rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT &&
+            rx->buffer[0] != GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT_V2) {
+            gchar **command = reload_command(loop->configfile);
+            loop->state = GVIR_SANDBOX_CONSOLE_STATE_RUNNING;
+            if (loop->version >= 2)
+                loop->stdoutCredit = loop->stderrCredit =
+                    GVIR_SANDBOX_PROTOCOL_WINDOW_INITIAL;
+            if (!command) {
+                /* Report the failure as if the command had run
+                 * and exited, instead of running something else */
+                loop->appQuit = loop->appOutEOF = loop->appErrEOF = TRUE;
+                loop->exitstatus = GVIR_SANDBOX_RELOAD_FAILED_STATUS;
+                if (!eventloop_queue_exit(loop, "config reload failed"))
+                    return FALSE;
+            } else {
+                gboolean started;
+                if (debug)
+                    fprintf(stderr, "Running command\n");
+                started = run_command(loop->interactive,
+                                      command,
+                                      &loop->child,
+                                      &loop->appin,
+                                      &loop->appout,
+                                      &loop->apperr);
+                g_strfreev(command);
+                if (!started) {
+                    if (debug)
+                        fprintf(stderr, "Failed to run command\n");
+                    return FALSE;
                 }
-            } else if (fds[i].fd == appout) {
-                /* The child stdout when using a plain pipe */
-                if (fds[i].revents && !tx) {
-                    if (!tx) {
-                        gsize len = 4096;
-                        gchar *buf = g_new0(gchar, len);
-                        got = read_data(appout, buf, len);
-                        if (got <= 0) {
-                            appOutEOF = TRUE;
-                            if (appErrEOF && appQuit) {
-                                if (debug)
-                                    fprintf(stderr, "Encoding exit status appout %d\n", exitstatus);
-                                if (!(tx = gvir_sandbox_encode_exit(exitstatus, serial++, NULL)))
-                                    goto cleanup;
-                            }
-                        } else {
-                            if (!(tx = gvir_sandbox_encode_stdout(buf, got, serial++, NULL))) {
-                                g_free(buf);
-                                goto cleanup;
-                            }
-                        }
-                        g_free(buf);
-                    }
+            }
+            rx->bufferLength = 4;
+            rx->bufferOffset = 0;
+        } else {
+            if (debug)
+                fprintf(stderr, "Ignoring delayed wait\n");
+            rx->bufferLength = 1;
+            rx->bufferOffset = 0;
+        }
+        break;
+
+    case GVIR_SANDBOX_CONSOLE_STATE_RUNNING:
+        if (!gvir_sandbox_rpcpacket_decode_header(rx, NULL)) {
+            if (debug)
+                fprintf(stderr, "Cannot decode header %zu\n", rx->bufferLength);
+            return FALSE;
+        }
+
+        switch (rx->header.proc) {
+        case GVIR_SANDBOX_PROTOCOL_PROC_STDIN:
+            if (rx->bufferLength - rx->bufferOffset) {
+                if (debug)
+                    fprintf(stderr, "Processed stdin %zu\n",
+                            rx->bufferLength - rx->bufferOffset);
+                if (loop->appin == -1 || loop->stdinEOF) {
+                    /* Nowhere for it to go */
+                    loop->stdinConsumed += rx->bufferLength - rx->bufferOffset;
+                } else {
+                    /* Write straight out of the packet
+                     * rather than copying the payload */
+                    g_queue_push_tail(&loop->stdinQueue, rx);
+                    rx = loop->rx = NULL;
                 }
-            } else if (fds[i].fd == apperr) {
-                /* The child stderr when using a plain pipe */
-                if (fds[i].revents && !tx) {
-                    if (!tx) {
-                        gsize len = 4096;
-                        gchar *buf = g_new0(gchar, len);
-                        got = read_data(apperr, buf, len);
-                        if (got <= 0) {
-                            appErrEOF = TRUE;
-                            if (appOutEOF && appQuit) {
-                                if (debug)
-                                    fprintf(stderr, "Encoding exit status apperr %d\n", exitstatus);
-                                if (!(tx = gvir_sandbox_encode_exit(exitstatus, serial++, NULL)))
-                                    goto cleanup;
-                            }
-                        } else {
-                            if (!(tx = gvir_sandbox_encode_stderr(buf, got, serial++, NULL))) {
-                                g_free(buf);
-                                goto cleanup;
-                            }
-                        }
-                        g_free(buf);
-                    }
+            } else if (g_queue_is_empty(&loop->stdinQueue)) {
+                close(loop->appin);
+                loop->appin = -1;
+            } else {
+                /* Close once the queued data is written */
+                loop->stdinEOF = TRUE;
+            }
+            break;
+
+        case GVIR_SANDBOX_PROTOCOL_PROC_QUIT:
+            loop->quit = TRUE;
+            break;
+
+        case GVIR_SANDBOX_PROTOCOL_PROC_CREDIT: {
+            GVirSandboxProtocolMessageCredit msgcredit;
+
+            memset(&msgcredit, 0, sizeof(msgcredit));
+            if (loop->version < 2 ||
+                !gvir_sandbox_rpcpacket_decode_payload_msg(rx,
+                                                           (xdrproc_t)xdr_GVirSandboxProtocolMessageCredit,
+                                                           (void*)&msgcredit,
+                                                           NULL)) {
+                if (debug)
+                    fprintf(stderr, "Cannot decode credit\n");
+                return FALSE;
+            }
+            if (msgcredit.stream == GVIR_SANDBOX_PROTOCOL_STREAM_STDOUT) {
+                loop->stdoutCredit += msgcredit.bytes;
+            } else if (msgcredit.stream == GVIR_SANDBOX_PROTOCOL_STREAM_STDERR) {
+                loop->stderrCredit += msgcredit.bytes;
+            } else {
+                if (debug)
+                    fprintf(stderr, "Unexpected credit stream %d\n",
+                            msgcredit.stream);
+                return FALSE;
+            }
+        }   break;
+
+        case GVIR_SANDBOX_PROTOCOL_PROC_NOP:
+            /* Keepalive, nothing to do */
+            break;
+
+        case GVIR_SANDBOX_PROTOCOL_PROC_FEATURES: {
+            GVirSandboxProtocolMessageFeatures msgfeatures;
+            guint formats;
+
+            memset(&msgfeatures, 0, sizeof(msgfeatures));
+            if (loop->version < 2 ||
+                !gvir_sandbox_rpcpacket_decode_payload_msg(rx,
+                                                           (xdrproc_t)xdr_GVirSandboxProtocolMessageFeatures,
+                                                           (void*)&msgfeatures,
+                                                           NULL)) {
+                if (debug)
+                    fprintf(stderr, "Cannot decode features\n");
+                return FALSE;
+            }
+            /* Compression is for the benefit of slow links,
+             * so prefer the better ratio of zstd */
+            formats = msgfeatures.compress &
+                gvir_sandbox_rpcpacket_compress_formats();
+            if (formats & GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD)
+                loop->compress = GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD;
+            else if (formats & GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4)
+                loop->compress = GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4;
+            /* Compressing needs a copy of the output anyway */
+            if (loop->compress)
+                loop->canSplice = FALSE;
+            if (debug)
+                fprintf(stderr, "Using compression %u\n", loop->compress);
+        }   break;
+
+        case GVIR_SANDBOX_PROTOCOL_PROC_STDOUT:
+        case GVIR_SANDBOX_PROTOCOL_PROC_STDERR:
+        case GVIR_SANDBOX_PROTOCOL_PROC_EXIT:
+        default:
+            if (debug)
+                fprintf(stderr, "Unexpected proc %u\n", rx->header.proc);
+            return FALSE;
+        }
+        gvir_sandbox_rpcpacket_free(rx);
+        loop->rx = NULL;
+        /* A v2 host keeps within our stdin window,
+         * so we can carry on reading while stdin is
+         * queued, and see credit for stdout/err */
+        if (!loop->quit &&
+            (loop->version >= 2 || g_queue_is_empty(&loop->stdinQueue)))
+            loop->rx = gvir_sandbox_rpcpacket_pool_get(loop->pool, TRUE, 0);
+        break;
+
+    default:
+        if (debug)
+            fprintf(stderr, "Unexpected state %d\n", loop->state);
+        break;
+    }
+
+    return TRUE;
+}
+
+
+static gboolean eventloop_host_read(GVirSandboxEventLoop *loop)
+{
+    /* Packets are read in two steps, the length word and then
+     * the rest, so carry on reading once the length is known */
+    while (loop->rx) {
+        GVirSandboxRPCPacket *rx = loop->rx;
+        gssize got = read_data(loop->host,
+                               rx->buffer + rx->bufferOffset,
+                               rx->bufferLength - rx->bufferOffset);
+        if (debug)
+            fprintf(stderr, "read %zd %zu %zu\n", got, rx->bufferLength, rx->bufferOffset);
+        if (got <= 0) {
+            gvir_sandbox_rpcpacket_free(rx);
+            loop->rx = NULL;
+            loop->quit = TRUE;
+            break;
+        }
+
+        rx->bufferOffset += got;
+        if (rx->bufferLength != rx->bufferOffset)
+            break;
+
+        if (loop->state == GVIR_SANDBOX_CONSOLE_STATE_RUNNING &&
+            rx->bufferLength == GVIR_SANDBOX_PROTOCOL_LEN_MAX) {
+            GError *error = NULL;
+            if (debug)
+                fprintf(stderr, "Read packet %zu\n", rx->bufferLength);
+            if (!gvir_sandbox_rpcpacket_decode_length(rx, &error)) {
+                if (debug)
+                    fprintf(stderr, "Cannot decode length %zu: %s\n",
+                            rx->bufferLength, error->message);
+                g_error_free(error);
+                return FALSE;
+            }
+            continue;
+        }
+
+        return eventloop_host_packet(loop);
+    }
+
+    return TRUE;
+}
+
+
+static gboolean eventloop_host(GVirSandboxEventLoop *loop,
+                               guint32 events)
+{
+    /* The channel to the virt-sandbox library client in host */
+    if (events & POLLIN) {
+        if (debug)
+            fprintf(stderr, "host readable\n");
+        if (!eventloop_host_read(loop))
+            return FALSE;
+        events &= ~(POLLIN);
+    }
+    if (events & POLLOUT) {
+        if (debug)
+            fprintf(stderr, "Host writable\n");
+        if (loop->tx.count) {
+            if (loop->compress)
+                tx_ring_compress(&loop->tx, loop->pool, loop->compress);
+            if (tx_ring_write(&loop->tx, loop->host) < 0) {
+                if (debug)
+                    fprintf(stderr, "Cannot write packet to host %s\n",
+                            strerror(errno));
+                tx_ring_clear(&loop->tx);
+                loop->quit = TRUE;
+            }
+        }
+        events &= ~(POLLOUT);
+    }
+    if (events)
+        loop->quit = TRUE;
+
+    return TRUE;
+}
+
+
+static void eventloop_stdin(GVirSandboxEventLoop *loop)
+{
+    if (loop->appin == -1 || g_queue_is_empty(&loop->stdinQueue))
+        return;
+
+    loop->stdinConsumed += stdin_queue_forward(&loop->stdinQueue, &loop->appin,
+                                               loop->stdinEOF);
+    if (!loop->rx && g_queue_is_empty(&loop->stdinQueue))
+        loop->rx = gvir_sandbox_rpcpacket_pool_get(loop->pool, TRUE, 0);
+}
+
+
+static gboolean eventloop_tty(GVirSandboxEventLoop *loop,
+                              guint32 events)
+{
+    /* The child application, when using a psuedo-tty */
+    if (events & POLLIN) {
+        if (tx_ring_can_read(&loop->tx) && loop->stdoutCredit) {
+            gssize got = read_data(loop->appout, loop->appbuf,
+                                   MIN(loop->stdoutCredit, GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX));
+            if (got <= 0) {
+                if (got < 0 && debug)
+                    fprintf(stderr, "Failed to read from app %s\n",
+                            strerror(errno));
+                loop->appOutEOF = TRUE;
+                loop->appErrEOF = TRUE;
+                if (!eventloop_queue_exit(loop, "appout tty"))
+                    return FALSE;
+            } else {
+                if (!tx_ring_queue_data(&loop->tx, loop->pool,
+                                        GVIR_SANDBOX_PROTOCOL_PROC_STDOUT,
+                                        loop->appbuf, got, &loop->serial)) {
+                    if (debug)
+                        fprintf(stderr, "Failed to encode stdout\n");
+                    return FALSE;
                 }
+                loop->stdoutCredit -= got;
+            }
+        }
+        events &= ~(POLLIN | POLLHUP);
+    }
+    if (events & POLLOUT) {
+        eventloop_stdin(loop);
+        events &= ~(POLLOUT | POLLHUP);
+    }
+    if (events & POLLHUP) {
+        loop->appOutEOF = TRUE;
+        loop->appErrEOF = TRUE;
+        if (!eventloop_queue_exit(loop, "due to HUP"))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/*
+ * The child stdout or stderr when using a plain pipe
+ */
+static gboolean eventloop_output(GVirSandboxEventLoop *loop,
+                                 int proc)
+{
+    gboolean isStdout = proc == GVIR_SANDBOX_PROTOCOL_PROC_STDOUT;
+    int fd = isStdout ? loop->appout : loop->apperr;
+    gsize *credit = isStdout ? &loop->stdoutCredit : &loop->stderrCredit;
+    gsize want;
+    gboolean spliced = FALSE;
+    gssize got;
+
+    if (fd == -1 || !tx_ring_can_read(&loop->tx) || !*credit)
+        return TRUE;
+
+    want = MIN(*credit, GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX);
+    /* Only splice if it can't hold up the loop */
+    if (loop->canSplice && !loop->tx.count && fd_writable(loop->host)) {
+        got = splice_output(loop->pool, fd, loop->host, proc, want,
+                            &loop->serial, loop->appbuf, &loop->canSplice);
+        if (got < 0) {
+            if (debug)
+                fprintf(stderr, "Lost sync with host forwarding %s\n",
+                        isStdout ? "stdout" : "stderr");
+            return FALSE;
+        }
+        spliced = TRUE;
+    } else {
+        got = read_data(fd, loop->appbuf, want);
+    }
+
+    if (got <= 0) {
+        if (isStdout)
+            loop->appOutEOF = TRUE;
+        else
+            loop->appErrEOF = TRUE;
+        return eventloop_queue_exit(loop, isStdout ? "appout" : "apperr");
+    }
+
+    *credit -= got;
+    if (!spliced &&
+        !tx_ring_queue_data(&loop->tx, loop->pool, proc,
+                            loop->appbuf, got, &loop->serial))
+        return FALSE;
+
+    return TRUE;
+}
+
+
+/*
+ * Work out which events are wanted from each descriptor
+ * in the current state
+ */
+static gboolean eventloop_watch(GVirSandboxEventLoop *loop,
+                                GVirSandboxWatchSet *want)
+{
+    int appinEv = 0;
+    int appoutEv = 0;
+    int apperrEv = 0;
+    int hostEv = 0;
+
+    switch (loop->state) {
+    case GVIR_SANDBOX_CONSOLE_STATE_WAITING:
+        hostEv = POLLIN;
+        break;
+    case GVIR_SANDBOX_CONSOLE_STATE_SYNCING:
+        hostEv = POLLIN;
+        if (loop->tx.count)
+            hostEv |= POLLOUT;
+        break;
+    case GVIR_SANDBOX_CONSOLE_STATE_RUNNING:
+        if (loop->version >= 2 &&
+            loop->stdinConsumed >= GVIR_SANDBOX_CREDIT_BATCH &&
+            tx_ring_can_read(&loop->tx)) {
+            if (!tx_ring_queue_credit(&loop->tx, loop->pool,
+                                      GVIR_SANDBOX_PROTOCOL_STREAM_STDIN,
+                                      loop->stdinConsumed, &loop->serial))
+                return FALSE;
+            loop->stdinConsumed = 0;
+        }
+
+        if (!g_queue_is_empty(&loop->stdinQueue) && loop->appin != -1)
+            appinEv |= POLLOUT;
+        if (loop->rx != NULL)
+            hostEv |= POLLIN;
+
+        if (loop->tx.count)
+            hostEv |= POLLOUT;
+        /* Keep reading from the app while earlier packets
+         * drain, as long as the host has granted credit */
+        if (tx_ring_can_read(&loop->tx)) {
+            if (!loop->appOutEOF && loop->appout != -1 && loop->stdoutCredit)
+                appoutEv |= POLLIN;
+            if ((loop->appout != loop->apperr) && !loop->appErrEOF &&
+                loop->apperr != -1 && loop->stderrCredit)
+                apperrEv |= POLLIN;
+        }
+        break;
+    default:
+        break;
+    }
+
+    memset(want, 0, sizeof(*want));
+    watch_set_add(want, loop->appin, appinEv, GVIR_SANDBOX_WATCH_APPIN);
+    watch_set_add(want, loop->appout, appoutEv, GVIR_SANDBOX_WATCH_APPOUT);
+    watch_set_add(want, loop->apperr, apperrEv, GVIR_SANDBOX_WATCH_APPERR);
+    watch_set_add(want, loop->host, hostEv, GVIR_SANDBOX_WATCH_HOST);
+    return TRUE;
+}
+
+
+static gboolean eventloop(gboolean interactive,
+                          const gchar *configfile,
+                          int sigfd,
+                          int host)
+{
+    int epfd = -1;
+    GVirSandboxWatchSet watches;
+    GVirSandboxEventLoop loop;
+    gboolean ret = FALSE;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.interactive = interactive;
+    loop.configfile = configfile;
+    loop.host = host;
+    loop.pool = gvir_sandbox_rpcpacket_pool_new();
+    g_queue_init(&loop.stdinQueue);
+    loop.appbuf = g_new(gchar, GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX);
+    loop.canSplice = !interactive;
+    loop.version = 1;
+    loop.stdoutCredit = G_MAXSIZE;
+    loop.stderrCredit = G_MAXSIZE;
+    loop.appin = loop.appout = loop.apperr = -1;
+    loop.state = GVIR_SANDBOX_CONSOLE_STATE_WAITING;
+
+    if (debug)
+        fprintf(stderr, "libvirt-sandbox-init-common: running I/O loop %d %d", loop.appin, loop.appout);
+
+
+    memset(&watches, 0, sizeof(watches));
+
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        if (debug)
+            fprintf(stderr, "Unable to create epoll set: %s\n",
+                    strerror(errno));
+        goto cleanup;
+    }
+    {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.u32 = GVIR_SANDBOX_WATCH_SIGNAL;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, sigfd, &ev) < 0) {
+            if (debug)
+                fprintf(stderr, "Unable to watch signals: %s\n",
+                        strerror(errno));
+            goto cleanup;
+        }
+    }
+
+    loop.rx = gvir_sandbox_rpcpacket_pool_get(loop.pool, FALSE, 0);
+    loop.rx->bufferLength = 1; /* Ready to get a sync packet */
+
+    while (!loop.quit) {
+        int i;
+        struct epoll_event evs[GVIR_SANDBOX_WATCH_MAX + 1];
+        GVirSandboxWatchSet want;
+        int nfds;
+
+        if (!eventloop_watch(&loop, &want) ||
+            !watch_set_apply(epfd, &watches, &want))
+            goto cleanup;
+
+        while ((nfds = epoll_wait(epfd, evs, G_N_ELEMENTS(evs), -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            if (debug)
+                fprintf(stderr, "Poll error:%s\n",
+                        strerror(errno));
+            goto cleanup;
+        }
+
+        /* EPOLLIN/OUT/ERR/HUP share their values with the poll() flags.
+         * An earlier handler may have closed the descriptor behind a
+         * later event, so the handlers check they still have one */
+        for (i = 0 ; i < nfds ; i++) {
+            guint32 roles = evs[i].data.u32;
+            guint32 events = evs[i].events;
+            gboolean ok = TRUE;
+
+            if (roles & GVIR_SANDBOX_WATCH_SIGNAL) {
+                ok = eventloop_signal(&loop, sigfd);
+            } else if (roles & GVIR_SANDBOX_WATCH_HOST) {
+                ok = eventloop_host(&loop, events);
+            } else if ((roles & GVIR_SANDBOX_WATCH_APPIN) &&
+                       (roles & GVIR_SANDBOX_WATCH_APPOUT)) {
+                if (loop.appin != -1 && loop.appin == loop.appout)
+                    ok = eventloop_tty(&loop, events);
+            } else if (roles & GVIR_SANDBOX_WATCH_APPIN) {
+                /* The child stdin when using a plain pipe */
+                eventloop_stdin(&loop);
+            } else if (roles & GVIR_SANDBOX_WATCH_APPOUT) {
+                ok = eventloop_output(&loop, GVIR_SANDBOX_PROTOCOL_PROC_STDOUT);
+            } else if (roles & GVIR_SANDBOX_WATCH_APPERR) {
+                ok = eventloop_output(&loop, GVIR_SANDBOX_PROTOCOL_PROC_STDERR);
             }
+
+            if (!ok)
+                goto cleanup;
         }
     }
 
     ret = TRUE;
 
  cleanup:
-    if (appin != -1) {
-        close(appin);
-        if (appin == appout)
-            appout = -1;
-        if (appin == apperr)
-            apperr = -1;
-    }
-    if (appout != -1)
-        close(appout);
-    if (apperr != -1)
-        close(apperr);
+    if (loop.appin != -1) {
+        close(loop.appin);
+        if (loop.appin == loop.appout)
+            loop.appout = -1;
+        if (loop.appin == loop.apperr)
+            loop.apperr = -1;
+    }
+    if (loop.appout != -1)
+        close(loop.appout);
+    if (loop.apperr != -1)
+        close(loop.apperr);
+    gvir_sandbox_rpcpacket_free(loop.rx);
+    tx_ring_clear(&loop.tx);
+    stdin_queue_clear(&loop.stdinQueue);
+    g_free(loop.appbuf);
+    gvir_sandbox_rpcpacket_pool_unref(loop.pool);
+    if (epfd != -1)
+        close(epfd);
     return ret;
 }
 
-
 static int
-run_interactive(GVirSandboxConfig *config)
+run_interactive(GVirSandboxConfig *config, const gchar *configfile)
 {
     GVirSandboxConfigInteractive *iconfig = GVIR_SANDBOX_CONFIG_INTERACTIVE(config);
-    int sigpipe[2] = { -1, -1 };
+    sigset_t mask, oldmask;
+    int sigfd = -1;
     int host = -1;
     int ret = -1;
     struct termios  rawattr;
     const char *devname;
-    gchar **command = NULL;
 
-    if (pipe(sigpipe) < 0) {
-        g_printerr(_("libvirt-sandbox-init-common: unable to create signal pipe: %s"),
+    /* SIGCHLD is only ever consumed via the signalfd, so
+     * it must be blocked from normal delivery */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &mask, &oldmask) < 0) {
+        g_printerr(_("libvirt-sandbox-init-common: unable to block SIGCHLD: %s"),
                    strerror(errno));
         return -1;
     }
 
-    sigwrite = sigpipe[1];
-    signal(SIGCHLD, sig_child);
+    if ((sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) < 0) {
+        g_printerr(_("libvirt-sandbox-init-common: unable to create signal fd: %s"),
+                   strerror(errno));
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        return -1;
+    }
 
     /* XXX lame hack */
     if (getenv("LIBVIRT_LXC_NAME")) {
@@ -1173,23 +2327,18 @@ run_interactive(GVirSandboxConfig *config)
                     gvir_sandbox_config_get_homedir(config)) < 0)
         goto cleanup;
 
-    command = gvir_sandbox_config_get_command(config);
     if (!eventloop(gvir_sandbox_config_interactive_get_tty(iconfig),
-                   command,
-                   sigpipe[0],
+                   configfile,
+                   sigfd,
                    host))
         goto cleanup;
 
     ret = 0;
 
  cleanup:
-    g_strfreev(command);
-    signal(SIGCHLD, SIG_DFL);
-
-    if (sigpipe[0] != -1)
-        close(sigpipe[0]);
-    if (sigpipe[1] != -1)
-        close(sigpipe[1]);
+    if (sigfd != -1)
+        close(sigfd);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
     if (host != -1)
         close(host);
 
@@ -1296,7 +2445,9 @@ int main(int argc, char **argv) {
         goto error;
 
     if (GVIR_SANDBOX_IS_CONFIG_INTERACTIVE(config)) {
-        if (run_interactive(config) < 0)
+        if (run_interactive(config,
+                            configfile ? configfile :
+                            SANDBOXCONFIGDIR "/sandbox.cfg") < 0)
             goto cleanup;
     } else if (GVIR_SANDBOX_IS_CONFIG_SERVICE(config)) {
         if (run_service(config) < 0)
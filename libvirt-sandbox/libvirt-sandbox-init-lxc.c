@@ -77,6 +77,11 @@ main(int argc, char **argv)
         args[narg++] = "1000";
     }
 
+#if WITH_STATIC_INIT_COMMON
+    args[narg++] = SANDBOXCONFIGDIR "/.libs/libvirt-sandbox-init-common";
+    if (debug)
+        args[narg++] = "-d";
+#else
     args[narg++] = SANDBOXCONFIGDIR "/.libs/ld.so";
     args[narg++] = SANDBOXCONFIGDIR "/.libs/libvirt-sandbox-init-common";
     if (debug)
@@ -87,6 +92,7 @@ main(int argc, char **argv)
                 __func__, strerror(errno));
         exit(EXIT_FAILURE);
     }
+#endif
 
     if (debug)
         fprintf(stderr, "Running interactive\n");
@@ -36,11 +36,16 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/mount.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <sys/reboot.h>
+#include <sys/syscall.h>
+#include <pthread.h>
 #include <termios.h>
 #if WITH_LZMA
 #include <lzma.h>
@@ -49,18 +54,23 @@
 #include <zlib.h>
 #endif /* WITH_ZLIB */
 
+#include "libvirt-sandbox-manifest.h"
+
 #define ATTR_UNUSED __attribute__((__unused__))
 
 #define STREQ(x,y) (strcmp(x,y) == 0)
 #define STRNEQ(x,y) (strcmp(x,y) != 0)
 
 static void print_uptime (void);
-static void insmod (const char *filename);
-static void set_debug(void);
+static void insmod_all(void);
+static void parse_cmdline(void);
 static int has_command_arg(const char *name,
                            char **val);
+static char *readall(const char *filename, size_t *len);
 
 static int debug = 0;
+static char rootcache[16];
+static char cachedev[16];
 static char line[1024];
 
 static void exit_poweroff(void) __attribute__((noreturn));
@@ -162,33 +172,125 @@ mount_other(const char *dst, const char *type, int mode)
     mount_other_opts(dst, type, "", mode);
 }
 
+/*
+ * The root and config shares are always 9p, so the host can
+ * keep them read only. A fixed cachetag lets a persistent
+ * fscache be found again by the next sandbox.
+ */
 static void
-mount_9pfs(const char *src, const char *dst, int mode, int readonly)
+mount_sharefs(const char *src, const char *dst, int mode, int readonly,
+              const char *cache)
 {
+    const char *type = "9p";
+    char opts[128];
     int flags = 0;
+
+    if (cache && cache[0])
+        snprintf(opts, sizeof(opts),
+                 "trans=virtio,version=9p2000.u,cache=%s,cachetag=root",
+                 cache);
+    else
+        strcpy(opts, "trans=virtio,version=9p2000.u");
     if (debug)
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s -> %s (%d)\n", __func__, src, dst, readonly);
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s -> %s (%s, %d)\n", __func__, src, dst, type, readonly);
 
     mount_mkdir(dst, mode);
 
     if (readonly)
         flags |= MS_RDONLY;
 
-    if (mount(src, dst, "9p", flags, "trans=virtio,version=9p2000.u") < 0) {
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot mount %s on %s (9p): %s\n",
-                __func__, src, dst, strerror(errno));
+    if (mount(src, dst, type, flags, opts) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot mount %s on %s (%s): %s\n",
+                __func__, src, dst, type, strerror(errno));
         exit_poweroff();
     }
 }
 
 
+/*
+ * Removes the readahead=KiB pseudo option from @opts,
+ * returning its value, or 0 if it was not present
+ */
+static unsigned long
+mount_take_readahead(char *opts)
+{
+    char *opt = opts;
+    unsigned long readahead = 0;
+
+    while (opt && *opt) {
+        char *next = strchr(opt, ',');
+
+        if (strncmp(opt, "readahead=", 10) == 0) {
+            readahead = strtoul(opt + 10, NULL, 10);
+            if (next) {
+                memmove(opt, next + 1, strlen(next + 1) + 1);
+                continue;
+            }
+            if (opt != opts)
+                opt--;
+            *opt = '\0';
+            break;
+        }
+        opt = next ? next + 1 : NULL;
+    }
+    return readahead;
+}
+
+/*
+ * Block devices and virtiofs name their backing device info
+ * after the device number, while 9p numbers them in order of
+ * creation, so the one for a 9p filesystem that was just
+ * mounted is the highest numbered
+ */
+static void
+mount_readahead(const char *target, const char *type, unsigned long readahead)
+{
+    char path[1024];
+    struct stat st;
+    FILE *fp;
+
+    if (stat(target, &st) < 0)
+        return;
+
+    snprintf(path, sizeof(path), "/sys/class/bdi/%u:%u/read_ahead_kb",
+             major(st.st_dev), minor(st.st_dev));
+
+    if (STREQ(type, "9p") && access(path, W_OK) < 0) {
+        DIR *dh = opendir("/sys/class/bdi");
+        struct dirent *de;
+        long last = -1;
+
+        while (dh && (de = readdir(dh)) != NULL) {
+            if (strncmp(de->d_name, "9p-", 3) == 0 &&
+                strtol(de->d_name + 3, NULL, 10) > last)
+                last = strtol(de->d_name + 3, NULL, 10);
+        }
+        if (dh)
+            closedir(dh);
+        snprintf(path, sizeof(path), "/sys/class/bdi/9p-%ld/read_ahead_kb", last);
+    }
+
+    if (debug)
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s readahead %lu KiB via %s\n",
+                __func__, target, readahead, path);
+
+    if (!(fp = fopen(path, "w")) ||
+        fprintf(fp, "%lu\n", readahead) < 0 ||
+        fclose(fp) != 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot set readahead of %s: %s\n",
+                __func__, target, strerror(errno));
+    }
+}
+
+
 static void
 mount_entry(const char *source,
             const char *target,
             const char *type,
-            const char * opts)
+            char *opts)
 {
     int flags = 0;
+    unsigned long readahead = mount_take_readahead(opts);
 
     if (STREQ(type, "")) {
         struct stat st;
@@ -215,31 +317,133 @@ mount_entry(const char *source,
                 __func__, source, target, type, opts, strerror(errno));
         exit_poweroff();
     }
+
+    /* There is no /sys while the root is being mounted */
+    if (readahead && type && access("/sys/class/bdi", F_OK) == 0)
+        mount_readahead(target, type, readahead);
+}
+
+/*
+ * Binds a cachefiles backend on the persistent cache disk, so
+ * the fscache of the root share outlives the sandbox. The
+ * cache stays bound only while /dev/cachefiles is held open,
+ * so a child keeps it open for the life of the guest. There
+ * is no cachefilesd to cull old objects, caching just stops
+ * once the disk runs short of space. Any failure here leaves
+ * the root mounted without a persistent cache.
+ */
+static void
+mount_cachefiles(void)
+{
+    static const char *cmds[] = { "dir /cache", "tag sandbox", "bind" };
+    char devpath[32];
+    size_t i;
+    pid_t pid;
+    int fd;
+
+    if (debug)
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cache on %s\n",
+                __func__, cachedev);
+
+    mount_other("/dev", "devtmpfs", 0755);
+    mount_mkdir("/cache", 0755);
+
+    snprintf(devpath, sizeof(devpath), "/dev/%s", cachedev);
+    if (mount(devpath, "/cache", "ext4", 0, "") < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot mount %s on /cache: %s\n",
+                __func__, devpath, strerror(errno));
+        goto cleanup;
+    }
+
+    if ((fd = open("/dev/cachefiles", O_RDWR|O_CLOEXEC)) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot open /dev/cachefiles: %s\n",
+                __func__, strerror(errno));
+        goto cleanup;
+    }
+
+    for (i = 0; i < sizeof(cmds) / sizeof(cmds[0]); i++) {
+        if (write(fd, cmds[i], strlen(cmds[i])) < 0) {
+            fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot write '%s' to /dev/cachefiles: %s\n",
+                    __func__, cmds[i], strerror(errno));
+            close(fd);
+            goto cleanup;
+        }
+    }
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot fork: %s\n",
+                __func__, strerror(errno));
+    } else if (pid == 0) {
+        for (;;)
+            pause();
+    }
+    close(fd);
+
+ cleanup:
+    /* The child still holds /dev/cachefiles open, so the
+     * temporary /dev can only be detached, not unmounted */
+    if (umount2("/dev", MNT_DETACH) < 0)
+        fprintf(stderr,
+                "libvirt-sandbox-init-qemu: %s: "
+                "cannot detach temporary /dev: %s\n",
+                __func__, strerror(errno));
+}
+
+static char *
+read_manifest(size_t *len, size_t *offset, long *nrecords)
+{
+    char *data = readall(SANDBOXCONFIGDIR "/" GVIR_SANDBOX_MANIFEST_FILE, len);
+
+    if ((*nrecords = gvir_sandbox_manifest_open(data, *len, offset)) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: malformed manifest "
+                SANDBOXCONFIGDIR "/" GVIR_SANDBOX_MANIFEST_FILE "\n",
+                __func__);
+        exit_poweroff();
+    }
+    return data;
+}
+
+/*
+ * Moves on to the next mount record in the manifest, returning
+ * 0 once there are none left
+ */
+static int
+next_manifest_mount(char *data, size_t len, size_t *offset, long *nrecords,
+                    GVirSandboxManifestRecord *rec)
+{
+    while (*nrecords > 0) {
+        (*nrecords)--;
+        if (gvir_sandbox_manifest_next(data, len, offset, rec) < 0) {
+            fprintf(stderr, "libvirt-sandbox-init-qemu: %s: malformed record at "
+                    "offset %zu in manifest\n", __func__, *offset);
+            exit_poweroff();
+        }
+        if (rec->type == GVIR_SANDBOX_MANIFEST_MOUNT && rec->nfields >= 4)
+            return 1;
+    }
+    return 0;
 }
 
 static void
 mount_root(const char *path)
 {
     int foundRoot = 0;
+    GVirSandboxManifestRecord rec;
+    size_t len, offset;
+    long nrecords;
+    char *data;
 
-    /* Loop over mounts.cfg to see if we have a candidate for / */
+    /* Loop over the manifest mounts to see if we have a candidate for / */
     mount_mkdir(SANDBOXCONFIGDIR, 0755);
-    mount_9pfs("sandbox:config", SANDBOXCONFIGDIR, 0755, 1);
-
-    FILE *fp = fopen(SANDBOXCONFIGDIR "/mounts.cfg", "r");
-    while (fgets(line, sizeof line, fp) && !foundRoot) {
-        char *source = line;
-        char *target = strchr(source, '\t');
-        *target = '\0';
-        target++;
-        char *type = strchr(target, '\t');
-        *type = '\0';
-        type++;
-        char *opts = strchr(type, '\t');
-        *opts = '\0';
-        opts++;
-        char *tmp = strchr(opts, '\n');
-        *tmp = '\0';
+    mount_sharefs("sandbox:config", SANDBOXCONFIGDIR, 0755, 1, NULL);
+
+    data = read_manifest(&len, &offset, &nrecords);
+    while (!foundRoot &&
+           next_manifest_mount(data, len, &offset, &nrecords, &rec)) {
+        char *source = rec.fields[0];
+        char *target = rec.fields[1];
+        char *type = rec.fields[2];
+        char *opts = rec.fields[3];
 
         if (STREQ(target, "/")) {
             int needsDev = strncmp(source, "/dev/", 5) == 0;
@@ -275,7 +479,7 @@ mount_root(const char *path)
             foundRoot = 1;
         }
     }
-    fclose(fp);
+    free(data);
 
     if (umount(SANDBOXCONFIGDIR) < 0) {
         fprintf(stderr,
@@ -286,8 +490,11 @@ mount_root(const char *path)
     }
 
     /* If we couldn't get a / in the mounts, then use the host one */
-    if (!foundRoot)
-        mount_9pfs("sandbox:root", path, 0755, 1);
+    if (!foundRoot) {
+        if (cachedev[0])
+            mount_cachefiles();
+        mount_sharefs("sandbox:root", path, 0755, 1, rootcache);
+    }
 }
 
 int
@@ -302,26 +509,14 @@ main(int argc ATTR_UNUSED, char **argv ATTR_UNUSED)
         exit(EXIT_FAILURE);
     }
 
-    set_debug();
+    parse_cmdline();
 
     if (debug)
         fprintf(stderr, "libvirt-sandbox-init-qemu: ext2 mini initrd starting up\n");
 
     mount_other("/sys", "sysfs", 0755);
 
-    FILE *fp = fopen("/modules", "r");
-    if (fp == NULL) {
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot open /modules: %s\n",
-                __func__, strerror(errno));
-        exit_poweroff();
-    }
-    while (fgets(line, sizeof line, fp)) {
-        size_t n = strlen(line);
-        if (n > 0 && line[n-1] == '\n')
-            line[--n] = '\0';
-        insmod(line);
-    }
-    fclose(fp);
+    insmod_all();
 
     if (umount("/sys") < 0) {
         fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot unmount /sys: %s\n",
@@ -329,6 +524,11 @@ main(int argc ATTR_UNUSED, char **argv ATTR_UNUSED)
         exit_poweroff();
     }
 
+    GVirSandboxManifestRecord rec;
+    size_t len, offset;
+    long nrecords;
+    char *data;
+
     /* Mount new root and chroot to it. */
     if (debug)
         fprintf(stderr, "libvirt-sandbox-init-qemu: mounting new root on /tmproot\n");
@@ -363,30 +563,17 @@ main(int argc ATTR_UNUSED, char **argv ATTR_UNUSED)
     mount_other("/dev/shm", "tmpfs", 01777);
 
     umask(0022);
-    mount_9pfs("sandbox:config", SANDBOXCONFIGDIR, 0755, 1);
+    mount_sharefs("sandbox:config", SANDBOXCONFIGDIR, 0755, 1, NULL);
 
     if (debug)
         fprintf(stderr, "libvirt-sandbox-init-qemu: %s: setting up filesystem mounts\n",
                 __func__);
-    fp = fopen(SANDBOXCONFIGDIR "/mounts.cfg", "r");
-    if (fp == NULL) {
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot open " SANDBOXCONFIGDIR "/mounts.cfg: %s\n",
-                __func__, strerror(errno));
-        exit_poweroff();
-    }
-    while (fgets(line, sizeof line, fp)) {
-        char *source = line;
-        char *target = strchr(source, '\t');
-        *target = '\0';
-        target++;
-        char *type = strchr(target, '\t');
-        *type = '\0';
-        type++;
-        char *opts = strchr(type, '\t');
-        *opts = '\0';
-        opts++;
-        char *tmp = strchr(opts, '\n');
-        *tmp = '\0';
+    data = read_manifest(&len, &offset, &nrecords);
+    while (next_manifest_mount(data, len, &offset, &nrecords, &rec)) {
+        char *source = rec.fields[0];
+        char *target = rec.fields[1];
+        char *type = rec.fields[2];
+        char *opts = rec.fields[3];
 
         if (debug)
             fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s -> %s (%s, %s)\n",
@@ -395,7 +582,7 @@ main(int argc ATTR_UNUSED, char **argv ATTR_UNUSED)
         if (STRNEQ(target, "/"))
             mount_entry(source, target, type, opts);
     }
-    fclose(fp);
+    free(data);
 
 
     if (debug)
@@ -422,6 +609,11 @@ main(int argc ATTR_UNUSED, char **argv ATTR_UNUSED)
         args[narg++] = "1000";
     }
 
+#if WITH_STATIC_INIT_COMMON
+    args[narg++] = SANDBOXCONFIGDIR "/.libs/libvirt-sandbox-init-common";
+    if (debug)
+        args[narg++] = "-d";
+#else
     args[narg++] = SANDBOXCONFIGDIR "/.libs/ld.so";
     args[narg++] = SANDBOXCONFIGDIR "/.libs/libvirt-sandbox-init-common";
     if (debug)
@@ -432,6 +624,7 @@ main(int argc ATTR_UNUSED, char **argv ATTR_UNUSED)
                 __func__, strerror(errno));
         exit_poweroff();
     }
+#endif
 
 
     if (debug)
@@ -447,34 +640,63 @@ extern long init_module(const void *mem, unsigned long len, const char *args);
 
 #define READ_SIZE (1024 * 16)
 
+/*
+ * Grows @data so it has room for at least @need bytes,
+ * doubling it to avoid copying over and over again
+ */
+static char *
+grow_buffer(char *data, size_t *capacity, size_t need)
+{
+    char *tmp;
+
+    if (need <= *capacity)
+        return data;
+    while (*capacity < need)
+        *capacity = *capacity ? *capacity * 2 : READ_SIZE;
+    if (!(tmp = realloc(data, *capacity))) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: out of memory\n",
+                __func__);
+        exit_poweroff();
+    }
+    return tmp;
+}
+
+/*
+ * Reads the whole of @filename, which is followed by a NUL
+ * that is not counted in @len. The buffer is sized up front
+ * from fstat, so normally needs a single read.
+ */
 static char *readall(const char *filename, size_t *len)
 {
-    char *data = NULL, *tmp;
+    char *data = NULL;
     int fd;
-    size_t capacity;
-    size_t offset;
+    struct stat sb;
+    size_t capacity = 0;
+    size_t offset = 0;
     ssize_t got;
 
-    *len = capacity = offset = 0;
+    *len = 0;
 
-    if ((fd = open(filename, O_RDONLY)) < 0) {
+    if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) < 0) {
         fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot open %s\n",
                 __func__, filename);
         exit_poweroff();
     }
 
+    if (fstat(fd, &sb) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot stat %s: %s\n",
+                __func__, filename, strerror(errno));
+        exit_poweroff();
+    }
+    /* The extra byte lets EOF be seen without growing */
+    data = grow_buffer(data, &capacity, (size_t)sb.st_size + 1);
+
     for (;;) {
-        if ((capacity - offset) < 1024) {
-            if (!(tmp = realloc(data, capacity + 2048))) {
-                fprintf(stderr, "libvirt-sandbox-init-qemu: %s: out of memory\n",
-                        __func__);
-                exit_poweroff();
-            }
-            data = tmp;
-            capacity += 2048;
-        }
+        data = grow_buffer(data, &capacity, offset + 1);
 
-        if ((got = read(fd, data + offset, capacity - offset)) < 0) {
+        if ((got = read(fd, data + offset, capacity - offset - 1)) < 0) {
+            if (errno == EINTR)
+                continue;
             fprintf(stderr, "libvirt-sandbox-init-qemu: %s: error reading %s: %s\n",
                     __func__, filename, strerror(errno));
             exit_poweroff();
@@ -483,13 +705,60 @@ static char *readall(const char *filename, size_t *len)
             break;
 
         offset += got;
+        /* Not at EOF yet, so make room for the next read */
+        if (offset == capacity - 1)
+            data = grow_buffer(data, &capacity, capacity + 1);
     }
+    data[offset] = '\0';
     *len = offset;
     close(fd);
     return data;
 }
 
 
+#if WITH_LZMA || WITH_ZLIB
+/*
+ * Maps the whole of @filename read only, for the decompressors
+ * to read their input from without copying it
+ */
+static unsigned char *
+mapall(const char *filename, size_t *len)
+{
+    struct stat sb;
+    void *data;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY|O_CLOEXEC)) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot open %s\n",
+                __func__, filename);
+        exit_poweroff();
+    }
+
+    if (fstat(fd, &sb) < 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot stat %s: %s\n",
+                __func__, filename, strerror(errno));
+        exit_poweroff();
+    }
+    if (sb.st_size == 0) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s is empty\n",
+                __func__, filename);
+        exit_poweroff();
+    }
+
+    data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot map %s: %s\n",
+                __func__, filename, strerror(errno));
+        exit_poweroff();
+    }
+    close(fd);
+
+    *len = sb.st_size;
+    return data;
+}
+#endif /* WITH_LZMA || WITH_ZLIB */
+
+
 static int
 has_suffix(const char *filename, const char *ext)
 {
@@ -499,13 +768,50 @@ has_suffix(const char *filename, const char *ext)
 }
 
 #if WITH_LZMA
+/*
+ * The uncompressed size recorded in the index at the end
+ * of the xz stream, or 0 if it cannot be found
+ */
+static size_t
+lzma_uncompressed_size(const unsigned char *xzdata, size_t xzlen)
+{
+    lzma_stream_flags flags;
+    lzma_index *index = NULL;
+    uint64_t memlimit = UINT64_MAX;
+    size_t pos = 0;
+    size_t size = 0;
+
+    /* Skip any stream padding */
+    while (xzlen >= LZMA_STREAM_HEADER_SIZE &&
+           !memcmp(xzdata + xzlen - 4, "\0\0\0\0", 4))
+        xzlen -= 4;
+
+    if (xzlen < 2 * LZMA_STREAM_HEADER_SIZE ||
+        lzma_stream_footer_decode(&flags, xzdata + xzlen -
+                                  LZMA_STREAM_HEADER_SIZE) != LZMA_OK ||
+        flags.backward_size > xzlen - 2 * LZMA_STREAM_HEADER_SIZE)
+        return 0;
+
+    if (lzma_index_buffer_decode(&index, &memlimit, NULL,
+                                 xzdata + xzlen - LZMA_STREAM_HEADER_SIZE -
+                                 flags.backward_size,
+                                 &pos, flags.backward_size) != LZMA_OK)
+        return 0;
+
+    /* Only a single stream module is accounted for in full */
+    size = lzma_index_uncompressed_size(index);
+    lzma_index_end(index, NULL);
+    return size;
+}
+
 static char *
 load_module_file_lzma(const char *filename, size_t *len)
 {
     lzma_stream st = LZMA_STREAM_INIT;
-    char *xzdata;
+    unsigned char *xzdata;
     size_t xzlen;
-    char *data;
+    char *data = NULL;
+    size_t capacity = 0;
     lzma_ret ret;
 
     *len = 0;
@@ -519,31 +825,24 @@ load_module_file_lzma(const char *filename, size_t *len)
                 __func__, filename, ret);
         exit_poweroff();
     }
-    xzdata = readall(filename, &xzlen);
+    xzdata = mapall(filename, &xzlen);
 
-    st.next_in = (unsigned char *)xzdata;
+    st.next_in = xzdata;
     st.avail_in = xzlen;
 
-    *len = 32 * 1024;
-    if (!(data = malloc(*len))) {
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s\n", __func__, strerror(errno));
-        exit_poweroff();
-    }
+    /* The +1 lets the end of the stream be seen without growing */
+    data = grow_buffer(data, &capacity,
+                       lzma_uncompressed_size(xzdata, xzlen) + 1);
 
     st.next_out = (unsigned char *)data;
-    st.avail_out = *len;
+    st.avail_out = capacity;
 
     do {
         ret = lzma_code(&st, LZMA_FINISH);
         if (st.avail_out == 0) {
-            size_t used = *len;
-            *len += (32 * 1024);
-            if (!(data = realloc(data, *len))) {
-                fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s\n", __func__, strerror(errno));
-                exit_poweroff();
-            }
-            st.next_out = (unsigned char *)data + used;
-            st.avail_out = *len - used;
+            data = grow_buffer(data, &capacity, capacity + 1);
+            st.next_out = (unsigned char *)data + st.total_out;
+            st.avail_out = capacity - st.total_out;
         }
         if (ret != LZMA_OK && ret != LZMA_STREAM_END) {
             fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s: lzma decode failure: %d\n",
@@ -551,8 +850,9 @@ load_module_file_lzma(const char *filename, size_t *len)
             exit_poweroff();
         }
     } while (ret != LZMA_STREAM_END);
+    *len = st.total_out;
     lzma_end(&st);
-    free(xzdata);
+    munmap(xzdata, xzlen);
     return data;
 }
 #else
@@ -569,51 +869,58 @@ load_module_file_lzma(const char *filename, size_t *len)
 static char *
 load_module_file_zlib(const char *filename, size_t *len)
 {
-    gzFile fp;
-    char *data;
-    unsigned int avail;
-    size_t total;
-    int got;
+    z_stream st;
+    unsigned char *gzdata;
+    size_t gzlen;
+    char *data = NULL;
+    size_t capacity = 0;
+    size_t hint = 0;
+    int ret;
+
+    *len = 0;
 
     if (debug)
         fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s\n", __func__, filename);
 
-    if (!(fp = gzopen(filename, "rb"))) {
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s: gzopen failure\n",
-                __func__, filename);
-        exit_poweroff();
-    }
-
-    *len = 32 * 1024;
-    if (!(data = malloc(*len))) {
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s\n", __func__, strerror(errno));
+    memset(&st, 0, sizeof(st));
+    /* 16 selects the gzip wrapper */
+    if ((ret = inflateInit2(&st, 16 + MAX_WBITS)) != Z_OK) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s: zlib init failure: %d\n",
+                __func__, filename, ret);
         exit_poweroff();
     }
-
-    avail = *len;
-    total = 0;
+    gzdata = mapall(filename, &gzlen);
+
+    /* The gzip trailer ends with the uncompressed size mod 2^32 */
+    if (gzlen >= 18)
+        hint = (size_t)gzdata[gzlen - 4] |
+            ((size_t)gzdata[gzlen - 3] << 8) |
+            ((size_t)gzdata[gzlen - 2] << 16) |
+            ((size_t)gzdata[gzlen - 1] << 24);
+    data = grow_buffer(data, &capacity, hint + 1);
+
+    st.next_in = gzdata;
+    st.avail_in = gzlen;
+    st.next_out = (unsigned char *)data;
+    st.avail_out = capacity;
 
     do {
-        got = gzread(fp, data + total, avail);
-
-        if (got < 0) {
-            fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s: gzread failure\n",
-                __func__, filename);
-            exit_poweroff();
+        ret = inflate(&st, Z_FINISH);
+        if ((ret == Z_OK || ret == Z_BUF_ERROR) && st.avail_out == 0) {
+            data = grow_buffer(data, &capacity, capacity + 1);
+            st.next_out = (unsigned char *)data + st.total_out;
+            st.avail_out = capacity - st.total_out;
+            continue;
         }
-
-        total += got;
-        if (total >= *len) {
-            *len += (32 * 1024);
-            if (!(data = realloc(data, *len))) {
-                fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s\n", __func__, strerror(errno));
-                exit_poweroff();
-            }
-            avail = *len - total;
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s: zlib decode failure: %d\n",
+                    __func__, filename, ret);
+            exit_poweroff();
         }
-    } while (got > 0);
-
-    gzclose(fp);
+    } while (ret != Z_STREAM_END);
+    *len = st.total_out;
+    inflateEnd(&st);
+    munmap(gzdata, gzlen);
     return data;
 }
 #else
@@ -646,36 +953,229 @@ load_module_file(const char *filename, size_t *len)
 }
 
 
+static int
+finit_module(int fd, const char *args, int flags)
+{
+#ifdef SYS_finit_module
+    return syscall(SYS_finit_module, fd, args, flags);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+
+/*
+ * A line of /modules, "FILE[\tDEP DEP...]". If there is no
+ * tab the dependencies are unknown, so the module is loaded
+ * after all the ones listed before it.
+ */
+struct module {
+    char *filename;
+    char **deps;
+    size_t ndeps;
+    int depsknown;
+    int loaded;
+};
+
+static struct module *modules;
+static size_t nmodules;
+static size_t nextmodule;
+static pthread_mutex_t modlock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t modcond = PTHREAD_COND_INITIALIZER;
+
 static void
-insmod(const char *filename)
+insmod_parse(void)
 {
-    char *data;
-    size_t len;
+    size_t len, i;
+    char *data = readall("/modules", &len);
+    char *tmp;
 
-    data = load_module_file(filename, &len);
+    for (i = 0; i < len; i++)
+        if (data[i] == '\n')
+            nmodules++;
 
-    if (init_module(data, (unsigned long)len, "") < 0) {
-        const char *msg;
-        switch (errno) {
-        case ENOEXEC:
-            msg = "Invalid module format";
-            break;
-        case ENOENT:
-            msg = "Unknown symbol in module";
-            break;
-        case ESRCH:
-            msg = "Module has wrong symbol version";
-            break;
-        case EINVAL:
-            msg = "Invalid parameters";
+    if (!(modules = calloc(nmodules, sizeof(*modules)))) {
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: out of memory\n",
+                __func__);
+        exit_poweroff();
+    }
+
+    tmp = data;
+    for (i = 0; i < nmodules; i++) {
+        struct module *mod = &modules[i];
+        char *end = strchr(tmp, '\n');
+        char *deps;
+
+        *end = '\0';
+        mod->filename = tmp;
+        tmp = end + 1;
+
+        if (!(deps = strchr(mod->filename, '\t')))
+            continue;
+        *deps++ = '\0';
+        mod->depsknown = 1;
+
+        if (!(mod->deps = calloc(strlen(deps) / 2 + 1, sizeof(char *)))) {
+            fprintf(stderr, "libvirt-sandbox-init-qemu: %s: out of memory\n",
+                    __func__);
+            exit_poweroff();
+        }
+        while (*deps) {
+            mod->deps[mod->ndeps++] = deps;
+            deps += strcspn(deps, " ");
+            if (*deps)
+                *deps++ = '\0';
+        }
+    }
+}
+
+/* Whether modules[idx] can be loaded, called with modlock held */
+static int
+insmod_ready(size_t idx)
+{
+    struct module *mod = &modules[idx];
+    size_t i, j;
+
+    for (i = 0; i < idx; i++) {
+        if (modules[i].loaded)
+            continue;
+        if (!mod->depsknown)
+            return 0;
+        for (j = 0; j < mod->ndeps; j++)
+            if (STREQ(mod->deps[j], modules[i].filename))
+                return 0;
+    }
+    return 1;
+}
+
+static void
+insmod_error(const char *filename)
+{
+    const char *msg;
+    switch (errno) {
+    case ENOEXEC:
+        msg = "Invalid module format";
+        break;
+    case ENOENT:
+        msg = "Unknown symbol in module";
+        break;
+    case ESRCH:
+        msg = "Module has wrong symbol version";
+        break;
+    case EINVAL:
+        msg = "Invalid parameters";
+        break;
+    default:
+        msg = strerror(errno);
+    }
+    fprintf(stderr, "libvirt-sandbox-init-qemu: insmod: error loading %s: %s\n",
+            filename, msg);
+    exit_poweroff();
+}
+
+/*
+ * Takes modules off the list in order, decompressing each one
+ * as soon as it is taken, but only loading it once everything
+ * it depends on is loaded. Modules are taken in dependency
+ * order, so the module being waited on is always already
+ * taken by a worker which is not waiting on this one.
+ */
+static void *
+insmod_worker(void *opaque ATTR_UNUSED)
+{
+    for (;;) {
+        struct module *mod;
+        char *data = NULL;
+        size_t len = 0;
+        size_t idx;
+        int fd = -1;
+
+        pthread_mutex_lock(&modlock);
+        if (nextmodule == nmodules) {
+            pthread_mutex_unlock(&modlock);
+            return NULL;
+        }
+        idx = nextmodule++;
+        pthread_mutex_unlock(&modlock);
+        mod = &modules[idx];
+
+        /* Uncompressed modules are read by the kernel itself */
+        if (!has_suffix(mod->filename, ".ko.xz") &&
+            !has_suffix(mod->filename, ".ko.gz")) {
+            if ((fd = open(mod->filename, O_RDONLY|O_CLOEXEC)) < 0) {
+                fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot open %s\n",
+                        __func__, mod->filename);
+                exit_poweroff();
+            }
+        } else {
+            data = load_module_file(mod->filename, &len);
+        }
+
+        pthread_mutex_lock(&modlock);
+        while (!insmod_ready(idx))
+            pthread_cond_wait(&modcond, &modlock);
+        pthread_mutex_unlock(&modlock);
+
+        if (debug)
+            fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %s\n",
+                    __func__, mod->filename);
+
+        if (fd >= 0) {
+            if (finit_module(fd, "", 0) < 0) {
+                if (errno != ENOSYS)
+                    insmod_error(mod->filename);
+                data = load_module_file_raw(mod->filename, &len);
+            }
+            close(fd);
+        }
+        if (data) {
+            if (init_module(data, (unsigned long)len, "") < 0)
+                insmod_error(mod->filename);
+            free(data);
+        }
+
+        pthread_mutex_lock(&modlock);
+        mod->loaded = 1;
+        pthread_cond_broadcast(&modcond);
+        pthread_mutex_unlock(&modlock);
+    }
+}
+
+#define MAX_INSMOD_WORKERS 8
+
+static void
+insmod_all(void)
+{
+    pthread_t workers[MAX_INSMOD_WORKERS];
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t nworkers, i;
+
+    insmod_parse();
+
+    nworkers = ncpus > 1 ? ncpus : 1;
+    if (nworkers > MAX_INSMOD_WORKERS)
+        nworkers = MAX_INSMOD_WORKERS;
+    if (nworkers > nmodules)
+        nworkers = nmodules;
+
+    if (debug)
+        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: %zu modules, %zu workers\n",
+                __func__, nmodules, nworkers);
+
+    /* The calling thread is a worker too */
+    for (i = 1; i < nworkers; i++) {
+        int err;
+        if ((err = pthread_create(&workers[i], NULL, insmod_worker, NULL)) != 0) {
+            fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot create thread: %s\n",
+                    __func__, strerror(err));
+            nworkers = i;
             break;
-        default:
-            msg = strerror(errno);
         }
-        fprintf(stderr, "libvirt-sandbox-init-qemu: %s: error loading %s: %s\n",
-                __func__, filename, msg);
-        exit_poweroff();
     }
+    insmod_worker(NULL);
+    for (i = 1; i < nworkers; i++)
+        pthread_join(workers[i], NULL);
 }
 
 /* Print contents of /proc/uptime. */
@@ -702,7 +1202,23 @@ print_uptime(void)
 }
 
 
-static void set_debug(void)
+/* Copies the value of @name from the cmdline in 'line' */
+static void parse_cmdline_value(const char *name, char *val, size_t len)
+{
+    const char *start = strstr(line, name);
+    size_t n;
+
+    if (!start)
+        return;
+    start += strlen(name);
+    n = strcspn(start, " \n");
+    if (n >= len)
+        n = len - 1;
+    memcpy(val, start, n);
+    val[n] = '\0';
+}
+
+static void parse_cmdline(void)
 {
     if (mkdir("/proc", 0755) < 0) {
         fprintf(stderr, "libvirt-sandbox-init-qemu: %s: cannot mkdir /proc: %s\n",
@@ -719,6 +1235,8 @@ static void set_debug(void)
     if (fp && fgets(line, sizeof line, fp)) {
         if (strstr(line, "debug"))
             debug=1;
+        parse_cmdline_value("sandbox_rootcache=", rootcache, sizeof(rootcache));
+        parse_cmdline_value("sandbox_cachedev=", cachedev, sizeof(cachedev));
     }
     if (fp)
         fclose(fp);
@@ -0,0 +1,149 @@
+/*
+ * libvirt-sandbox-manifest.h: boot manifest format
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __LIBVIRT_SANDBOX_MANIFEST_H__
+# define __LIBVIRT_SANDBOX_MANIFEST_H__
+
+/*
+ * The boot manifest tells the guest init programs which disks
+ * and mounts to set up. It is read in one go and parsed in
+ * place, so it must not need glib. It looks like
+ *
+ *   "LVSB"  u32 version  u32 nrecords
+ *   nrecords times: u32 type  u32 reclen  u32 nfields
+ *     nfields times: u32 length  length bytes  '\0'
+ *
+ * with all integers little endian, since the guest may not
+ * have the same byte order as the host. reclen counts the
+ * bytes of the record after itself, so a reader can step over
+ * a record whole. Records of unknown type are skipped, and
+ * fields beyond those a reader knows about are ignored, so
+ * that either can be added without bumping the version.
+ */
+
+# include <stddef.h>
+# include <stdint.h>
+# include <string.h>
+# include <endian.h>
+
+# define GVIR_SANDBOX_MANIFEST_FILE "boot.manifest"
+# define GVIR_SANDBOX_MANIFEST_MAGIC "LVSB"
+# define GVIR_SANDBOX_MANIFEST_VERSION 2
+# define GVIR_SANDBOX_MANIFEST_HEADER_SIZE 12
+
+enum {
+    /* source, target, fstype, options */
+    GVIR_SANDBOX_MANIFEST_MOUNT = 1,
+    /* tag, device */
+    GVIR_SANDBOX_MANIFEST_DISK = 2,
+};
+
+# define GVIR_SANDBOX_MANIFEST_MAX_FIELDS 8
+
+typedef struct _GVirSandboxManifestRecord GVirSandboxManifestRecord;
+struct _GVirSandboxManifestRecord {
+    uint32_t type;
+    /* At most GVIR_SANDBOX_MANIFEST_MAX_FIELDS */
+    uint32_t nfields;
+    /* NUL terminated, pointing into the manifest data */
+    char *fields[GVIR_SANDBOX_MANIFEST_MAX_FIELDS];
+};
+
+static inline int
+gvir_sandbox_manifest_read_u32(const char *data, size_t len,
+                               size_t *offset, uint32_t *val)
+{
+    uint32_t le;
+
+    if (len - *offset < sizeof(le))
+        return -1;
+    memcpy(&le, data + *offset, sizeof(le));
+    *offset += sizeof(le);
+    *val = le32toh(le);
+    return 0;
+}
+
+/*
+ * Checks the manifest header, returning the number of records
+ * and setting @offset to the first of them, or -1 if @data is
+ * not a manifest this code understands
+ */
+static inline long
+gvir_sandbox_manifest_open(const char *data, size_t len, size_t *offset)
+{
+    uint32_t version, nrecords;
+
+    *offset = 4;
+    if (len < GVIR_SANDBOX_MANIFEST_HEADER_SIZE ||
+        memcmp(data, GVIR_SANDBOX_MANIFEST_MAGIC, 4) != 0 ||
+        gvir_sandbox_manifest_read_u32(data, len, offset, &version) < 0 ||
+        version != GVIR_SANDBOX_MANIFEST_VERSION ||
+        gvir_sandbox_manifest_read_u32(data, len, offset, &nrecords) < 0)
+        return -1;
+    return nrecords;
+}
+
+/*
+ * Parses the record at @offset into @rec and moves @offset on
+ * to the next one. Only the first GVIR_SANDBOX_MANIFEST_MAX_FIELDS
+ * fields are parsed, the rest are skipped along with the record.
+ * Returns -1 if the record is truncated or a field overruns it.
+ */
+static inline int
+gvir_sandbox_manifest_next(char *data, size_t len, size_t *offset,
+                           GVirSandboxManifestRecord *rec)
+{
+    uint32_t reclen, nfields, flen;
+    size_t end;
+
+    if (gvir_sandbox_manifest_read_u32(data, len, offset, &rec->type) < 0 ||
+        gvir_sandbox_manifest_read_u32(data, len, offset, &reclen) < 0 ||
+        len - *offset < reclen)
+        return -1;
+    end = *offset + reclen;
+
+    if (gvir_sandbox_manifest_read_u32(data, end, offset, &nfields) < 0)
+        return -1;
+
+    rec->nfields = 0;
+    while (rec->nfields < nfields &&
+           rec->nfields < GVIR_SANDBOX_MANIFEST_MAX_FIELDS) {
+        if (gvir_sandbox_manifest_read_u32(data, end, offset, &flen) < 0 ||
+            end - *offset <= flen ||
+            data[*offset + flen] != '\0')
+            return -1;
+        rec->fields[rec->nfields++] = data + *offset;
+        *offset += flen + 1;
+    }
+
+    *offset = end;
+    return 0;
+}
+
+#endif /* __LIBVIRT_SANDBOX_MANIFEST_H__ */
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ *  tab-width: 8
+ * End:
+ */
@@ -7,19 +7,54 @@ const GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX = 262128;
 const GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT = 033;
 const GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC = 034;
 
+/*
+ * Version 2 of the protocol is offered by sending WAIT_V2
+ * bytes instead of WAIT. A guest which accepts it replies
+ * with SYNC_V2 instead of SYNC. Version 2 adds flow control,
+ * where the sender of a data stream may only have as many
+ * unacknowledged payload bytes in flight as the receiver
+ * has granted, starting from WINDOW_INITIAL.
+ */
+const GVIR_SANDBOX_PROTOCOL_HANDSHAKE_WAIT_V2 = 035;
+const GVIR_SANDBOX_PROTOCOL_HANDSHAKE_SYNC_V2 = 036;
+
+const GVIR_SANDBOX_PROTOCOL_WINDOW_INITIAL = 1048512;
+
+/*
+ * Payload compression formats, which the host lists in
+ * GVirSandboxProtocolMessageFeatures. The guest may then
+ * send data packets compressed with one of them, marked by
+ * their type. Packets which don't compress are sent as is.
+ */
+const GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4 = 1;
+const GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD = 2;
+
 enum GVirSandboxProtocolProc {
      GVIR_SANDBOX_PROTOCOL_PROC_STDIN = 1,
      GVIR_SANDBOX_PROTOCOL_PROC_STDOUT = 2,
      GVIR_SANDBOX_PROTOCOL_PROC_STDERR = 3,
      GVIR_SANDBOX_PROTOCOL_PROC_EXIT = 4,
-     GVIR_SANDBOX_PROTOCOL_PROC_QUIT = 5
+     GVIR_SANDBOX_PROTOCOL_PROC_QUIT = 5,
+     /* Version 2 only */
+     GVIR_SANDBOX_PROTOCOL_PROC_CREDIT = 6,
+     GVIR_SANDBOX_PROTOCOL_PROC_NOP = 7,
+     GVIR_SANDBOX_PROTOCOL_PROC_FEATURES = 8
+};
+
+enum GVirSandboxProtocolStream {
+     GVIR_SANDBOX_PROTOCOL_STREAM_STDIN = 0,
+     GVIR_SANDBOX_PROTOCOL_STREAM_STDOUT = 1,
+     GVIR_SANDBOX_PROTOCOL_STREAM_STDERR = 2
 };
 
 enum GVirSandboxProtocolType {
     /* Async message */
     GVIR_SANDBOX_PROTOCOL_TYPE_MESSAGE = 0,
     /* Async data packet */
-    GVIR_SANDBOX_PROTOCOL_TYPE_DATA = 1
+    GVIR_SANDBOX_PROTOCOL_TYPE_DATA = 1,
+    /* Async data packet, with a compressed payload (version 2 only) */
+    GVIR_SANDBOX_PROTOCOL_TYPE_DATA_LZ4 = 2,
+    GVIR_SANDBOX_PROTOCOL_TYPE_DATA_ZSTD = 3
 };
 
 enum GVirSandboxProtocolStatus {
@@ -39,3 +74,12 @@ struct GVirSandboxProtocolHeader {
 struct GVirSandboxProtocolMessageExit {
      int status;
 };
+
+struct GVirSandboxProtocolMessageCredit {
+     GVirSandboxProtocolStream stream;
+     unsigned int bytes;
+};
+
+struct GVirSandboxProtocolMessageFeatures {
+     unsigned int compress;
+};
@@ -21,10 +21,18 @@
 #include <config.h>
 
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <glib/gi18n.h>
 
+#if WITH_LZ4
+#include <lz4.h>
+#endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+
 #include "libvirt-sandbox-rpcpacket.h"
 
 #define GVIR_SANDBOX_RPCPACKET_ERROR gvir_sandbox_rpcpacket_error_quark()
@@ -35,23 +43,188 @@ gvir_sandbox_rpcpacket_error_quark(void)
     return g_quark_from_static_string("gvir-sandbox-rpcpacket");
 }
 
-GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_new(gboolean rxready)
+/*
+ * Buffers are handed out in a few fixed size classes, so
+ * that a packet released back to the pool can be reused
+ * for any later packet of similar size. The smallest class
+ * covers handshake bytes, length words and control messages,
+ * the middle one a typical console read, and the last one
+ * the largest packet the protocol permits.
+ */
+static const gsize gvir_sandbox_rpcpacket_sizes[] = {
+    GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX + 64,
+    GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX + 4096,
+    GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_PACKET_MAX,
+};
+#define GVIR_SANDBOX_RPCPACKET_NSIZES G_N_ELEMENTS(gvir_sandbox_rpcpacket_sizes)
+
+/* Max number of idle packets kept around per size class */
+#define GVIR_SANDBOX_RPCPACKET_POOL_IDLE 4
+
+/*
+ * A pool is not thread safe, it is intended to be owned
+ * by a single event loop. Each packet handed out holds a
+ * reference on the pool, so the owner can drop its own
+ * reference while packets are still in flight.
+ */
+struct _GVirSandboxRPCPacketPool {
+    gint refs;
+    GSList *idle[GVIR_SANDBOX_RPCPACKET_NSIZES];
+    guint nidle[GVIR_SANDBOX_RPCPACKET_NSIZES];
+};
+
+
+static gssize gvir_sandbox_rpcpacket_size_class(gsize size)
+{
+    gsize i;
+
+    for (i = 0 ; i < GVIR_SANDBOX_RPCPACKET_NSIZES ; i++) {
+        if (size <= gvir_sandbox_rpcpacket_sizes[i])
+            return i;
+    }
+    return -1;
+}
+
+
+static void gvir_sandbox_rpcpacket_dispose(GVirSandboxRPCPacket *msg)
+{
+    g_free(msg->buffer);
+    g_free(msg);
+}
+
+
+/*
+ * Ensure the packet buffer can hold at least @size bytes,
+ * rounding up to the next size class. Existing buffer
+ * contents are preserved.
+ */
+static gboolean gvir_sandbox_rpcpacket_reserve(GVirSandboxRPCPacket *msg,
+                                               gsize size,
+                                               GError **error)
 {
-    GVirSandboxRPCPacket *msg = g_new0(GVirSandboxRPCPacket, 1);
+    gssize cls;
+
+    if (size <= msg->bufferSize)
+        return TRUE;
 
-    if (rxready)
-        msg->bufferLength = GVIR_SANDBOX_PROTOCOL_LEN_MAX;
+    if ((cls = gvir_sandbox_rpcpacket_size_class(size)) < 0) {
+        g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
+                    _("packet %zu bytes too large, want %d"),
+                    size, GVIR_SANDBOX_PROTOCOL_PACKET_MAX + GVIR_SANDBOX_PROTOCOL_LEN_MAX);
+        return FALSE;
+    }
+
+    msg->bufferSize = gvir_sandbox_rpcpacket_sizes[cls];
+    msg->buffer = g_renew(char, msg->buffer, msg->bufferSize);
+    return TRUE;
+}
+
+
+GVirSandboxRPCPacketPool *gvir_sandbox_rpcpacket_pool_new(void)
+{
+    GVirSandboxRPCPacketPool *pool = g_new0(GVirSandboxRPCPacketPool, 1);
+
+    pool->refs = 1;
+
+    return pool;
+}
+
+
+GVirSandboxRPCPacketPool *gvir_sandbox_rpcpacket_pool_ref(GVirSandboxRPCPacketPool *pool)
+{
+    pool->refs++;
+    return pool;
+}
+
+
+void gvir_sandbox_rpcpacket_pool_unref(GVirSandboxRPCPacketPool *pool)
+{
+    gsize i;
+
+    if (!pool)
+        return;
+
+    if (--pool->refs > 0)
+        return;
+
+    for (i = 0 ; i < GVIR_SANDBOX_RPCPACKET_NSIZES ; i++)
+        g_slist_free_full(pool->idle[i],
+                          (GDestroyNotify)gvir_sandbox_rpcpacket_dispose);
+    g_free(pool);
+}
+
+
+/*
+ * @pool: the pool to take the packet from, or NULL
+ * @rxready: whether to prepare the packet to receive a length word
+ * @size: the number of buffer bytes initially required
+ *
+ * Returns a packet whose buffer holds at least @size bytes,
+ * reusing an idle packet from @pool if one is available.
+ * The buffer grows on demand when decoding the length word
+ * or encoding a payload, so @size is merely a hint.
+ */
+GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_pool_get(GVirSandboxRPCPacketPool *pool,
+                                                      gboolean rxready,
+                                                      gsize size)
+{
+    GVirSandboxRPCPacket *msg = NULL;
+    gssize cls;
+
+    if ((cls = gvir_sandbox_rpcpacket_size_class(size)) < 0)
+        cls = GVIR_SANDBOX_RPCPACKET_NSIZES - 1;
+
+    if (pool && pool->idle[cls]) {
+        msg = pool->idle[cls]->data;
+        pool->idle[cls] = g_slist_delete_link(pool->idle[cls], pool->idle[cls]);
+        pool->nidle[cls]--;
+    } else {
+        msg = g_new0(GVirSandboxRPCPacket, 1);
+        msg->bufferSize = gvir_sandbox_rpcpacket_sizes[cls];
+        msg->buffer = g_new(char, msg->bufferSize);
+    }
+
+    msg->bufferLength = rxready ? GVIR_SANDBOX_PROTOCOL_LEN_MAX : 0;
+    msg->bufferOffset = 0;
+    memset(&msg->header, 0, sizeof(msg->header));
+    msg->pool = pool ? gvir_sandbox_rpcpacket_pool_ref(pool) : NULL;
 
     return msg;
 }
 
 
+GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_new(gboolean rxready)
+{
+    return gvir_sandbox_rpcpacket_pool_get(NULL, rxready, 0);
+}
+
+
 void gvir_sandbox_rpcpacket_free(GVirSandboxRPCPacket *msg)
 {
+    GVirSandboxRPCPacketPool *pool;
+    gssize cls;
+
     if (!msg)
         return;
 
-    g_free(msg);
+    if (!(pool = msg->pool)) {
+        gvir_sandbox_rpcpacket_dispose(msg);
+        return;
+    }
+
+    msg->pool = NULL;
+    cls = gvir_sandbox_rpcpacket_size_class(msg->bufferSize);
+    if (pool->refs > 1 &&
+        cls >= 0 &&
+        gvir_sandbox_rpcpacket_sizes[cls] == msg->bufferSize &&
+        pool->nidle[cls] < GVIR_SANDBOX_RPCPACKET_POOL_IDLE) {
+        pool->idle[cls] = g_slist_prepend(pool->idle[cls], msg);
+        pool->nidle[cls]++;
+    } else {
+        gvir_sandbox_rpcpacket_dispose(msg);
+    }
+
+    gvir_sandbox_rpcpacket_pool_unref(pool);
 }
 
 
@@ -90,6 +263,8 @@ gboolean gvir_sandbox_rpcpacket_decode_length(GVirSandboxRPCPacket *msg,
 
     /* Extend our declared buffer length and carry
        on reading the header + payload */
+    if (!gvir_sandbox_rpcpacket_reserve(msg, msg->bufferLength + len, error))
+        goto cleanup;
     msg->bufferLength += len;
 
     ret = TRUE;
@@ -159,7 +334,13 @@ gboolean gvir_sandbox_rpcpacket_encode_header(GVirSandboxRPCPacket *msg,
     gboolean ret = FALSE;
     unsigned int len = 0;
 
-    msg->bufferLength = sizeof(msg->buffer);
+    if (!gvir_sandbox_rpcpacket_reserve(msg,
+                                        GVIR_SANDBOX_PROTOCOL_LEN_MAX +
+                                        GVIR_SANDBOX_PROTOCOL_HEADER_MAX,
+                                        error))
+        return FALSE;
+
+    msg->bufferLength = msg->bufferSize;
     msg->bufferOffset = 0;
 
     /* Format the header. */
@@ -214,6 +395,12 @@ gboolean gvir_sandbox_rpcpacket_encode_payload_msg(GVirSandboxRPCPacket *msg,
     /* Serialise payload of the message. This assumes that
      * GVirSandboxRPCPacketEncodeHeader has already been run, so
      * just appends to that data */
+    if (!gvir_sandbox_rpcpacket_reserve(msg,
+                                        msg->bufferOffset + xdr_sizeof(filter, data),
+                                        error))
+        return FALSE;
+    msg->bufferLength = msg->bufferSize;
+
     xdrmem_create(&xdr, msg->buffer + msg->bufferOffset,
                   msg->bufferLength - msg->bufferOffset, XDR_ENCODE);
 
@@ -285,6 +472,10 @@ gboolean gvir_sandbox_rpcpacket_encode_payload_raw(GVirSandboxRPCPacket *msg,
     XDR xdr;
     unsigned int msglen;
 
+    if (msg->bufferLength == msg->bufferSize &&
+        gvir_sandbox_rpcpacket_reserve(msg, msg->bufferOffset + len, NULL))
+        msg->bufferLength = msg->bufferSize;
+
     if ((msg->bufferLength - msg->bufferOffset) < len) {
         g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
                     _("Raw data too long to send (%zu bytes needed, %zu bytes available)"),
@@ -315,6 +506,258 @@ gboolean gvir_sandbox_rpcpacket_encode_payload_raw(GVirSandboxRPCPacket *msg,
 }
 
 
+/*
+ * @msg: an encoded outgoing message, none of which has been sent yet
+ *
+ * Appends further raw data to the payload of a message which
+ * was already completed by gvir_sandbox_rpcpacket_encode_payload_raw,
+ * growing the buffer as needed and re-encoding the length word.
+ * This lets a writer coalesce many small chunks of data into one
+ * packet while it is still queued.
+ *
+ * returns TRUE if the data was appended, FALSE upon error
+ */
+gboolean gvir_sandbox_rpcpacket_append_payload_raw(GVirSandboxRPCPacket *msg,
+                                                   const char *data,
+                                                   gsize len,
+                                                   GError **error)
+{
+    XDR xdr;
+    unsigned int msglen;
+
+    if (msg->bufferOffset != 0) {
+        g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
+                    "%s", _("Cannot append to a message which is being sent"));
+        return FALSE;
+    }
+
+    if (!gvir_sandbox_rpcpacket_reserve(msg, msg->bufferLength + len, error))
+        return FALSE;
+
+    memcpy(msg->buffer + msg->bufferLength, data, len);
+    msg->bufferLength += len;
+
+    /* Re-encode the length word. */
+    xdrmem_create(&xdr, msg->buffer, GVIR_SANDBOX_PROTOCOL_LEN_MAX, XDR_ENCODE);
+    msglen = msg->bufferLength;
+    if (!xdr_u_int(&xdr, &msglen)) {
+        g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
+                    "%s", _("Unable to encode message length"));
+        goto error;
+    }
+    xdr_destroy(&xdr);
+
+    return TRUE;
+
+ error:
+    xdr_destroy(&xdr);
+    return FALSE;
+}
+
+
+/*
+ * @msg: the outgoing message, whose header is already encoded
+ * @len: the size of the payload which will follow
+ *
+ * Encodes the length word for a message whose @len bytes of raw
+ * payload are not held in the buffer, but will be written out by
+ * the caller straight after it. Upon return the buffer just holds
+ * the length word and header.
+ *
+ * returns TRUE if successfully encoded, FALSE upon error
+ */
+gboolean gvir_sandbox_rpcpacket_encode_payload_external(GVirSandboxRPCPacket *msg,
+                                                        gsize len,
+                                                        GError **error)
+{
+    XDR xdr;
+    unsigned int msglen;
+
+    if ((msg->bufferOffset + len) >
+        (GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_PACKET_MAX)) {
+        g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
+                    _("Raw data too long to send (%zu bytes)"), len);
+        return FALSE;
+    }
+
+    /* Re-encode the length word. */
+    xdrmem_create(&xdr, msg->buffer, GVIR_SANDBOX_PROTOCOL_LEN_MAX, XDR_ENCODE);
+    msglen = msg->bufferOffset + len;
+    if (!xdr_u_int(&xdr, &msglen)) {
+        g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
+                    "%s", _("Unable to encode message length"));
+        goto error;
+    }
+    xdr_destroy(&xdr);
+
+    msg->bufferLength = msg->bufferOffset;
+    msg->bufferOffset = 0;
+    return TRUE;
+
+ error:
+    xdr_destroy(&xdr);
+    return FALSE;
+}
+
+
+/*
+ * Returns the GVIR_SANDBOX_PROTOCOL_COMPRESS_* formats
+ * this build is able to compress & decompress
+ */
+guint gvir_sandbox_rpcpacket_compress_formats(void)
+{
+    guint formats = 0;
+#if WITH_LZ4
+    formats |= GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4;
+#endif
+#if WITH_ZSTD
+    formats |= GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD;
+#endif
+    return formats;
+}
+
+
+/*
+ * @pool: the pool to take the new packet from
+ * @msg: an encoded outgoing data message, none of which has been sent yet
+ * @format: the GVIR_SANDBOX_PROTOCOL_COMPRESS_* format to use
+ *
+ * Compresses the payload of @msg into a new packet, with the
+ * same header apart from its type marking the format used.
+ * Unless the payload shrinks by at least an eighth, it isn't
+ * worth the receiver decompressing it, so it is left as is.
+ *
+ * returns the compressed packet, or NULL if @msg should be
+ * sent uncompressed
+ */
+GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_compress_payload(GVirSandboxRPCPacketPool *pool,
+                                                              GVirSandboxRPCPacket *msg,
+                                                              guint format)
+{
+    const gsize start = GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX;
+    GVirSandboxRPCPacket *pkt = NULL;
+    gsize len, max;
+    gssize got = -1;
+
+    if (msg->bufferOffset != 0 ||
+        msg->header.type != GVIR_SANDBOX_PROTOCOL_TYPE_DATA ||
+        msg->bufferLength <= start)
+        return NULL;
+
+    len = msg->bufferLength - start;
+    max = len - (len / 8);
+
+    pkt = gvir_sandbox_rpcpacket_pool_get(pool, FALSE, start + max);
+    pkt->header = msg->header;
+    pkt->header.type = format == GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD ?
+        GVIR_SANDBOX_PROTOCOL_TYPE_DATA_ZSTD :
+        GVIR_SANDBOX_PROTOCOL_TYPE_DATA_LZ4;
+    if (!gvir_sandbox_rpcpacket_encode_header(pkt, NULL))
+        goto error;
+
+    switch (format) {
+#if WITH_LZ4
+    case GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4:
+        got = LZ4_compress_default(msg->buffer + start,
+                                   pkt->buffer + pkt->bufferOffset,
+                                   len, max);
+        if (got == 0)
+            got = -1;
+        break;
+#endif
+#if WITH_ZSTD
+    case GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD: {
+        size_t zret = ZSTD_compress(pkt->buffer + pkt->bufferOffset, max,
+                                    msg->buffer + start, len, 1);
+        if (!ZSTD_isError(zret))
+            got = zret;
+    }   break;
+#endif
+    default:
+        break;
+    }
+
+    if (got < 0)
+        goto error;
+
+    if (!gvir_sandbox_rpcpacket_encode_payload_external(pkt, got, NULL))
+        goto error;
+    pkt->bufferLength += got;
+
+    return pkt;
+
+ error:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return NULL;
+}
+
+
+/*
+ * @pool: the pool to take the new packet from
+ * @msg: an incoming data message, whose header is decoded
+ *
+ * Decompresses the payload of @msg, according to the format
+ * given by its type, into a new packet. The new packet holds
+ * the decompressed payload between its bufferOffset and
+ * bufferLength, ready to be consumed like any data message.
+ *
+ * returns the new packet, or NULL upon error
+ */
+GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_decompress_payload(GVirSandboxRPCPacketPool *pool,
+                                                                GVirSandboxRPCPacket *msg,
+                                                                GError **error)
+{
+    const gsize start = GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX;
+    GVirSandboxRPCPacket *pkt;
+    gssize got = -1;
+
+    pkt = gvir_sandbox_rpcpacket_pool_get(pool, FALSE,
+                                          start + GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX);
+    pkt->header = msg->header;
+    pkt->header.type = GVIR_SANDBOX_PROTOCOL_TYPE_DATA;
+
+    switch (msg->header.type) {
+#if WITH_LZ4
+    case GVIR_SANDBOX_PROTOCOL_TYPE_DATA_LZ4:
+        got = LZ4_decompress_safe(msg->buffer + msg->bufferOffset,
+                                  pkt->buffer + start,
+                                  msg->bufferLength - msg->bufferOffset,
+                                  GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX);
+        break;
+#endif
+#if WITH_ZSTD
+    case GVIR_SANDBOX_PROTOCOL_TYPE_DATA_ZSTD: {
+        size_t zret = ZSTD_decompress(pkt->buffer + start,
+                                      GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX,
+                                      msg->buffer + msg->bufferOffset,
+                                      msg->bufferLength - msg->bufferOffset);
+        if (!ZSTD_isError(zret))
+            got = zret;
+    }   break;
+#endif
+    default:
+        g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
+                    _("Unsupported payload compression type %d"),
+                    msg->header.type);
+        goto error;
+    }
+
+    if (got < 0) {
+        g_set_error(error, GVIR_SANDBOX_RPCPACKET_ERROR, 0,
+                    "%s", _("Unable to decompress message payload"));
+        goto error;
+    }
+
+    pkt->bufferOffset = start;
+    pkt->bufferLength = start + got;
+    return pkt;
+
+ error:
+    gvir_sandbox_rpcpacket_free(pkt);
+    return NULL;
+}
+
+
 gboolean gvir_sandbox_rpcpacket_encode_payload_empty(GVirSandboxRPCPacket *msg,
                                                      GError **error)
 {
@@ -26,19 +26,34 @@
 # include "libvirt-sandbox-protocol.h"
 
 typedef struct _GVirSandboxRPCPacket GVirSandboxRPCPacket;
+typedef struct _GVirSandboxRPCPacketPool GVirSandboxRPCPacketPool;
 
-/* Never allocate this (huge) buffer on the stack. Always
- * use GVirSandboxRPCPacketNew() to allocate on the heap
+/* The buffer is allocated on the heap sized to what the
+ * packet actually needs, and grown on demand (up to
+ * PACKET_MAX + LEN_MAX) as the length / payload becomes
+ * known. Packets taken from a pool are handed back to it
+ * by gvir_sandbox_rpcpacket_free()
  */
 struct _GVirSandboxRPCPacket {
-    char buffer[GVIR_SANDBOX_PROTOCOL_PACKET_MAX + GVIR_SANDBOX_PROTOCOL_LEN_MAX];
+    char *buffer;
+    gsize bufferSize;
     gsize bufferLength;
     gsize bufferOffset;
 
     GVirSandboxProtocolHeader header;
+
+    GVirSandboxRPCPacketPool *pool;
 };
 
 
+GVirSandboxRPCPacketPool *gvir_sandbox_rpcpacket_pool_new(void);
+GVirSandboxRPCPacketPool *gvir_sandbox_rpcpacket_pool_ref(GVirSandboxRPCPacketPool *pool);
+void gvir_sandbox_rpcpacket_pool_unref(GVirSandboxRPCPacketPool *pool);
+
+GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_pool_get(GVirSandboxRPCPacketPool *pool,
+                                                      gboolean rxready,
+                                                      gsize size);
+
 GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_new(gboolean rxready);
 
 void gvir_sandbox_rpcpacket_free(GVirSandboxRPCPacket *pkt);
@@ -63,9 +78,24 @@ gboolean gvir_sandbox_rpcpacket_encode_payload_raw(GVirSandboxRPCPacket *msg,
                                                    const char *buf,
                                                    size_t len,
                                                    GError **error);
+gboolean gvir_sandbox_rpcpacket_append_payload_raw(GVirSandboxRPCPacket *msg,
+                                                   const char *buf,
+                                                   size_t len,
+                                                   GError **error);
+gboolean gvir_sandbox_rpcpacket_encode_payload_external(GVirSandboxRPCPacket *msg,
+                                                        size_t len,
+                                                        GError **error);
 gboolean gvir_sandbox_rpcpacket_encode_payload_empty(GVirSandboxRPCPacket *msg,
                                                      GError **error);
 
+guint gvir_sandbox_rpcpacket_compress_formats(void);
+GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_compress_payload(GVirSandboxRPCPacketPool *pool,
+                                                              GVirSandboxRPCPacket *msg,
+                                                              guint format);
+GVirSandboxRPCPacket *gvir_sandbox_rpcpacket_decompress_payload(GVirSandboxRPCPacketPool *pool,
+                                                                GVirSandboxRPCPacket *msg,
+                                                                GError **error);
+
 #endif /* __VIR_NET_MESSAGE_H__ */
 
 /*
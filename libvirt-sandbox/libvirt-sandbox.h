@@ -59,6 +59,7 @@
 #include <libvirt-sandbox/libvirt-sandbox-console-rpc.h>
 #include <libvirt-sandbox/libvirt-sandbox-context.h>
 #include <libvirt-sandbox/libvirt-sandbox-context-interactive.h>
+#include <libvirt-sandbox/libvirt-sandbox-context-pool.h>
 #include <libvirt-sandbox/libvirt-sandbox-context-service.h>
 
 #endif /* __LIBVIRT_SANDBOX_H__ */
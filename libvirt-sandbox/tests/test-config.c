@@ -56,6 +56,8 @@ int main(int argc, char **argv)
         "host-image:/etc=/tmp/home",
         "host-image:/etc=/tmp/home,format=qcow2",
         "host-bind:/tmp=",
+        "host-bind:/srv=/tmp/srv,transport=virtiofs,dax",
+        "host-bind:/usr=/usr,msize=262144,cache=loose,readahead=1024",
         NULL
     };
 
@@ -107,6 +109,21 @@ int main(int argc, char **argv)
     gvir_sandbox_config_set_username(cfg1, "superdevil");
     gvir_sandbox_config_set_homedir(cfg1, "/var/run/hell");
 
+    gvir_sandbox_config_set_memory(cfg1, 2048);
+    gvir_sandbox_config_set_vcpus(cfg1, 4);
+    gvir_sandbox_config_set_cpuset(cfg1, "0-5,^3");
+    gvir_sandbox_config_set_nodeset(cfg1, "1");
+    gvir_sandbox_config_set_hugepages(cfg1, TRUE);
+    gvir_sandbox_config_set_memory_shared(cfg1, TRUE);
+    gvir_sandbox_config_set_memory_locked(cfg1, TRUE);
+    gvir_sandbox_config_set_host_bind_transport(cfg1,
+                                                GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_TRANSPORT_VIRTIOFS);
+    gvir_sandbox_config_set_root_cache(cfg1,
+                                       GVIR_SANDBOX_CONFIG_MOUNT_HOST_BIND_CACHE_FSCACHE);
+    gvir_sandbox_config_set_root_cache_image(cfg1, "/var/cache/sandbox-root.img");
+    gvir_sandbox_config_set_dhcp_timeout(cfg1, 10);
+    gvir_sandbox_config_set_network_required(cfg1, FALSE);
+
     if (!gvir_sandbox_config_add_mount_strv(cfg1, (gchar**)mounts, &err))
         goto cleanup;
 
@@ -0,0 +1,686 @@
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if WITH_ZLIB
+#include <zlib.h>
+#endif
+#if WITH_LZ4
+#include <lz4.h>
+#endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <libvirt-sandbox/libvirt-sandbox.h>
+
+/* Matches the size of the blocks the builder compresses */
+#define LZ4_BLOCK (8 * 1024 * 1024)
+
+
+typedef struct _TestEntry TestEntry;
+struct _TestEntry {
+    gchar *name;
+    guint32 mode;
+    gsize size;
+    const gchar *data;
+};
+
+
+static void test_entry_free(gpointer opaque)
+{
+    TestEntry *entry = opaque;
+    g_free(entry->name);
+    g_free(entry);
+}
+
+
+static gboolean parse_hex(const gchar *str, guint32 *val)
+{
+    gchar tmp[9];
+
+    memcpy(tmp, str, 8);
+    tmp[8] = '\0';
+    if (strspn(tmp, "0123456789ABCDEF") != 8)
+        return FALSE;
+    *val = strtoul(tmp, NULL, 16);
+    return TRUE;
+}
+
+
+static gboolean check_padding(const gchar *data, gsize from, gsize to)
+{
+    for (; from < to; from++)
+        if (data[from] != '\0')
+            return FALSE;
+    return TRUE;
+}
+
+
+/*
+ * Parses a newc cpio archive, checking each header field the
+ * kernel relies on, and returns its entries up to the trailer
+ */
+static GPtrArray *parse_cpio(const gchar *data, gsize len, GError **error)
+{
+    GPtrArray *entries = g_ptr_array_new_with_free_func(test_entry_free);
+    gsize offset = 0;
+    guint32 ino = 0;
+
+    for (;;) {
+        guint32 fields[13];
+        TestEntry *entry;
+        gsize namestart, dataend;
+        gsize i;
+
+        if (len - offset < 110 ||
+            memcmp(data + offset, "070701", 6) != 0) {
+            g_set_error(error, 0, 0,
+                        "Missing newc header at offset %zu", offset);
+            goto error;
+        }
+        for (i = 0; i < 13; i++) {
+            if (!parse_hex(data + offset + 6 + (i * 8), &fields[i])) {
+                g_set_error(error, 0, 0,
+                            "Malformed header field %zu at offset %zu",
+                            i, offset);
+                goto error;
+            }
+        }
+
+        /* ino, mode, uid, gid, nlink, mtime, filesize, devmajor,
+         * devminor, rdevmajor, rdevminor, namesize, check */
+        if (fields[0] != ino++ ||
+            fields[2] != 0 || fields[3] != 0 ||
+            fields[5] != 0 || fields[12] != 0) {
+            g_set_error(error, 0, 0,
+                        "Unexpected header values at offset %zu", offset);
+            goto error;
+        }
+
+        namestart = offset + 110;
+        if (fields[11] == 0 ||
+            len - namestart < fields[11] ||
+            data[namestart + fields[11] - 1] != '\0' ||
+            strlen(data + namestart) != fields[11] - 1) {
+            g_set_error(error, 0, 0,
+                        "Malformed name at offset %zu", offset);
+            goto error;
+        }
+
+        /* The name and the data are each padded to 4 bytes,
+         * counting from the start of the archive */
+        offset = namestart + fields[11];
+        if (len - offset < ((4 - (offset % 4)) % 4) ||
+            !check_padding(data, offset, offset + ((4 - (offset % 4)) % 4))) {
+            g_set_error(error, 0, 0,
+                        "Bad name padding for %s", data + namestart);
+            goto error;
+        }
+        offset += (4 - (offset % 4)) % 4;
+
+        if (len - offset < fields[6]) {
+            g_set_error(error, 0, 0,
+                        "Truncated data for %s", data + namestart);
+            goto error;
+        }
+        dataend = offset + fields[6];
+
+        entry = g_new0(TestEntry, 1);
+        entry->name = g_strdup(data + namestart);
+        entry->mode = fields[1];
+        entry->size = fields[6];
+        entry->data = data + offset;
+
+        if (g_str_equal(entry->name, "TRAILER!!!")) {
+            gboolean ok = fields[6] == 0 && fields[1] == 0;
+            test_entry_free(entry);
+            /* Nothing follows the trailer but its padding */
+            if (!ok ||
+                len - dataend >= 4 ||
+                !check_padding(data, dataend, len)) {
+                g_set_error(error, 0, 0, "%s",
+                            "Malformed trailer");
+                goto error;
+            }
+            return entries;
+        }
+
+        if (fields[4] != 1) {
+            g_set_error(error, 0, 0,
+                        "Unexpected link count for %s", entry->name);
+            test_entry_free(entry);
+            goto error;
+        }
+        g_ptr_array_add(entries, entry);
+
+        offset = dataend;
+        if (len - offset < ((4 - (offset % 4)) % 4) ||
+            !check_padding(data, offset, offset + ((4 - (offset % 4)) % 4))) {
+            g_set_error(error, 0, 0,
+                        "Bad data padding for %s", data + namestart);
+            goto error;
+        }
+        offset += (4 - (offset % 4)) % 4;
+    }
+
+ error:
+    g_ptr_array_unref(entries);
+    return NULL;
+}
+
+
+static gchar *build_initrd(GVirSandboxConfigInitrd *config,
+                           GVirSandboxBuilderInitrdCompression compression,
+                           const gchar *outputfile,
+                           gsize *len,
+                           GError **error)
+{
+    GVirSandboxBuilderInitrd *builder = gvir_sandbox_builder_initrd_new();
+    gchar *data = NULL;
+
+    gvir_sandbox_builder_initrd_set_compression(builder, compression);
+
+    if (gvir_sandbox_builder_initrd_construct(builder, config,
+                                              (gchar *)outputfile, error))
+        g_file_get_contents(outputfile, &data, len, error);
+
+    unlink(outputfile);
+    g_object_unref(builder);
+    return data;
+}
+
+
+#if WITH_ZLIB
+static gchar *decompress_gzip(const gchar *data, gsize len,
+                              gsize *outlen, GError **error)
+{
+    GByteArray *out = g_byte_array_new();
+    guchar buf[4096];
+    z_stream zs;
+    int ret;
+
+    memset(&zs, 0, sizeof(zs));
+    if (len < 3 ||
+        memcmp(data, "\x1f\x8b\x08", 3) != 0 ||
+        inflateInit2(&zs, 15 + 16) != Z_OK) {
+        g_set_error(error, 0, 0, "%s", "Missing gzip header");
+        g_byte_array_unref(out);
+        return NULL;
+    }
+
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    do {
+        zs.next_out = buf;
+        zs.avail_out = sizeof(buf);
+        ret = inflate(&zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END)
+            break;
+        g_byte_array_append(out, buf, sizeof(buf) - zs.avail_out);
+    } while (ret != Z_STREAM_END);
+    inflateEnd(&zs);
+
+    /* The kernel treats anything after the stream as a further
+     * archive, so there must be nothing there */
+    if (ret != Z_STREAM_END || zs.avail_in != 0) {
+        g_set_error(error, 0, 0, "%s", "Malformed gzip stream");
+        g_byte_array_unref(out);
+        return NULL;
+    }
+
+    *outlen = out->len;
+    return (gchar *)g_byte_array_free(out, FALSE);
+}
+#endif
+
+
+#if WITH_LZ4
+static gchar *decompress_lz4(const gchar *data, gsize len,
+                             gsize *outlen, GError **error)
+{
+    GByteArray *out = g_byte_array_new();
+    gchar *buf = g_new0(gchar, LZ4_BLOCK);
+    gsize offset = 4;
+    gboolean last = FALSE;
+    guint32 val = 0;
+
+    /* Legacy framing: a magic number, then blocks each of a
+     * little endian length followed by that many bytes */
+    if (len >= 4)
+        memcpy(&val, data, 4);
+    if (len < 4 || GUINT32_FROM_LE(val) != 0x184C2102) {
+        g_set_error(error, 0, 0, "%s", "Missing lz4 legacy magic");
+        goto error;
+    }
+
+    while (offset < len) {
+        int got;
+
+        if (len - offset < 4) {
+            g_set_error(error, 0, 0, "%s", "Truncated lz4 block length");
+            goto error;
+        }
+        memcpy(&val, data + offset, 4);
+        val = GUINT32_FROM_LE(val);
+        offset += 4;
+        if (len - offset < val) {
+            g_set_error(error, 0, 0, "%s", "Truncated lz4 block");
+            goto error;
+        }
+
+        /* Only the last block may be short of a whole block */
+        if (last) {
+            g_set_error(error, 0, 0, "%s", "Short lz4 block before the end");
+            goto error;
+        }
+        got = LZ4_decompress_safe(data + offset, buf, val, LZ4_BLOCK);
+        if (got < 0) {
+            g_set_error(error, 0, 0, "%s", "Malformed lz4 block");
+            goto error;
+        }
+        if (got < LZ4_BLOCK)
+            last = TRUE;
+        g_byte_array_append(out, (guchar *)buf, got);
+        offset += val;
+    }
+
+    g_free(buf);
+    *outlen = out->len;
+    return (gchar *)g_byte_array_free(out, FALSE);
+
+ error:
+    g_free(buf);
+    g_byte_array_unref(out);
+    return NULL;
+}
+#endif
+
+
+#if WITH_ZSTD
+static gchar *decompress_zstd(const gchar *data, gsize len,
+                              gsize *outlen, GError **error)
+{
+    GByteArray *out = g_byte_array_new();
+    ZSTD_DStream *zstd = ZSTD_createDStream();
+    ZSTD_inBuffer in = { data, len, 0 };
+    guchar buf[4096];
+    size_t ret = 1;
+
+    if (len < 4 || memcmp(data, "\x28\xb5\x2f\xfd", 4) != 0) {
+        g_set_error(error, 0, 0, "%s", "Missing zstd magic");
+        goto error;
+    }
+
+    ZSTD_initDStream(zstd);
+    while (in.pos < in.size) {
+        ZSTD_outBuffer outbuf = { buf, sizeof(buf), 0 };
+        ret = ZSTD_decompressStream(zstd, &outbuf, &in);
+        if (ZSTD_isError(ret)) {
+            g_set_error(error, 0, 0, "Malformed zstd stream: %s",
+                        ZSTD_getErrorName(ret));
+            goto error;
+        }
+        g_byte_array_append(out, buf, outbuf.pos);
+    }
+
+    /* A return of 0 means the frame was completed */
+    if (ret != 0) {
+        g_set_error(error, 0, 0, "%s", "Truncated zstd stream");
+        goto error;
+    }
+
+    ZSTD_freeDStream(zstd);
+    *outlen = out->len;
+    return (gchar *)g_byte_array_free(out, FALSE);
+
+ error:
+    ZSTD_freeDStream(zstd);
+    g_byte_array_unref(out);
+    return NULL;
+}
+#endif
+
+
+#if WITH_ZLIB || WITH_LZ4 || WITH_ZSTD
+/*
+ * Checks that the ramdisk built with @compression is framed
+ * as the kernel expects, and holds exactly the same archive
+ * as the uncompressed one
+ */
+static gboolean check_compression(GVirSandboxConfigInitrd *config,
+                                  GVirSandboxBuilderInitrdCompression compression,
+                                  gchar *(*decompress)(const gchar *, gsize,
+                                                       gsize *, GError **),
+                                  const gchar *outputfile,
+                                  const gchar *want, gsize wantlen,
+                                  GError **error)
+{
+    gchar *data = NULL;
+    gchar *plain = NULL;
+    gsize len, plainlen;
+    gboolean ret = FALSE;
+
+    if (!(data = build_initrd(config, compression, outputfile, &len, error)))
+        goto cleanup;
+
+    if (!(plain = decompress(data, len, &plainlen, error)))
+        goto cleanup;
+
+    if (plainlen != wantlen || memcmp(plain, want, wantlen) != 0) {
+        g_set_error(error, 0, 0,
+                    "Compression %d changed the archive contents",
+                    compression);
+        goto cleanup;
+    }
+
+    ret = TRUE;
+ cleanup:
+    g_free(data);
+    g_free(plain);
+    return ret;
+}
+#endif
+
+
+static void remove_tree(const gchar *path)
+{
+    GDir *dh;
+    const gchar *name;
+
+    if ((dh = g_dir_open(path, 0, NULL))) {
+        while ((name = g_dir_read_name(dh)) != NULL) {
+            gchar *child = g_build_filename(path, name, NULL);
+            remove_tree(child);
+            g_free(child);
+        }
+        g_dir_close(dh);
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+}
+
+
+/*
+ * A module tree as left by depmod, where 9p needs netfs and
+ * 9pnet, 9pnet_virtio needs 9pnet, "fs-9p" is an alias for 9p
+ * and ext4 is built into the kernel
+ */
+static const gchar *moddep =
+    "kernel/fs/9p/9p.ko: kernel/fs/netfs/netfs.ko kernel/net/9p/9pnet.ko\n"
+    "kernel/net/9p/9pnet.ko:\n"
+    "kernel/fs/netfs/netfs.ko:\n"
+    "kernel/net/9p/9pnet_virtio.ko: kernel/net/9p/9pnet.ko\n"
+    "kernel/drivers/block/virtio_blk.ko:\n";
+static const gchar *modalias =
+    "# Aliases extracted from modules themselves.\n"
+    "alias fs-9p 9p\n"
+    "alias virtio:d00000009v* 9pnet_virtio\n";
+static const gchar *modbuiltin =
+    "kernel/fs/ext4/ext4.ko\n";
+
+
+static gboolean write_module_tree(const gchar *kmoddir, GError **error)
+{
+    gchar *basedir = g_path_get_dirname(kmoddir);
+    gchar **lines = g_strsplit(moddep, "\n", 0);
+    gboolean ret = FALSE;
+    gchar *path = NULL;
+    gsize i;
+
+    for (i = 0; lines[i]; i++) {
+        gchar *end;
+        gchar *dir;
+
+        if (!(end = strchr(lines[i], ':')))
+            continue;
+        *end = '\0';
+
+        path = g_build_filename(basedir, lines[i], NULL);
+        dir = g_path_get_dirname(path);
+        g_mkdir_with_parents(dir, 0700);
+        g_free(dir);
+        /* The content is checked to make sure the right
+         * file was picked up */
+        if (!g_file_set_contents(path, lines[i], -1, error))
+            goto cleanup;
+        g_free(path);
+        path = NULL;
+    }
+
+#define WRITE_INDEX(file, data)                                         \
+    do {                                                                \
+        path = g_build_filename(basedir, file, NULL);                   \
+        if (!g_file_set_contents(path, data, -1, error))                \
+            goto cleanup;                                               \
+        g_free(path);                                                   \
+        path = NULL;                                                    \
+    } while (0)
+
+    WRITE_INDEX("modules.dep", moddep);
+    WRITE_INDEX("modules.alias", modalias);
+    WRITE_INDEX("modules.builtin", modbuiltin);
+
+#undef WRITE_INDEX
+
+    ret = TRUE;
+ cleanup:
+    g_free(path);
+    g_strfreev(lines);
+    g_free(basedir);
+    return ret;
+}
+
+
+/*
+ * Checks that the requested modules are resolved through their
+ * aliases, that builtin and unknown modules are left out, and
+ * that each module comes after everything it depends on
+ */
+static gboolean check_modules(GVirSandboxConfigInitrd *config,
+                              const gchar *kmoddir,
+                              const gchar *outputfile,
+                              GError **error)
+{
+    static const gchar *wantfiles[] = {
+        "kernel/fs/netfs/netfs.ko",
+        "kernel/net/9p/9pnet.ko",
+        "kernel/fs/9p/9p.ko",
+        "kernel/net/9p/9pnet_virtio.ko",
+    };
+    static const gchar *wantlist =
+        "netfs.ko\t\n"
+        "9pnet.ko\t\n"
+        "9p.ko\tnetfs.ko 9pnet.ko\n"
+        "9pnet_virtio.ko\t9pnet.ko\n";
+    GPtrArray *entries = NULL;
+    gchar *archive = NULL;
+    gsize archivelen;
+    TestEntry *entry;
+    gboolean ret = FALSE;
+    gsize i;
+
+    if (!write_module_tree(kmoddir, error))
+        goto cleanup;
+
+    gvir_sandbox_config_initrd_add_module(config, "fs-9p");
+    gvir_sandbox_config_initrd_add_module(config, "9pnet_virtio.ko");
+    gvir_sandbox_config_initrd_add_module(config, "ext4");
+    gvir_sandbox_config_initrd_add_module(config, "no-such-module");
+
+    if (!(archive = build_initrd(config, GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_NONE,
+                                 outputfile, &archivelen, error)))
+        goto cleanup;
+
+    if (!(entries = parse_cpio(archive, archivelen, error)))
+        goto cleanup;
+
+    /* init, then the modules, then the module list */
+    if (entries->len != G_N_ELEMENTS(wantfiles) + 2) {
+        g_set_error(error, 0, 0, "Expected %zu archive entries, got %u",
+                    G_N_ELEMENTS(wantfiles) + 2, entries->len);
+        goto cleanup;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(wantfiles); i++) {
+        gchar *name = g_path_get_basename(wantfiles[i]);
+        gboolean ok;
+
+        entry = g_ptr_array_index(entries, i + 1);
+        ok = g_str_equal(entry->name, name) &&
+            entry->mode == 0100644 &&
+            entry->size == strlen(wantfiles[i]) &&
+            memcmp(entry->data, wantfiles[i], entry->size) == 0;
+        if (!ok)
+            g_set_error(error, 0, 0, "Expected module %s at position %zu, got %s",
+                        name, i, entry->name);
+        g_free(name);
+        if (!ok)
+            goto cleanup;
+    }
+
+    entry = g_ptr_array_index(entries, entries->len - 1);
+    if (!g_str_equal(entry->name, "modules") ||
+        entry->size != strlen(wantlist) ||
+        memcmp(entry->data, wantlist, entry->size) != 0) {
+        g_set_error(error, 0, 0, "Unexpected module list '%.*s'",
+                    (int)entry->size, entry->data);
+        goto cleanup;
+    }
+
+    ret = TRUE;
+ cleanup:
+    if (entries)
+        g_ptr_array_unref(entries);
+    g_free(archive);
+    return ret;
+}
+
+
+int main(int argc, char **argv)
+{
+    GVirSandboxConfigInitrd *config = NULL;
+    GPtrArray *entries = NULL;
+    GError *err = NULL;
+    gchar *tmpdir = NULL;
+    gchar *initfile = NULL;
+    gchar *kmoddir = NULL;
+    gchar *outputfile = NULL;
+    gchar *initdata = NULL;
+    gchar *archive = NULL;
+    gsize archivelen;
+    TestEntry *entry;
+    int ret = EXIT_FAILURE;
+    gsize i;
+
+    if (!gvir_init_object_check(&argc, &argv, &err))
+        goto cleanup;
+
+    if (!(tmpdir = g_dir_make_tmp("libvirt-sandbox-test-XXXXXX", &err)))
+        goto cleanup;
+
+    /* An odd size, so that the data needs padding */
+    initfile = g_build_filename(tmpdir, "init", NULL);
+    initdata = g_new0(gchar, 1001);
+    for (i = 0; i < 1001; i++)
+        initdata[i] = 'a' + (i % 26);
+    if (!g_file_set_contents(initfile, initdata, 1001, &err))
+        goto cleanup;
+
+    kmoddir = g_build_filename(tmpdir, "lib", "modules", "1.0", "kernel", NULL);
+    g_mkdir_with_parents(kmoddir, 0700);
+
+    outputfile = g_build_filename(tmpdir, "initrd.img", NULL);
+
+    config = gvir_sandbox_config_initrd_new();
+    gvir_sandbox_config_initrd_set_kver(config, "1.0");
+    gvir_sandbox_config_initrd_set_kmoddir(config, kmoddir);
+    gvir_sandbox_config_initrd_set_init(config, initfile);
+
+    if (!(archive = build_initrd(config, GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_NONE,
+                                 outputfile, &archivelen, &err)))
+        goto cleanup;
+
+    if (!(entries = parse_cpio(archive, archivelen, &err)))
+        goto cleanup;
+
+    if (entries->len != 2) {
+        g_set_error(&err, 0, 0, "Expected 2 archive entries, got %u",
+                    entries->len);
+        goto cleanup;
+    }
+
+    entry = g_ptr_array_index(entries, 0);
+    if (!g_str_equal(entry->name, "init") ||
+        entry->mode != 0100755 ||
+        entry->size != 1001 ||
+        memcmp(entry->data, initdata, 1001) != 0) {
+        g_set_error(&err, 0, 0, "Unexpected init entry %s", entry->name);
+        goto cleanup;
+    }
+
+    entry = g_ptr_array_index(entries, 1);
+    if (!g_str_equal(entry->name, "modules") ||
+        entry->mode != 0100644 ||
+        entry->size != 0) {
+        g_set_error(&err, 0, 0, "Unexpected modules entry %s", entry->name);
+        goto cleanup;
+    }
+
+#if WITH_ZLIB
+    if (!check_compression(config, GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_GZIP,
+                           decompress_gzip, outputfile,
+                           archive, archivelen, &err))
+        goto cleanup;
+#endif
+#if WITH_LZ4
+    if (!check_compression(config, GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_LZ4,
+                           decompress_lz4, outputfile,
+                           archive, archivelen, &err))
+        goto cleanup;
+#endif
+#if WITH_ZSTD
+    if (!check_compression(config, GVIR_SANDBOX_BUILDER_INITRD_COMPRESSION_ZSTD,
+                           decompress_zstd, outputfile,
+                           archive, archivelen, &err))
+        goto cleanup;
+#endif
+
+    if (!check_modules(config, kmoddir, outputfile, &err))
+        goto cleanup;
+
+    ret = EXIT_SUCCESS;
+cleanup:
+    if (ret != EXIT_SUCCESS)
+        fprintf(stderr, "Error in test: %s\n", err && err->message ? err->message : "none");
+
+    if (err)
+        g_error_free(err);
+    if (entries)
+        g_ptr_array_unref(entries);
+    if (config)
+        g_object_unref(config);
+    if (tmpdir)
+        remove_tree(tmpdir);
+    g_free(tmpdir);
+    g_free(initfile);
+    g_free(initdata);
+    g_free(kmoddir);
+    g_free(outputfile);
+    g_free(archive);
+    exit(ret);
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ *  tab-width: 8
+ * End:
+ */
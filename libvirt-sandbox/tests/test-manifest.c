@@ -0,0 +1,282 @@
+
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libvirt-sandbox/libvirt-sandbox.h>
+#include <libvirt-sandbox/libvirt-sandbox-builder-private.h>
+#include <libvirt-sandbox/libvirt-sandbox-manifest.h>
+
+
+static void append_u32(GByteArray *manifest, guint32 val)
+{
+    guint32 le = GUINT32_TO_LE(val);
+    g_byte_array_append(manifest, (const guint8 *)&le, sizeof(le));
+}
+
+
+static void set_u32(GByteArray *manifest, gsize offset, guint32 val)
+{
+    guint32 le = GUINT32_TO_LE(val);
+    memcpy(manifest->data + offset, &le, sizeof(le));
+}
+
+
+/*
+ * Appends a record the way a newer builder might: @nfields
+ * fields named f0, f1, ... followed by @extra bytes which are
+ * not fields at all
+ */
+static void append_future_record(GByteArray *manifest, guint32 type,
+                                 guint nfields, gsize extra)
+{
+    guint32 nrecords;
+    gsize start;
+    guint i;
+
+    append_u32(manifest, type);
+    append_u32(manifest, 0);
+    start = manifest->len;
+    append_u32(manifest, nfields);
+    for (i = 0; i < nfields; i++) {
+        gchar *field = g_strdup_printf("f%u", i);
+        append_u32(manifest, strlen(field));
+        g_byte_array_append(manifest, (const guint8 *)field, strlen(field) + 1);
+        g_free(field);
+    }
+    for (i = 0; i < extra; i++)
+        g_byte_array_append(manifest, (const guint8 *)"?", 1);
+    set_u32(manifest, start - 4, manifest->len - start);
+
+    memcpy(&nrecords, manifest->data + 8, sizeof(nrecords));
+    set_u32(manifest, 8, GUINT32_FROM_LE(nrecords) + 1);
+}
+
+
+/*
+ * Parses all of the @len bytes of @manifest into @recs, which
+ * must have room for @maxrecs. Returns the number of records,
+ * or -1 if it is malformed. The data is copied to a buffer of
+ * exactly @len bytes so overruns are caught by valgrind.
+ */
+static long parse(GByteArray *manifest, gsize len,
+                  GVirSandboxManifestRecord *recs, long maxrecs,
+                  gchar **copy)
+{
+    size_t offset;
+    long nrecords, i;
+
+    *copy = g_malloc(len);
+    memcpy(*copy, manifest->data, len);
+
+    if ((nrecords = gvir_sandbox_manifest_open(*copy, len, &offset)) < 0 ||
+        nrecords > maxrecs)
+        return -1;
+
+    for (i = 0; i < nrecords; i++)
+        if (gvir_sandbox_manifest_next(*copy, len, &offset, &recs[i]) < 0)
+            return -1;
+
+    if (offset != len)
+        return -1;
+
+    return nrecords;
+}
+
+
+static gboolean check_record(GVirSandboxManifestRecord *rec,
+                             guint32 type, guint32 nfields, ...)
+{
+    va_list args;
+    guint32 i;
+    gboolean ret = TRUE;
+
+    if (rec->type != type || rec->nfields != nfields) {
+        fprintf(stderr, "Expected record type %u with %u fields, got type %u with %u\n",
+                type, nfields, rec->type, rec->nfields);
+        return FALSE;
+    }
+
+    va_start(args, nfields);
+    for (i = 0; i < nfields; i++) {
+        const gchar *want = va_arg(args, const gchar *);
+        if (!g_str_equal(rec->fields[i], want)) {
+            fprintf(stderr, "Expected field %u to be '%s', got '%s'\n",
+                    i, want, rec->fields[i]);
+            ret = FALSE;
+        }
+    }
+    va_end(args);
+
+    return ret;
+}
+
+
+static GByteArray *sample_manifest(void)
+{
+    GByteArray *manifest = gvir_sandbox_builder_manifest_new();
+
+    gvir_sandbox_builder_manifest_add(manifest, GVIR_SANDBOX_MANIFEST_MOUNT, 4,
+                                      "/home/demo", "/home", "9p", "");
+    gvir_sandbox_builder_manifest_add(manifest, GVIR_SANDBOX_MANIFEST_DISK, 2,
+                                      "dbdata", "vda");
+    return manifest;
+}
+
+
+static gboolean test_round_trip(void)
+{
+    GByteArray *manifest = sample_manifest();
+    GVirSandboxManifestRecord recs[2];
+    gchar *copy = NULL;
+    gboolean ret = FALSE;
+
+    if (parse(manifest, manifest->len, recs, 2, &copy) != 2) {
+        fprintf(stderr, "Unable to parse manifest\n");
+        goto cleanup;
+    }
+
+    if (!check_record(&recs[0], GVIR_SANDBOX_MANIFEST_MOUNT, 4,
+                      "/home/demo", "/home", "9p", "") ||
+        !check_record(&recs[1], GVIR_SANDBOX_MANIFEST_DISK, 2,
+                      "dbdata", "vda"))
+        goto cleanup;
+
+    ret = TRUE;
+ cleanup:
+    g_free(copy);
+    g_byte_array_unref(manifest);
+    return ret;
+}
+
+
+static gboolean test_truncated(void)
+{
+    GByteArray *manifest = sample_manifest();
+    GVirSandboxManifestRecord recs[2];
+    gboolean ret = TRUE;
+    gsize len;
+
+    for (len = 0; len < manifest->len; len++) {
+        gchar *copy = NULL;
+        if (parse(manifest, len, recs, 2, &copy) >= 0) {
+            fprintf(stderr, "Manifest truncated to %zu bytes was accepted\n", len);
+            ret = FALSE;
+        }
+        g_free(copy);
+    }
+
+    g_byte_array_unref(manifest);
+    return ret;
+}
+
+
+static gboolean test_unterminated(void)
+{
+    GByteArray *manifest = gvir_sandbox_builder_manifest_new();
+    GVirSandboxManifestRecord recs[1];
+    gchar *copy = NULL;
+    gboolean ret = FALSE;
+
+    gvir_sandbox_builder_manifest_add(manifest, GVIR_SANDBOX_MANIFEST_DISK, 2,
+                                      "dbdata", "vda");
+
+    /* Replace the NUL after the last field, which is also
+     * the last byte of the record */
+    manifest->data[manifest->len - 1] = 'x';
+    if (parse(manifest, manifest->len, recs, 1, &copy) >= 0) {
+        fprintf(stderr, "Field without a NUL terminator was accepted\n");
+        goto cleanup;
+    }
+    g_free(copy);
+    copy = NULL;
+
+    /* Put it back, but shorten the record so that its last
+     * field, and the NUL terminating it, lie beyond its end */
+    manifest->data[manifest->len - 1] = '\0';
+    set_u32(manifest, GVIR_SANDBOX_MANIFEST_HEADER_SIZE + 4,
+            manifest->len - GVIR_SANDBOX_MANIFEST_HEADER_SIZE - 8 - 2);
+    if (parse(manifest, manifest->len, recs, 1, &copy) >= 0) {
+        fprintf(stderr, "Field overrunning its record was accepted\n");
+        goto cleanup;
+    }
+
+    ret = TRUE;
+ cleanup:
+    g_free(copy);
+    g_byte_array_unref(manifest);
+    return ret;
+}
+
+
+static gboolean test_forward_compat(void)
+{
+    GByteArray *manifest = gvir_sandbox_builder_manifest_new();
+    GVirSandboxManifestRecord recs[3];
+    gchar *copy = NULL;
+    gboolean ret = FALSE;
+
+    /* An unknown type, more fields than a reader can hold,
+     * and data which is not in fields at all */
+    append_future_record(manifest, 99, GVIR_SANDBOX_MANIFEST_MAX_FIELDS + 2, 7);
+    /* A known type which has gained a field and trailing data */
+    append_future_record(manifest, GVIR_SANDBOX_MANIFEST_DISK, 3, 5);
+    gvir_sandbox_builder_manifest_add(manifest, GVIR_SANDBOX_MANIFEST_DISK, 2,
+                                      "dbdata", "vda");
+
+    if (parse(manifest, manifest->len, recs, 3, &copy) != 3) {
+        fprintf(stderr, "Unable to skip over newer records\n");
+        goto cleanup;
+    }
+
+    if (!check_record(&recs[0], 99, GVIR_SANDBOX_MANIFEST_MAX_FIELDS,
+                      "f0", "f1", "f2", "f3", "f4", "f5", "f6", "f7") ||
+        !check_record(&recs[1], GVIR_SANDBOX_MANIFEST_DISK, 3,
+                      "f0", "f1", "f2") ||
+        !check_record(&recs[2], GVIR_SANDBOX_MANIFEST_DISK, 2,
+                      "dbdata", "vda"))
+        goto cleanup;
+
+    ret = TRUE;
+ cleanup:
+    g_free(copy);
+    g_byte_array_unref(manifest);
+    return ret;
+}
+
+
+int main(int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+    int ret = EXIT_SUCCESS;
+
+    if (!test_round_trip()) {
+        fprintf(stderr, "Manifest round trip failed\n");
+        ret = EXIT_FAILURE;
+    }
+    if (!test_truncated()) {
+        fprintf(stderr, "Truncated manifest test failed\n");
+        ret = EXIT_FAILURE;
+    }
+    if (!test_unterminated()) {
+        fprintf(stderr, "Unterminated field test failed\n");
+        ret = EXIT_FAILURE;
+    }
+    if (!test_forward_compat()) {
+        fprintf(stderr, "Forward compatibility test failed\n");
+        ret = EXIT_FAILURE;
+    }
+
+    exit(ret);
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ *  tab-width: 8
+ * End:
+ */
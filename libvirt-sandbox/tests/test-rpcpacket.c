@@ -0,0 +1,369 @@
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if WITH_LZ4
+#include <lz4.h>
+#endif
+#if WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#include <libvirt-sandbox/libvirt-sandbox-rpcpacket.h>
+
+#define PAYLOAD_START (GVIR_SANDBOX_PROTOCOL_LEN_MAX + GVIR_SANDBOX_PROTOCOL_HEADER_MAX)
+
+
+/*
+ * Returns @len bytes of text, which compresses well
+ */
+static gchar *text_payload(gsize len)
+{
+    static const char words[] = "the quick brown fox jumps over the lazy dog ";
+    gchar *data = g_malloc(len);
+    gsize i;
+
+    for (i = 0; i < len; i++)
+        data[i] = words[i % (sizeof(words) - 1)];
+    return data;
+}
+
+
+/*
+ * Returns @len bytes of noise, which doesn't compress at all
+ */
+static gchar *random_payload(gsize len)
+{
+    GRand *rand = g_rand_new_with_seed(42);
+    gchar *data = g_malloc(len);
+    gsize i;
+
+    for (i = 0; i < len; i++)
+        data[i] = g_rand_int(rand) & 0xff;
+    g_rand_free(rand);
+    return data;
+}
+
+
+static GVirSandboxRPCPacket *data_packet(GVirSandboxRPCPacketPool *pool,
+                                         GVirSandboxProtocolType type,
+                                         const gchar *data,
+                                         gsize len)
+{
+    GVirSandboxRPCPacket *pkt = gvir_sandbox_rpcpacket_pool_get(pool, FALSE, 0);
+    GError *error = NULL;
+
+    pkt->header.proc = GVIR_SANDBOX_PROTOCOL_PROC_STDOUT;
+    pkt->header.type = type;
+    pkt->header.status = GVIR_SANDBOX_PROTOCOL_STATUS_OK;
+    pkt->header.serial = 7;
+
+    if (!gvir_sandbox_rpcpacket_encode_header(pkt, &error) ||
+        !gvir_sandbox_rpcpacket_encode_payload_raw(pkt, data, len, &error)) {
+        fprintf(stderr, "Unable to encode packet: %s\n", error->message);
+        g_error_free(error);
+        gvir_sandbox_rpcpacket_free(pkt);
+        return NULL;
+    }
+
+    return pkt;
+}
+
+
+/*
+ * Feeds the encoded @tx through the same steps as the receiving
+ * event loop, returning a packet with its header decoded
+ */
+static GVirSandboxRPCPacket *receive_packet(GVirSandboxRPCPacketPool *pool,
+                                            GVirSandboxRPCPacket *tx)
+{
+    GVirSandboxRPCPacket *rx = gvir_sandbox_rpcpacket_pool_get(pool, TRUE, 0);
+    GError *error = NULL;
+
+    memcpy(rx->buffer, tx->buffer, GVIR_SANDBOX_PROTOCOL_LEN_MAX);
+    if (!gvir_sandbox_rpcpacket_decode_length(rx, &error))
+        goto error;
+
+    if (rx->bufferLength != tx->bufferLength) {
+        fprintf(stderr, "Expected packet length %zu, got %zu\n",
+                tx->bufferLength, rx->bufferLength);
+        gvir_sandbox_rpcpacket_free(rx);
+        return NULL;
+    }
+    memcpy(rx->buffer, tx->buffer, tx->bufferLength);
+
+    if (!gvir_sandbox_rpcpacket_decode_header(rx, &error))
+        goto error;
+
+    return rx;
+
+ error:
+    fprintf(stderr, "Unable to receive packet: %s\n", error->message);
+    g_error_free(error);
+    gvir_sandbox_rpcpacket_free(rx);
+    return NULL;
+}
+
+
+static gboolean check_round_trip(GVirSandboxRPCPacketPool *pool,
+                                 guint format,
+                                 GVirSandboxProtocolType type,
+                                 gsize len)
+{
+    gchar *data = text_payload(len);
+    GVirSandboxRPCPacket *msg = NULL, *tx = NULL, *rx = NULL, *pkt = NULL;
+    GError *error = NULL;
+    gsize got;
+    gboolean ret = FALSE;
+
+    if (!(msg = data_packet(pool, GVIR_SANDBOX_PROTOCOL_TYPE_DATA, data, len)))
+        goto cleanup;
+
+    if (!(tx = gvir_sandbox_rpcpacket_compress_payload(pool, msg, format))) {
+        fprintf(stderr, "Payload of %zu bytes was not compressed\n", len);
+        goto cleanup;
+    }
+
+    if (tx->header.type != type) {
+        fprintf(stderr, "Expected compressed type %d, got %d\n",
+                type, tx->header.type);
+        goto cleanup;
+    }
+
+    got = tx->bufferLength - PAYLOAD_START;
+    if (got > len - (len / 8)) {
+        fprintf(stderr, "Compressed payload of %zu bytes to %zu, which is too large\n",
+                len, got);
+        goto cleanup;
+    }
+
+    if (!(rx = receive_packet(pool, tx)))
+        goto cleanup;
+
+    if (!(pkt = gvir_sandbox_rpcpacket_decompress_payload(pool, rx, &error))) {
+        fprintf(stderr, "Unable to decompress payload: %s\n", error->message);
+        g_error_free(error);
+        goto cleanup;
+    }
+
+    if (pkt->header.type != GVIR_SANDBOX_PROTOCOL_TYPE_DATA ||
+        pkt->header.proc != msg->header.proc ||
+        pkt->header.serial != msg->header.serial) {
+        fprintf(stderr, "Decompressed packet has the wrong header\n");
+        goto cleanup;
+    }
+
+    got = pkt->bufferLength - pkt->bufferOffset;
+    if (got != len ||
+        memcmp(pkt->buffer + pkt->bufferOffset, data, len) != 0) {
+        fprintf(stderr, "Decompressed payload of %zu bytes does not match %zu\n",
+                got, len);
+        goto cleanup;
+    }
+
+    ret = TRUE;
+ cleanup:
+    gvir_sandbox_rpcpacket_free(pkt);
+    gvir_sandbox_rpcpacket_free(rx);
+    gvir_sandbox_rpcpacket_free(tx);
+    gvir_sandbox_rpcpacket_free(msg);
+    g_free(data);
+    return ret;
+}
+
+
+/*
+ * Payloads which don't shrink by an eighth, or which
+ * are not data at all, must be sent as is
+ */
+static gboolean check_uncompressed(GVirSandboxRPCPacketPool *pool,
+                                   guint format)
+{
+    gchar *noise = random_payload(4096);
+    gchar *text = text_payload(4096);
+    GVirSandboxRPCPacket *msg = NULL, *tx = NULL;
+    gboolean ret = FALSE;
+
+    if (!(msg = data_packet(pool, GVIR_SANDBOX_PROTOCOL_TYPE_DATA, noise, 4096)))
+        goto cleanup;
+    if ((tx = gvir_sandbox_rpcpacket_compress_payload(pool, msg, format))) {
+        fprintf(stderr, "Incompressible payload was compressed\n");
+        goto cleanup;
+    }
+    gvir_sandbox_rpcpacket_free(msg);
+
+    if (!(msg = data_packet(pool, GVIR_SANDBOX_PROTOCOL_TYPE_MESSAGE, text, 4096)))
+        goto cleanup;
+    if ((tx = gvir_sandbox_rpcpacket_compress_payload(pool, msg, format))) {
+        fprintf(stderr, "Message payload was compressed\n");
+        goto cleanup;
+    }
+    gvir_sandbox_rpcpacket_free(msg);
+
+    if (!(msg = data_packet(pool, GVIR_SANDBOX_PROTOCOL_TYPE_DATA, text, 0)))
+        goto cleanup;
+    if ((tx = gvir_sandbox_rpcpacket_compress_payload(pool, msg, format))) {
+        fprintf(stderr, "Empty payload was compressed\n");
+        goto cleanup;
+    }
+
+    ret = TRUE;
+ cleanup:
+    gvir_sandbox_rpcpacket_free(tx);
+    gvir_sandbox_rpcpacket_free(msg);
+    g_free(text);
+    g_free(noise);
+    return ret;
+}
+
+
+/*
+ * A peer must not be able to make us decompress more
+ * than PAYLOAD_MAX bytes from a single packet
+ */
+static gboolean check_oversized(GVirSandboxRPCPacketPool *pool,
+                                guint format,
+                                GVirSandboxProtocolType type)
+{
+    gsize len = GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX + 1;
+    gchar *data = text_payload(len);
+    gchar *packed = g_malloc(len);
+    gssize packedlen = -1;
+    GVirSandboxRPCPacket *tx = NULL, *rx = NULL, *pkt = NULL;
+    GError *error = NULL;
+    gboolean ret = FALSE;
+
+    switch (format) {
+#if WITH_LZ4
+    case GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4:
+        packedlen = LZ4_compress_default(data, packed, len, len);
+        break;
+#endif
+#if WITH_ZSTD
+    case GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD: {
+        size_t zret = ZSTD_compress(packed, len, data, len, 1);
+        if (!ZSTD_isError(zret))
+            packedlen = zret;
+    }   break;
+#endif
+    default:
+        break;
+    }
+
+    if (packedlen <= 0) {
+        fprintf(stderr, "Unable to compress %zu bytes\n", len);
+        goto cleanup;
+    }
+
+    if (!(tx = data_packet(pool, type, packed, packedlen)) ||
+        !(rx = receive_packet(pool, tx)))
+        goto cleanup;
+
+    if ((pkt = gvir_sandbox_rpcpacket_decompress_payload(pool, rx, &error))) {
+        fprintf(stderr, "Payload of %zu bytes was decompressed\n", len);
+        goto cleanup;
+    }
+    g_error_free(error);
+
+    ret = TRUE;
+ cleanup:
+    gvir_sandbox_rpcpacket_free(pkt);
+    gvir_sandbox_rpcpacket_free(rx);
+    gvir_sandbox_rpcpacket_free(tx);
+    g_free(packed);
+    g_free(data);
+    return ret;
+}
+
+
+static gboolean check_unsupported(GVirSandboxRPCPacketPool *pool)
+{
+    gchar *text = text_payload(4096);
+    GVirSandboxRPCPacket *tx = NULL, *rx = NULL, *pkt = NULL;
+    GError *error = NULL;
+    gboolean ret = FALSE;
+
+    if (!(tx = data_packet(pool, GVIR_SANDBOX_PROTOCOL_TYPE_DATA, text, 4096)) ||
+        !(rx = receive_packet(pool, tx)))
+        goto cleanup;
+
+    if ((pkt = gvir_sandbox_rpcpacket_decompress_payload(pool, rx, &error))) {
+        fprintf(stderr, "Uncompressed payload was decompressed\n");
+        goto cleanup;
+    }
+    g_error_free(error);
+
+    ret = TRUE;
+ cleanup:
+    gvir_sandbox_rpcpacket_free(pkt);
+    gvir_sandbox_rpcpacket_free(rx);
+    gvir_sandbox_rpcpacket_free(tx);
+    g_free(text);
+    return ret;
+}
+
+
+static gboolean check_format(GVirSandboxRPCPacketPool *pool,
+                             guint format,
+                             GVirSandboxProtocolType type,
+                             const char *name)
+{
+    static const gsize sizes[] = {
+        64, 4096, 65536, GVIR_SANDBOX_PROTOCOL_PAYLOAD_MAX,
+    };
+    gboolean ret = TRUE;
+    gsize i;
+
+    for (i = 0; i < G_N_ELEMENTS(sizes); i++) {
+        if (!check_round_trip(pool, format, type, sizes[i])) {
+            fprintf(stderr, "%s round trip of %zu bytes failed\n", name, sizes[i]);
+            ret = FALSE;
+        }
+    }
+    if (!check_uncompressed(pool, format)) {
+        fprintf(stderr, "%s uncompressed payload test failed\n", name);
+        ret = FALSE;
+    }
+    if (!check_oversized(pool, format, type)) {
+        fprintf(stderr, "%s oversized payload test failed\n", name);
+        ret = FALSE;
+    }
+
+    return ret;
+}
+
+
+int main(int argc G_GNUC_UNUSED, char **argv G_GNUC_UNUSED)
+{
+    GVirSandboxRPCPacketPool *pool = gvir_sandbox_rpcpacket_pool_new();
+    guint formats = gvir_sandbox_rpcpacket_compress_formats();
+    int ret = EXIT_SUCCESS;
+
+    if ((formats & GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4) &&
+        !check_format(pool, GVIR_SANDBOX_PROTOCOL_COMPRESS_LZ4,
+                      GVIR_SANDBOX_PROTOCOL_TYPE_DATA_LZ4, "LZ4"))
+        ret = EXIT_FAILURE;
+    if ((formats & GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD) &&
+        !check_format(pool, GVIR_SANDBOX_PROTOCOL_COMPRESS_ZSTD,
+                      GVIR_SANDBOX_PROTOCOL_TYPE_DATA_ZSTD, "ZSTD"))
+        ret = EXIT_FAILURE;
+    if (!check_unsupported(pool)) {
+        fprintf(stderr, "Unsupported compression test failed\n");
+        ret = EXIT_FAILURE;
+    }
+
+    gvir_sandbox_rpcpacket_pool_unref(pool);
+    exit(ret);
+}
+
+/*
+ * Local variables:
+ *  c-indent-level: 4
+ *  c-basic-offset: 4
+ *  indent-tabs-mode: nil
+ *  tab-width: 8
+ * End:
+ */